@@ -21,7 +21,19 @@
  *
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <ulfius.h>
 
 #include "static_file_callback.h"
@@ -38,34 +50,975 @@ const char * get_filename_ext(const char *path) {
     return dot;
 }
 
+static const char * static_file_days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char * static_file_months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+/**
+ * Precompressed variants, sorted by preference
+ */
+static const struct {
+  const char * encoding;
+  const char * suffix;
+} static_file_encodings[] = {{"br", ".br"}, {"gzip", ".gz"}};
+#define STATIC_FILE_NB_ENCODINGS 2
+
+/**
+ * A piece of a multipart/byteranges body, either a part header or a range of the file
+ */
+struct _static_file_range_piece {
+  char     * data;   /* part header or closing boundary, NULL for a range of the file */
+  uint64_t   offset; /* offset of the range in the file */
+  uint64_t   length;
+};
+
+/**
+ * A file in the hot file cache, the content is ready to be sent
+ * The entry is kept until it's removed from the cache and the last response using it is complete
+ */
+struct _static_file_cache_entry {
+  struct _static_file_cache       * cache;
+  char                            * path;          /* path requested, relative to files_path */
+  char                            * file_path;
+  char                            * data;
+  uint64_t                          size;
+  time_t                            mtime;
+  ino_t                             ino;
+  char                            * content_type;
+  char                              etag[64];
+  char                              last_modified[32];
+  int                               wd;            /* inotify watch descriptor, -1 if none */
+  unsigned int                      refcount;
+  int                               cached;        /* 0 once the entry is removed from the cache */
+  struct _static_file_cache_entry * bucket_next;
+  struct _static_file_cache_entry * lru_prev;
+  struct _static_file_cache_entry * lru_next;
+};
+
+/**
+ * Precompressed variants available for a file
+ */
+struct _static_file_variants {
+  char                         * path;    /* path requested, relative to files_path */
+  unsigned int                   mask;    /* bit i is set if static_file_encodings[i] is available */
+  time_t                         expires;
+  struct _static_file_variants * next;
+};
+
+/**
+ * Size-bounded LRU cache of small files
+ */
+struct _static_file_cache {
+  pthread_mutex_t                   lock;
+  struct _static_file_cache_entry * buckets[STATIC_FILE_CACHE_BUCKETS];
+  struct _static_file_cache_entry * lru_head;
+  struct _static_file_cache_entry * lru_tail;
+  size_t                            size;
+  size_t                            max_size;
+  size_t                            max_file_size;
+  unsigned long                     generation;    /* incremented on each inotify event */
+  int                               inotify_fd;    /* -1 if the entries are revalidated with stat */
+  int                               wake_fd[2];
+  pthread_t                         inotify_thread;
+  struct _static_file_variants    * variants[STATIC_FILE_CACHE_BUCKETS];
+  size_t                            nb_variants;
+};
+
+/**
+ * File sent in a response, either an open file or a cache entry
+ */
+struct _static_file_source {
+  int                               fd;
+  struct _static_file_cache_entry * entry;
+  uint64_t                          size;
+  time_t                            mtime;
+  const char                      * etag;
+  const char                      * last_modified;
+  const char                      * content_type;
+};
+
+/**
+ * Stream state of a multipart/byteranges body
+ */
+struct _static_file_multipart {
+  int                               fd;
+  struct _static_file_cache_entry * entry;
+  struct _static_file_range_piece * pieces;
+  size_t                            nb_pieces;
+  size_t                            piece;     /* current piece of the reader */
+  uint64_t                          piece_pos; /* position of the current piece in the body */
+};
+
+/**
+ * Format t as an HTTP date (IMF-fixdate), independently of the locale
+ */
+static void static_file_format_date(time_t t, char * date, size_t date_len) {
+  struct tm tm;
+  
+  gmtime_r(&t, &tm);
+  snprintf(date, date_len, "%s, %02d %s %04d %02d:%02d:%02d GMT", static_file_days[tm.tm_wday], tm.tm_mday, static_file_months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/**
+ * Parse an HTTP date (IMF-fixdate)
+ * Return 1 and set t on success, 0 if date is invalid
+ */
+static int static_file_parse_date(const char * date, time_t * t) {
+  char month[4] = {0};
+  int day, year, hour, min, sec, m, y, era;
+  unsigned int yoe, doy, doe;
+  
+  if (date == NULL || sscanf(date, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &day, month, &year, &hour, &min, &sec) != 6) {
+    return 0;
+  }
+  for (m=0; m<12 && o_strcmp(month, static_file_months[m]); m++);
+  if (m == 12 || day < 1 || day > 31 || year < 1970 || hour > 23 || min > 59 || sec > 60) {
+    return 0;
+  }
+  // Days since 1970-01-01 in the proleptic Gregorian calendar
+  m++;
+  y = year - (m <= 2);
+  era = y / 400;
+  yoe = (unsigned int)(y - era * 400);
+  doy = (unsigned int)((153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + day - 1);
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  *t = (time_t)(era * 146097 + (int)doe - 719468) * 86400 + hour * 3600 + min * 60 + sec;
+  return 1;
+}
+
+/**
+ * Return 1 if the entity tag etag matches one of the entity tags of list, using the weak comparison
+ */
+static int static_file_etag_match(const char * list, const char * etag) {
+  const char * end;
+  size_t etag_len = o_strlen(etag);
+  
+  while (list != NULL && *list != '\0') {
+    while (*list == ' ' || *list == '\t' || *list == ',') {
+      list++;
+    }
+    if (*list == '*') {
+      return 1;
+    }
+    if (0 == o_strncmp(list, "W/", 2)) {
+      list += 2;
+    }
+    if (*list != '"' || (end = strchr(list + 1, '"')) == NULL) {
+      return 0;
+    }
+    if ((size_t)(end + 1 - list) == etag_len && 0 == o_strncmp(list, etag, etag_len)) {
+      return 1;
+    }
+    list = end + 1;
+  }
+  return 0;
+}
+
+/**
+ * Parse the Range header value
+ * Return the number of satisfiable ranges set in starts and lengths,
+ * 0 if no range is satisfiable, -1 if the header must be ignored
+ */
+static int static_file_parse_range(const char * range, uint64_t size, uint64_t * starts, uint64_t * lengths) {
+  unsigned long long first, last;
+  char * end;
+  int nb_ranges = 0, nb_specs = 0;
+  
+  if (o_strncasecmp(range, "bytes=", 6)) {
+    return -1;
+  }
+  range += 6;
+  while (*range != '\0') {
+    while (*range == ' ' || *range == '\t' || *range == ',') {
+      range++;
+    }
+    if (*range == '\0') {
+      break;
+    }
+    if (++nb_specs > STATIC_FILE_MAX_RANGES) {
+      // Too many ranges, send the whole file
+      return -1;
+    }
+    if (*range == '-') {
+      // Suffix range: the last bytes of the file
+      if (range[1] < '0' || range[1] > '9') {
+        return -1;
+      }
+      last = strtoull(range + 1, &end, 10);
+      if (last > 0 && size > 0) {
+        starts[nb_ranges] = size > last ? size - last : 0;
+        lengths[nb_ranges] = size - starts[nb_ranges];
+        nb_ranges++;
+      }
+    } else if (*range >= '0' && *range <= '9') {
+      first = strtoull(range, &end, 10);
+      if (*end != '-') {
+        return -1;
+      }
+      end++;
+      if (*end >= '0' && *end <= '9') {
+        last = strtoull(end, &end, 10);
+        if (last < first) {
+          return -1;
+        }
+      } else {
+        last = size;
+      }
+      if (first < size) {
+        starts[nb_ranges] = first;
+        lengths[nb_ranges] = (last >= size ? size - 1 : last) - first + 1;
+        nb_ranges++;
+      }
+    } else {
+      return -1;
+    }
+    range = end;
+    while (*range == ' ' || *range == '\t') {
+      range++;
+    }
+    if (*range != '\0' && *range != ',') {
+      return -1;
+    }
+  }
+  return nb_specs?nb_ranges:-1;
+}
+
+/**
+ * Return the bucket of path in the cache
+ */
+static size_t static_file_cache_hash(const char * path) {
+  size_t hash = 2166136261U;
+  
+  while (*path) {
+    hash = (hash ^ (unsigned char)*path++) * 16777619U;
+  }
+  return hash % STATIC_FILE_CACHE_BUCKETS;
+}
+
+/**
+ * Free an entry, the cache must be locked
+ */
+static void static_file_cache_unref(struct _static_file_cache_entry * entry) {
+  if (!--entry->refcount) {
+    o_free(entry->path);
+    o_free(entry->file_path);
+    o_free(entry->data);
+    o_free(entry->content_type);
+    o_free(entry);
+  }
+}
+
+/**
+ * Release an entry used by a response, used as release callback of the response body
+ */
+static void static_file_cache_release(void * cls) {
+  struct _static_file_cache_entry * entry = (struct _static_file_cache_entry *)cls;
+  struct _static_file_cache * cache = entry->cache;
+  
+  pthread_mutex_lock(&cache->lock);
+  static_file_cache_unref(entry);
+  pthread_mutex_unlock(&cache->lock);
+}
+
 /**
- * Streaming callback function to ease sending large files
+ * Remove the inotify watch wd if no entry uses it anymore, the cache must be locked
+ * Files with the same inode share the same watch descriptor
  */
-static ssize_t callback_static_file_stream(void * cls, uint64_t pos, char * buf, size_t max) {
-  if (cls != NULL) {
-    return fread (buf, 1, max, (FILE *)cls);
+static void static_file_cache_remove_watch(struct _static_file_cache * cache, int wd) {
+  struct _static_file_cache_entry * entry;
+  
+#ifdef __linux__
+  if (wd != -1) {
+    for (entry = cache->lru_head; entry != NULL && entry->wd != wd; entry = entry->lru_next);
+    if (entry == NULL) {
+      inotify_rm_watch(cache->inotify_fd, wd);
+    }
+  }
+#else
+  (void)cache;
+  (void)wd;
+  (void)entry;
+#endif
+}
+
+/**
+ * Remove an entry from the cache, the cache must be locked
+ */
+static void static_file_cache_remove(struct _static_file_cache * cache, struct _static_file_cache_entry * entry) {
+  struct _static_file_cache_entry ** bucket = &cache->buckets[static_file_cache_hash(entry->path)];
+  
+  while (*bucket != entry) {
+    bucket = &(*bucket)->bucket_next;
+  }
+  *bucket = entry->bucket_next;
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
   } else {
-    return U_STREAM_END;
+    cache->lru_head = entry->lru_next;
   }
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    cache->lru_tail = entry->lru_prev;
+  }
+  cache->size -= (size_t)entry->size;
+  entry->cached = 0;
+  static_file_cache_remove_watch(cache, entry->wd);
+  static_file_cache_unref(entry);
 }
 
+#ifdef __linux__
 /**
- * Cleanup FILE* structure when streaming is complete
+ * Thread removing the entries of the modified files from the cache
  */
-static void callback_static_file_stream_free(void * cls) {
-  if (cls != NULL) {
-    fclose((FILE *)cls);
+static void * static_file_cache_inotify_thread(void * cls) {
+  struct _static_file_cache * cache = (struct _static_file_cache *)cls;
+  struct _static_file_cache_entry * entry, * next;
+  struct pollfd fds[2];
+  char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event * event;
+  ssize_t len;
+  
+  fds[0].fd = cache->inotify_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = cache->wake_fd[0];
+  fds[1].events = POLLIN;
+  while (poll(fds, 2, -1) >= 0 || errno == EINTR) {
+    if (fds[1].revents) {
+      break;
+    }
+    if (fds[0].revents) {
+      while ((len = read(cache->inotify_fd, buffer, sizeof(buffer))) > 0) {
+        pthread_mutex_lock(&cache->lock);
+        cache->generation++;
+        for (event = (const struct inotify_event *)buffer; (const char *)event < buffer + len; event = (const struct inotify_event *)((const char *)event + sizeof(struct inotify_event) + event->len)) {
+          if (event->mask & IN_Q_OVERFLOW) {
+            // Events were lost, any entry may be stale
+            while (cache->lru_head != NULL) {
+              static_file_cache_remove(cache, cache->lru_head);
+            }
+            continue;
+          }
+          for (entry = cache->lru_head; entry != NULL; entry = next) {
+            next = entry->lru_next;
+            if (entry->wd == event->wd) {
+              // The watch is removed by the kernel after IN_IGNORED
+              if (event->mask & IN_IGNORED) {
+                entry->wd = -1;
+              }
+              static_file_cache_remove(cache, entry);
+            }
+          }
+        }
+        pthread_mutex_unlock(&cache->lock);
+      }
+    }
   }
+  return NULL;
+}
+#endif
+
+/**
+ * Look for path in the cache
+ * Return a referenced entry if path is cached and unchanged, NULL otherwise
+ */
+static struct _static_file_cache_entry * static_file_cache_get(struct _static_file_cache * cache, const char * path) {
+  struct _static_file_cache_entry * entry;
+  struct stat file_stat;
+  
+  pthread_mutex_lock(&cache->lock);
+  for (entry = cache->buckets[static_file_cache_hash(path)]; entry != NULL && o_strcmp(entry->path, path); entry = entry->bucket_next);
+  if (entry != NULL) {
+    entry->refcount++;
+    if (entry != cache->lru_head) {
+      entry->lru_prev->lru_next = entry->lru_next;
+      if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+      } else {
+        cache->lru_tail = entry->lru_prev;
+      }
+      entry->lru_prev = NULL;
+      entry->lru_next = cache->lru_head;
+      cache->lru_head->lru_prev = entry;
+      cache->lru_head = entry;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  
+  // Without inotify, the file is revalidated with its modification time
+  if (entry != NULL && cache->inotify_fd == -1) {
+    if (stat(entry->file_path, &file_stat) || file_stat.st_mtime != entry->mtime || (uint64_t)file_stat.st_size != entry->size || file_stat.st_ino != entry->ino) {
+      pthread_mutex_lock(&cache->lock);
+      if (entry->cached) {
+        static_file_cache_remove(cache, entry);
+      }
+      static_file_cache_unref(entry);
+      pthread_mutex_unlock(&cache->lock);
+      entry = NULL;
+    }
+  }
+  return entry;
+}
+
+/**
+ * Read the file opened in fd and add it to the cache
+ * Return a referenced entry on success, NULL if the file can't be cached
+ * fd is left open
+ */
+static struct _static_file_cache_entry * static_file_cache_put(struct _static_file_cache * cache, const char * path, const char * file_path, int fd, const struct stat * file_stat, const char * content_type) {
+  struct _static_file_cache_entry * entry, * existing;
+  struct stat check_stat;
+  unsigned long generation;
+  uint64_t offset = 0;
+  ssize_t res = 0;
+  int readable;
+  
+  if ((uint64_t)file_stat->st_size > cache->max_file_size || (uint64_t)file_stat->st_size > cache->max_size) {
+    return NULL;
+  }
+  if ((entry = o_malloc(sizeof(struct _static_file_cache_entry))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "callback_static_file - Error allocating resources for cache entry");
+    return NULL;
+  }
+  memset(entry, 0, sizeof(struct _static_file_cache_entry));
+  entry->cache = cache;
+  entry->wd = -1;
+  entry->size = (uint64_t)file_stat->st_size;
+  entry->mtime = file_stat->st_mtime;
+  entry->ino = file_stat->st_ino;
+  entry->path = o_strdup(path);
+  entry->file_path = o_strdup(file_path);
+  entry->content_type = o_strdup(content_type);
+  entry->data = o_malloc((size_t)entry->size + 1);
+  snprintf(entry->etag, sizeof(entry->etag), "\"%llx-%llx-%llx\"", (unsigned long long)file_stat->st_ino, (unsigned long long)file_stat->st_mtime, (unsigned long long)file_stat->st_size);
+  static_file_format_date(file_stat->st_mtime, entry->last_modified, sizeof(entry->last_modified));
+  
+  pthread_mutex_lock(&cache->lock);
+  generation = cache->generation;
+  pthread_mutex_unlock(&cache->lock);
+#ifdef __linux__
+  // The watch is added before reading the file, so a modification made while reading is notified
+  if (cache->inotify_fd != -1) {
+    entry->wd = inotify_add_watch(cache->inotify_fd, file_path, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+  }
+#endif
+  readable = entry->path != NULL && entry->file_path != NULL && entry->content_type != NULL && entry->data != NULL && (entry->wd != -1 || cache->inotify_fd == -1);
+  if (readable) {
+    while (offset < entry->size && (res = pread(fd, entry->data + offset, (size_t)(entry->size - offset), (off_t)offset)) > 0) {
+      offset += (uint64_t)res;
+    }
+  }
+  
+  pthread_mutex_lock(&cache->lock);
+  for (existing = cache->buckets[static_file_cache_hash(path)]; existing != NULL && o_strcmp(existing->path, path); existing = existing->bucket_next);
+  // The file is not cached if it was modified while reading or if another request cached it first
+  if (!readable || offset != entry->size || existing != NULL || generation != cache->generation || fstat(fd, &check_stat) || check_stat.st_mtime != entry->mtime || (uint64_t)check_stat.st_size != entry->size) {
+    static_file_cache_remove_watch(cache, entry->wd);
+    entry->refcount = 1;
+    static_file_cache_unref(entry);
+    entry = NULL;
+  } else {
+    while (cache->lru_tail != NULL && cache->size + (size_t)entry->size > cache->max_size) {
+      static_file_cache_remove(cache, cache->lru_tail);
+    }
+    entry->cached = 1;
+    entry->refcount = 2;
+    entry->bucket_next = cache->buckets[static_file_cache_hash(path)];
+    cache->buckets[static_file_cache_hash(path)] = entry;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL) {
+      cache->lru_head->lru_prev = entry;
+    } else {
+      cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+    cache->size += (size_t)entry->size;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return entry;
+}
+
+/**
+ * Free all the precompressed variants lookups, the cache must be locked
+ */
+static void static_file_cache_clean_variants(struct _static_file_cache * cache) {
+  struct _static_file_variants * variants;
+  size_t i;
+  
+  for (i=0; i<STATIC_FILE_CACHE_BUCKETS; i++) {
+    while ((variants = cache->variants[i]) != NULL) {
+      cache->variants[i] = variants->next;
+      o_free(variants->path);
+      o_free(variants);
+    }
+  }
+  cache->nb_variants = 0;
+}
+
+/**
+ * Return the precompressed variants available for the file,
+ * bit i is set if the file suffixed by static_file_encodings[i].suffix exists
+ * The result is kept in the cache for STATIC_FILE_VARIANTS_TTL seconds,
+ * without cache the variants are looked up with stat on each request
+ */
+static unsigned int static_file_get_variants(struct _static_file_cache * cache, const char * path, const char * file_path) {
+  struct _static_file_variants * variants = NULL;
+  struct stat file_stat;
+  unsigned int mask = 0, i;
+  time_t now = time(NULL);
+  char * variant_path;
+  int found = 0;
+  
+  if (cache != NULL) {
+    pthread_mutex_lock(&cache->lock);
+    for (variants = cache->variants[static_file_cache_hash(path)]; variants != NULL && o_strcmp(variants->path, path); variants = variants->next);
+    if (variants != NULL && variants->expires > now) {
+      mask = variants->mask;
+      found = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (found) {
+      return mask;
+    }
+  }
+  for (i=0; i<STATIC_FILE_NB_ENCODINGS; i++) {
+    if ((variant_path = msprintf("%s%s", file_path, static_file_encodings[i].suffix)) != NULL) {
+      if (!stat(variant_path, &file_stat) && S_ISREG(file_stat.st_mode)) {
+        mask |= (1U << i);
+      }
+      o_free(variant_path);
+    }
+  }
+  if (cache != NULL) {
+    pthread_mutex_lock(&cache->lock);
+    for (variants = cache->variants[static_file_cache_hash(path)]; variants != NULL && o_strcmp(variants->path, path); variants = variants->next);
+    if (variants == NULL) {
+      if (cache->nb_variants >= STATIC_FILE_VARIANTS_MAX) {
+        static_file_cache_clean_variants(cache);
+      }
+      if ((variants = o_malloc(sizeof(struct _static_file_variants))) != NULL && (variants->path = o_strdup(path)) != NULL) {
+        variants->next = cache->variants[static_file_cache_hash(path)];
+        cache->variants[static_file_cache_hash(path)] = variants;
+        cache->nb_variants++;
+      } else {
+        o_free(variants);
+        variants = NULL;
+      }
+    }
+    if (variants != NULL) {
+      variants->mask = mask;
+      variants->expires = now + STATIC_FILE_VARIANTS_TTL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+  }
+  return mask;
+}
+
+/**
+ * Select the precompressed variant to send, among the available ones, using the Accept-Encoding header value
+ * Return the index of the encoding in static_file_encodings, -1 if the file must be sent without encoding
+ */
+static int static_file_select_encoding(const char * accept_encoding, unsigned int mask) {
+  int qvalues[STATIC_FILE_NB_ENCODINGS], q_any = -1, q, i, selected = -1;
+  const char * token, * end;
+  size_t token_len;
+  
+  if (accept_encoding == NULL || !mask) {
+    return -1;
+  }
+  for (i=0; i<STATIC_FILE_NB_ENCODINGS; i++) {
+    qvalues[i] = -1;
+  }
+  token = accept_encoding;
+  while (*token != '\0') {
+    while (*token == ' ' || *token == '\t' || *token == ',') {
+      token++;
+    }
+    if (*token == '\0') {
+      break;
+    }
+    for (end = token; *end != '\0' && *end != ',' && *end != ';' && *end != ' ' && *end != '\t'; end++);
+    token_len = (size_t)(end - token);
+    // Quality value in thousandths, 1 if absent
+    q = 1000;
+    while (*end == ' ' || *end == '\t') {
+      end++;
+    }
+    if (*end == ';') {
+      end++;
+      while (*end == ' ' || *end == '\t') {
+        end++;
+      }
+      if ((*end == 'q' || *end == 'Q') && end[1] == '=') {
+        q = (int)(strtod(end + 2, NULL) * 1000);
+      }
+    }
+    if (token_len == 1 && *token == '*') {
+      q_any = q;
+    } else {
+      for (i=0; i<STATIC_FILE_NB_ENCODINGS; i++) {
+        if (token_len == o_strlen(static_file_encodings[i].encoding) && !o_strncasecmp(token, static_file_encodings[i].encoding, token_len)) {
+          qvalues[i] = q;
+        }
+      }
+    }
+    for (token = end; *token != '\0' && *token != ','; token++);
+  }
+  // The encodings are sorted by preference, the first one is selected among the ones with the highest quality value
+  for (i=0; i<STATIC_FILE_NB_ENCODINGS; i++) {
+    q = qvalues[i]!=-1?qvalues[i]:q_any;
+    if ((mask & (1U << i)) && q > 0 && (selected == -1 || q > (qvalues[selected]!=-1?qvalues[selected]:q_any))) {
+      selected = i;
+    }
+  }
+  return selected;
+}
+
+/**
+ * Initialize the hot file cache of config
+ * Files up to max_file_size bytes are kept in memory, up to max_size bytes in total
+ * Return U_OK on success
+ */
+int static_file_cache_init(struct _static_file_config * config, size_t max_size, size_t max_file_size) {
+  struct _static_file_cache * cache;
+  
+  if (config == NULL || !max_size || !max_file_size) {
+    return U_ERROR_PARAMS;
+  }
+  if ((cache = o_malloc(sizeof(struct _static_file_cache))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "static_file_cache_init - Error allocating resources for cache");
+    return U_ERROR_MEMORY;
+  }
+  memset(cache, 0, sizeof(struct _static_file_cache));
+  if (pthread_mutex_init(&cache->lock, NULL)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "static_file_cache_init - Error initializing lock");
+    o_free(cache);
+    return U_ERROR;
+  }
+  cache->max_size = max_size;
+  cache->max_file_size = max_file_size;
+  cache->inotify_fd = -1;
+  cache->wake_fd[0] = cache->wake_fd[1] = -1;
+#ifdef __linux__
+  if ((cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1) {
+    if (pipe(cache->wake_fd) || pthread_create(&cache->inotify_thread, NULL, &static_file_cache_inotify_thread, cache)) {
+      y_log_message(Y_LOG_LEVEL_WARNING, "static_file_cache_init - Error starting inotify thread, use modification time");
+      close(cache->inotify_fd);
+      if (cache->wake_fd[0] != -1) {
+        close(cache->wake_fd[0]);
+        close(cache->wake_fd[1]);
+      }
+      cache->inotify_fd = cache->wake_fd[0] = cache->wake_fd[1] = -1;
+    }
+  }
+#endif
+  config->cache = cache;
+  return U_OK;
+}
+
+/**
+ * Clean the hot file cache of config
+ * Must be called after the framework is stopped
+ */
+void static_file_cache_clean(struct _static_file_config * config) {
+  struct _static_file_cache * cache;
+  
+  if (config != NULL && config->cache != NULL) {
+    cache = config->cache;
+    if (cache->inotify_fd != -1) {
+      if (write(cache->wake_fd[1], "", 1) == 1) {
+        pthread_join(cache->inotify_thread, NULL);
+      }
+    }
+    pthread_mutex_lock(&cache->lock);
+    while (cache->lru_head != NULL) {
+      static_file_cache_remove(cache, cache->lru_head);
+    }
+    static_file_cache_clean_variants(cache);
+    pthread_mutex_unlock(&cache->lock);
+    if (cache->inotify_fd != -1) {
+      close(cache->inotify_fd);
+      close(cache->wake_fd[0]);
+      close(cache->wake_fd[1]);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    o_free(cache);
+    config->cache = NULL;
+  }
+}
+
+/**
+ * Release the file of a response, either an open file or a cache entry
+ */
+static void static_file_release(int fd, struct _static_file_cache_entry * entry) {
+  if (entry != NULL) {
+    static_file_cache_release(entry);
+  } else {
+    close(fd);
+  }
+}
+
+/**
+ * Streaming callback function sending a multipart/byteranges body
+ */
+static ssize_t callback_static_file_multipart_stream(void * cls, uint64_t pos, char * buf, size_t max) {
+  struct _static_file_multipart * multipart = (struct _static_file_multipart *)cls;
+  struct _static_file_range_piece * piece;
+  size_t len = 0, chunk;
+  uint64_t offset;
+  ssize_t res;
+  
+  if (pos < multipart->piece_pos) {
+    multipart->piece = 0;
+    multipart->piece_pos = 0;
+  }
+  while (multipart->piece < multipart->nb_pieces && pos >= multipart->piece_pos + multipart->pieces[multipart->piece].length) {
+    multipart->piece_pos += multipart->pieces[multipart->piece].length;
+    multipart->piece++;
+  }
+  while (len < max && multipart->piece < multipart->nb_pieces) {
+    piece = &multipart->pieces[multipart->piece];
+    offset = pos + len - multipart->piece_pos;
+    chunk = (piece->length - offset) < (max - len) ? (size_t)(piece->length - offset) : (max - len);
+    if (piece->data != NULL) {
+      memcpy(buf + len, piece->data + offset, chunk);
+    } else if (multipart->entry != NULL) {
+      memcpy(buf + len, multipart->entry->data + piece->offset + offset, chunk);
+    } else if ((res = pread(multipart->fd, buf + len, chunk, (off_t)(piece->offset + offset))) > 0) {
+      chunk = (size_t)res;
+    } else {
+      return U_STREAM_ERROR;
+    }
+    len += chunk;
+    if (offset + chunk == piece->length) {
+      multipart->piece_pos += piece->length;
+      multipart->piece++;
+    }
+  }
+  return len?(ssize_t)len:U_STREAM_END;
+}
+
+/**
+ * Cleanup the multipart/byteranges stream state when streaming is complete
+ */
+static void callback_static_file_multipart_stream_free(void * cls) {
+  struct _static_file_multipart * multipart = (struct _static_file_multipart *)cls;
+  size_t i;
+  
+  if (multipart != NULL) {
+    for (i=0; i<multipart->nb_pieces; i++) {
+      o_free(multipart->pieces[i].data);
+    }
+    o_free(multipart->pieces);
+    static_file_release(multipart->fd, multipart->entry);
+    o_free(multipart);
+  }
+}
+
+/**
+ * Set a multipart/byteranges response with the ranges of the file
+ * The response takes the ownership of the file, even on error
+ * Return U_OK on success
+ */
+static int static_file_set_multipart_response(struct _u_response * response, const struct _static_file_source * source, const uint64_t * starts, const uint64_t * lengths, int nb_ranges) {
+  struct _static_file_multipart * multipart;
+  char * boundary, * multipart_type;
+  uint64_t body_size = 0;
+  int i, ret = U_OK;
+  
+  if ((multipart = o_malloc(sizeof(struct _static_file_multipart))) == NULL ||
+      (multipart->pieces = o_malloc((2 * (size_t)nb_ranges + 1) * sizeof(struct _static_file_range_piece))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "callback_static_file - Error allocating resources for multipart");
+    o_free(multipart);
+    static_file_release(source->fd, source->entry);
+    return U_ERROR_MEMORY;
+  }
+  multipart->fd = source->fd;
+  multipart->entry = source->entry;
+  multipart->nb_pieces = 0;
+  multipart->piece = 0;
+  multipart->piece_pos = 0;
+  // The entity tag is made of hexadecimal digits and dashes, it doesn't appear in the part headers
+  boundary = msprintf("ulfius_byteranges_%.*s", (int)o_strlen(source->etag) - 2, source->etag + 1);
+  for (i=0; i<nb_ranges && ret == U_OK; i++) {
+    multipart->pieces[multipart->nb_pieces].data = msprintf("\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64 "\r\n\r\n", boundary, source->content_type, starts[i], starts[i] + lengths[i] - 1, source->size);
+    if (multipart->pieces[multipart->nb_pieces].data == NULL) {
+      ret = U_ERROR_MEMORY;
+    } else {
+      multipart->pieces[multipart->nb_pieces].length = o_strlen(multipart->pieces[multipart->nb_pieces].data);
+      body_size += multipart->pieces[multipart->nb_pieces].length;
+      multipart->nb_pieces++;
+      multipart->pieces[multipart->nb_pieces].data = NULL;
+      multipart->pieces[multipart->nb_pieces].offset = starts[i];
+      multipart->pieces[multipart->nb_pieces].length = lengths[i];
+      body_size += lengths[i];
+      multipart->nb_pieces++;
+    }
+  }
+  if (ret == U_OK) {
+    if ((multipart->pieces[multipart->nb_pieces].data = msprintf("\r\n--%s--\r\n", boundary)) == NULL) {
+      ret = U_ERROR_MEMORY;
+    } else {
+      multipart->pieces[multipart->nb_pieces].length = o_strlen(multipart->pieces[multipart->nb_pieces].data);
+      body_size += multipart->pieces[multipart->nb_pieces].length;
+      multipart->nb_pieces++;
+    }
+  }
+  if (ret == U_OK) {
+    multipart_type = msprintf("multipart/byteranges; boundary=%s", boundary);
+    u_map_put(response->map_header, "Content-Type", multipart_type);
+    o_free(multipart_type);
+    ret = ulfius_set_stream_response(response, 206, callback_static_file_multipart_stream, callback_static_file_multipart_stream_free, body_size, STATIC_FILE_CHUNK, multipart);
+  }
+  if (ret != U_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "callback_static_file - Error building multipart response");
+    callback_static_file_multipart_stream_free(multipart);
+  }
+  o_free(boundary);
+  return ret;
+}
+
+/**
+ * Set a range of the file as the response body
+ * The response takes the ownership of the file, even on error
+ * Return U_OK on success
+ */
+static int static_file_set_body(struct _u_response * response, unsigned int status, const struct _static_file_source * source, uint64_t offset, uint64_t length) {
+  int ret;
+  
+  if (source->entry != NULL) {
+    // The cached content is sent without copy, the entry is released when the response is complete
+    if (!length) {
+      ret = ulfius_set_empty_body_response(response, status);
+      static_file_cache_release(source->entry);
+    } else if ((ret = ulfius_set_buffer_body_response(response, status, source->entry->data + offset, (size_t)length, &static_file_cache_release, source->entry)) != U_OK) {
+      static_file_cache_release(source->entry);
+    }
+  } else if ((ret = ulfius_set_file_response(response, status, source->fd, offset, length)) != U_OK) {
+    // The file is sent by the kernel, the response closes fd when it's complete
+    close(source->fd);
+  }
+  if (ret != U_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "callback_static_file - Error setting response body");
+  }
+  return ret;
+}
+
+/**
+ * Send the file, handle conditional requests and ranges
+ * The response takes the ownership of the file
+ */
+static void static_file_send(const struct _u_request * request, struct _u_response * response, const struct _static_file_source * source) {
+  char content_range[64];
+  const char * if_none_match = u_map_get_case(request->map_header, "If-None-Match"), * range = u_map_get_case(request->map_header, "Range"), * if_range;
+  uint64_t starts[STATIC_FILE_MAX_RANGES], lengths[STATIC_FILE_MAX_RANGES];
+  time_t if_modified_since;
+  int nb_ranges = -1;
+  
+  u_map_put(response->map_header, "ETag", source->etag);
+  u_map_put(response->map_header, "Last-Modified", source->last_modified);
+  u_map_put(response->map_header, "Accept-Ranges", "bytes");
+  
+  // If-Modified-Since is ignored if If-None-Match is present
+  if ((if_none_match != NULL && static_file_etag_match(if_none_match, source->etag)) ||
+      (if_none_match == NULL && static_file_parse_date(u_map_get_case(request->map_header, "If-Modified-Since"), &if_modified_since) && source->mtime <= if_modified_since)) {
+    ulfius_set_empty_body_response(response, 304);
+    static_file_release(source->fd, source->entry);
+    return;
+  }
+  
+  u_map_put(response->map_header, "Content-Type", source->content_type);
+  // Range is ignored if If-Range doesn't match the current entity tag or modification date
+  if (range != NULL) {
+    if_range = u_map_get_case(request->map_header, "If-Range");
+    if (if_range == NULL || 0 == o_strcmp(if_range, source->etag) || 0 == o_strcmp(if_range, source->last_modified)) {
+      nb_ranges = static_file_parse_range(range, source->size, starts, lengths);
+    }
+  }
+  
+  if (nb_ranges == 0) {
+    snprintf(content_range, sizeof(content_range), "bytes */%" PRIu64, source->size);
+    u_map_put(response->map_header, "Content-Range", content_range);
+    ulfius_set_empty_body_response(response, 416);
+    static_file_release(source->fd, source->entry);
+  } else if (nb_ranges == 1) {
+    snprintf(content_range, sizeof(content_range), "bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64, starts[0], starts[0] + lengths[0] - 1, source->size);
+    u_map_put(response->map_header, "Content-Range", content_range);
+    static_file_set_body(response, 206, source, starts[0], lengths[0]);
+  } else if (nb_ranges > 1) {
+    static_file_set_multipart_response(response, source, starts, lengths, nb_ranges);
+  } else {
+    static_file_set_body(response, 200, source, 0, source->size);
+  }
+}
+
+/**
+ * Send the file path if it exists
+ * content_type is looked up with the extension of name when the file isn't in the cache
+ * Return 0 if the file doesn't exist
+ */
+static int static_file_serve(const struct _u_request * request, struct _u_response * response, struct _static_file_config * config, const char * path, const char * file_path, const char * name) {
+  struct _static_file_source source;
+  struct stat file_stat;
+  char etag[64], last_modified[32];
+  const char * content_type;
+  
+  memset(&source, 0, sizeof(struct _static_file_source));
+  source.fd = -1;
+  if (config->cache != NULL && (source.entry = static_file_cache_get(config->cache, path)) != NULL) {
+    // Hot file, sent from memory without filesystem access
+    source.size = source.entry->size;
+    source.mtime = source.entry->mtime;
+    source.etag = source.entry->etag;
+    source.last_modified = source.entry->last_modified;
+    source.content_type = source.entry->content_type;
+    u_map_copy_into(response->map_header, config->map_header);
+    static_file_send(request, response, &source);
+  } else if (access(file_path, F_OK) != -1) {
+    source.fd = open(file_path, O_RDONLY);
+    if (source.fd != -1) {
+      if (fstat(source.fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+        content_type = u_map_get_case(config->mime_types, get_filename_ext(name));
+        if (content_type == NULL) {
+          content_type = u_map_get(config->mime_types, "*");
+          y_log_message(Y_LOG_LEVEL_WARNING, "Static File Server - Unknown mime type for extension %s", get_filename_ext(name));
+        }
+        u_map_copy_into(response->map_header, config->map_header);
+        if (config->cache != NULL && (source.entry = static_file_cache_put(config->cache, path, file_path, source.fd, &file_stat, content_type)) != NULL) {
+          close(source.fd);
+          source.fd = -1;
+          source.etag = source.entry->etag;
+          source.last_modified = source.entry->last_modified;
+          source.content_type = source.entry->content_type;
+        } else {
+          // The entity tag is derived from the inode, the modification time and the size, the file is never read to revalidate it
+          snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx\"", (unsigned long long)file_stat.st_ino, (unsigned long long)file_stat.st_mtime, (unsigned long long)file_stat.st_size);
+          static_file_format_date(file_stat.st_mtime, last_modified, sizeof(last_modified));
+          source.etag = etag;
+          source.last_modified = last_modified;
+          source.content_type = content_type;
+        }
+        source.size = (uint64_t)file_stat.st_size;
+        source.mtime = file_stat.st_mtime;
+        static_file_send(request, response, &source);
+      } else {
+        close(source.fd);
+      }
+    }
+  } else {
+    return 0;
+  }
+  return 1;
 }
 
 /**
  * static file callback endpoint
  */
 int callback_static_file (const struct _u_request * request, struct _u_response * response, void * user_data) {
-  size_t length;
-  FILE * f;
-  char * file_requested, * file_path, * url_dup_save;
-  const char * content_type;
+  struct _static_file_config * config = (struct _static_file_config *)user_data;
+  char * file_requested, * file_path, * url_dup_save, * variant_requested, * variant_path, * vary;
+  const char * vary_value;
+  unsigned int variants;
+  int encoding, served = 0;
 
   /*
    * Comment this if statement if you put static files url not in root, like /app
@@ -74,14 +1027,14 @@ int callback_static_file (const struct _u_request * request, struct _u_response
     return U_CALLBACK_CONTINUE;
   }
   
-  if (user_data != NULL && ((struct _static_file_config *)user_data)->files_path != NULL) {
+  if (config != NULL && config->files_path != NULL) {
     file_requested = o_strdup(request->http_url);
     url_dup_save = file_requested;
     
     while (file_requested[0] == '/') {
       file_requested++;
     }
-    file_requested += o_strlen(((struct _static_file_config *)user_data)->url_prefix);
+    file_requested += o_strlen(config->url_prefix);
     while (file_requested[0] == '/') {
       file_requested++;
     }
@@ -99,35 +1052,40 @@ int callback_static_file (const struct _u_request * request, struct _u_response
       url_dup_save = file_requested = o_strdup("index.html");
     }
     
-    file_path = msprintf("%s/%s", ((struct _static_file_config *)user_data)->files_path, file_requested);
-
-    if (access(file_path, F_OK) != -1) {
-      f = fopen (file_path, "rb");
-      if (f) {
-        fseek (f, 0, SEEK_END);
-        length = ftell (f);
-        fseek (f, 0, SEEK_SET);
-        
-        content_type = u_map_get_case(((struct _static_file_config *)user_data)->mime_types, get_filename_ext(file_requested));
-        if (content_type == NULL) {
-          content_type = u_map_get(((struct _static_file_config *)user_data)->mime_types, "*");
-          y_log_message(Y_LOG_LEVEL_WARNING, "Static File Server - Unknown mime type for extension %s", get_filename_ext(file_requested));
-        }
-        u_map_put(response->map_header, "Content-Type", content_type);
-        u_map_copy_into(response->map_header, ((struct _static_file_config *)user_data)->map_header);
-        
-        if (ulfius_set_stream_response(response, 200, callback_static_file_stream, callback_static_file_stream_free, length, STATIC_FILE_CHUNK, f) != U_OK) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "callback_static_file - Error ulfius_set_stream_response");
+    file_path = msprintf("%s/%s", config->files_path, file_requested);
+
+    // Send a precompressed variant of the file if the client accepts its encoding
+    if ((variants = static_file_get_variants(config->cache, file_requested, file_path))) {
+      if ((encoding = static_file_select_encoding(u_map_get_case(request->map_header, "Accept-Encoding"), variants)) != -1) {
+        variant_requested = msprintf("%s%s", file_requested, static_file_encodings[encoding].suffix);
+        variant_path = msprintf("%s%s", file_path, static_file_encodings[encoding].suffix);
+        if (variant_requested != NULL && variant_path != NULL && (served = static_file_serve(request, response, config, variant_requested, variant_path, file_requested))) {
+          u_map_put(response->map_header, "Content-Encoding", static_file_encodings[encoding].encoding);
         }
+        o_free(variant_requested);
+        o_free(variant_path);
       }
-    } else {
-      if (((struct _static_file_config *)user_data)->redirect_on_404 == NULL) {
+    }
+    
+    if (!served && !static_file_serve(request, response, config, file_requested, file_path, file_requested)) {
+      if (config->redirect_on_404 == NULL) {
         ulfius_set_string_body_response(response, 404, "File not found");
       } else {
-        ulfius_add_header_to_response(response, "Location", ((struct _static_file_config *)user_data)->redirect_on_404);
+        ulfius_add_header_to_response(response, "Location", config->redirect_on_404);
         response->status = 302;
       }
     }
+    // The response depends on Accept-Encoding if the file has precompressed variants
+    if (variants) {
+      // The headers set before may have any case, they are replaced to be sent once
+      if ((vary_value = u_map_get_case(response->map_header, "Vary")) == NULL) {
+        u_map_put(response->map_header, "Vary", "Accept-Encoding");
+      } else if (o_strcasestr(vary_value, "Accept-Encoding") == NULL && (vary = msprintf("%s, Accept-Encoding", vary_value)) != NULL) {
+        u_map_remove_from_key_case(response->map_header, "Vary");
+        u_map_put(response->map_header, "Vary", vary);
+        o_free(vary);
+      }
+    }
     o_free(file_path);
     o_free(url_dup_save);
     return U_CALLBACK_CONTINUE;
@@ -7,6 +7,7 @@
  * url_prefix: prefix used to access the callback function
  * mime_types: a struct _u_map filled with all the mime-types needed for a static file server
  * redirect_on_404: redirct uri on error 404, if NULL, send 404
+ * cache: hot file cache, NULL to disable it, initialized with static_file_cache_init
  * 
  * example of mime-types used in Hutch:
  * {
@@ -60,6 +61,12 @@
 #define _STATIC_FILE
 
 #define STATIC_FILE_CHUNK 256
+#define STATIC_FILE_MAX_RANGES 16
+#define STATIC_FILE_CACHE_BUCKETS 256
+#define STATIC_FILE_VARIANTS_TTL 60
+#define STATIC_FILE_VARIANTS_MAX 4096
+
+struct _static_file_cache;
 
 struct _static_file_config {
   char          * files_path;
@@ -67,9 +74,12 @@ struct _static_file_config {
   struct _u_map * mime_types;
   struct _u_map * map_header;
   char          * redirect_on_404;
+  struct _static_file_cache * cache;
 };
 
 int callback_static_file (const struct _u_request * request, struct _u_response * response, void * user_data);
 const char * get_filename_ext(const char *path);
+int static_file_cache_init(struct _static_file_config * config, size_t max_size, size_t max_file_size);
+void static_file_cache_clean(struct _static_file_config * config);
 
 #endif
@@ -0,0 +1,177 @@
+/**
+ *
+ * Ulfius Framework alloc_benchmark program
+ *
+ * This program counts the memory allocations made by the library
+ * for each request processed by an instance
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <ulfius.h>
+
+#define PORT 8538
+#define PREFIX "/bench"
+#define BODY "Hello World!"
+#define REQUEST_GET "GET " PREFIX "/42/value?param1=one&param2=two HTTP/1.1\r\nHost: localhost\r\nUser-Agent: alloc_benchmark\r\nAccept: */*\r\nCookie: session=abcdef\r\n\r\n"
+#define REQUEST_POST "POST " PREFIX "/42/value HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: 21\r\n\r\nkey1=value1&key2=val2"
+#define RESPONSE_BUFFER_SIZE 1024
+#define DEFAULT_NB_REQUESTS 10000
+
+static unsigned long nb_malloc = 0, nb_realloc = 0, nb_free = 0;
+
+/**
+ * Allocation functions counting the calls, set with o_set_alloc_funcs
+ */
+static void * counting_malloc(size_t size) {
+  __atomic_add_fetch(&nb_malloc, 1, __ATOMIC_RELAXED);
+  return malloc(size);
+}
+
+static void * counting_realloc(void * ptr, size_t size) {
+  __atomic_add_fetch(&nb_realloc, 1, __ATOMIC_RELAXED);
+  return realloc(ptr, size);
+}
+
+static void counting_free(void * ptr) {
+  if (ptr != NULL) {
+    __atomic_add_fetch(&nb_free, 1, __ATOMIC_RELAXED);
+  }
+  free(ptr);
+}
+
+/**
+ * Callback function for the benchmark endpoint
+ */
+int callback_bench (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ulfius_set_string_body_response(response, 200, BODY);
+  return U_CALLBACK_CONTINUE;
+}
+
+static double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Send a request and read the response on a keep-alive connection
+ * return 1 on success
+ */
+static int run_request(int fd, const char * request) {
+  char buffer[RESPONSE_BUFFER_SIZE];
+  const char * end_headers, * content_length;
+  size_t len = 0, expected = 0;
+  ssize_t res;
+
+  if (send(fd, request, strlen(request), MSG_NOSIGNAL) != (ssize_t)strlen(request)) {
+    return 0;
+  }
+  while (!expected || len < expected) {
+    if ((res = recv(fd, buffer + len, RESPONSE_BUFFER_SIZE - len - 1, 0)) <= 0) {
+      return 0;
+    }
+    len += (size_t)res;
+    buffer[len] = '\0';
+    if (!expected && (end_headers = strstr(buffer, "\r\n\r\n")) != NULL) {
+      expected = (size_t)(end_headers + 4 - buffer);
+      if ((content_length = strcasestr(buffer, "Content-Length:")) != NULL && content_length < end_headers) {
+        expected += strtoul(content_length + 15, NULL, 10);
+      }
+    }
+  }
+  return !strncmp(buffer, "HTTP/1.1 200", 12);
+}
+
+/**
+ * Run nb_requests requests on a keep-alive connection and print the allocations per request
+ */
+static int run_benchmark(const char * name, const char * request, unsigned int nb_requests) {
+  struct sockaddr_in addr;
+  unsigned long malloc_before, realloc_before, free_before;
+  unsigned int i, nb_errors = 0;
+  int fd, one = 1;
+  double start, duration;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    fprintf(stderr, "Error connecting to the instance\n");
+    return 1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  // Warm up the connection before counting
+  run_request(fd, request);
+
+  malloc_before = __atomic_load_n(&nb_malloc, __ATOMIC_RELAXED);
+  realloc_before = __atomic_load_n(&nb_realloc, __ATOMIC_RELAXED);
+  free_before = __atomic_load_n(&nb_free, __ATOMIC_RELAXED);
+  start = get_time();
+  for (i=0; i<nb_requests; i++) {
+    if (!run_request(fd, request)) {
+      nb_errors++;
+    }
+  }
+  duration = get_time() - start;
+  close(fd);
+
+  printf("%s: %u requests, %u errors, %.0f requests/s\n", name, nb_requests, nb_errors, (double)nb_requests / duration);
+  printf("  malloc/request:  %.2f\n", (double)(__atomic_load_n(&nb_malloc, __ATOMIC_RELAXED) - malloc_before) / nb_requests);
+  printf("  realloc/request: %.2f\n", (double)(__atomic_load_n(&nb_realloc, __ATOMIC_RELAXED) - realloc_before) / nb_requests);
+  printf("  free/request:    %.2f\n", (double)(__atomic_load_n(&nb_free, __ATOMIC_RELAXED) - free_before) / nb_requests);
+  return nb_errors != 0;
+}
+
+int main(int argc, char ** argv) {
+  struct _u_instance instance;
+  unsigned int nb_requests = DEFAULT_NB_REQUESTS;
+  int ret;
+
+  if (argc > 1 && strtoul(argv[1], NULL, 10)) {
+    nb_requests = (unsigned int)strtoul(argv[1], NULL, 10);
+  }
+
+  // Must be set before any allocation made by the library
+  o_set_alloc_funcs(&counting_malloc, &counting_realloc, &counting_free);
+
+  y_init_logs("alloc_benchmark", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_ERROR, NULL, "Starting alloc_benchmark");
+
+  if (ulfius_init_instance(&instance, PORT, NULL, NULL) != U_OK) {
+    fprintf(stderr, "Error ulfius_init_instance, abort\n");
+    return 1;
+  }
+  ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/:id/:name", 0, &callback_bench, NULL);
+  ulfius_add_endpoint_by_val(&instance, "POST", PREFIX, "/:id/:name", 0, &callback_bench, NULL);
+
+  if (ulfius_start_framework(&instance) != U_OK) {
+    fprintf(stderr, "Error ulfius_start_framework, abort\n");
+    ulfius_clean_instance(&instance);
+    return 1;
+  }
+
+  ret = run_benchmark("GET with url parameters, headers and cookie", REQUEST_GET, nb_requests);
+  ret |= run_benchmark("POST with url-encoded body", REQUEST_POST, nb_requests);
+
+  ulfius_stop_framework(&instance);
+  ulfius_clean_instance(&instance);
+  y_close_logs();
+
+  return ret;
+}
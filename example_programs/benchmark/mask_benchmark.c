@@ -0,0 +1,101 @@
+/**
+ *
+ * Ulfius Framework mask_benchmark program
+ *
+ * This program measures the throughput of the websocket payload mask,
+ * with the scalar version and the vectorized version selected for the CPU
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "u_private.h"
+
+#define DEFAULT_TOTAL_SIZE_MB 1024
+
+#ifndef U_DISABLE_WEBSOCKET
+static double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Mask the payload in place enough times to mask total_size bytes, print the throughput
+ */
+static void run_benchmark(uint8_t * payload, size_t size, size_t total_size, void (* mask_func)(uint8_t *, const uint8_t *, size_t, const uint8_t *, size_t)) {
+  const uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+  size_t i, nb_iterations = total_size / size;
+  double start, duration;
+
+  start = get_time();
+  for (i=0; i<nb_iterations; i++) {
+    mask_func(payload, payload, size, mask, i);
+  }
+  duration = get_time() - start;
+  printf("%8zu bytes %-8s %10.1f MB/s\n", size, mask_func==&ulfius_websocket_mask_scalar?"scalar":"mask", (double)(nb_iterations * size) / (1024*1024) / duration);
+}
+
+/**
+ * Check that both versions give the same result on payloads of all the sizes and offsets up to 256 bytes
+ * return 0 on success
+ */
+static int check_mask(void) {
+  const uint8_t mask[4] = {0x9a, 0xbc, 0xde, 0xf0};
+  uint8_t payload[256], expected[256], result[256];
+  size_t len, offset, i;
+
+  for (i=0; i<sizeof(payload); i++) {
+    payload[i] = (uint8_t)(i * 7 + 3);
+  }
+  for (len=0; len<=sizeof(payload); len++) {
+    for (offset=0; offset<4; offset++) {
+      ulfius_websocket_mask_scalar(expected, payload, len, mask, offset);
+      ulfius_websocket_mask(result, payload, len, mask, offset);
+      if (memcmp(expected, result, len)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char ** argv) {
+  size_t sizes[] = {16, 125, 1024, 16384, 65536, 1048576}, total_size = (size_t)DEFAULT_TOTAL_SIZE_MB * 1024 * 1024;
+  uint8_t * payload;
+  unsigned int i;
+
+  if (argc > 1 && strtoul(argv[1], NULL, 10)) {
+    total_size = (size_t)strtoul(argv[1], NULL, 10) * 1024 * 1024;
+  }
+  if (check_mask()) {
+    fprintf(stderr, "Error, ulfius_websocket_mask and ulfius_websocket_mask_scalar results differ\n");
+    return 1;
+  }
+  if ((payload = malloc(sizes[sizeof(sizes)/sizeof(size_t)-1])) == NULL) {
+    fprintf(stderr, "Error allocating memory for payload\n");
+    return 1;
+  }
+  memset(payload, 'a', sizes[sizeof(sizes)/sizeof(size_t)-1]);
+
+  for (i=0; i<sizeof(sizes)/sizeof(size_t); i++) {
+    run_benchmark(payload, sizes[i], total_size, &ulfius_websocket_mask_scalar);
+    run_benchmark(payload, sizes[i], total_size, &ulfius_websocket_mask);
+  }
+
+  free(payload);
+  return 0;
+}
+#else
+int main(void) {
+  fprintf(stderr, "Websocket support is disabled\n");
+  return 1;
+}
+#endif
@@ -0,0 +1,214 @@
+/**
+ *
+ * Ulfius Framework post_benchmark program
+ *
+ * This program measures the memory allocations and the time spent
+ * by an instance to parse url-encoded bodies with many small fields
+ * or a few large fields
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ulfius.h>
+
+#define PORT 8541
+#define PREFIX "/bench"
+#define RESPONSE_BUFFER_SIZE 1024
+#define DEFAULT_NB_REQUESTS 20
+#define NB_SMALL_FIELDS 10000
+#define NB_LARGE_FIELDS 10
+#define LARGE_FIELD_SIZE (1024*1024)
+
+static unsigned long nb_malloc = 0, nb_realloc = 0, nb_free = 0;
+
+/**
+ * Allocation functions counting the calls, set with o_set_alloc_funcs
+ */
+static void * counting_malloc(size_t size) {
+  __atomic_add_fetch(&nb_malloc, 1, __ATOMIC_RELAXED);
+  return malloc(size);
+}
+
+static void * counting_realloc(void * ptr, size_t size) {
+  __atomic_add_fetch(&nb_realloc, 1, __ATOMIC_RELAXED);
+  return realloc(ptr, size);
+}
+
+static void counting_free(void * ptr) {
+  if (ptr != NULL) {
+    __atomic_add_fetch(&nb_free, 1, __ATOMIC_RELAXED);
+  }
+  free(ptr);
+}
+
+/**
+ * Callback function for the benchmark endpoint, sends the number of post parameters received
+ */
+int callback_bench (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  char count[32];
+
+  snprintf(count, sizeof(count), "%d", u_map_count(request->map_post_body));
+  ulfius_set_string_body_response(response, 200, count);
+  return U_CALLBACK_CONTINUE;
+}
+
+static double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static int send_all(int fd, const char * data, size_t len) {
+  ssize_t res;
+
+  while (len) {
+    if ((res = send(fd, data, len, MSG_NOSIGNAL)) <= 0) {
+      return 0;
+    }
+    data += res;
+    len -= (size_t)res;
+  }
+  return 1;
+}
+
+/**
+ * Build an url-encoded body of nb_fields fields of field_size bytes
+ */
+static char * build_body(unsigned int nb_fields, size_t field_size, size_t * body_len) {
+  char * body = malloc(nb_fields * (field_size + 32)), * cur;
+  unsigned int i;
+
+  if (body != NULL) {
+    cur = body;
+    for (i=0; i<nb_fields; i++) {
+      cur += sprintf(cur, "%sfield%u=", i?"&":"", i);
+      memset(cur, 'a', field_size);
+      cur += field_size;
+    }
+    *body_len = (size_t)(cur - body);
+  }
+  return body;
+}
+
+/**
+ * Send a POST request with the url-encoded body
+ * return the number of post parameters received by the instance, 0 on error
+ */
+static int run_post(const char * body, size_t body_len) {
+  struct sockaddr_in addr;
+  char headers[256], response[RESPONSE_BUFFER_SIZE];
+  const char * response_body;
+  size_t received = 0;
+  ssize_t res;
+  int fd, ok;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    fprintf(stderr, "Error connecting to the instance\n");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 0;
+  }
+  snprintf(headers, sizeof(headers), "POST " PREFIX " HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+  ok = send_all(fd, headers, strlen(headers)) && send_all(fd, body, body_len);
+  if (ok) {
+    while (received < RESPONSE_BUFFER_SIZE - 1 && (res = recv(fd, response + received, RESPONSE_BUFFER_SIZE - 1 - received, 0)) > 0) {
+      received += (size_t)res;
+    }
+    response[received] = '\0';
+  }
+  close(fd);
+  if (ok && !strncmp(response, "HTTP/1.1 200", 12) && (response_body = strstr(response, "\r\n\r\n")) != NULL) {
+    return (int)strtol(response_body + 4, NULL, 10);
+  }
+  return 0;
+}
+
+/**
+ * Send nb_requests bodies of nb_fields fields of field_size bytes,
+ * print the time spent and the allocations per request
+ */
+static int run_benchmark(const char * name, unsigned int nb_fields, size_t field_size, unsigned int nb_requests) {
+  unsigned long malloc_before, realloc_before, free_before;
+  unsigned int i, nb_errors = 0;
+  double start, duration;
+  size_t body_len = 0;
+  char * body;
+
+  if ((body = build_body(nb_fields, field_size, &body_len)) == NULL) {
+    fprintf(stderr, "Error allocating memory for body\n");
+    return 1;
+  }
+  malloc_before = __atomic_load_n(&nb_malloc, __ATOMIC_RELAXED);
+  realloc_before = __atomic_load_n(&nb_realloc, __ATOMIC_RELAXED);
+  free_before = __atomic_load_n(&nb_free, __ATOMIC_RELAXED);
+  start = get_time();
+  for (i=0; i<nb_requests; i++) {
+    if (run_post(body, body_len) != (int)nb_fields) {
+      nb_errors++;
+    }
+  }
+  duration = get_time() - start;
+  free(body);
+
+  printf("%s: %u requests, %u errors, %.3f ms/request\n", name, nb_requests, nb_errors, duration * 1000 / nb_requests);
+  printf("  malloc/request:  %.2f\n", (double)(__atomic_load_n(&nb_malloc, __ATOMIC_RELAXED) - malloc_before) / nb_requests);
+  printf("  realloc/request: %.2f\n", (double)(__atomic_load_n(&nb_realloc, __ATOMIC_RELAXED) - realloc_before) / nb_requests);
+  printf("  free/request:    %.2f\n", (double)(__atomic_load_n(&nb_free, __ATOMIC_RELAXED) - free_before) / nb_requests);
+  return nb_errors != 0;
+}
+
+int main(int argc, char ** argv) {
+  struct _u_instance instance;
+  unsigned int nb_requests = DEFAULT_NB_REQUESTS;
+  char name[64];
+  int ret;
+
+  if (argc > 1 && strtoul(argv[1], NULL, 10)) {
+    nb_requests = (unsigned int)strtoul(argv[1], NULL, 10);
+  }
+
+  // Must be set before any allocation made by the library
+  o_set_alloc_funcs(&counting_malloc, &counting_realloc, &counting_free);
+
+  y_init_logs("post_benchmark", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_ERROR, NULL, "Starting post_benchmark");
+
+  if (ulfius_init_instance(&instance, PORT, NULL, NULL) != U_OK) {
+    fprintf(stderr, "Error ulfius_init_instance, abort\n");
+    return 1;
+  }
+  ulfius_add_endpoint_by_val(&instance, "POST", PREFIX, NULL, 0, &callback_bench, NULL);
+
+  if (ulfius_start_framework(&instance) != U_OK) {
+    fprintf(stderr, "Error ulfius_start_framework, abort\n");
+    ulfius_clean_instance(&instance);
+    return 1;
+  }
+
+  snprintf(name, sizeof(name), "%d small fields", NB_SMALL_FIELDS);
+  ret = run_benchmark(name, NB_SMALL_FIELDS, 8, nb_requests);
+  snprintf(name, sizeof(name), "%d large fields of %d kB", NB_LARGE_FIELDS, LARGE_FIELD_SIZE / 1024);
+  ret |= run_benchmark(name, NB_LARGE_FIELDS, LARGE_FIELD_SIZE, nb_requests);
+
+  ulfius_stop_framework(&instance);
+  ulfius_clean_instance(&instance);
+  y_close_logs();
+
+  return ret;
+}
@@ -0,0 +1,154 @@
+/**
+ *
+ * Ulfius Framework stream_benchmark program
+ *
+ * This program measures the throughput of a large stream response
+ * with different stream block sizes and in adaptive mode
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ulfius.h>
+
+#define PORT 8539
+#define PREFIX "/bench"
+#define REQUEST "GET " PREFIX " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n"
+#define RECV_BUFFER_SIZE (1024*1024)
+#define DEFAULT_STREAM_SIZE_MB 1024
+#define ADAPTIVE_BLOCK_SIZE_MAX (1024*1024)
+
+static uint64_t stream_size;
+
+/**
+ * Stream callback function, the block isn't filled so only the framework and the socket are measured
+ */
+static ssize_t stream_bench (void * cls, uint64_t pos, char * buf, size_t max) {
+  if (pos >= stream_size) {
+    return U_STREAM_END;
+  }
+  return (ssize_t)(max<(stream_size - pos)?max:(stream_size - pos));
+}
+
+/**
+ * Callback function for the benchmark endpoint, the block size is the instance one
+ */
+int callback_bench (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ulfius_set_stream_response(response, 200, &stream_bench, NULL, stream_size, 0, NULL);
+  return U_CALLBACK_CONTINUE;
+}
+
+static double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Download the stream response and return the number of bytes received, headers included
+ */
+static uint64_t run_download(char * buffer) {
+  struct sockaddr_in addr;
+  uint64_t received = 0;
+  ssize_t res;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    fprintf(stderr, "Error connecting to the instance\n");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 0;
+  }
+  if (send(fd, REQUEST, strlen(REQUEST), MSG_NOSIGNAL) == (ssize_t)strlen(REQUEST)) {
+    while ((res = recv(fd, buffer, RECV_BUFFER_SIZE, 0)) > 0) {
+      received += (uint64_t)res;
+    }
+  }
+  close(fd);
+  return received;
+}
+
+/**
+ * Run an instance with the specified block sizes and print the throughput of the download
+ */
+static int run_benchmark(const char * name, size_t block_size, size_t block_size_max, char * buffer) {
+  struct _u_instance instance;
+  uint64_t received;
+  double start, duration;
+
+  if (ulfius_init_instance(&instance, PORT, NULL, NULL) != U_OK) {
+    fprintf(stderr, "Error ulfius_init_instance, abort\n");
+    return 1;
+  }
+  instance.stream_block_size = block_size;
+  instance.stream_block_size_max = block_size_max;
+  ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, NULL, 0, &callback_bench, NULL);
+  if (ulfius_start_framework(&instance) != U_OK) {
+    fprintf(stderr, "Error ulfius_start_framework, abort\n");
+    ulfius_clean_instance(&instance);
+    return 1;
+  }
+
+  start = get_time();
+  received = run_download(buffer);
+  duration = get_time() - start;
+
+  ulfius_stop_framework(&instance);
+  ulfius_clean_instance(&instance);
+
+  if (received < stream_size) {
+    fprintf(stderr, "%s: incomplete response, %" PRIu64 " bytes received\n", name, received);
+    return 1;
+  }
+  printf("%-24s %8.2f s %10.1f MB/s\n", name, duration, (double)stream_size / (1024*1024) / duration);
+  return 0;
+}
+
+int main(int argc, char ** argv) {
+  size_t block_sizes[] = {1024, 4*1024, 16*1024, 64*1024, 256*1024, 1024*1024};
+  char name[64], * buffer;
+  unsigned long size_mb = DEFAULT_STREAM_SIZE_MB;
+  unsigned int i;
+  int ret = 0;
+
+  if (argc > 1 && strtoul(argv[1], NULL, 10)) {
+    size_mb = strtoul(argv[1], NULL, 10);
+  }
+  stream_size = (uint64_t)size_mb * 1024 * 1024;
+  if ((buffer = malloc(RECV_BUFFER_SIZE)) == NULL) {
+    fprintf(stderr, "Error allocating memory for buffer\n");
+    return 1;
+  }
+
+  y_init_logs("stream_benchmark", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_ERROR, NULL, "Starting stream_benchmark");
+
+  printf("Stream response of %lu MB\n", size_mb);
+  for (i=0; i<sizeof(block_sizes)/sizeof(size_t); i++) {
+    snprintf(name, sizeof(name), "block size %zu kB", block_sizes[i] / 1024);
+    ret |= run_benchmark(name, block_sizes[i], 0, buffer);
+  }
+  snprintf(name, sizeof(name), "adaptive 1 kB-%d kB", ADAPTIVE_BLOCK_SIZE_MAX / 1024);
+  ret |= run_benchmark(name, ULFIUS_STREAM_BLOCK_SIZE_DEFAULT, ADAPTIVE_BLOCK_SIZE_MAX, buffer);
+
+  y_close_logs();
+  free(buffer);
+
+  return ret;
+}
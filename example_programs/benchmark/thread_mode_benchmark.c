@@ -0,0 +1,250 @@
+/**
+ *
+ * Ulfius Framework thread_mode_benchmark program
+ *
+ * This program measures the requests per second and the memory used by an instance
+ * with a large number of concurrent keep-alive connections,
+ * either in U_EXECUTION_MODE_THREAD_PER_CONNECTION or in U_EXECUTION_MODE_THREAD_POOL
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <ulfius.h>
+
+#define PORT 8537
+#define PREFIX "/bench"
+#define BODY "Hello World!"
+#define REQUEST "GET " PREFIX " HTTP/1.1\r\nHost: localhost\r\n\r\n"
+#define CONNECTION_BUFFER_SIZE 512
+#define CONNECT_TIMEOUT 30
+
+struct bench_connection {
+  int    fd;
+  size_t len;
+  char   buffer[CONNECTION_BUFFER_SIZE];
+};
+
+/**
+ * Callback function for the benchmark endpoint
+ */
+int callback_bench (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ulfius_set_string_body_response(response, 200, BODY);
+  return U_CALLBACK_CONTINUE;
+}
+
+/**
+ * Return the value of the specified field in /proc/self/status, in kB for memory fields
+ */
+static long get_proc_status_value(const char * field) {
+  FILE * f = fopen("/proc/self/status", "r");
+  char line[256];
+  long value = -1;
+  size_t field_len = strlen(field);
+
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (!strncmp(line, field, field_len) && line[field_len] == ':') {
+        value = strtol(line + field_len + 1, NULL, 10);
+        break;
+      }
+    }
+    fclose(f);
+  }
+  return value;
+}
+
+static double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Return 1 if the buffer contains a complete http response
+ */
+static int is_response_complete(const char * buffer, size_t len) {
+  const char * end_headers, * content_length;
+
+  if ((end_headers = memmem(buffer, len, "\r\n\r\n", 4)) != NULL) {
+    if ((content_length = strcasestr(buffer, "Content-Length:")) != NULL && content_length < end_headers) {
+      return (size_t)(end_headers + 4 - buffer) + strtoul(content_length + 15, NULL, 10) <= len;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+static void close_connection(int epfd, struct bench_connection * connection) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  connection->fd = -1;
+}
+
+static int send_request(struct bench_connection * connection) {
+  connection->len = 0;
+  return send(connection->fd, REQUEST, strlen(REQUEST), MSG_NOSIGNAL) == (ssize_t)strlen(REQUEST);
+}
+
+int main(int argc, char ** argv) {
+  struct _u_instance instance;
+  struct bench_connection * connections;
+  struct epoll_event ev, * events;
+  struct sockaddr_in addr;
+  struct rlimit limit;
+  unsigned int nb_connections, duration = 10, i;
+  unsigned long nb_responses = 0, nb_errors = 0, nb_connected = 0;
+  long rss_before, rss_after;
+  int epfd, nb_events, j, measure = 0, one = 1;
+  double start, now;
+  ssize_t res;
+
+  if (argc < 3 || (strcmp(argv[1], "pool") && strcmp(argv[1], "thread")) || !strtoul(argv[2], NULL, 10)) {
+    fprintf(stderr, "Usage: %s <pool|thread> <nb_connections> [duration_in_seconds] [thread_pool_size]\n", argv[0]);
+    return 1;
+  }
+  nb_connections = (unsigned int)strtoul(argv[2], NULL, 10);
+  if (argc > 3) {
+    duration = (unsigned int)strtoul(argv[3], NULL, 10);
+  }
+
+  // Each connection uses one file descriptor on each side
+  if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  y_init_logs("thread_mode_benchmark", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_ERROR, NULL, "Starting thread_mode_benchmark");
+
+  if (ulfius_init_instance(&instance, PORT, NULL, NULL) != U_OK) {
+    fprintf(stderr, "Error ulfius_init_instance, abort\n");
+    return 1;
+  }
+  if (!strcmp(argv[1], "pool")) {
+    instance.execution_mode = U_EXECUTION_MODE_THREAD_POOL;
+    if (argc > 4) {
+      instance.thread_pool_size = (unsigned int)strtoul(argv[4], NULL, 10);
+    }
+  }
+  ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, NULL, 0, &callback_bench, NULL);
+
+  rss_before = get_proc_status_value("VmRSS");
+  if (ulfius_start_framework(&instance) != U_OK) {
+    fprintf(stderr, "Error ulfius_start_framework, abort\n");
+    ulfius_clean_instance(&instance);
+    return 1;
+  }
+
+  connections = calloc(nb_connections, sizeof(struct bench_connection));
+  events = calloc(nb_connections, sizeof(struct epoll_event));
+  epfd = epoll_create1(0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  for (i=0; i<nb_connections; i++) {
+    connections[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connections[i].fd < 0) {
+      fprintf(stderr, "Error opening socket %u: %s\n", i, strerror(errno));
+      nb_connections = i;
+      break;
+    }
+    setsockopt(connections[i].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(connections[i].fd, F_SETFL, fcntl(connections[i].fd, F_GETFL) | O_NONBLOCK);
+    if (connect(connections[i].fd, (struct sockaddr *)&addr, sizeof(addr)) && errno != EINPROGRESS) {
+      fprintf(stderr, "Error connecting socket %u: %s\n", i, strerror(errno));
+      close(connections[i].fd);
+      nb_connections = i;
+      break;
+    }
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &connections[i];
+    epoll_ctl(epfd, EPOLL_CTL_ADD, connections[i].fd, &ev);
+  }
+
+  // Every connection sends its first request when connected, then a new request as soon as the previous response is complete
+  start = get_time();
+  while (1) {
+    now = get_time();
+    if (!measure && (nb_connected == nb_connections || now - start > CONNECT_TIMEOUT)) {
+      measure = 1;
+      nb_responses = 0;
+      start = now;
+    } else if (measure && now - start >= duration) {
+      break;
+    }
+    nb_events = epoll_wait(epfd, events, nb_connections, 100);
+    for (j=0; j<nb_events; j++) {
+      struct bench_connection * connection = events[j].data.ptr;
+      if (events[j].events & (EPOLLERR|EPOLLHUP)) {
+        nb_errors++;
+        close_connection(epfd, connection);
+      } else if (events[j].events & EPOLLOUT) {
+        nb_connected++;
+        ev.events = EPOLLIN;
+        ev.data.ptr = connection;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, connection->fd, &ev);
+        if (!send_request(connection)) {
+          nb_errors++;
+        }
+      } else if (events[j].events & EPOLLIN) {
+        res = recv(connection->fd, connection->buffer + connection->len, CONNECTION_BUFFER_SIZE - connection->len - 1, 0);
+        if (res <= 0) {
+          nb_errors++;
+          close_connection(epfd, connection);
+        } else {
+          connection->len += (size_t)res;
+          connection->buffer[connection->len] = '\0';
+          if (is_response_complete(connection->buffer, connection->len)) {
+            nb_responses++;
+            if (!send_request(connection)) {
+              nb_errors++;
+            }
+          }
+        }
+      }
+    }
+  }
+  now = get_time();
+  rss_after = get_proc_status_value("VmRSS");
+
+  printf("mode:           %s\n", instance.execution_mode==U_EXECUTION_MODE_THREAD_POOL?"U_EXECUTION_MODE_THREAD_POOL":"U_EXECUTION_MODE_THREAD_PER_CONNECTION");
+  printf("connections:    %lu/%u established\n", nb_connected, nb_connections);
+  printf("errors:         %lu\n", nb_errors);
+  printf("requests/s:     %.0f\n", (double)nb_responses / (now - start));
+  printf("threads:        %ld\n", get_proc_status_value("Threads"));
+  printf("RSS:            %ld kB (%ld kB before start)\n", rss_after, rss_before);
+
+  for (i=0; i<nb_connections; i++) {
+    if (connections[i].fd >= 0) {
+      close(connections[i].fd);
+    }
+  }
+  close(epfd);
+  free(connections);
+  free(events);
+
+  ulfius_stop_framework(&instance);
+  ulfius_clean_instance(&instance);
+  y_close_logs();
+
+  return 0;
+}
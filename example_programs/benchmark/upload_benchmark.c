@@ -0,0 +1,206 @@
+/**
+ *
+ * Ulfius Framework upload_benchmark program
+ *
+ * This program measures the memory reallocations and the time spent
+ * by an instance to receive large request bodies stored in memory
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ulfius.h>
+
+#define PORT 8540
+#define PREFIX "/bench"
+#define SEND_BUFFER_SIZE (1024*1024)
+#define RESPONSE_BUFFER_SIZE 1024
+#define DEFAULT_MAX_SIZE_MB 1024
+
+static unsigned long nb_malloc = 0, nb_realloc = 0;
+
+/**
+ * Allocation functions counting the calls, set with o_set_alloc_funcs
+ */
+static void * counting_malloc(size_t size) {
+  __atomic_add_fetch(&nb_malloc, 1, __ATOMIC_RELAXED);
+  return malloc(size);
+}
+
+static void * counting_realloc(void * ptr, size_t size) {
+  __atomic_add_fetch(&nb_realloc, 1, __ATOMIC_RELAXED);
+  return realloc(ptr, size);
+}
+
+/**
+ * Callback function for the benchmark endpoint, sends the length of the body received
+ */
+int callback_bench (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  char length[32];
+
+  snprintf(length, sizeof(length), "%zu", request->binary_body_length);
+  ulfius_set_string_body_response(response, 200, length);
+  return U_CALLBACK_CONTINUE;
+}
+
+static double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+static int send_all(int fd, const char * data, size_t len) {
+  ssize_t res;
+
+  while (len) {
+    if ((res = send(fd, data, len, MSG_NOSIGNAL)) <= 0) {
+      return 0;
+    }
+    data += res;
+    len -= (size_t)res;
+  }
+  return 1;
+}
+
+/**
+ * Send a POST request of size bytes, with a Content-Length header or with a chunked body
+ * return the body length received by the instance, 0 on error
+ */
+static size_t run_upload(size_t size, int chunked, const char * buffer) {
+  struct sockaddr_in addr;
+  char headers[256], chunk_header[32], response[RESPONSE_BUFFER_SIZE];
+  const char * body;
+  size_t sent = 0, len, received = 0;
+  ssize_t res;
+  int fd, ok;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    fprintf(stderr, "Error connecting to the instance\n");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 0;
+  }
+  if (chunked) {
+    snprintf(headers, sizeof(headers), "POST " PREFIX " HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/octet-stream\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n");
+  } else {
+    snprintf(headers, sizeof(headers), "POST " PREFIX " HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/octet-stream\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", size);
+  }
+  ok = send_all(fd, headers, strlen(headers));
+  while (ok && sent < size) {
+    len = size - sent < SEND_BUFFER_SIZE ? size - sent : SEND_BUFFER_SIZE;
+    if (chunked) {
+      snprintf(chunk_header, sizeof(chunk_header), "%zx\r\n", len);
+      ok = send_all(fd, chunk_header, strlen(chunk_header)) && send_all(fd, buffer, len) && send_all(fd, "\r\n", 2);
+    } else {
+      ok = send_all(fd, buffer, len);
+    }
+    sent += len;
+  }
+  if (ok && chunked) {
+    ok = send_all(fd, "0\r\n\r\n", 5);
+  }
+  if (ok) {
+    while (received < RESPONSE_BUFFER_SIZE - 1 && (res = recv(fd, response + received, RESPONSE_BUFFER_SIZE - 1 - received, 0)) > 0) {
+      received += (size_t)res;
+    }
+    response[received] = '\0';
+  }
+  close(fd);
+  if (ok && !strncmp(response, "HTTP/1.1 200", 12) && (body = strstr(response, "\r\n\r\n")) != NULL) {
+    return (size_t)strtoull(body + 4, NULL, 10);
+  }
+  return 0;
+}
+
+/**
+ * Upload size bytes and print the allocations and the time spent
+ */
+static int run_benchmark(size_t size, int chunked, const char * buffer) {
+  unsigned long malloc_before, realloc_before;
+  double start, duration;
+  size_t received;
+
+  malloc_before = __atomic_load_n(&nb_malloc, __ATOMIC_RELAXED);
+  realloc_before = __atomic_load_n(&nb_realloc, __ATOMIC_RELAXED);
+  start = get_time();
+  received = run_upload(size, chunked, buffer);
+  duration = get_time() - start;
+
+  if (received != size) {
+    fprintf(stderr, "%zu MB %s: error, %zu bytes received by the instance\n", size / (1024*1024), chunked?"chunked":"Content-Length", received);
+    return 1;
+  }
+  printf("%6zu MB %-15s %8.3f s %10.1f MB/s %8lu malloc %8lu realloc\n",
+         size / (1024*1024),
+         chunked?"chunked":"Content-Length",
+         duration,
+         (double)size / (1024*1024) / duration,
+         __atomic_load_n(&nb_malloc, __ATOMIC_RELAXED) - malloc_before,
+         __atomic_load_n(&nb_realloc, __ATOMIC_RELAXED) - realloc_before);
+  return 0;
+}
+
+int main(int argc, char ** argv) {
+  size_t sizes_mb[] = {1, 100, 1024};
+  struct _u_instance instance;
+  unsigned long max_size_mb = DEFAULT_MAX_SIZE_MB;
+  char * buffer;
+  unsigned int i;
+  int ret = 0;
+
+  if (argc > 1 && strtoul(argv[1], NULL, 10)) {
+    max_size_mb = strtoul(argv[1], NULL, 10);
+  }
+  if ((buffer = malloc(SEND_BUFFER_SIZE)) == NULL) {
+    fprintf(stderr, "Error allocating memory for buffer\n");
+    return 1;
+  }
+  memset(buffer, 'a', SEND_BUFFER_SIZE);
+
+  // Must be set before any allocation made by the library
+  o_set_alloc_funcs(&counting_malloc, &counting_realloc, &free);
+
+  y_init_logs("upload_benchmark", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_ERROR, NULL, "Starting upload_benchmark");
+
+  if (ulfius_init_instance(&instance, PORT, NULL, NULL) != U_OK) {
+    fprintf(stderr, "Error ulfius_init_instance, abort\n");
+    free(buffer);
+    return 1;
+  }
+  ulfius_add_endpoint_by_val(&instance, "POST", PREFIX, NULL, 0, &callback_bench, NULL);
+
+  if (ulfius_start_framework(&instance) == U_OK) {
+    for (i=0; i<sizeof(sizes_mb)/sizeof(size_t); i++) {
+      if (sizes_mb[i] <= max_size_mb) {
+        ret |= run_benchmark(sizes_mb[i] * 1024 * 1024, 0, buffer);
+        ret |= run_benchmark(sizes_mb[i] * 1024 * 1024, 1, buffer);
+      }
+    }
+    ulfius_stop_framework(&instance);
+  } else {
+    fprintf(stderr, "Error ulfius_start_framework, abort\n");
+    ret = 1;
+  }
+
+  ulfius_clean_instance(&instance);
+  y_close_logs();
+  free(buffer);
+
+  return ret;
+}
@@ -0,0 +1,105 @@
+/**
+ *
+ * Ulfius Framework utf8_benchmark program
+ *
+ * This program measures the throughput of the utf8 validation
+ * of ASCII-only and mixed-script strings, with the scalar version
+ * and the vectorized version selected for the CPU
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * License MIT
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "u_private.h"
+
+#define DEFAULT_TOTAL_SIZE_MB 256
+#define MIXED_SAMPLE "Ulfius é ü ß Привет мир Γειά σου 日本語のテキスト 안녕하세요 مرحبا 😀 "
+
+static double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+/**
+ * Fill str with size bytes of sample repeated, cut on complete characters, padded with spaces
+ */
+static void fill_string(char * str, size_t size, const char * sample) {
+  size_t cur = 0, pos = 0, char_len;
+
+  while (cur < size) {
+    char_len = (unsigned char)sample[pos] < 0x80?1:(unsigned char)sample[pos] < 0xe0?2:(unsigned char)sample[pos] < 0xf0?3:4;
+    if (cur + char_len > size) {
+      str[cur++] = ' ';
+    } else {
+      memcpy(str + cur, sample + pos, char_len);
+      cur += char_len;
+      pos += char_len;
+      if (sample[pos] == '\0') {
+        pos = 0;
+      }
+    }
+  }
+  str[size] = '\0';
+}
+
+/**
+ * Check the string enough times to validate total_size bytes, print the throughput
+ */
+static int run_benchmark(const char * name, const char * str, size_t size, size_t total_size, const unsigned char * (* check)(const char *)) {
+  size_t i, nb_iterations = total_size / size;
+  unsigned long nb_invalid = 0;
+  double start, duration;
+
+  start = get_time();
+  for (i=0; i<nb_iterations; i++) {
+    if (check(str) != NULL) {
+      nb_invalid++;
+    }
+  }
+  duration = get_time() - start;
+  printf("%-8s %6zu bytes %-8s %10.1f MB/s\n", name, size, check==&utf8_check_scalar?"scalar":"utf8_check", (double)(nb_iterations * size) / (1024*1024) / duration);
+  return nb_invalid != 0;
+}
+
+int main(int argc, char ** argv) {
+  size_t sizes[] = {16, 32, 64, 256, 4096, 65536}, total_size = (size_t)DEFAULT_TOTAL_SIZE_MB * 1024 * 1024;
+  char * ascii, * mixed;
+  unsigned int i;
+  int ret = 0;
+
+  if (argc > 1 && strtoul(argv[1], NULL, 10)) {
+    total_size = (size_t)strtoul(argv[1], NULL, 10) * 1024 * 1024;
+  }
+  ascii = malloc(sizes[sizeof(sizes)/sizeof(size_t)-1] + 1);
+  mixed = malloc(sizes[sizeof(sizes)/sizeof(size_t)-1] + 1);
+  if (ascii == NULL || mixed == NULL) {
+    fprintf(stderr, "Error allocating memory for strings\n");
+    free(ascii);
+    free(mixed);
+    return 1;
+  }
+
+  for (i=0; i<sizeof(sizes)/sizeof(size_t); i++) {
+    fill_string(ascii, sizes[i], "GET /api/resource?param=value&other=1 ");
+    fill_string(mixed, sizes[i], MIXED_SAMPLE);
+    ret |= run_benchmark("ascii", ascii, sizes[i], total_size, &utf8_check_scalar);
+    ret |= run_benchmark("ascii", ascii, sizes[i], total_size, &utf8_check);
+    ret |= run_benchmark("mixed", mixed, sizes[i], total_size, &utf8_check_scalar);
+    ret |= run_benchmark("mixed", mixed, sizes[i], total_size, &utf8_check);
+  }
+  if (ret) {
+    fprintf(stderr, "Error, a valid string was rejected\n");
+  }
+
+  free(ascii);
+  free(mixed);
+  return ret;
+}
@@ -4,6 +4,9 @@
  * 
  * This example program describes the endpoints injections
  * 
+ * Run it with the argument stress to add and remove endpoints
+ * while client threads are sending requests
+ * 
  * Copyright 2016-2017 Nicolas Mora <mail@babelouest.org>
  * 
  * License MIT
@@ -11,6 +14,10 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <jansson.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -22,6 +29,16 @@
 #define PORT 4528
 #define PREFIX "/inject"
 
+#define STRESS_NB_CLIENTS 8
+#define STRESS_DURATION 10
+
+struct stress_client {
+  pthread_t     thread;
+  int           stop;
+  unsigned long nb_requests;
+  unsigned long nb_errors;
+};
+
 /**
  * callback functions declaration
  */
@@ -35,9 +52,12 @@ int callback_fourth (const struct _u_request * request, struct _u_response * res
 
 int callback_fifth (const struct _u_request * request, struct _u_response * response, void * user_data);
 
+int stress_test(struct _u_instance * instance, unsigned int duration);
+
 int main (int argc, char **argv) {
   // Initialize the instance
   struct _u_instance instance;
+  int ret = 0;
   
   y_init_logs("injection_example", Y_LOG_MODE_CONSOLE, Y_LOG_LEVEL_DEBUG, NULL, "Starting injection_example");
   
@@ -55,21 +75,25 @@ int main (int argc, char **argv) {
   if (ulfius_start_framework(&instance) == U_OK) {
     y_log_message(Y_LOG_LEVEL_DEBUG, "Start framework on port %d", instance.port);
     
-    y_log_message(Y_LOG_LEVEL_DEBUG, "Press <enter> to inject %s/fourth endpoint", PREFIX);
-    getchar();
-    ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/fourth", 1, &callback_fourth, NULL);
-    
-    y_log_message(Y_LOG_LEVEL_DEBUG, "Press <enter> to inject %s/fifth endpoint", PREFIX);
-    getchar();
-    ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/fifth", 1, &callback_fifth, NULL);
-    
-    y_log_message(Y_LOG_LEVEL_DEBUG, "Press <enter> to remove %s/fourth endpoint", PREFIX);
-    getchar();
-    ulfius_remove_endpoint_by_val(&instance, "GET", PREFIX, "/fourth");
-    
-    y_log_message(Y_LOG_LEVEL_DEBUG, "Press <enter> to quit the application");
-    // Wait for the user to press <enter> on the console to quit the application
-    getchar();
+    if (argc > 1 && 0 == o_strcmp(argv[1], "stress")) {
+      ret = stress_test(&instance, argc>2?(unsigned int)strtoul(argv[2], NULL, 10):STRESS_DURATION);
+    } else {
+      y_log_message(Y_LOG_LEVEL_DEBUG, "Press <enter> to inject %s/fourth endpoint", PREFIX);
+      getchar();
+      ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/fourth", 1, &callback_fourth, NULL);
+      
+      y_log_message(Y_LOG_LEVEL_DEBUG, "Press <enter> to inject %s/fifth endpoint", PREFIX);
+      getchar();
+      ulfius_add_endpoint_by_val(&instance, "GET", PREFIX, "/fifth", 1, &callback_fifth, NULL);
+      
+      y_log_message(Y_LOG_LEVEL_DEBUG, "Press <enter> to remove %s/fourth endpoint", PREFIX);
+      getchar();
+      ulfius_remove_endpoint_by_val(&instance, "GET", PREFIX, "/fourth");
+      
+      y_log_message(Y_LOG_LEVEL_DEBUG, "Press <enter> to quit the application");
+      // Wait for the user to press <enter> on the console to quit the application
+      getchar();
+    }
   } else {
     y_log_message(Y_LOG_LEVEL_DEBUG, "Error starting framework");
   }
@@ -80,7 +104,94 @@ int main (int argc, char **argv) {
   ulfius_stop_framework(&instance);
   ulfius_clean_instance(&instance);
   
-  return 0;
+  return ret;
+}
+
+/**
+ * Send a GET request to the url and return the response status, or -1 on error
+ * The connection is closed by the server after the response
+ */
+static int stress_request(const char * url) {
+  struct sockaddr_in addr;
+  char buffer[512];
+  int fd, status = -1;
+  ssize_t len, total = 0;
+  
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0) {
+    snprintf(buffer, sizeof(buffer), "GET %s HTTP/1.0\r\n\r\n", url);
+    if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr)) && send(fd, buffer, strlen(buffer), MSG_NOSIGNAL) == (ssize_t)strlen(buffer)) {
+      while (total < (ssize_t)sizeof(buffer) - 1 && (len = recv(fd, buffer + total, sizeof(buffer) - 1 - total, 0)) > 0) {
+        total += len;
+      }
+      buffer[total] = '\0';
+      if (total > 12 && 0 == strncmp(buffer, "HTTP/1.", 7)) {
+        status = (int)strtol(buffer + 9, NULL, 10);
+      }
+    }
+    close(fd);
+  }
+  return status;
+}
+
+/**
+ * Client thread of the stress test
+ * The static endpoints must always answer 200,
+ * the injected endpoints must answer 200 or 404 depending on when the request is dispatched
+ */
+static void * stress_client_run(void * arg) {
+  struct stress_client * client = (struct stress_client *)arg;
+  static const char * urls[] = {PREFIX "/first", PREFIX "/fourth", PREFIX "/fifth", PREFIX "/stress/42"};
+  int status, injected;
+  
+  while (!__atomic_load_n(&client->stop, __ATOMIC_RELAXED)) {
+    injected = client->nb_requests%4;
+    status = stress_request(urls[injected]);
+    if (status != 200 && (!injected || status != 404)) {
+      client->nb_errors++;
+    }
+    client->nb_requests++;
+  }
+  return NULL;
+}
+
+/**
+ * Add and remove endpoints during duration seconds while STRESS_NB_CLIENTS threads are sending requests
+ * return 0 if all the responses were expected
+ */
+int stress_test(struct _u_instance * instance, unsigned int duration) {
+  struct stress_client clients[STRESS_NB_CLIENTS];
+  unsigned long nb_requests = 0, nb_errors = 0, nb_injections = 0;
+  time_t end = time(NULL) + duration;
+  int i;
+  
+  memset(clients, 0, sizeof(clients));
+  for (i=0; i<STRESS_NB_CLIENTS; i++) {
+    if (pthread_create(&clients[i].thread, NULL, stress_client_run, &clients[i])) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Error pthread_create");
+      return 1;
+    }
+  }
+  while (time(NULL) < end) {
+    ulfius_add_endpoint_by_val(instance, "GET", PREFIX, "/fourth", 1, &callback_fourth, NULL);
+    ulfius_add_endpoint_by_val(instance, "GET", PREFIX, "/stress/:id", 1, &callback_fifth, NULL);
+    ulfius_add_endpoint_by_val(instance, "GET", PREFIX, "/fifth", 1, &callback_fifth, NULL);
+    ulfius_remove_endpoint_by_val(instance, "GET", PREFIX, "/fourth");
+    ulfius_remove_endpoint_by_val(instance, "GET", PREFIX, "/stress/:id");
+    ulfius_remove_endpoint_by_val(instance, "GET", PREFIX, "/fifth");
+    nb_injections++;
+  }
+  for (i=0; i<STRESS_NB_CLIENTS; i++) {
+    __atomic_store_n(&clients[i].stop, 1, __ATOMIC_RELAXED);
+    pthread_join(clients[i].thread, NULL);
+    nb_requests += clients[i].nb_requests;
+    nb_errors += clients[i].nb_errors;
+  }
+  y_log_message(Y_LOG_LEVEL_INFO, "Stress test: %lu injection cycles, %lu requests, %lu unexpected responses", nb_injections, nb_requests, nb_errors);
+  return nb_errors?1:0;
 }
 
 /**
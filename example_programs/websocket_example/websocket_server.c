@@ -90,6 +90,12 @@ int main(int argc, char ** argv) {
   file_config.url_prefix = PREFIX_STATIC;
   file_config.map_header = o_malloc(sizeof(struct _u_map));
   u_map_init(file_config.map_header);
+  file_config.redirect_on_404 = NULL;
+  file_config.cache = NULL;
+  // Keep files up to 64kB in memory, up to 4MB in total
+  if (static_file_cache_init(&file_config, 4*1024*1024, 64*1024) != U_OK) {
+    y_log_message(Y_LOG_LEVEL_WARNING, "Error static_file_cache_init, files are read on each request");
+  }
   
   if (ulfius_init_instance(&instance, PORT, NULL, NULL) != U_OK) {
     y_log_message(Y_LOG_LEVEL_ERROR, "Error ulfius_init_instance, abort");
@@ -132,6 +138,7 @@ int main(int argc, char ** argv) {
   
   ulfius_stop_framework(&instance);
   ulfius_clean_instance(&instance);
+  static_file_cache_clean(&file_config);
   u_map_clean_full(file_config.mime_types);
   u_map_clean_full(file_config.map_header);
   y_close_logs();
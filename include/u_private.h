@@ -46,24 +46,349 @@
 #endif // U_WITH_FREERTOS
 
 
+/**********************************
+ * Internal structures declarations
+ **********************************/
+
+/**
+ * A url parameter (:param or @param) of a route
+ */
+struct _u_route_param {
+  size_t   segment; /* index of the url segment containing the parameter value */
+  char   * name;
+};
+
+/**
+ * An endpoint compiled in a route table
+ */
+struct _u_route {
+  const struct _u_endpoint * endpoint;  /* endpoint copy owned by the route table */
+  size_t                     index;     /* position of the endpoint in the endpoint list, used to sort routes with the same priority */
+  struct _u_route_param    * params;    /* url parameters in the order of the url_format */
+  size_t                     nb_params;
+};
+
+/**
+ * A node of the route tree
+ * Each node is a url segment, either static or a parameter (:param or @param)
+ */
+struct _u_route_node {
+  char                  * segment;            /* value of a static segment, NULL for the root and parameter nodes */
+  struct _u_route_node ** children;           /* static children sorted by segment value */
+  size_t                  nb_children;
+  struct _u_route_node  * param_child;        /* child matching any segment value */
+  struct _u_route      ** routes;             /* routes whose format ends on this node */
+  size_t                  nb_routes;
+  struct _u_route      ** wildcard_routes;    /* routes whose format ends with '*' after this node */
+  size_t                  nb_wildcard_routes;
+};
+
+/**
+ * Endpoint list and default endpoint compiled in a segment tree
+ * A route table is immutable once built, it's shared between the instance
+ * and the requests being processed with a reference counter
+ */
+struct _u_route_table {
+  unsigned int           refcount;
+  struct _u_endpoint   * endpoints;        /* copy of the endpoint list */
+  struct _u_route      * routes;
+  size_t                 nb_routes;
+  struct _u_endpoint     default_endpoint; /* copy of the default endpoint */
+  struct _u_route        default_route;    /* default_route.endpoint is NULL if there is no default endpoint */
+  int                    has_body_handler; /* at least one endpoint has a body_callback or a body_file_threshold */
+  struct _u_route_node   root;
+};
+
+/**
+ * Number of keys from which a struct _u_map uses a hash index
+ */
+#define U_MAP_INDEX_THRESHOLD 8
+
+/**
+ * Number of url segments and matching routes stored in a struct _u_route_match without allocation
+ */
+#define U_ROUTE_MATCH_INLINE_SIZE 16
+
+/**
+ * Size of the decoded url segments buffer stored in a struct _u_route_match without allocation
+ */
+#define U_ROUTE_MATCH_DECODED_INLINE_SIZE 256
+
+/**
+ * Result of a match between a url and a route table
+ * segments and routes point to the inline buffers unless they're too small
+ */
+struct _u_route_match {
+  const char            ** segments;     /* url segments, not '\0'-terminated */
+  size_t                 * segments_len;
+  size_t                   nb_segments;
+  const struct _u_route ** routes;       /* matching routes sorted by priority */
+  size_t                   nb_routes;
+  size_t                   routes_size;
+  char                  ** decoded;      /* url-decoded segments, NULL if the segment isn't valid utf8, filled on first use */
+  char                   * decoded_data;
+  const char             * segments_buffer[U_ROUTE_MATCH_INLINE_SIZE];
+  size_t                   segments_len_buffer[U_ROUTE_MATCH_INLINE_SIZE];
+  const struct _u_route  * routes_buffer[U_ROUTE_MATCH_INLINE_SIZE];
+  char                   * decoded_buffer[U_ROUTE_MATCH_INLINE_SIZE];
+  char                     decoded_data_buffer[U_ROUTE_MATCH_DECODED_INLINE_SIZE];
+};
+
+/**
+ * Route table currently used by an instance
+ * Readers pin the current route table without locking, writers build a new route table,
+ * publish it atomically, then wait for a grace period before releasing the previous one
+ * readers[epoch & 1] counts the readers loading the route table pointer in the current epoch
+ * lock serializes the writers
+ */
+struct _u_router {
+  pthread_mutex_t         lock;
+  struct _u_route_table * route_table;
+  unsigned int            epoch;
+  unsigned int            readers[2];
+};
+
+/**
+ * Size of the blocks of the arena used for the lifetime of a request
+ */
+#define U_ARENA_BLOCK_SIZE 2048
+
+/**
+ * Alignment of the memory allocated in an arena
+ */
+#define U_ARENA_ALIGNMENT 16
+
+/**
+ * A block of memory of an arena, the data follows the header
+ */
+struct _u_arena_block {
+  struct _u_arena_block * next;
+  size_t                  size;
+  size_t                  used;
+};
+
+/**
+ * Default connection memory limit of libmicrohttpd, raised if the stream blocks don't fit in it
+ */
+#define U_CONNECTION_MEMORY_LIMIT_DEFAULT (32*1024)
+
+/**
+ * Directory of the anonymous temporary files storing the request bodies larger than the endpoint body_file_threshold
+ */
+#define U_BODY_FILE_DIR "/tmp"
+
+/**
+ * Minimum capacity of the request body buffer, the capacity is doubled when the buffer is full
+ */
+#define U_BODY_BUFFER_MIN_SIZE 4096
+
+/**
+ * Minimum size of the post processor buffer accepted by libmicrohttpd
+ */
+#define U_POST_BUFFER_SIZE_MIN 256
+
+/**
+ * In adaptive mode, the block size of a stream doubles if the previous block was drained
+ * by the socket in less than U_STREAM_ADAPTIVE_FAST_DRAIN microseconds,
+ * and is divided by 2 if it took more than U_STREAM_ADAPTIVE_SLOW_DRAIN microseconds
+ */
+#define U_STREAM_ADAPTIVE_FAST_DRAIN 2000
+#define U_STREAM_ADAPTIVE_SLOW_DRAIN 200000
+
+/**
+ * Size of the buffer batching the writes of a file uploaded in the instance upload_file_directory
+ */
+#define U_UPLOAD_FILE_BUFFER_SIZE (256*1024)
+
+/**
+ * Size of the first disk space block preallocated for a file uploaded in the instance upload_file_directory,
+ * the next blocks are twice as large as the size already preallocated
+ */
+#define U_UPLOAD_FILE_PREALLOC_SIZE (1024*1024)
+
+/**
+ * File part of a multipart body written in the instance upload_file_directory
+ */
+struct _u_upload_file {
+  char     * key;
+  char     * filename;
+  char     * content_type;
+  char     * path;          /* NULL while the file is anonymous */
+  int        fd;
+  uint64_t   size;          /* number of bytes received */
+  uint64_t   written;       /* number of bytes written in the file */
+  uint64_t   allocated;     /* number of bytes preallocated in the file */
+  int        preallocate;   /* 0 if the file system doesn't support preallocation */
+  char     * buffer;
+  size_t     buffer_len;
+};
+
+/**
+ * Path of a file uploaded during a request, the file is removed when the request is completed
+ */
+struct _u_upload_path {
+  char                  * path;
+  struct _u_upload_path * next;
+};
+
+/**
+ * Bump allocator, the memory is free'd all at once when the arena is free'd
+ * Used for the data owned by the framework during a request
+ */
+struct _u_arena {
+  struct _u_arena_block * block;      /* current block, the previous ones are chained in block->next */
+  size_t                  block_size;
+};
+
 /**********************************
  * Internal functions declarations
  **********************************/
 
 /**
- * ulfius_endpoint_match
- * return the endpoint array matching the url called with the proper http method
- * the returned array always has its last value to NULL
- * return NULL on memory error
+ * ulfius_build_route_table
+ * Compiles the endpoint_list and the default_endpoint into a route tree
+ * The endpoints are copied in the route table, so endpoint_list and default_endpoint
+ * can be modified or free'd while the route table is in use
+ * The route table is immutable and has a reference counter set to 1
+ * return a new route table on success, NULL on memory error
+ * returned value must be released with ulfius_release_route_table after use
+ */
+struct _u_route_table * ulfius_build_route_table(const struct _u_endpoint * endpoint_list, const struct _u_endpoint * default_endpoint);
+
+/**
+ * ulfius_retain_route_table
+ * Increment the reference counter of a route table
+ */
+void ulfius_retain_route_table(struct _u_route_table * route_table);
+
+/**
+ * ulfius_release_route_table
+ * Decrement the reference counter of a route table and free it when it reaches 0
  */
-struct _u_endpoint ** ulfius_endpoint_match(const char * method, const char * url, struct _u_endpoint * endpoint_list);
+void ulfius_release_route_table(struct _u_route_table * route_table);
 
 /**
- * ulfius_parse_url
- * fills map with the keys/values defined in the url that are described in the endpoint format url
+ * ulfius_route_match
+ * Fills match with the routes of route_table matching the url called with the proper http method
+ * match->routes is sorted by priority, if no route matches, match->routes contains the default route if any
+ * match->routes and match->segments point to route_table and url, so both must be kept until match is cleaned
  * return U_OK on success
+ * match must be cleaned with ulfius_clean_route_match after use
+ */
+int ulfius_route_match(const struct _u_route_table * route_table, const char * method, const char * url, struct _u_route_match * match);
+
+/**
+ * ulfius_clean_route_match
+ * Free the content of a match
+ */
+void ulfius_clean_route_match(struct _u_route_match * match);
+
+/**
+ * ulfius_init_router
+ * Initialize a router with no route table
+ * return U_OK on success
+ */
+int ulfius_init_router(struct _u_router * router);
+
+/**
+ * ulfius_clean_router
+ * Release the current route table of a router and free its resources
+ * No request must be processed with the router anymore
+ */
+void ulfius_clean_router(struct _u_router * router);
+
+/**
+ * ulfius_router_publish
+ * Replace the current route table of the router with route_table
+ * The router takes the reference of route_table, the previous route table is released
+ * and will be free'd when the last request using it is complete
+ * router->lock must be locked by the caller, readers never lock it
+ */
+void ulfius_router_publish(struct _u_router * router, struct _u_route_table * route_table);
+
+/**
+ * ulfius_router_acquire
+ * return the current route table of the router with its reference counter incremented, may be NULL
+ * This function doesn't lock
+ * returned value must be released with ulfius_release_route_table after use
+ */
+struct _u_route_table * ulfius_router_acquire(struct _u_router * router);
+
+/**
+ * ulfius_route_match_fill_map_url
+ * fills map with the keys/values of map_initial and the url parameters of route
+ * The url segments are decoded once per match, map is left unchanged if the previous route
+ * used to fill it has the same url parameters
+ * return U_OK on success
+ */
+int ulfius_route_match_fill_map_url(struct _u_route_match * match, const struct _u_route * route, const struct _u_map * map_initial, struct _u_map * map, int check_utf8);
+
+/**
+ * ulfius_arena_new
+ * Allocate an arena whose blocks store block_size bytes
+ * return the new arena on success, NULL on memory error
+ * returned value must be free'd with ulfius_arena_free after use
+ */
+struct _u_arena * ulfius_arena_new(size_t block_size);
+
+/**
+ * ulfius_arena_alloc
+ * Allocate size bytes in the arena
+ * return a pointer to the allocated memory on success, NULL on memory error
+ * returned value is free'd with the arena
+ */
+void * ulfius_arena_alloc(struct _u_arena * arena, size_t size);
+
+/**
+ * ulfius_arena_strdup
+ * Copy str in the arena
+ * return the copy on success, NULL on error
+ */
+char * ulfius_arena_strdup(struct _u_arena * arena, const char * str);
+
+/**
+ * ulfius_arena_strndup
+ * Copy at most len characters of str in the arena and add a '\0' at the end
+ * return the copy on success, NULL on error
  */
-int ulfius_parse_url(const char * url, const struct _u_endpoint * endpoint, struct _u_map * map, int check_utf8);
+char * ulfius_arena_strndup(struct _u_arena * arena, const char * str, size_t len);
+
+/**
+ * ulfius_arena_free
+ * Free all the memory allocated in the arena, including the arena itself
+ */
+void ulfius_arena_free(struct _u_arena * arena);
+
+/**
+ * u_map_init_arena
+ * Initialize a struct _u_map whose keys, values and arrays are allocated in the arena
+ * The memory of the removed or replaced elements is released with the arena
+ * return U_OK on success
+ */
+int u_map_init_arena(struct _u_map * u_map, struct _u_arena * arena);
+
+/**
+ * ulfius_init_arena_request
+ * Initialize a request structure whose maps are allocated in the arena
+ * http_protocol, http_verb, http_url, url_path and client_address must be allocated in the arena too
+ * return U_OK on success
+ * request must be cleaned with ulfius_clean_arena_request after use
+ */
+int ulfius_init_arena_request(struct _u_arena * arena, struct _u_request * request);
+
+/**
+ * ulfius_clean_arena_request
+ * clean the elements of a request initialized with ulfius_init_arena_request
+ * that aren't allocated in the arena
+ * return U_OK on success
+ */
+int ulfius_clean_arena_request(struct _u_request * request);
+
+/**
+ * ulfius_free_body_segments
+ * Release the data of the segments and free the segments array
+ */
+void ulfius_free_body_segments(struct _u_body_segment * segments, size_t nb_segments);
 
 /**
  * ulfius_set_response_header
@@ -97,10 +422,198 @@ int ulfius_set_response_cookie(struct MHD_Response * mhd_response, const struct
  * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/> -- 2005-03-30
  * License: http://www.cl.cam.ac.uk/~mgk25/short-license.html
  */
+const unsigned char * utf8_check_scalar(const char * s_orig);
+
+/**
+ * utf8_check
+ * Check that the '\0'-terminated string s_orig is valid utf8, with the same rules as utf8_check_scalar,
+ * using a vectorized validator selected at runtime for the CPU: AVX2 or SSE2 on x86_64, NEON on aarch64
+ * return a pointer to the first malformed byte, NULL if the string is valid
+ */
 const unsigned char * utf8_check(const char * s_orig);
 
+/**
+ * Flags of the state of utf8_check_chunk
+ */
+#define U_UTF8_STATE_EF  0x04
+#define U_UTF8_STATE_END 0x08
+
+/**
+ * utf8_check_chunk
+ * Incremental version of utf8_check for a string received in several chunks
+ * *state must be 0 for the first chunk
+ * return a pointer to the first malformed byte of the chunk, NULL if the chunk is valid
+ */
+const unsigned char * utf8_check_chunk(const char * s_orig, size_t len, unsigned int * state);
+
+/**
+ * utf8_check_chunk_end
+ * Check the state of utf8_check_chunk after the last chunk of a string
+ * return 1 if the string ends with an incomplete sequence, 0 otherwise
+ */
+int utf8_check_chunk_end(unsigned int state);
+
+/**
+ * u_map_append_binary
+ * Write length bytes of value at offset in the value of key, followed by a '\0'
+ * Used to receive a value by chunks: the value buffer grows geometrically,
+ * *capacity holds its allocated size between calls and must be 0 for the first chunk
+ * return U_OK on success
+ */
+int u_map_append_binary(struct _u_map * u_map, const char * key, const char * value, uint64_t offset, size_t length, size_t * capacity);
+
+/**
+ * ulfius_upload_file_write
+ * Write a block of a file part of a multipart body in the instance upload_file_directory
+ * return U_OK on success
+ */
+int ulfius_upload_file_write(struct connection_info_struct * con_info, const char * key, const char * filename, const char * content_type, const char * data, uint64_t off, size_t size);
+
+/**
+ * ulfius_upload_file_close
+ * Write the end of the current uploaded file and put its path, size, filename and content type in map_post_body
+ * return U_OK on success
+ */
+int ulfius_upload_file_close(struct connection_info_struct * con_info);
+
+/**
+ * ulfius_upload_file_clean
+ * Close the current uploaded file and remove the files uploaded during the request
+ */
+void ulfius_upload_file_clean(struct connection_info_struct * con_info);
+
+#ifndef U_DISABLE_ZLIB
+/**
+ * ulfius_compress_response
+ * Compress the response body with the encoding negotiated with the request Accept-Encoding header
+ * Buffered bodies smaller than u_instance->compression_min_size, file bodies, partial responses,
+ * responses with a Content-Encoding header and compressed content types are sent unchanged
+ * return U_OK if the body is compressed
+ */
+int ulfius_compress_response(const struct _u_instance * u_instance, const struct _u_request * request, struct _u_response * response);
+#endif
+
 #ifndef U_DISABLE_WEBSOCKET
 
+/**
+ * Size of the buffer used by a websocket reactor loop to read the sockets
+ */
+#define U_WEBSOCKET_REACTOR_BUFFER_SIZE (64*1024)
+
+/**
+ * Maximum number of events handled by a websocket reactor loop in one epoll_wait
+ */
+#define U_WEBSOCKET_REACTOR_MAX_EVENTS 64
+
+/**
+ * Size of the receive buffer of a websocket read by its own thread
+ */
+#define U_WEBSOCKET_RECEIVE_BUFFER_SIZE (16*1024)
+
+/**
+ * Maximum size of a websocket frame header: 2 bytes, 8 bytes of payload length and 4 bytes of mask
+ */
+#define U_WEBSOCKET_FRAME_HEADER_MAX_SIZE 14
+
+/**
+ * The payload of a sent message is copied in the message stored in message_list_outcoming
+ */
+#define U_WEBSOCKET_BUFFER_COPY 2
+
+/**
+ * Resumable websocket frame parser
+ * The bytes received are given as they come, the messages are complete when the last frame is parsed
+ */
+struct _websocket_parser {
+  uint8_t                     header[14];     /* frame header: 2 bytes, extended length and mask */
+  size_t                      header_len;     /* number of header bytes received */
+  size_t                      header_expected; /* header size, known when the 2 first bytes are received */
+  uint8_t                     opcode;         /* opcode of the current frame */
+  int                         fin;            /* fin flag of the current frame */
+  int                         has_mask;
+  uint8_t                     mask[4];
+  uint64_t                    payload_len;    /* payload length of the current frame */
+  uint64_t                    payload_read;   /* number of payload bytes of the current frame received */
+  struct _websocket_message * frame_message;  /* message receiving the current frame payload, NULL while reading a header */
+  struct _websocket_message * message;        /* data message reassembled from fragments, NULL if none is pending */
+};
+
+/**
+ * Receive buffer of a websocket read by its own thread
+ * The data read in the socket is parsed from offset to len, the remaining data is kept for the next message
+ */
+struct _websocket_receive {
+  struct _websocket_parser   parser;
+  uint8_t                  * buffer;
+  size_t                     offset;  /* first byte not parsed yet */
+  size_t                     len;     /* number of bytes read in the buffer */
+};
+
+/**
+ * Incoming message waiting to be dispatched by a websocket reactor worker,
+ * or control frame sent by the worker in answer to a ping, a close message or the close signal
+ */
+struct _websocket_reactor_job {
+  struct _websocket_message     * message;      /* message to dispatch, NULL for a control frame */
+  uint8_t                         reply_opcode; /* U_WEBSOCKET_OPCODE_PONG or U_WEBSOCKET_OPCODE_CLOSE */
+  size_t                          reply_len;
+  char                            reply_data[125];
+  struct _websocket_reactor_job * next;
+};
+
+/**
+ * Websocket owned by a websocket reactor loop
+ */
+struct _websocket_reactor_connection {
+  struct _websocket                    * websocket;
+  struct _websocket_reactor_loop       * loop;
+  size_t                                 index;      /* index in loop->connections */
+  struct _websocket_parser               parser;
+  pthread_t                              thread_manager;
+  int                                    has_thread_manager;
+  struct _websocket_reactor_job        * job_first;  /* messages waiting for the workers, protected by the reactor queue_lock */
+  struct _websocket_reactor_job        * job_last;
+  int                                    scheduled;  /* 1 if the connection is in the run queue or being dispatched by a worker */
+  int                                    closing;    /* 1 when the loop doesn't own the socket anymore */
+  int                                    finished;   /* 1 once the loop removed the connection, protected by the loop lock */
+  struct _websocket_reactor_connection * next_run;
+  struct _websocket_reactor_connection * next_finished;
+};
+
+/**
+ * Event loop thread of a websocket reactor, owns the sockets registered in its epoll instance
+ */
+struct _websocket_reactor_loop {
+  struct _websocket_reactor             * reactor;
+  pthread_t                               thread;
+  int                                     epoll_fd;
+  int                                     event_fd;   /* written to stop the loop, or by ulfius_websocket_send_close_signal to check the connections */
+  int                                     stop;
+  uint8_t                               * buffer;
+  pthread_mutex_t                         lock;       /* protects connections and nb_connections */
+  struct _websocket_reactor_connection ** connections;
+  size_t                                  nb_connections;
+  struct _websocket_reactor_connection  * finished_first; /* connections removed during the current epoll_wait events, closed by the workers after them */
+};
+
+/**
+ * Websocket reactor shared by the websockets of an instance
+ * the loops read and parse the frames, the workers dispatch the messages to websocket_incoming_message_callback,
+ * the messages of a websocket are dispatched in order by one worker at a time
+ */
+struct _websocket_reactor {
+  struct _websocket_reactor_loop       * loops;
+  unsigned int                           nb_loops;
+  unsigned int                           next_loop;
+  pthread_t                            * workers;
+  unsigned int                           nb_workers;
+  pthread_mutex_t                        queue_lock;
+  pthread_cond_t                         queue_cond;
+  struct _websocket_reactor_connection * run_first;
+  struct _websocket_reactor_connection * run_last;
+  int                                    stop;
+};
+
 /**
  * Websocket callback function for MHD
  * Starts the websocket manager if set,
@@ -199,6 +712,63 @@ int ulfius_init_websocket_manager(struct _websocket_manager * websocket_manager)
  */
 int ulfius_check_handshake_response(const char * key, const char * response);
 
+/**
+ * Initialize a struct _websocket_parser
+ */
+void ulfius_init_websocket_parser(struct _websocket_parser * parser);
+
+/**
+ * Clear data of a struct _websocket_parser, including the message being received
+ */
+void ulfius_clear_websocket_parser(struct _websocket_parser * parser);
+
+/**
+ * Parse the bytes received in a websocket
+ * type is U_WEBSOCKET_SERVER or U_WEBSOCKET_CLIENT, to check the mask of the frames
+ * parsing stops when a message is complete, then *message is set and *consumed is the number of bytes used
+ * the remaining bytes must be given in another call
+ * *message is NULL if all the bytes are consumed before the end of a message
+ * *message must be cleared after use
+ * return U_OK on success, U_ERROR on protocol error
+ */
+int ulfius_websocket_parse(struct _websocket_parser * parser, int type, const uint8_t * data, size_t len, size_t * consumed, struct _websocket_message ** message);
+
+/**
+ * ulfius_websocket_mask_scalar
+ * XOR len bytes of src with the 4 bytes mask, byte by byte, and write them in dest
+ * offset is the position of src in the payload, dest may be src to mask in place
+ */
+void ulfius_websocket_mask_scalar(uint8_t * dest, const uint8_t * src, size_t len, const uint8_t * mask, size_t offset);
+
+/**
+ * ulfius_websocket_mask
+ * XOR len bytes of src with the 4 bytes mask and write them in dest, with the same result as ulfius_websocket_mask_scalar,
+ * using 64 bits words and vectors selected at runtime for the CPU: AVX2 or SSE2 on x86_64, NEON on aarch64
+ * offset is the position of src in the payload, dest may be src to mask in place
+ */
+void ulfius_websocket_mask(uint8_t * dest, const uint8_t * src, size_t len, const uint8_t * mask, size_t offset);
+
+/**
+ * ulfius_websocket_send_control_message
+ * Send a control frame in the websocket even if it's not connected anymore,
+ * used by the websocket reactor workers to answer the messages read by a loop that has released the socket
+ * return U_OK on success
+ */
+int ulfius_websocket_send_control_message(struct _websocket_manager * websocket_manager, const uint8_t opcode, const uint64_t data_len, const char * data);
+
+/**
+ * Run the websocket in the instance websocket reactor
+ * the reactor is started with the first websocket
+ * return U_OK on success, the websocket must be run in its own thread otherwise
+ */
+int ulfius_websocket_reactor_add(struct _u_instance * instance, struct _websocket * websocket);
+
+/**
+ * Stop the instance websocket reactor and free its resources
+ * All the websockets must be closed before
+ */
+void ulfius_websocket_reactor_stop(struct _u_instance * instance);
+
 #endif // U_DISABLE_WEBSOCKET
 
 #endif // __U_PRIVATE_H__
@@ -181,6 +181,40 @@ int y_close_logs();
 */
 #define U_USE_ALL (U_USE_IPV4|U_USE_IPV6)
 
+/**
+ * @def Run the instance with one thread per connection (default)
+*/
+#define U_EXECUTION_MODE_THREAD_PER_CONNECTION 0
+/**
+ * @def Run the instance with an internal event loop (epoll, poll or select) served by a fixed pool of threads
+*/
+#define U_EXECUTION_MODE_THREAD_POOL           1
+
+/**
+ * @def Don't compress the responses (default)
+*/
+#define U_COMPRESSION_NONE    0x00
+/**
+ * @def Compress the responses with gzip if the client accepts it
+*/
+#define U_COMPRESSION_GZIP    0x01
+/**
+ * @def Compress the responses with deflate if the client accepts it
+*/
+#define U_COMPRESSION_DEFLATE 0x02
+/**
+ * @def Compress the responses with any supported encoding accepted by the client
+*/
+#define U_COMPRESSION_ALL     (U_COMPRESSION_GZIP|U_COMPRESSION_DEFLATE)
+/**
+ * @def Default minimum size of a response body to compress it
+*/
+#define U_COMPRESSION_DEFAULT_MIN_SIZE 1024
+/**
+ * @def Default compression level, equivalent to zlib's Z_DEFAULT_COMPRESSION
+*/
+#define U_COMPRESSION_DEFAULT_LEVEL -1
+
 /**
  * @def Verify TLS session with peers
 */
@@ -212,6 +246,10 @@ struct _u_map {
   char  ** keys; /* !< Array of keys */
   char  ** values; /* !< Array of values */
   size_t * lengths; /* !< Lengths of each values */
+  int      size; /* !< Allocated size of keys, values and lengths, internal variable, do not change it */
+  int    * index; /* !< Hash index of the keys, NULL if the map is small, internal variable, do not change it */
+  int      index_size; /* !< Number of slots in index, internal variable, do not change it */
+  void   * arena; /* !< Arena where the keys, values and arrays are allocated, NULL if they are allocated on the heap, internal variable, do not change it */
 };
 
 /**
@@ -230,6 +268,16 @@ struct _u_cookie {
   int    same_site; /* !< flag to set same_site option to the cookie */
 };
 
+/**
+ * struct _u_body_segment
+ * a segment of a response body sent without copy
+ */
+struct _u_body_segment {
+  const void * data; /* !< content of the segment */
+  size_t       length; /* !< length of data */
+  void      (* release_callback) (void * data); /* !< callback function to release data when the response is complete, NULL if data doesn't need to be released */
+};
+
 /**
  * 
  * @struct _u_request request parameters
@@ -261,6 +309,8 @@ struct _u_request {
   struct _u_map *      map_post_body; /* !< map containing the post body variables (if available) */
   void *               binary_body; /* !< raw body */
   size_t               binary_body_length; /* !< length of raw body */
+  int                  body_fd; /* !< file descriptor of the raw body if it's larger than the endpoint body_file_threshold, -1 otherwise, the file is anonymous, its offset is 0 and it's closed when the request is cleaned */
+  uint64_t             body_fd_length; /* !< length of the raw body in body_fd */
   unsigned int         callback_position; /* !< position of the current callback function in the callback list, starts at 0 */
 #ifndef U_DISABLE_GNUTLS
   gnutls_x509_crt_t    client_cert; /* !< x509 certificate of the client if the instance uses client certificate authentication and the client is authenticated, available only if websocket support is enabled */
@@ -285,6 +335,13 @@ struct _u_response {
   char             * auth_realm; /* !< realm to send to the client on authenticationb failed */
   void             * binary_body; /* !< raw binary content */
   size_t             binary_body_length; /* !< length of the binary_body */
+  void            (* binary_body_free) (void * binary_body_free_cls); /* !< callback function to release binary_body if it's not owned by the response, NULL if binary_body must be free'd with u_free */
+  void             * binary_body_free_cls; /* !< user defined data passed to binary_body_free */
+  struct _u_body_segment * body_segments; /* !< segments of the body set with ulfius_set_segmented_body_response, NULL otherwise */
+  size_t             nb_body_segments; /* !< number of segments in body_segments */
+  int                body_fd; /* !< file descriptor of the body if it's set with ulfius_set_file_response, -1 otherwise */
+  uint64_t           body_fd_offset; /* !< offset of the body in body_fd */
+  uint64_t           body_fd_length; /* !< length of the body in body_fd */
   ssize_t         (* stream_callback) (void * stream_user_data, uint64_t offset, char * out_buf, size_t max); /* !< callback function to stream data in response body */
   void            (* stream_callback_free) (void * stream_user_data); /* !< callback function to free data allocated for streaming */
   uint64_t           stream_size; /* !< size of the streamed data (U_STREAM_SIZE_UNKOWN if unknown) */
@@ -310,6 +367,13 @@ struct _u_endpoint {
                                   struct _u_response * response,
                                   void * user_data);
   void       * user_data; /* !< pointer to a data or a structure that will be available in callback_function */
+  int          disable_compression; /* !< set to 1 to send the responses of this endpoint uncompressed, for example if the endpoint sends already compressed content, default 0 */
+  int       (* body_callback)(const struct _u_request * request, /* !< pointer to a function called with each block of the request body as it's received, before callback_function, the body isn't stored nor parsed in the request then, must return U_OK to continue, NULL to store the body */
+                              const char * data,
+                              uint64_t off,
+                              size_t size,
+                              void * user_data);
+  size_t       body_file_threshold; /* !< if body_callback is NULL and the request body is larger than body_file_threshold bytes, it's stored in an anonymous temporary file available in request->body_fd instead of request->binary_body, 0 means no limit, default 0 */
 };
 
 /**
@@ -331,6 +395,7 @@ struct _u_instance {
   int                           nb_endpoints; /* !< Number of available endpoints */
   char                        * default_auth_realm; /* !< Default realm on authentication error */
   struct _u_endpoint          * endpoint_list; /* !< List of available endpoints */
+  void                        * router; /* !< endpoint_list and default_endpoint compiled in a shared route table, internal variable, do not change it */
   struct _u_endpoint          * default_endpoint; /* !< Default endpoint if no other endpoint match the current url */
   struct _u_map               * default_headers; /* !< Default headers that will be added to all response->map_header */
   size_t                        max_post_param_size; /* !< maximum size for a post parameter, 0 means no limit, default 0 */
@@ -346,8 +411,19 @@ struct _u_instance {
                                                        size_t size, 
                                                        void * cls);
   void                        * file_upload_cls; /* !< any pointer to pass to the file_upload_callback function */
+  char                        * upload_file_directory; /* !< directory where the files of multipart bodies are written, map_post_body gets the path, the size and the content type of each file, ignored if file_upload_callback is set, NULL means the files are stored in memory, default NULL */
   int                           mhd_response_copy_data; /* !< to choose between MHD_RESPMEM_MUST_COPY and MHD_RESPMEM_MUST_FREE, only if you use MHD < 0.9.61, otherwise this option is skipped because it's useless */
   int                           check_utf8; /* !< check that all parameters values in the request (url, header and post_body), are valid utf8 strings, if a parameter value has non utf8 character, the value, will be ignored, default 1 */
+  unsigned short                execution_mode; /* !< threading model of the webservice, values available are U_EXECUTION_MODE_THREAD_PER_CONNECTION or U_EXECUTION_MODE_THREAD_POOL, default U_EXECUTION_MODE_THREAD_PER_CONNECTION */
+  unsigned int                  thread_pool_size; /* !< number of threads serving the connections when execution_mode is U_EXECUTION_MODE_THREAD_POOL, 0 means the number of online CPUs, default 0 */
+  unsigned short                compression; /* !< encodings used to compress the responses, values available are U_COMPRESSION_NONE or a combination of U_COMPRESSION_GZIP and U_COMPRESSION_DEFLATE, ignored if zlib support is disabled, default U_COMPRESSION_NONE */
+  size_t                        compression_min_size; /* !< minimum size of a response body to compress it, default U_COMPRESSION_DEFAULT_MIN_SIZE */
+  int                           compression_level; /* !< zlib compression level, from 0 to 9, default U_COMPRESSION_DEFAULT_LEVEL */
+  size_t                        stream_block_size; /* !< default size of the blocks sent for stream responses and bodies sent by blocks, used if ulfius_set_stream_response is called with a stream_block_size of 0, default ULFIUS_STREAM_BLOCK_SIZE_DEFAULT */
+  size_t                        stream_block_size_max; /* !< adaptive mode if greater than the block size of a stream response: the block size doubles up to stream_block_size_max while the socket drains the blocks quickly, 0 disables adaptive mode, default 0 */
+  size_t                        post_buffer_size; /* !< size of the buffer used by the post processor to parse url-encoded and multipart bodies, minimum 256, default ULFIUS_POSTBUFFERSIZE */
+  unsigned int                  websocket_reactor_threads; /* !< number of event loop threads sharing the upgraded websockets through epoll, websocket_incoming_message_callback is then called by a pool of websocket_worker_threads threads, 0 runs each websocket in its own threads, Linux only, default 0 */
+  unsigned int                  websocket_worker_threads; /* !< number of threads calling websocket_incoming_message_callback when websocket_reactor_threads is set, 0 means the number of online CPUs, default 0 */
 #ifndef U_DISABLE_GNUTLS
   int                           use_client_cert_auth; /* !< Internal variable use to indicate if the instance uses client certificate authentication, Do not change this value, available only if websocket support is enabled */
 #endif
@@ -361,6 +437,7 @@ struct _u_instance {
  * Structures used to facilitate data manipulations (internal)
  */
 struct connection_info_struct {
+  void                     * arena;
   struct _u_instance       * u_instance;
   struct MHD_PostProcessor * post_processor;
   int                        has_post_processor;
@@ -368,6 +445,17 @@ struct connection_info_struct {
   struct _u_request        * request;
   size_t                     max_post_param_size;
   struct _u_map              map_url_initial;
+  uint64_t                   body_length;
+  size_t                     body_capacity;
+  int                     (* body_callback)(const struct _u_request * request, const char * data, uint64_t off, size_t size, void * user_data);
+  void                     * body_user_data;
+  size_t                     body_file_threshold;
+  void                     * upload_file;
+  void                     * upload_paths;
+  size_t                     post_value_capacity;
+  unsigned int               post_utf8_state;
+  int                        post_value_ignored;
+  char                     * post_value_key;
 };
 
 /**********************************
@@ -507,6 +595,26 @@ int ulfius_set_upload_file_callback_function(struct _u_instance * u_instance,
                                                                            void * cls),
                                              void * cls);
 
+/**
+ * ulfius_set_upload_file_directory
+ * 
+ * Set the directory where the files uploaded in multipart bodies are written
+ * The files are written directly on the disk by large blocks,
+ * map_post_body gets the path of the file for the key of the file part,
+ * its size in key_size, its filename in key_filename and its content type in key_content_type
+ * 
+ * The files are removed when the request is completed,
+ * the callback functions must move the files they want to keep with rename or link
+ * on the same file system
+ * 
+ * Ignored if a callback function is set with ulfius_set_upload_file_callback_function
+ * 
+ * @param u_instance pointer to a struct _u_instance that describe its port and bind address
+ * @param directory path to an existing directory, NULL to store the files in memory
+ * @return U_OK on success
+ */
+int ulfius_set_upload_file_directory(struct _u_instance * u_instance, const char * directory);
+
 /**
  * @}
  */
@@ -560,6 +668,7 @@ int ulfius_add_endpoint_by_val(struct _u_instance * u_instance,
 /**
  * Add a struct _u_endpoint * list to the specified u_instance
  * Can be done during the execution of the webservice for injection
+ * The endpoints are added together, if one of them can't be added, none of them is added
  * @param u_instance pointer to a struct _u_instance that describe its port and bind address
  * @param u_endpoint_list pointer to an array of struct _u_endpoint ending with a ulfius_empty_endpoint() that will be copied in the u_instance endpoint_list
  * @return U_OK on success
@@ -874,6 +983,45 @@ int ulfius_set_string_body_response(struct _u_response * response, const unsigne
  */
 int ulfius_set_binary_body_response(struct _u_response * response, const unsigned int status, const char * body, const size_t length);
 
+/**
+ * ulfius_set_buffer_body_response
+ * Add a body to a response without copying it, replace any existing body in the response
+ * Use it to send static or shared buffers, e.g. precomputed payloads
+ * @param response the response to be updated
+ * @param status the http status code to set to the response
+ * @param body the buffer to send, must be kept unchanged until release_callback is called
+ * @param length the length of body
+ * @param release_callback a pointer to a function called when the response doesn't use body anymore, may be NULL for a static buffer
+ * @param release_cls a user-defined pointer passed to release_callback
+ * @return U_OK on success
+ */
+int ulfius_set_buffer_body_response(struct _u_response * response, const unsigned int status, const void * body, const size_t length, void (* release_callback)(void * release_cls), void * release_cls);
+
+/**
+ * ulfius_set_segmented_body_response
+ * Add a body made of several segments to a response, replace any existing body in the response
+ * The segments are sent one after the other without being concatenated nor copied
+ * @param response the response to be updated
+ * @param status the http status code to set to the response
+ * @param segments the array of segments, the array is copied, each segment data must be kept unchanged until its release_callback is called
+ * @param nb_segments the number of segments
+ * @return U_OK on success
+ */
+int ulfius_set_segmented_body_response(struct _u_response * response, const unsigned int status, const struct _u_body_segment * segments, const size_t nb_segments);
+
+/**
+ * ulfius_set_file_response
+ * Add a body read from a file to a response, replace any existing body in the response
+ * The file is sent by the kernel with sendfile if possible, the data doesn't go through user space
+ * @param response the response to be updated
+ * @param status the http status code to set to the response
+ * @param fd the file descriptor to read, the response takes its ownership and closes it when the response is complete
+ * @param offset the offset of the body in the file
+ * @param length the length of the body
+ * @return U_OK on success
+ */
+int ulfius_set_file_response(struct _u_response * response, const unsigned int status, int fd, uint64_t offset, uint64_t length);
+
 /**
  * ulfius_set_empty_body_response
  * Set an empty response with only a status
@@ -901,7 +1049,8 @@ int ulfius_set_empty_body_response(struct _u_response * response, const unsigned
  * @param stream_callback a pointer to a function that will handle the response stream
  * @param stream_callback_free a pointer to a function that will free its allocated resoures during stream_callback
  * @param stream_size size of the streamed data (U_STREAM_SIZE_UNKOWN if unknown)
- * @param stream_block_size preferred size of each stream chunk, may be overwritten by the system if necessary
+ * @param stream_block_size preferred size of each stream chunk, may be overwritten by the system if necessary,
+ *        0 to use the instance stream_block_size
  * @param stream_user_data a user-defined pointer that will be available in stream_callback and stream_callback_free
  * @return U_OK on success
  */
@@ -1407,6 +1556,9 @@ int u_map_empty(struct _u_map * u_map);
 #define U_WEBSOCKET_STATUS_CLOSE 1
 #define U_WEBSOCKET_STATUS_ERROR 2
 
+#define U_WEBSOCKET_BUFFER_BORROW 0
+#define U_WEBSOCKET_BUFFER_OWN    1
+
 #define WEBSOCKET_RESPONSE_HTTP       0x0001
 #define WEBSOCKET_RESPONSE_UPGRADE    0x0002
 #define WEBSOCKET_RESPONSE_CONNECTION 0x0004
@@ -1438,6 +1590,9 @@ struct _websocket_manager {
   pthread_cond_t                   status_cond; /* !< condition to broadcast new status */
   struct pollfd                    fds;
   int                              type;
+  int                              reactor; /* !< set to 1 if the websocket is run by the instance websocket reactor */
+  int                              signal_fd[2]; /* !< eventfd or pipe written by ulfius_websocket_send_close_signal to wake up the thread reading the websocket */
+  void                           * receive; /* !< receive buffer and frame parser of the thread reading the websocket */
 };
 
 /**
@@ -1512,6 +1667,28 @@ int ulfius_websocket_send_message(struct _websocket_manager * websocket_manager,
                                   const uint64_t data_len,
                                   const char * data);
 
+/**
+ * Sends a message in the websocket without copying data in a new message
+ * The frames of a websocket server aren't masked, each frame header and its part of data are sent with one sendmsg call
+ * The frames of a websocket client are masked in a temporary buffer
+ * @param websocket_manager the websocket manager to use for sending the message
+ * @param opcode the opcode to use
+ * values available are U_WEBSOCKET_OPCODE_TEXT, U_WEBSOCKET_OPCODE_BINARY, U_WEBSOCKET_OPCODE_PING, U_WEBSOCKET_OPCODE_PONG,
+ * use ulfius_websocket_send_message to send U_WEBSOCKET_OPCODE_CLOSE
+ * @param data_len the length of the data to send
+ * @param data the data to send
+ * @param ownership U_WEBSOCKET_BUFFER_OWN if data is allocated with o_malloc and given to the websocket manager,
+ * data is then the data of the message in message_list_outcoming and is free'd with the message, or on error
+ * U_WEBSOCKET_BUFFER_BORROW if data is only used until the function returns,
+ * the message in message_list_outcoming has no data then
+ * @return U_OK on success
+ */
+int ulfius_websocket_send_buffer_message(struct _websocket_manager * websocket_manager,
+                                         const uint8_t opcode,
+                                         const uint64_t data_len,
+                                         const char * data,
+                                         const int ownership);
+
 /**
  * Send a fragmented message in the websocket
  * each fragment size will be at most fragment_len
@@ -1744,6 +1921,7 @@ struct _websocket_handler {
   pthread_mutex_t               websocket_close_lock; /* !< mutex to broadcast close signal */
   pthread_cond_t                websocket_close_cond; /* !< condition to broadcast close signal */
   int                           pthread_init;
+  void                        * reactor; /* !< websocket reactor shared by the websockets if the instance websocket_reactor_threads is set, NULL otherwise */
 };
 
 #endif // U_DISABLE_WEBSOCKET
@@ -0,0 +1,157 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_arena.c: bump allocator used for the lifetime of a request
+ *
+ * Copyright 2015-2017 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <string.h>
+
+#include "u_private.h"
+#include "ulfius.h"
+
+#define U_ARENA_ALIGN(size) (((size) + (U_ARENA_ALIGNMENT - 1)) & ~((size_t)U_ARENA_ALIGNMENT - 1))
+#define U_ARENA_BLOCK_HEADER_SIZE U_ARENA_ALIGN(sizeof(struct _u_arena_block))
+
+/**
+ * ulfius_arena_new_block
+ * Allocate a block able to store size bytes
+ * return the new block on success, NULL on memory error
+ */
+static struct _u_arena_block * ulfius_arena_new_block(size_t size) {
+  struct _u_arena_block * block = o_malloc(U_ARENA_BLOCK_HEADER_SIZE + size);
+
+  if (block != NULL) {
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for arena block");
+  }
+  return block;
+}
+
+/**
+ * ulfius_arena_new
+ * Allocate an arena whose blocks store block_size bytes
+ * The arena structure is stored in its first block
+ * return the new arena on success, NULL on memory error
+ * returned value must be free'd with ulfius_arena_free after use
+ */
+struct _u_arena * ulfius_arena_new(size_t block_size) {
+  struct _u_arena_block * block;
+  struct _u_arena * arena = NULL;
+
+  if (block_size < U_ARENA_ALIGN(sizeof(struct _u_arena))) {
+    block_size = U_ARENA_ALIGN(sizeof(struct _u_arena));
+  }
+  if ((block = ulfius_arena_new_block(block_size)) != NULL) {
+    arena = (struct _u_arena *)((char *)block + U_ARENA_BLOCK_HEADER_SIZE);
+    block->used = U_ARENA_ALIGN(sizeof(struct _u_arena));
+    arena->block = block;
+    arena->block_size = block_size;
+  }
+  return arena;
+}
+
+/**
+ * ulfius_arena_alloc
+ * Allocate size bytes in the arena, aligned on U_ARENA_ALIGNMENT
+ * A new block is allocated if the current one is full,
+ * allocations larger than a quarter of a block get their own block so the current one keeps its free space
+ * return a pointer to the allocated memory on success, NULL on memory error
+ * returned value is free'd with the arena
+ */
+void * ulfius_arena_alloc(struct _u_arena * arena, size_t size) {
+  struct _u_arena_block * block;
+  void * ptr;
+
+  if (arena == NULL) {
+    return NULL;
+  }
+  size = U_ARENA_ALIGN(size?size:1);
+  if (arena->block->size - arena->block->used >= size) {
+    block = arena->block;
+  } else if (size > arena->block_size / 4) {
+    if ((block = ulfius_arena_new_block(size)) == NULL) {
+      return NULL;
+    }
+    block->next = arena->block->next;
+    arena->block->next = block;
+  } else {
+    if ((block = ulfius_arena_new_block(arena->block_size)) == NULL) {
+      return NULL;
+    }
+    block->next = arena->block;
+    arena->block = block;
+  }
+  ptr = (char *)block + U_ARENA_BLOCK_HEADER_SIZE + block->used;
+  block->used += size;
+  return ptr;
+}
+
+/**
+ * ulfius_arena_strndup
+ * Copy at most len characters of str in the arena and add a '\0' at the end
+ * return the copy on success, NULL on error
+ */
+char * ulfius_arena_strndup(struct _u_arena * arena, const char * str, size_t len) {
+  char * copy;
+  const char * end;
+
+  if (str == NULL) {
+    return NULL;
+  }
+  if ((end = memchr(str, '\0', len)) != NULL) {
+    len = (size_t)(end - str);
+  }
+  if ((copy = ulfius_arena_alloc(arena, len + 1)) != NULL) {
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+/**
+ * ulfius_arena_strdup
+ * Copy str in the arena
+ * return the copy on success, NULL on error
+ */
+char * ulfius_arena_strdup(struct _u_arena * arena, const char * str) {
+  if (str == NULL) {
+    return NULL;
+  }
+  return ulfius_arena_strndup(arena, str, o_strlen(str));
+}
+
+/**
+ * ulfius_arena_free
+ * Free all the memory allocated in the arena, including the arena itself
+ */
+void ulfius_arena_free(struct _u_arena * arena) {
+  struct _u_arena_block * block, * next;
+
+  if (arena != NULL) {
+    for (block = arena->block; block != NULL; block = next) {
+      next = block->next;
+      o_free(block);
+    }
+  }
+}
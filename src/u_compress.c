@@ -0,0 +1,365 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_compress.c: response compression functions definitions
+ *
+ * Copyright 2015-2017 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include "u_private.h"
+#include "ulfius.h"
+
+#ifndef U_DISABLE_ZLIB
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define U_COMPRESS_WINDOW_BITS 15
+#define U_COMPRESS_GZIP_WINDOW_BITS (U_COMPRESS_WINDOW_BITS + 16)
+#define U_COMPRESS_MEM_LEVEL 8
+#define U_COMPRESS_STREAM_BLOCK_SIZE 4096
+
+/**
+ * Stream state of a compressed stream response
+ */
+struct _u_compress_stream {
+  z_stream   strm;
+  ssize_t (* stream_callback) (void * stream_cls, uint64_t pos, char * buf, size_t max);
+  void    (* stream_callback_free) (void * stream_cls);
+  void     * stream_user_data;
+  char     * in;
+  size_t     in_size;
+  uint64_t   in_pos;   /* bytes read from stream_callback */
+  int        finished; /* stream_callback has reached the end of its stream */
+};
+
+/**
+ * Content types compressed by design, compressing them again is useless
+ */
+static const char * u_compressed_content_types[] = {
+  "image/", "video/", "audio/", "font/woff",
+  "application/zip", "application/gzip", "application/x-gzip", "application/x-bzip2",
+  "application/x-xz", "application/x-7z-compressed", "application/x-rar-compressed", "application/zstd",
+  NULL
+};
+
+/**
+ * ulfius_is_compressed_content_type
+ * return true if content_type is a compressed format
+ */
+static int ulfius_is_compressed_content_type(const char * content_type) {
+  size_t i;
+
+  if (content_type == NULL || 0 == o_strncasecmp(content_type, "image/svg", o_strlen("image/svg"))) {
+    return 0;
+  }
+  for (i=0; u_compressed_content_types[i] != NULL; i++) {
+    if (0 == o_strncasecmp(content_type, u_compressed_content_types[i], o_strlen(u_compressed_content_types[i]))) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * ulfius_select_compression
+ * Select the encoding among the ones enabled in compression, using the Accept-Encoding header value
+ * gzip is preferred over deflate at equal quality value
+ * return U_COMPRESSION_GZIP, U_COMPRESSION_DEFLATE, or U_COMPRESSION_NONE if the client accepts none of them
+ */
+static unsigned short ulfius_select_compression(const char * accept_encoding, unsigned short compression) {
+  int q_gzip = -1, q_deflate = -1, q_any = -1, q;
+  const char * token, * end;
+  size_t token_len;
+
+  if (accept_encoding == NULL) {
+    return U_COMPRESSION_NONE;
+  }
+  token = accept_encoding;
+  while (*token != '\0') {
+    while (*token == ' ' || *token == '\t' || *token == ',') {
+      token++;
+    }
+    if (*token == '\0') {
+      break;
+    }
+    for (end = token; *end != '\0' && *end != ',' && *end != ';' && *end != ' ' && *end != '\t'; end++);
+    token_len = (size_t)(end - token);
+    // Quality value in thousandths, 1 if absent
+    q = 1000;
+    while (*end == ' ' || *end == '\t') {
+      end++;
+    }
+    if (*end == ';') {
+      end++;
+      while (*end == ' ' || *end == '\t') {
+        end++;
+      }
+      if ((*end == 'q' || *end == 'Q') && end[1] == '=') {
+        q = (int)(strtod(end + 2, NULL) * 1000);
+      }
+    }
+    if (token_len == 1 && *token == '*') {
+      q_any = q;
+    } else if (token_len == 4 && 0 == o_strncasecmp(token, "gzip", 4)) {
+      q_gzip = q;
+    } else if (token_len == 7 && 0 == o_strncasecmp(token, "deflate", 7)) {
+      q_deflate = q;
+    }
+    for (token = end; *token != '\0' && *token != ','; token++);
+  }
+  q_gzip = (compression & U_COMPRESSION_GZIP)?(q_gzip!=-1?q_gzip:q_any):0;
+  q_deflate = (compression & U_COMPRESSION_DEFLATE)?(q_deflate!=-1?q_deflate:q_any):0;
+  if (q_gzip > 0 && q_gzip >= q_deflate) {
+    return U_COMPRESSION_GZIP;
+  } else if (q_deflate > 0) {
+    return U_COMPRESSION_DEFLATE;
+  } else {
+    return U_COMPRESSION_NONE;
+  }
+}
+
+/**
+ * ulfius_compress_init_stream
+ * Initialize a deflate stream for the encoding
+ * return U_OK on success
+ */
+static int ulfius_compress_init_stream(z_stream * strm, unsigned short encoding, int level) {
+  memset(strm, 0, sizeof(z_stream));
+  if (deflateInit2(strm, level, Z_DEFLATED, encoding==U_COMPRESSION_GZIP?U_COMPRESS_GZIP_WINDOW_BITS:U_COMPRESS_WINDOW_BITS, U_COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error deflateInit2");
+    return U_ERROR;
+  }
+  return U_OK;
+}
+
+/**
+ * ulfius_compress_buffer_body
+ * Compress the binary body or the segmented body of the response in a new buffer
+ * The body is kept unchanged if compressing it doesn't reduce its size
+ * return U_OK on success
+ */
+static int ulfius_compress_buffer_body(struct _u_response * response, unsigned short encoding, int level, size_t length) {
+  z_stream strm;
+  unsigned char * out;
+  size_t i, nb_segments = response->nb_body_segments?response->nb_body_segments:1;
+  uLong out_len;
+  int ret = U_OK, z_ret = Z_OK;
+
+  if (length > (uInt)-1) {
+    return U_ERROR_NOT_FOUND;
+  }
+  if (ulfius_compress_init_stream(&strm, encoding, level) != U_OK) {
+    return U_ERROR;
+  }
+  out_len = deflateBound(&strm, (uLong)length);
+  if ((out = o_malloc(out_len)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for compressed body");
+    deflateEnd(&strm);
+    return U_ERROR_MEMORY;
+  }
+  strm.next_out = out;
+  strm.avail_out = (uInt)out_len;
+  // The segments are compressed in place, they are never flattened
+  for (i=0; i<nb_segments && (z_ret == Z_OK || z_ret == Z_BUF_ERROR); i++) {
+    if (response->nb_body_segments) {
+      strm.next_in = (Bytef *)response->body_segments[i].data;
+      strm.avail_in = (uInt)response->body_segments[i].length;
+    } else {
+      strm.next_in = (Bytef *)response->binary_body;
+      strm.avail_in = (uInt)response->binary_body_length;
+    }
+    z_ret = deflate(&strm, i+1==nb_segments?Z_FINISH:Z_NO_FLUSH);
+  }
+  if (z_ret != Z_STREAM_END) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error deflate");
+    o_free(out);
+    ret = U_ERROR;
+  } else if (strm.total_out >= length) {
+    o_free(out);
+    ret = U_ERROR_NOT_FOUND;
+  } else if (ulfius_set_buffer_body_response(response, response->status, out, strm.total_out, &u_free, out) != U_OK) {
+    o_free(out);
+    ret = U_ERROR;
+  }
+  deflateEnd(&strm);
+  return ret;
+}
+
+/**
+ * ulfius_compress_stream_reader
+ * Stream callback reading the original stream and sending it compressed
+ * Each block read is flushed so the client receives it without waiting for the next one
+ */
+static ssize_t ulfius_compress_stream_reader(void * cls, uint64_t pos, char * buf, size_t max) {
+  struct _u_compress_stream * stream = (struct _u_compress_stream *)cls;
+  ssize_t res;
+  int z_ret;
+
+  UNUSED(pos);
+  stream->strm.next_out = (Bytef *)buf;
+  stream->strm.avail_out = (uInt)max;
+  while (stream->strm.avail_out == max) {
+    if (!stream->strm.avail_in && !stream->finished) {
+      res = stream->stream_callback(stream->stream_user_data, stream->in_pos, stream->in, stream->in_size);
+      if (res == U_STREAM_END) {
+        stream->finished = 1;
+      } else if (res < 0) {
+        return U_STREAM_ERROR;
+      } else if (!res) {
+        // The original stream has no data available yet
+        break;
+      } else {
+        stream->in_pos += (uint64_t)res;
+        stream->strm.next_in = (Bytef *)stream->in;
+        stream->strm.avail_in = (uInt)res;
+      }
+    }
+    z_ret = deflate(&stream->strm, stream->finished?Z_FINISH:Z_SYNC_FLUSH);
+    if (z_ret == Z_STREAM_END) {
+      if (stream->strm.avail_out == max) {
+        return U_STREAM_END;
+      }
+      break;
+    } else if (z_ret != Z_OK && z_ret != Z_BUF_ERROR) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error deflate stream");
+      return U_STREAM_ERROR;
+    }
+  }
+  return (ssize_t)(max - stream->strm.avail_out);
+}
+
+/**
+ * ulfius_compress_stream_free
+ * Cleanup the compressed stream and the original stream
+ */
+static void ulfius_compress_stream_free(void * cls) {
+  struct _u_compress_stream * stream = (struct _u_compress_stream *)cls;
+
+  if (stream != NULL) {
+    if (stream->stream_callback_free != NULL) {
+      stream->stream_callback_free(stream->stream_user_data);
+    }
+    deflateEnd(&stream->strm);
+    o_free(stream->in);
+    o_free(stream);
+  }
+}
+
+/**
+ * ulfius_compress_stream_body
+ * Wrap the stream callback of the response in an incremental compressor
+ * return U_OK on success
+ */
+static int ulfius_compress_stream_body(struct _u_response * response, unsigned short encoding, int level) {
+  struct _u_compress_stream * stream;
+
+  if ((stream = o_malloc(sizeof(struct _u_compress_stream))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for compressed stream");
+    return U_ERROR_MEMORY;
+  }
+  stream->in_size = response->stream_block_size?response->stream_block_size:U_COMPRESS_STREAM_BLOCK_SIZE;
+  if ((stream->in = o_malloc(stream->in_size)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for compressed stream buffer");
+    o_free(stream);
+    return U_ERROR_MEMORY;
+  }
+  if (ulfius_compress_init_stream(&stream->strm, encoding, level) != U_OK) {
+    o_free(stream->in);
+    o_free(stream);
+    return U_ERROR;
+  }
+  stream->stream_callback = response->stream_callback;
+  stream->stream_callback_free = response->stream_callback_free;
+  stream->stream_user_data = response->stream_user_data;
+  stream->in_pos = 0;
+  stream->finished = 0;
+  response->stream_callback = &ulfius_compress_stream_reader;
+  response->stream_callback_free = &ulfius_compress_stream_free;
+  response->stream_user_data = stream;
+  response->stream_size = U_STREAM_SIZE_UNKOWN;
+  return U_OK;
+}
+
+/**
+ * ulfius_compress_response
+ * Compress the response body with the encoding negotiated with the request Accept-Encoding header
+ * Buffered bodies smaller than u_instance->compression_min_size, file bodies, partial responses,
+ * responses with a Content-Encoding header and compressed content types are sent unchanged
+ * return U_OK if the body is compressed
+ */
+int ulfius_compress_response(const struct _u_instance * u_instance, const struct _u_request * request, struct _u_response * response) {
+  unsigned short encoding;
+  const char * etag, * vary;
+  char * header;
+  size_t i, length = 0;
+  int ret;
+
+  if (u_instance->compression == U_COMPRESSION_NONE ||
+      response->body_fd >= 0 ||
+      response->status < 200 || response->status == 204 || response->status == 206 || response->status == 304 ||
+      u_map_get_case(response->map_header, "Content-Encoding") != NULL ||
+      ulfius_is_compressed_content_type(u_map_get_case(response->map_header, "Content-Type"))) {
+    return U_ERROR_NOT_FOUND;
+  }
+  if (response->stream_callback == NULL) {
+    if (response->nb_body_segments) {
+      for (i=0; i<response->nb_body_segments; i++) {
+        length += response->body_segments[i].length;
+      }
+    } else {
+      length = response->binary_body!=NULL?response->binary_body_length:0;
+    }
+    if (!length || length < u_instance->compression_min_size) {
+      return U_ERROR_NOT_FOUND;
+    }
+  } else if (response->stream_size != U_STREAM_SIZE_UNKOWN && response->stream_size < u_instance->compression_min_size) {
+    return U_ERROR_NOT_FOUND;
+  }
+
+  // The response depends on Accept-Encoding whether it's compressed or not
+  // The headers set by the callback may have any case, they are replaced to be sent once
+  if ((vary = u_map_get_case(response->map_header, "Vary")) == NULL) {
+    u_map_put(response->map_header, "Vary", "Accept-Encoding");
+  } else if (o_strcasestr(vary, "Accept-Encoding") == NULL && (header = msprintf("%s, Accept-Encoding", vary)) != NULL) {
+    u_map_remove_from_key_case(response->map_header, "Vary");
+    u_map_put(response->map_header, "Vary", header);
+    o_free(header);
+  }
+  if ((encoding = ulfius_select_compression(u_map_get_case(request->map_header, "Accept-Encoding"), u_instance->compression)) == U_COMPRESSION_NONE) {
+    return U_ERROR_NOT_FOUND;
+  }
+
+  if (response->stream_callback != NULL) {
+    ret = ulfius_compress_stream_body(response, encoding, u_instance->compression_level);
+  } else {
+    ret = ulfius_compress_buffer_body(response, encoding, u_instance->compression_level, length);
+  }
+  if (ret == U_OK) {
+    u_map_put(response->map_header, "Content-Encoding", encoding==U_COMPRESSION_GZIP?"gzip":"deflate");
+    // The compressed body isn't byte-for-byte identical to the original one, a strong entity tag becomes weak
+    if ((etag = u_map_get_case(response->map_header, "ETag")) != NULL && etag[0] == '"' && (header = msprintf("W/%s", etag)) != NULL) {
+      u_map_remove_from_key_case(response->map_header, "ETag");
+      u_map_put(response->map_header, "ETag", header);
+      o_free(header);
+    }
+  }
+  return ret;
+}
+#endif
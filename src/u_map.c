@@ -26,41 +26,208 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "u_private.h"
 #include "ulfius.h"
 
+/**
+ * Allocation functions of a struct _u_map
+ * The memory of a map initialized with u_map_init_arena is allocated in its arena
+ * and isn't free'd before the arena, the other maps use the heap
+ */
+static void * u_map_malloc(const struct _u_map * u_map, size_t size) {
+  return u_map->arena!=NULL?ulfius_arena_alloc((struct _u_arena *)u_map->arena, size):o_malloc(size);
+}
+
+static void u_map_free(const struct _u_map * u_map, void * ptr) {
+  if (u_map->arena == NULL) {
+    o_free(ptr);
+  }
+}
+
+/**
+ * In an arena, the old_size bytes of ptr still used are copied in a new allocation
+ */
+static void * u_map_realloc(const struct _u_map * u_map, void * ptr, size_t old_size, size_t size) {
+  void * new_ptr;
+
+  if (u_map->arena == NULL) {
+    return o_realloc(ptr, size);
+  } else if ((new_ptr = ulfius_arena_alloc((struct _u_arena *)u_map->arena, size)) != NULL && ptr != NULL) {
+    memcpy(new_ptr, ptr, old_size<size?old_size:size);
+  }
+  return new_ptr;
+}
+
+static char * u_map_strdup(const struct _u_map * u_map, const char * str) {
+  return u_map->arena!=NULL?ulfius_arena_strdup((struct _u_arena *)u_map->arena, str):o_strdup(str);
+}
+
+/**
+ * Case-insensitive FNV-1a hash of a key
+ * Keys differing only by case have the same hash, so the index is used by case sensitive
+ * and case insensitive searches
+ */
+static unsigned int u_map_hash(const char * key) {
+  unsigned int hash = 2166136261u;
+
+  for (; *key; key++) {
+    hash ^= (unsigned char)tolower((unsigned char)*key);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Add the key at position i to the hash index using linear probing
+ * Slots contain the key position + 1, 0 is an empty slot
+ */
+static void u_map_index_insert(struct _u_map * u_map, int i) {
+  unsigned int slot = u_map_hash(u_map->keys[i]) & (unsigned int)(u_map->index_size - 1);
+
+  while (u_map->index[slot]) {
+    slot = (slot + 1) & (unsigned int)(u_map->index_size - 1);
+  }
+  u_map->index[slot] = i + 1;
+}
+
+/**
+ * Remove the key at position i from the hash index, the key must still be in u_map->keys
+ * The following keys of the cluster are shifted backward to fill the slot, so the index
+ * doesn't need to be rebuilt, then the positions after i are decremented
+ */
+static void u_map_index_remove(struct _u_map * u_map, int i) {
+  unsigned int mask = (unsigned int)(u_map->index_size - 1), slot = u_map_hash(u_map->keys[i]) & mask, next, home;
+  int k;
+
+  while (u_map->index[slot] != i + 1) {
+    slot = (slot + 1) & mask;
+  }
+  for (next = (slot + 1) & mask; u_map->index[next]; next = (next + 1) & mask) {
+    home = u_map_hash(u_map->keys[u_map->index[next] - 1]) & mask;
+    // The key in next can move to the free slot if its home slot isn't after the free slot
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      u_map->index[slot] = u_map->index[next];
+      slot = next;
+    }
+  }
+  u_map->index[slot] = 0;
+  for (k=0; k<u_map->index_size; k++) {
+    if (u_map->index[k] > i + 1) {
+      u_map->index[k]--;
+    }
+  }
+}
+
+/**
+ * Update the hash index after keys were added or removed
+ * The index is built when the map reaches U_MAP_INDEX_THRESHOLD keys
+ * and rebuilt with twice more slots when it's half full
+ * If the index can't be allocated, the map is searched without index
+ */
+static void u_map_update_index(struct _u_map * u_map, int rebuild) {
+  int i, index_size;
+
+  if (u_map->nb_values < U_MAP_INDEX_THRESHOLD) {
+    u_map_free(u_map, u_map->index);
+    u_map->index = NULL;
+    u_map->index_size = 0;
+  } else if (!rebuild && u_map->index != NULL && 2 * u_map->nb_values <= u_map->index_size) {
+    u_map_index_insert(u_map, u_map->nb_values - 1);
+  } else {
+    for (index_size = 2 * U_MAP_INDEX_THRESHOLD; index_size < 4 * u_map->nb_values; index_size *= 2);
+    u_map_free(u_map, u_map->index);
+    u_map->index_size = 0;
+    if ((u_map->index = u_map_malloc(u_map, index_size * sizeof(int))) != NULL) {
+      memset(u_map->index, 0, index_size * sizeof(int));
+      u_map->index_size = index_size;
+      for (i=0; i<u_map->nb_values; i++) {
+        u_map_index_insert(u_map, i);
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->index");
+    }
+  }
+}
+
+/**
+ * Return the position of the first key matching key, or -1 if not found
+ * if case_insensitive is true, keys are compared with o_strcasecmp, otherwise with o_strcmp
+ */
+static int u_map_find(const struct _u_map * u_map, const char * key, int case_insensitive) {
+  unsigned int slot;
+  int i, found = -1;
+
+  if (u_map->index != NULL) {
+    slot = u_map_hash(key) & (unsigned int)(u_map->index_size - 1);
+    while (u_map->index[slot]) {
+      i = u_map->index[slot] - 1;
+      if (case_insensitive) {
+        // Several keys may match case insensitively, return the first one
+        if ((found == -1 || i < found) && 0 == o_strcasecmp(u_map->keys[i], key)) {
+          found = i;
+        }
+      } else if (0 == o_strcmp(u_map->keys[i], key)) {
+        return i;
+      }
+      slot = (slot + 1) & (unsigned int)(u_map->index_size - 1);
+    }
+  } else {
+    for (i=0; u_map->keys[i] != NULL; i++) {
+      if (0 == (case_insensitive?o_strcasecmp(u_map->keys[i], key):o_strcmp(u_map->keys[i], key))) {
+        return i;
+      }
+    }
+  }
+  return found;
+}
+
 /**
  * initialize a struct _u_map
  * this function MUST be called after a declaration or allocation
  * return U_OK on success
  */
 int u_map_init(struct _u_map * u_map) {
+  return u_map_init_arena(u_map, NULL);
+}
+
+/**
+ * u_map_init_arena
+ * Initialize a struct _u_map whose keys, values and arrays are allocated in the arena
+ * The memory of the removed or replaced elements is released with the arena
+ * return U_OK on success
+ */
+int u_map_init_arena(struct _u_map * u_map, struct _u_arena * arena) {
   if (u_map != NULL) {
+    u_map->arena = arena;
     u_map->nb_values = 0;
-    u_map->keys = o_malloc(sizeof(char *));
+    u_map->keys = u_map_malloc(u_map, sizeof(char *));
     if (u_map->keys == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->keys");
       return U_ERROR_MEMORY;
     }
     u_map->keys[0] = NULL;
 
-    u_map->values = o_malloc(sizeof(char *));
+    u_map->values = u_map_malloc(u_map, sizeof(char *));
     if (u_map->values == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->values");
-      o_free(u_map->keys);
+      u_map_free(u_map, u_map->keys);
       return U_ERROR_MEMORY;
     }
     u_map->values[0] = NULL;
     
-    u_map->lengths = o_malloc(sizeof(size_t));
+    u_map->lengths = u_map_malloc(u_map, sizeof(size_t));
     if (u_map->lengths == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->lengths");
-      o_free(u_map->keys);
-      o_free(u_map->values);
+      u_map_free(u_map, u_map->keys);
+      u_map_free(u_map, u_map->values);
       return U_ERROR_MEMORY;
     }
     u_map->lengths[0] = 0;
+    u_map->size = 1;
+    u_map->index = NULL;
+    u_map->index_size = 0;
 
     return U_OK;
   } else {
@@ -75,13 +242,17 @@ int u_map_init(struct _u_map * u_map) {
 int u_map_clean(struct _u_map * u_map) {
   int i;
   if (u_map != NULL) {
-    for (i=0; i<u_map->nb_values; i++) {
-      o_free(u_map->keys[i]);
-      o_free(u_map->values[i]);
+    if (u_map->arena == NULL) {
+      for (i=0; i<u_map->nb_values; i++) {
+        o_free(u_map->keys[i]);
+        o_free(u_map->values[i]);
+      }
+      o_free(u_map->keys);
+      o_free(u_map->values);
+      o_free(u_map->lengths);
+      o_free(u_map->index);
     }
-    o_free(u_map->keys);
-    o_free(u_map->values);
-    o_free(u_map->lengths);
+    u_map->index = NULL;
     return U_OK;
   } else {
     return U_ERROR_PARAMS;
@@ -141,13 +312,8 @@ const char ** u_map_enum_values(const struct _u_map * u_map) {
  * search is case sensitive
  */
 int u_map_has_key(const struct _u_map * u_map, const char * key) {
-  int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcmp(u_map->keys[i], key)) {
-        return 1;
-      }
-    }
+    return u_map_find(u_map, key, 0) != -1;
   }
   return 0;
 }
@@ -191,6 +357,53 @@ int u_map_put(struct _u_map * u_map, const char * key, const char * value) {
   }
 }
 
+/**
+ * u_map_insert
+ * Add a new key with its allocated value at the end of u_map
+ * dup_key and dup_value are owned by u_map on success and free'd on error
+ * return U_OK on success
+ */
+static int u_map_insert(struct _u_map * u_map, char * dup_key, char * dup_value, size_t length) {
+  char ** keys, ** values;
+  size_t * lengths;
+  int i, size;
+
+  // Grow the arrays geometrically, keeping room for the NULL terminating element
+  if (u_map->nb_values + 2 > u_map->size) {
+    size = u_map->size * 2;
+    if (size < u_map->nb_values + 2) {
+      size = u_map->nb_values + 2;
+    }
+    if ((keys = u_map_realloc(u_map, u_map->keys, u_map->size*sizeof(char *), size*sizeof(char *))) != NULL) {
+      u_map->keys = keys;
+    }
+    if ((values = u_map_realloc(u_map, u_map->values, u_map->size*sizeof(char *), size*sizeof(char *))) != NULL) {
+      u_map->values = values;
+    }
+    if ((lengths = u_map_realloc(u_map, u_map->lengths, u_map->size*sizeof(size_t), size*sizeof(size_t))) != NULL) {
+      u_map->lengths = lengths;
+    }
+    if (keys == NULL || values == NULL || lengths == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map arrays");
+      u_map_free(u_map, dup_key);
+      u_map_free(u_map, dup_value);
+      return U_ERROR_MEMORY;
+    }
+    u_map->size = size;
+  }
+  
+  i = u_map->nb_values;
+  u_map->keys[i] = dup_key;
+  u_map->keys[i+1] = NULL;
+  u_map->values[i] = dup_value;
+  u_map->values[i+1] = NULL;
+  u_map->lengths[i] = length;
+  u_map->lengths[i+1] = 0;
+  u_map->nb_values++;
+  u_map_update_index(u_map, 0);
+  return U_OK;
+}
+
 /**
  * add the specified key/binary value pair into the specified u_map
  * if the u_map already contains a pair with the same key,
@@ -201,114 +414,178 @@ int u_map_put_binary(struct _u_map * u_map, const char * key, const char * value
   int i;
   char * dup_key, * dup_value;
   if (u_map != NULL && key != NULL && o_strlen(key) > 0) {
-    for (i=0; i < u_map->nb_values; i++) {
-      if (0 == o_strcmp(u_map->keys[i], key)) {
-        // Key already exist, extend and/or replace value
-        if (u_map->lengths[i] < (offset + length)) {
-          u_map->values[i] = o_realloc(u_map->values[i], (offset + length)*sizeof(char));
-          if (u_map->values[i] == NULL) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->values");
-            return U_ERROR_MEMORY;
-          }
+    if ((i = u_map_find(u_map, key, 0)) != -1) {
+      // Key already exist, extend and/or replace value
+      if (u_map->lengths[i] < (offset + length)) {
+        u_map->values[i] = u_map_realloc(u_map, u_map->values[i], u_map->lengths[i], (offset + length)*sizeof(char));
+        if (u_map->values[i] == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->values");
+          return U_ERROR_MEMORY;
         }
-        if (value != NULL) {
-          memcpy(u_map->values[i]+offset, value, length);
-          if (u_map->lengths[i] < (offset + length)) {
-            u_map->lengths[i] = (offset + length);
-          }
-        } else {
-          o_free(u_map->values[i]);
-          u_map->values[i] = o_strdup("");
-          u_map->lengths[i] = 0;
+      }
+      if (value != NULL) {
+        memcpy(u_map->values[i]+offset, value, length);
+        if (u_map->lengths[i] < (offset + length)) {
+          u_map->lengths[i] = (offset + length);
         }
-        return U_OK;
+      } else {
+        u_map_free(u_map, u_map->values[i]);
+        u_map->values[i] = u_map_strdup(u_map, "");
+        u_map->lengths[i] = 0;
       }
+      return U_OK;
     }
-    if (u_map->values[i] == NULL) {
-      // Not found, add key/value
-      dup_key = o_strdup(key);
-      if (dup_key == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for dup_key");
+    // Not found, add key/value
+    dup_key = u_map_strdup(u_map, key);
+    if (dup_key == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for dup_key");
+      return U_ERROR_MEMORY;
+    }
+    if (value != NULL) {
+      dup_value = u_map_malloc(u_map, (offset + length)*sizeof(char));
+      if (dup_value == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for dup_value");
+        u_map_free(u_map, dup_key);
         return U_ERROR_MEMORY;
       }
-      if (value != NULL) {
-        dup_value = o_malloc((offset + length)*sizeof(char));
-        if (dup_value == NULL) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for dup_value");
-          o_free(dup_key);
+      memcpy((dup_value + offset), value, length);
+    } else {
+      dup_value = u_map_strdup(u_map, "");
+    }
+    return u_map_insert(u_map, dup_key, dup_value, (offset + length));
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
+/**
+ * u_map_append_binary
+ * Write length bytes of value at offset in the value of key, followed by a '\0'
+ * Used to receive a value by chunks: the value buffer grows geometrically,
+ * *capacity holds its allocated size between calls and must be 0 for the first chunk
+ * return U_OK on success
+ */
+int u_map_append_binary(struct _u_map * u_map, const char * key, const char * value, uint64_t offset, size_t length, size_t * capacity) {
+  int i;
+  size_t needed = (size_t)offset + length + 1, new_capacity;
+  char * dup_key, * dup_value;
+
+  if (u_map != NULL && key != NULL && o_strlen(key) > 0 && (value != NULL || !length) && capacity != NULL) {
+    if ((i = u_map_find(u_map, key, 0)) != -1) {
+      if (*capacity < u_map->lengths[i]) {
+        *capacity = u_map->lengths[i];
+      }
+      if (*capacity < needed) {
+        new_capacity = *capacity * 2;
+        if (new_capacity < needed) {
+          new_capacity = needed;
+        }
+        if ((dup_value = u_map_realloc(u_map, u_map->values[i], u_map->lengths[i], new_capacity)) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->values");
           return U_ERROR_MEMORY;
         }
-        memcpy((dup_value + offset), value, length);
-      } else {
-        dup_value = o_strdup("");
+        u_map->values[i] = dup_value;
+        *capacity = new_capacity;
       }
-      
-      // Append key
-      for (i = 0; u_map->keys[i] != NULL; i++);
-      u_map->keys = o_realloc(u_map->keys, (i + 2)*sizeof(char *));
-      if (u_map->keys == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->keys");
-        o_free(dup_key);
-        o_free(dup_value);
-        return U_ERROR_MEMORY;
+      if (length) {
+        memcpy(u_map->values[i]+offset, value, length);
       }
-      u_map->keys[i] = (char *)dup_key;
-      u_map->keys[i+1] = NULL;
-      
-      // Append value
-      u_map->values = o_realloc(u_map->values, (i + 2)*sizeof(char *));
-      if (u_map->values == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->values");
-        o_free(dup_key);
-        o_free(dup_value);
-        return U_ERROR_MEMORY;
-      }
-      u_map->values[i] = (char *)dup_value;
-      u_map->values[i+1] = NULL;
-      
-      // Append length
-      u_map->lengths = o_realloc(u_map->lengths, (i + 2)*sizeof(size_t));
-      if (u_map->lengths == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->lengths");
-        o_free(dup_key);
-        o_free(dup_value);
-        return U_ERROR_MEMORY;
+      u_map->values[i][needed-1] = '\0';
+      if (u_map->lengths[i] < needed) {
+        u_map->lengths[i] = needed;
       }
-      u_map->lengths[i] = (offset + length);
-      u_map->lengths[i+1] = 0;
-      
-      u_map->nb_values++;
+      return U_OK;
     }
-    return U_OK;
+    // Not found, the first chunk is allocated with its exact size, most values have only one chunk
+    if ((dup_key = u_map_strdup(u_map, key)) == NULL || (dup_value = u_map_malloc(u_map, needed)) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for dup_key or dup_value");
+      u_map_free(u_map, dup_key);
+      return U_ERROR_MEMORY;
+    }
+    if (length) {
+      memcpy(dup_value+offset, value, length);
+    }
+    dup_value[needed-1] = '\0';
+    *capacity = needed;
+    return u_map_insert(u_map, dup_key, dup_value, needed);
   } else {
     return U_ERROR_PARAMS;
   }
 }
 
+/**
+ * Functions used by u_map_remove_matching to select the pairs to remove
+ */
+static int u_map_match_key(const struct _u_map * u_map, int i, const char * param, size_t length) {
+  UNUSED(length);
+  return 0 == o_strcmp(u_map->keys[i], param);
+}
+
+static int u_map_match_key_case(const struct _u_map * u_map, int i, const char * param, size_t length) {
+  UNUSED(length);
+  return 0 == o_strcasecmp(u_map->keys[i], param);
+}
+
+static int u_map_match_value_binary(const struct _u_map * u_map, int i, const char * param, size_t length) {
+  return u_map->lengths[i] >= length && 0 == memcmp(u_map->values[i], param, length);
+}
+
+static int u_map_match_value_case(const struct _u_map * u_map, int i, const char * param, size_t length) {
+  UNUSED(length);
+  return 0 == o_strcasecmp(u_map->values[i], param);
+}
+
+/**
+ * Remove all the pairs key/value from position first for which match returns true
+ * A single pair is removed with u_map_remove_at, which updates the hash index in place,
+ * several pairs are removed in a single pass and the hash index is rebuilt once
+ * return U_OK on success, U_ERROR_NOT_FOUND if no pair matches
+ */
+static int u_map_remove_matching(struct _u_map * u_map, int first, int (* match)(const struct _u_map * u_map, int i, const char * param, size_t length), const char * param, size_t length) {
+  int i, j, nb_found = 0, found = -1;
+
+  for (i = first; i >= 0 && i < u_map->nb_values; i++) {
+    if (match(u_map, i, param, length)) {
+      if (!nb_found++) {
+        found = i;
+      }
+    }
+  }
+  if (!nb_found) {
+    return U_ERROR_NOT_FOUND;
+  } else if (nb_found == 1) {
+    return u_map_remove_at(u_map, found);
+  } else {
+    for (i = j = found; i < u_map->nb_values; i++) {
+      if (match(u_map, i, param, length)) {
+        u_map_free(u_map, u_map->keys[i]);
+        u_map_free(u_map, u_map->values[i]);
+      } else {
+        u_map->keys[j] = u_map->keys[i];
+        u_map->values[j] = u_map->values[i];
+        u_map->lengths[j] = u_map->lengths[i];
+        j++;
+      }
+    }
+    u_map->keys[j] = NULL;
+    u_map->values[j] = NULL;
+    u_map->lengths[j] = 0;
+    u_map->nb_values = j;
+    u_map_update_index(u_map, 1);
+    return U_OK;
+  }
+}
+
 /**
  * remove an pair key/value that has the specified key
  * return U_OK on success, U_NOT_FOUND if key was not found, error otherwise
  */
 int u_map_remove_from_key(struct _u_map * u_map, const char * key) {
-  int i, res, found = 0;
-  
   if (u_map == NULL || key == NULL) {
     return U_ERROR_PARAMS;
   } else {
-    for (i = u_map->nb_values-1; i >= 0; i--) {
-      if (0 == o_strcmp(u_map->keys[i], key)) {
-        found = 1;
-        res = u_map_remove_at(u_map, i);
-        if (res != U_OK) {
-          return res;
-        }
-      }
-    }
-    if (found) {
-      return U_OK;
-    } else {
-      return U_ERROR_NOT_FOUND;
-    }
+    // The search starts at the first key matching case insensitively, found with the hash index if the map has one
+    return u_map_remove_matching(u_map, u_map_find(u_map, key, 1), &u_map_match_key, key, 0);
   }
 }
 
@@ -317,25 +594,10 @@ int u_map_remove_from_key(struct _u_map * u_map, const char * key) {
  * return U_OK on success, U_NOT_FOUND if key was not found, error otherwise
  */
 int u_map_remove_from_key_case(struct _u_map * u_map, const char * key) {
-  int i, res, found = 0;
-  
   if (u_map == NULL || key == NULL) {
     return U_ERROR_PARAMS;
   } else {
-    for (i = u_map->nb_values-1; i >= 0; i--) {
-      if (0 == o_strcasecmp(u_map->keys[i], key)) {
-        found = 1;
-        res = u_map_remove_at(u_map, i);
-        if (res != U_OK) {
-          return res;
-        }
-      }
-    }
-    if (found) {
-      return U_OK;
-    } else {
-      return U_ERROR_NOT_FOUND;
-    }
+    return u_map_remove_matching(u_map, u_map_find(u_map, key, 1), &u_map_match_key_case, key, 0);
   }
 }
 
@@ -352,25 +614,10 @@ int u_map_remove_from_value(struct _u_map * u_map, const char * value) {
  * return U_OK on success, U_NOT_FOUND if key was not found, error otherwise
  */
 int u_map_remove_from_value_binary(struct _u_map * u_map, const char * value, size_t length) {
-  int i, res, found = 0;
-  
   if (u_map == NULL || value == NULL) {
     return U_ERROR_PARAMS;
   } else {
-    for (i = u_map->nb_values-1; i >= 0; i--) {
-      if (0 == memcmp(u_map->values[i], value, length)) {
-        found = 1;
-        res = u_map_remove_at(u_map, i);
-        if (res != U_OK) {
-          return res;
-        }
-      }
-    }
-    if (found) {
-      return U_OK;
-    } else {
-      return U_ERROR_NOT_FOUND;
-    }
+    return u_map_remove_matching(u_map, 0, &u_map_match_value_binary, value, length);
   }
 }
 
@@ -379,25 +626,10 @@ int u_map_remove_from_value_binary(struct _u_map * u_map, const char * value, si
  * return U_OK on success, U_NOT_FOUND if key was not found, error otherwise
  */
 int u_map_remove_from_value_case(struct _u_map * u_map, const char * value) {
-  int i, res, found = 0;
-  
   if (u_map == NULL || value == NULL) {
     return U_ERROR_PARAMS;
   } else {
-    for (i = u_map->nb_values-1; i >= 0; i--) {
-      if (0 == o_strcasecmp(u_map->values[i], value)) {
-        found = 1;
-        res = u_map_remove_at(u_map, i);
-        if (res != U_OK) {
-          return res;
-        }
-      }
-    }
-    if (found) {
-      return U_OK;
-    } else {
-      return U_ERROR_NOT_FOUND;
-    }
+    return u_map_remove_matching(u_map, 0, &u_map_match_value_case, value, 0);
   }
 }
 
@@ -412,30 +644,21 @@ int u_map_remove_at(struct _u_map * u_map, const int index) {
   } else if (index >= u_map->nb_values) {
     return U_ERROR_NOT_FOUND;
   } else {
-    o_free(u_map->keys[index]);
-    o_free(u_map->values[index]);
+    if (u_map->index != NULL && u_map->nb_values > U_MAP_INDEX_THRESHOLD) {
+      u_map_index_remove(u_map, index);
+    }
+    u_map_free(u_map, u_map->keys[index]);
+    u_map_free(u_map, u_map->values[index]);
     for (i = index; i < u_map->nb_values; i++) {
       u_map->keys[i] = u_map->keys[i + 1];
       u_map->values[i] = u_map->values[i + 1];
       u_map->lengths[i] = u_map->lengths[i + 1];
     }
-    u_map->keys = o_realloc(u_map->keys, (u_map->nb_values)*sizeof(char *));
-    if (u_map->keys == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->keys");
-      return U_ERROR_MEMORY;
-    }
-    u_map->values = o_realloc(u_map->values, (u_map->nb_values)*sizeof(char *));
-    if (u_map->values == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->values");
-      return U_ERROR_MEMORY;
-    }
-    u_map->lengths = o_realloc(u_map->lengths, (u_map->nb_values)*sizeof(char *));
-    if (u_map->lengths == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_map->lengths");
-      return U_ERROR_MEMORY;
-    }
-    
     u_map->nb_values--;
+    if (u_map->nb_values < U_MAP_INDEX_THRESHOLD) {
+      // The index isn't used anymore
+      u_map_update_index(u_map, 1);
+    }
     return U_OK;
   }
 }
@@ -448,16 +671,11 @@ int u_map_remove_at(struct _u_map * u_map, const int index) {
 const char * u_map_get(const struct _u_map * u_map, const char * key) {
   int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcmp(u_map->keys[i], key)) {
-        if (u_map->lengths[i] > 0) {
-          return u_map->values[i];
-        } else {
-          return NULL;
-        }
-      }
+    if ((i = u_map_find(u_map, key, 0)) != -1 && u_map->lengths[i] > 0) {
+      return u_map->values[i];
+    } else {
+      return NULL;
     }
-    return NULL;
   } else {
     return NULL;
   }
@@ -469,13 +687,8 @@ const char * u_map_get(const struct _u_map * u_map, const char * key) {
  * search is case insensitive
  */
 int u_map_has_key_case(const struct _u_map * u_map, const char * key) {
-  int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcasecmp(u_map->keys[i], key)) {
-        return 1;
-      }
-    }
+    return u_map_find(u_map, key, 1) != -1;
   }
   return 0;
 }
@@ -505,10 +718,8 @@ int u_map_has_value_case(const struct _u_map * u_map, const char * value) {
 const char * u_map_get_case(const struct _u_map * u_map, const char * key) {
   int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcasecmp(u_map->keys[i], key)) {
-        return u_map->values[i];
-      }
+    if ((i = u_map_find(u_map, key, 1)) != -1) {
+      return u_map->values[i];
     }
     return NULL;
   } else {
@@ -524,10 +735,8 @@ const char * u_map_get_case(const struct _u_map * u_map, const char * key) {
 ssize_t u_map_get_length(const struct _u_map * u_map, const char * key) {
   int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcmp(u_map->keys[i], key)) {
-        return u_map->lengths[i];
-      }
+    if ((i = u_map_find(u_map, key, 0)) != -1) {
+      return u_map->lengths[i];
     }
     return -1;
   } else {
@@ -543,10 +752,8 @@ ssize_t u_map_get_length(const struct _u_map * u_map, const char * key) {
 ssize_t u_map_get_case_length(const struct _u_map * u_map, const char * key) {
   int i;
   if (u_map != NULL && key != NULL) {
-    for (i=0; u_map->keys[i] != NULL; i++) {
-      if (0 == o_strcasecmp(u_map->keys[i], key)) {
-        return u_map->lengths[i];
-      }
+    if ((i = u_map_find(u_map, key, 1)) != -1) {
+      return u_map->lengths[i];
     }
     return -1;
   } else {
@@ -627,7 +834,8 @@ int u_map_count(const struct _u_map * source) {
 int u_map_empty(struct _u_map * u_map) {
   int ret = u_map_clean(u_map);
   if (ret == U_OK) {
-    return u_map_init(u_map);
+    // The map stays in its arena
+    return u_map_init_arena(u_map, (struct _u_arena *)u_map->arena);
   } else {
     return ret;
   }
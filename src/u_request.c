@@ -24,273 +24,45 @@
  */
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <unistd.h>
 
 #include "u_private.h"
 #include "ulfius.h"
 
-#ifdef _MSC_VER
-#define strtok_r strtok_s
-#endif
-
-/**
- * Splits the url to an array of char *
- */
-static char ** ulfius_split_url(const char * prefix, const char * url) {
-  char * saveptr = NULL, * cur_word = NULL, ** to_return = o_malloc(sizeof(char*)), * url_cpy = NULL, * url_cpy_addr = NULL;
-  int counter = 1;
-  
-  if (to_return != NULL) {
-    to_return[0] = NULL;
-    if (prefix != NULL) {
-      url_cpy = url_cpy_addr = o_strdup(prefix);
-      cur_word = strtok_r( url_cpy, ULFIUS_URL_SEPARATOR, &saveptr );
-      while (cur_word != NULL) {
-        to_return = o_realloc(to_return, (counter+1)*sizeof(char*));
-        if (to_return == NULL) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for ulfius_split_url.to_return");
-          break;
-        }
-        to_return[counter-1] = o_strdup(cur_word);
-        if (to_return[counter-1] == NULL) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for ulfius_split_url.to_return[counter-1]");
-          break;
-        }
-        to_return[counter] = NULL;
-        counter++;
-        cur_word = strtok_r( NULL, ULFIUS_URL_SEPARATOR, &saveptr );
-      }
-      o_free(url_cpy_addr);
-      url_cpy_addr = NULL;
-    }
-    if (url != NULL) {
-      url_cpy = url_cpy_addr = o_strdup(url);
-      cur_word = strtok_r( url_cpy, ULFIUS_URL_SEPARATOR, &saveptr );
-      while (cur_word != NULL) {
-        if (0 != o_strcmp("", cur_word) && cur_word[0] != '?') {
-          to_return = o_realloc(to_return, (counter+1)*sizeof(char*));
-          if (to_return == NULL) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for ulfius_split_url.to_return");
-            break;
-          }
-          to_return[counter-1] = o_strdup(cur_word);
-          if (to_return[counter-1] == NULL) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for ulfius_split_url.to_return[counter-1]");
-            break;
-          }
-          to_return[counter] = NULL;
-          counter++;
-        }
-        cur_word = strtok_r( NULL, ULFIUS_URL_SEPARATOR, &saveptr );
-      }
-      o_free(url_cpy_addr);
-      url_cpy_addr = NULL;
-    }
-  } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for ulfius_split_url.to_return");
-  }
-  return to_return;
-}
-
-/**
- * Compare two endoints by their priorities
- * Used by qsort to compare endpoints
- */
-static int compare_endpoint_priorities(const void * a, const void * b) {
-  struct _u_endpoint * e1 = *(struct _u_endpoint **)a, * e2 = *(struct _u_endpoint **)b;
-  
-  if (e1->priority < e2->priority) {
-    return -1;
-  } else if (e1->priority > e2->priority) {
-    return 1;
-  } else {
-    return 0;
-  }
-}
-
 /**
- * ulfius_url_format_match
- * return true if splitted_url matches splitted_url_format
- * false otherwise
+ * ulfius_init_request_values
+ * Initialize the elements of a request structure except the maps
  */
-static int ulfius_url_format_match(const char ** splitted_url, const char ** splitted_url_format) {
-  int i;
-  
-  for (i=0; splitted_url_format[i] != NULL; i++) {
-    if (splitted_url_format[i][0] == '*' && splitted_url_format[i+1] == NULL) {
-      return 1;
-    }
-    if (splitted_url[i] == NULL || (splitted_url_format[i][0] != '@' && splitted_url_format[i][0] != ':' && 0 != o_strcmp(splitted_url_format[i], splitted_url[i]))) {
-      return 0;
-    }
-  }
-  return (splitted_url[i] == NULL && splitted_url_format[i] == NULL);
-}
-
-/**
- * Converts a hex character to its integer value
- */
-static char from_hex(char ch) {
-  return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
-}
-
-/**
- * Returns a url-decoded version of str
- * IMPORTANT: be sure to free() the returned string after use
- * Thanks Geek Hideout!
- * http://www.geekhideout.com/urlcode.shtml
- */
-static char * url_decode(const char * str) {
-  if (str != NULL) {
-    char * pstr = (char*)str, * buf = malloc(strlen(str) + 1), * pbuf = buf;
-    while (* pstr) {
-      if (* pstr == '%') {
-        if (pstr[1] && pstr[2]) {
-          * pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
-          pstr += 2;
-        }
-      } else if (* pstr == '+') { 
-        * pbuf++ = ' ';
-      } else {
-        * pbuf++ = * pstr;
-      }
-      pstr++;
-    }
-    * pbuf = '\0';
-    return buf;
-  } else {
-    return NULL;
-  }
-}
-
-/**
- * ulfius_endpoint_match
- * return the endpoint array matching the url called with the proper http method
- * the returned array always has its last value to NULL
- * return NULL on memory error
- * returned value must be free'd after use
- */
-struct _u_endpoint ** ulfius_endpoint_match(const char * method, const char * url, struct _u_endpoint * endpoint_list) {
-  char ** splitted_url, ** splitted_url_format;
-  struct _u_endpoint ** endpoint_returned = o_malloc(sizeof(struct _u_endpoint *));
-  int i;
-  size_t count = 0;
-  
-  if (endpoint_returned == NULL) {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for endpoint_returned");
-  } else {
-    endpoint_returned[0] = NULL;
-    if (method != NULL && url != NULL && endpoint_list != NULL) {
-      splitted_url = ulfius_split_url(url, NULL);
-      for (i=0; (splitted_url != NULL && !ulfius_equals_endpoints(&(endpoint_list[i]), ulfius_empty_endpoint())); i++) {
-        if (0 == o_strcasecmp(endpoint_list[i].http_method, method) || endpoint_list[i].http_method[0] == '*') {
-          splitted_url_format = ulfius_split_url(endpoint_list[i].url_prefix, endpoint_list[i].url_format);
-          if (splitted_url_format != NULL && ulfius_url_format_match((const char **)splitted_url, (const char **)splitted_url_format)) {
-            endpoint_returned = o_realloc(endpoint_returned, (count+2)*sizeof(struct _u_endpoint *));
-            if (endpoint_returned != NULL) {
-              endpoint_returned[count] = o_malloc(sizeof(struct _u_endpoint));
-              if (endpoint_returned[count] != NULL) {
-                if (ulfius_copy_endpoint(endpoint_returned[count], (endpoint_list + i)) != U_OK) {
-                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_copy_endpoint for endpoint_returned[%zu]", count);
-                }
-              } else {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for endpoint_returned[%zu]", count);
-              }
-              endpoint_returned[count + 1] = NULL;
-            } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reallocating memory for endpoint_returned");
-            }
-            count++;
-            u_map_clean_enum(splitted_url_format);
-            splitted_url_format = NULL;
-          }
-          u_map_clean_enum(splitted_url_format);
-          splitted_url_format = NULL;
-        }
-      }
-      u_map_clean_enum(splitted_url);
-      splitted_url = NULL;
-    }
-  }
-  /* 
-   * only sort if endpoint_returned is != NULL
-   * can be NULL either after initial o_malloc() or after o_realloc()
-   */
-  if (endpoint_returned != NULL) {
-    qsort(endpoint_returned, count, sizeof(struct endpoint_list *), &compare_endpoint_priorities);
-  }
-  return endpoint_returned;
-}
-
-/**
- * ulfius_parse_url
- * fills map with the keys/values defined in the url that are described in the endpoint format url
- * return U_OK on success
- */
-int ulfius_parse_url(const char * url, const struct _u_endpoint * endpoint, struct _u_map * map, int check_utf8) {
-  char * saveptr = NULL, * cur_word = NULL, * url_cpy = NULL, * url_cpy_addr = NULL;
-  char * saveptr_format = NULL, * saveptr_prefix = NULL, * cur_word_format = NULL, * url_format_cpy = NULL, * url_format_cpy_addr = NULL, * concat_url_param = NULL;
-
-  if (map != NULL && endpoint != NULL) {
-    url_cpy = url_cpy_addr = o_strdup(url);
-    url_format_cpy = url_format_cpy_addr = o_strdup(endpoint->url_prefix);
-    cur_word = url_decode(strtok_r( url_cpy, ULFIUS_URL_SEPARATOR, &saveptr ));
-    if (endpoint->url_prefix != NULL && url_format_cpy == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for url_format_cpy");
-    } else if (url_format_cpy != NULL) {
-      cur_word_format = strtok_r( url_format_cpy, ULFIUS_URL_SEPARATOR, &saveptr_prefix );
-    }
-    while (cur_word_format != NULL && cur_word != NULL) {
-      // Ignoring url_prefix words
-      o_free(cur_word);
-      cur_word = url_decode(strtok_r( NULL, ULFIUS_URL_SEPARATOR, &saveptr ));
-      cur_word_format = strtok_r( NULL, ULFIUS_URL_SEPARATOR, &saveptr_prefix );
-    }
-    o_free(url_format_cpy_addr);
-    
-    url_format_cpy = url_format_cpy_addr = o_strdup(endpoint->url_format);
-    if (endpoint->url_format != NULL && url_format_cpy == NULL) {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for url_format_cpy");
-      return U_ERROR_MEMORY;
-    } else if (url_format_cpy != NULL) {
-      cur_word_format = strtok_r( url_format_cpy, ULFIUS_URL_SEPARATOR, &saveptr_format );
-    }
-    while (cur_word_format != NULL && cur_word != NULL) {
-      if ((cur_word_format[0] == ':' || cur_word_format[0] == '@') && (!check_utf8 || utf8_check(cur_word) == NULL)) {
-        if (u_map_has_key(map, cur_word_format+1)) {
-          concat_url_param = msprintf("%s,%s", u_map_get(map, cur_word_format+1), cur_word);
-          if (concat_url_param == NULL) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for concat_url_param");
-            o_free(url_cpy_addr);
-            o_free(url_format_cpy_addr);
-            return U_ERROR_MEMORY;
-          } else if (u_map_put(map, cur_word_format+1, concat_url_param) != U_OK) {
-            url_cpy_addr = NULL;
-            url_format_cpy_addr = NULL;
-            return U_ERROR_MEMORY;
-          }
-          o_free(concat_url_param);
-        } else {
-          if (u_map_put(map, cur_word_format+1, cur_word) != U_OK) {
-            url_cpy_addr = NULL;
-            url_format_cpy_addr = NULL;
-            return U_ERROR_MEMORY;
-          }
-        }
-      }
-      o_free(cur_word);
-      cur_word = url_decode(strtok_r( NULL, ULFIUS_URL_SEPARATOR, &saveptr ));
-      cur_word_format = strtok_r( NULL, ULFIUS_URL_SEPARATOR, &saveptr_format );
-    }
-    o_free(cur_word);
-    o_free(url_cpy_addr);
-    o_free(url_format_cpy_addr);
-    url_cpy_addr = NULL;
-    url_format_cpy_addr = NULL;
-    return U_OK;
-  } else {
-    return U_ERROR_PARAMS;
-  }
+static void ulfius_init_request_values(struct _u_request * request) {
+  request->auth_basic_user = NULL;
+  request->auth_basic_password = NULL;
+  request->http_protocol = NULL;
+  request->http_verb = NULL;
+  request->http_url = NULL;
+  request->url_path = NULL;
+  request->proxy = NULL;
+#if MHD_VERSION >= 0x00095208
+  request->network_type = U_USE_ALL;
+#endif
+  request->timeout = 0L;
+  request->check_server_certificate = 1;
+  request->check_server_certificate_flag = U_SSL_VERIFY_PEER|U_SSL_VERIFY_HOSTNAME;
+  request->check_proxy_certificate = 1;
+  request->check_proxy_certificate_flag = U_SSL_VERIFY_PEER|U_SSL_VERIFY_HOSTNAME;
+  request->follow_redirect = 0;
+  request->ca_path = NULL;
+  request->client_address = NULL;
+  request->binary_body = NULL;
+  request->binary_body_length = 0;
+  request->body_fd = -1;
+  request->body_fd_length = 0;
+  request->callback_position = 0;
+#ifndef U_DISABLE_GNUTLS
+  request->client_cert = NULL;
+  request->client_cert_file = NULL;
+  request->client_key_file = NULL;
+  request->client_key_password = NULL;
+#endif
 }
 
 /**
@@ -316,32 +88,68 @@ int ulfius_init_request(struct _u_request * request) {
     u_map_init(request->map_header);
     u_map_init(request->map_cookie);
     u_map_init(request->map_post_body);
+    ulfius_init_request_values(request);
+    return U_OK;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
+/**
+ * ulfius_init_arena_request
+ * Initialize a request structure whose maps are allocated in the arena
+ * http_protocol, http_verb, http_url, url_path and client_address must be allocated in the arena too
+ * return U_OK on success
+ * request must be cleaned with ulfius_clean_arena_request after use
+ */
+int ulfius_init_arena_request(struct _u_arena * arena, struct _u_request * request) {
+  struct _u_map * maps;
+  
+  if (arena != NULL && request != NULL) {
+    // The 4 maps are allocated at once
+    if ((maps = ulfius_arena_alloc(arena, 4*sizeof(struct _u_map))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for request->map*");
+      return U_ERROR_MEMORY;
+    }
+    request->map_url = &maps[0];
+    request->map_header = &maps[1];
+    request->map_cookie = &maps[2];
+    request->map_post_body = &maps[3];
+    // The post body values can be large and grow chunk by chunk, they stay on the heap
+    u_map_init_arena(request->map_url, arena);
+    u_map_init_arena(request->map_header, arena);
+    u_map_init_arena(request->map_cookie, arena);
+    u_map_init(request->map_post_body);
+    ulfius_init_request_values(request);
+    return U_OK;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
+/**
+ * ulfius_clean_arena_request
+ * clean the elements of a request initialized with ulfius_init_arena_request
+ * that aren't allocated in the arena
+ * return U_OK on success
+ */
+int ulfius_clean_arena_request(struct _u_request * request) {
+  if (request != NULL) {
+    u_map_clean(request->map_url);
+    u_map_clean(request->map_header);
+    u_map_clean(request->map_cookie);
+    u_map_clean(request->map_post_body);
+    // Detach the elements allocated in the arena, then clean the other ones
+    request->map_url = NULL;
+    request->map_header = NULL;
+    request->map_cookie = NULL;
+    request->map_post_body = NULL;
     request->http_protocol = NULL;
     request->http_verb = NULL;
     request->http_url = NULL;
     request->url_path = NULL;
-    request->proxy = NULL;
-#if MHD_VERSION >= 0x00095208
-    request->network_type = U_USE_ALL;
-#endif
-    request->timeout = 0L;
-    request->check_server_certificate = 1;
-    request->check_server_certificate_flag = U_SSL_VERIFY_PEER|U_SSL_VERIFY_HOSTNAME;
-    request->check_proxy_certificate = 1;
-    request->check_proxy_certificate_flag = U_SSL_VERIFY_PEER|U_SSL_VERIFY_HOSTNAME;
-    request->follow_redirect = 0;
-    request->ca_path = NULL;
     request->client_address = NULL;
-    request->binary_body = NULL;
-    request->binary_body_length = 0;
-    request->callback_position = 0;
-#ifndef U_DISABLE_GNUTLS
-    request->client_cert = NULL;
-    request->client_cert_file = NULL;
-    request->client_key_file = NULL;
-    request->client_key_password = NULL;
-#endif
-    return U_OK;
+    return ulfius_clean_request(request);
   } else {
     return U_ERROR_PARAMS;
   }
@@ -370,6 +178,9 @@ int ulfius_clean_request(struct _u_request * request) {
     u_map_clean_full(request->map_cookie);
     u_map_clean_full(request->map_post_body);
     o_free(request->binary_body);
+    if (request->body_fd >= 0) {
+      close(request->body_fd);
+    }
     request->http_protocol = NULL;
     request->http_verb = NULL;
     request->http_url = NULL;
@@ -380,6 +191,8 @@ int ulfius_clean_request(struct _u_request * request) {
     request->map_cookie = NULL;
     request->map_post_body = NULL;
     request->binary_body = NULL;
+    request->body_fd = -1;
+    request->body_fd_length = 0;
 #ifndef U_DISABLE_GNUTLS
     gnutls_x509_crt_deinit(request->client_cert);
     o_free(request->client_cert_file);
@@ -494,6 +307,14 @@ int ulfius_copy_request(struct _u_request * dest, const struct _u_request * sour
           ret = U_ERROR_MEMORY;
         }
       }
+      if (source->body_fd >= 0) {
+        if ((dest->body_fd = dup(source->body_fd)) >= 0) {
+          dest->body_fd_length = source->body_fd_length;
+        } else {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error duplicating source->body_fd");
+          ret = U_ERROR;
+        }
+      }
     }
 
 #ifndef U_DISABLE_GNUTLS
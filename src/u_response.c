@@ -23,10 +23,59 @@
  * 
  */
 #include <string.h>
+#include <unistd.h>
 
 #include "u_private.h"
 #include "ulfius.h"
 
+/**
+ * ulfius_release_static_body
+ * release callback of the bodies that don't need to be free'd
+ */
+static void ulfius_release_static_body(void * release_cls) {
+  UNUSED(release_cls);
+}
+
+/**
+ * ulfius_free_body_segments
+ * Release the data of the segments and free the segments array
+ */
+void ulfius_free_body_segments(struct _u_body_segment * segments, size_t nb_segments) {
+  size_t i;
+  
+  for (i=0; i<nb_segments; i++) {
+    if (segments[i].release_callback != NULL) {
+      segments[i].release_callback((void *)segments[i].data);
+    }
+  }
+  o_free(segments);
+}
+
+/**
+ * ulfius_clean_response_body
+ * Free the body of the response, or run its release callback if the body isn't owned by the response
+ */
+static void ulfius_clean_response_body(struct _u_response * response) {
+  if (response->binary_body_free != NULL) {
+    response->binary_body_free(response->binary_body_free_cls);
+  } else {
+    o_free(response->binary_body);
+  }
+  response->binary_body = NULL;
+  response->binary_body_length = 0;
+  response->binary_body_free = NULL;
+  response->binary_body_free_cls = NULL;
+  ulfius_free_body_segments(response->body_segments, response->nb_body_segments);
+  response->body_segments = NULL;
+  response->nb_body_segments = 0;
+  if (response->body_fd >= 0) {
+    close(response->body_fd);
+  }
+  response->body_fd = -1;
+  response->body_fd_offset = 0;
+  response->body_fd_length = 0;
+}
+
 /**
  * Add a cookie in the cookie map as defined in the RFC 6265
  * Returned value must be free'd after use
@@ -379,10 +428,9 @@ int ulfius_clean_response(struct _u_response * response) {
     }
     o_free(response->auth_realm);
     o_free(response->map_cookie);
-    o_free(response->binary_body);
+    ulfius_clean_response_body(response);
     response->auth_realm = NULL;
     response->map_cookie = NULL;
-    response->binary_body = NULL;
 #ifndef U_DISABLE_WEBSOCKET
     /* ulfius_clean_response might be called without websocket_handle being initialized */
     if ((struct _websocket_handle *)response->websocket_handle) {
@@ -433,6 +481,13 @@ int ulfius_init_response(struct _u_response * response) {
     response->protocol = NULL;
     response->binary_body = NULL;
     response->binary_body_length = 0;
+    response->binary_body_free = NULL;
+    response->binary_body_free_cls = NULL;
+    response->body_segments = NULL;
+    response->nb_body_segments = 0;
+    response->body_fd = -1;
+    response->body_fd_offset = 0;
+    response->body_fd_length = 0;
     response->stream_callback = NULL;
     response->stream_size = U_STREAM_SIZE_UNKOWN;
     response->stream_block_size = ULFIUS_STREAM_BLOCK_SIZE_DEFAULT;
@@ -468,6 +523,7 @@ int ulfius_init_response(struct _u_response * response) {
  */
 int ulfius_copy_response(struct _u_response * dest, const struct _u_response * source) {
   unsigned int i;
+  size_t body_length;
   if (dest != NULL && source != NULL) {
     dest->status = source->status;
     dest->protocol = o_strdup(source->protocol);
@@ -503,6 +559,32 @@ int ulfius_copy_response(struct _u_response * dest, const struct _u_response * s
       }
       dest->binary_body_length = source->binary_body_length;
       memcpy(dest->binary_body, source->binary_body, source->binary_body_length);
+    } else if (source->nb_body_segments > 0) {
+      // The copy of a segmented body is a single binary_body
+      for (i=0, body_length=0; i<source->nb_body_segments; i++) {
+        body_length += source->body_segments[i].length;
+      }
+      if (body_length > 0) {
+        dest->binary_body = o_malloc(body_length);
+        if (dest->binary_body == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for dest->binary_body");
+          return U_ERROR_MEMORY;
+        }
+        for (i=0; i<source->nb_body_segments; i++) {
+          memcpy((char *)dest->binary_body + dest->binary_body_length, source->body_segments[i].data, source->body_segments[i].length);
+          dest->binary_body_length += source->body_segments[i].length;
+        }
+      }
+    }
+    
+    if (source->body_fd >= 0) {
+      dest->body_fd = dup(source->body_fd);
+      if (dest->body_fd == -1) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error duplicating source->body_fd");
+        return U_ERROR;
+      }
+      dest->body_fd_offset = source->body_fd_offset;
+      dest->body_fd_length = source->body_fd_length;
     }
     
     if (source->stream_callback != NULL) {
@@ -569,7 +651,7 @@ struct _u_response * ulfius_duplicate_response(const struct _u_response * respon
 int ulfius_set_string_body_response(struct _u_response * response, const unsigned int status, const char * string_body) {
   if (response != NULL && string_body != NULL) {
     // Free all the bodies available
-    o_free(response->binary_body);
+    ulfius_clean_response_body(response);
     response->binary_body = o_strdup(string_body);
     if (response->binary_body == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for response->binary_body");
@@ -592,9 +674,7 @@ int ulfius_set_string_body_response(struct _u_response * response, const unsigne
 int ulfius_set_binary_body_response(struct _u_response * response, const unsigned int status, const char * binary_body, const size_t length) {
   if (response != NULL && binary_body != NULL && length > 0) {
     // Free all the bodies available
-    o_free(response->binary_body);
-    response->binary_body = NULL;
-    response->binary_body_length = 0;
+    ulfius_clean_response_body(response);
 
     response->binary_body = o_malloc(length);
     if (response->binary_body == NULL) {
@@ -610,6 +690,83 @@ int ulfius_set_binary_body_response(struct _u_response * response, const unsigne
   }
 }
 
+/**
+ * ulfius_set_buffer_body_response
+ * Set a body to a response without copying it
+ * binary_body must be kept unchanged until release_callback is called with release_cls
+ * release_callback may be NULL if binary_body doesn't need to be released
+ * return U_OK on success
+ */
+int ulfius_set_buffer_body_response(struct _u_response * response, const unsigned int status, const void * binary_body, const size_t length, void (* release_callback)(void * release_cls), void * release_cls) {
+  if (response != NULL && binary_body != NULL && length > 0) {
+    // Free all the bodies available
+    ulfius_clean_response_body(response);
+    
+    response->binary_body = (void *)binary_body;
+    response->binary_body_length = length;
+    response->binary_body_free = release_callback!=NULL?release_callback:&ulfius_release_static_body;
+    response->binary_body_free_cls = release_cls;
+    response->status = status;
+    return U_OK;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
+/**
+ * ulfius_set_segmented_body_response
+ * Set a body made of several segments to a response
+ * The segments array is copied, the segments data are sent without copy
+ * and released with their release_callback when the response is complete
+ * return U_OK on success
+ */
+int ulfius_set_segmented_body_response(struct _u_response * response, const unsigned int status, const struct _u_body_segment * segments, const size_t nb_segments) {
+  size_t i;
+  
+  if (response != NULL && segments != NULL && nb_segments > 0) {
+    for (i=0; i<nb_segments; i++) {
+      if (segments[i].data == NULL && segments[i].length > 0) {
+        return U_ERROR_PARAMS;
+      }
+    }
+    // Free all the bodies available
+    ulfius_clean_response_body(response);
+    
+    response->body_segments = o_malloc(nb_segments*sizeof(struct _u_body_segment));
+    if (response->body_segments == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for response->body_segments");
+      return U_ERROR_MEMORY;
+    }
+    memcpy(response->body_segments, segments, nb_segments*sizeof(struct _u_body_segment));
+    response->nb_body_segments = nb_segments;
+    response->status = status;
+    return U_OK;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
+/**
+ * ulfius_set_file_response
+ * Set a body read from a file to a response
+ * The response takes the ownership of fd and closes it when the response is complete
+ * return U_OK on success
+ */
+int ulfius_set_file_response(struct _u_response * response, const unsigned int status, int fd, uint64_t offset, uint64_t length) {
+  if (response != NULL && fd >= 0) {
+    // Free all the bodies available
+    ulfius_clean_response_body(response);
+    
+    response->body_fd = fd;
+    response->body_fd_offset = offset;
+    response->body_fd_length = length;
+    response->status = status;
+    return U_OK;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
 /**
  * ulfius_set_empty_body_response
  * Set an empty response with only a status
@@ -618,9 +775,7 @@ int ulfius_set_binary_body_response(struct _u_response * response, const unsigne
 int ulfius_set_empty_body_response(struct _u_response * response, const unsigned int status) {
   if (response != NULL) {
     // Free all the bodies available
-    o_free(response->binary_body);
-    response->binary_body = NULL;
-    response->binary_body_length = 0;
+    ulfius_clean_response_body(response);
     
     response->status = status;
     return U_OK;
@@ -633,7 +788,8 @@ int ulfius_set_empty_body_response(struct _u_response * response, const unsigned
  * ulfius_set_stream_response
  * Set an stream response with a status
  * set stream_size to -1 if unknown
- * set stream_block_size to a proper value based on the system
+ * set stream_block_size to a proper value based on the system,
+ * or to 0 to use the instance stream_block_size
  * return U_OK on success
  */
 int ulfius_set_stream_response(struct _u_response * response, 
@@ -645,15 +801,15 @@ int ulfius_set_stream_response(struct _u_response * response,
                                 void * stream_user_data) {
   if (response != NULL && stream_callback != NULL) {
     // Free all the bodies available
-    o_free(response->binary_body);
-    response->binary_body = NULL;
-    response->binary_body_length = 0;
+    ulfius_clean_response_body(response);
     
     response->status = status;
     response->stream_callback = stream_callback;
     response->stream_callback_free = stream_callback_free;
     response->stream_size = stream_size;
-    response->stream_block_size = stream_block_size;
+    if (stream_block_size) {
+      response->stream_block_size = stream_block_size;
+    }
     response->stream_user_data = stream_user_data;
     return U_OK;
   } else {
@@ -670,9 +826,7 @@ int ulfius_set_stream_response(struct _u_response * response,
 int ulfius_set_json_body_response(struct _u_response * response, const unsigned int status, const json_t * j_body) {
   if (response != NULL && j_body != NULL && (json_is_array(j_body) || json_is_object(j_body))) {
     // Free all the bodies available
-    o_free(response->binary_body);
-    response->binary_body = NULL;
-    response->binary_body_length = 0;
+    ulfius_clean_response_body(response);
 
     response->binary_body = (void*) json_dumps(j_body, JSON_COMPACT);
     if (response->binary_body == NULL) {
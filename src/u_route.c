@@ -0,0 +1,678 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_route.c: endpoints routing functions definitions
+ *
+ * Copyright 2020 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sched.h>
+
+#include "u_private.h"
+#include "ulfius.h"
+
+/**
+ * Return the next segment of the url or NULL if there is no segment left
+ * The separators before the segment are skipped
+ * *url is moved after the segment, *len is set to the segment length
+ */
+static const char * ulfius_route_next_segment(const char ** url, size_t * len) {
+  const char * segment;
+
+  if (*url == NULL) {
+    return NULL;
+  }
+  segment = *url + strspn(*url, ULFIUS_URL_SEPARATOR);
+  *len = strcspn(segment, ULFIUS_URL_SEPARATOR);
+  *url = segment + *len;
+  return *len?segment:NULL;
+}
+
+/**
+ * Return the next segment of an endpoint format, i.e. url_prefix segments then url_format segments
+ * url_format segments starting with '?' are ignored
+ * *is_format is set to 1 if the segment is part of the url_format
+ */
+static const char * ulfius_route_next_format_segment(const char ** url_prefix, const char ** url_format, size_t * len, int * is_format) {
+  const char * segment;
+
+  *is_format = 0;
+  if ((segment = ulfius_route_next_segment(url_prefix, len)) == NULL) {
+    *is_format = 1;
+    do {
+      segment = ulfius_route_next_segment(url_format, len);
+    } while (segment != NULL && segment[0] == '?');
+  }
+  return segment;
+}
+
+/**
+ * Compare the '\0'-terminated node segment with the url segment of length len
+ */
+static int ulfius_route_segment_cmp(const char * node_segment, const char * segment, size_t len) {
+  int ret = strncmp(node_segment, segment, len);
+
+  if (!ret && node_segment[len] != '\0') {
+    ret = 1;
+  }
+  return ret;
+}
+
+/**
+ * Look for the static child of node whose segment is the one specified
+ * Children are sorted by segment value
+ * return the child index if found, otherwise set *found to 0 and return the index where the child should be inserted
+ */
+static size_t ulfius_route_node_find_child(const struct _u_route_node * node, const char * segment, size_t len, int * found) {
+  size_t low = 0, high = node->nb_children, middle;
+  int cmp;
+
+  *found = 0;
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    cmp = ulfius_route_segment_cmp(node->children[middle]->segment, segment, len);
+    if (!cmp) {
+      *found = 1;
+      return middle;
+    } else if (cmp < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+/**
+ * Allocate a new node, segment may be NULL for parameter nodes
+ */
+static struct _u_route_node * ulfius_route_new_node(const char * segment, size_t len) {
+  struct _u_route_node * node = o_malloc(sizeof(struct _u_route_node));
+
+  if (node != NULL) {
+    memset(node, 0, sizeof(struct _u_route_node));
+    if (segment != NULL && (node->segment = o_strndup(segment, len)) == NULL) {
+      o_free(node);
+      node = NULL;
+    }
+  }
+  if (node == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for route node");
+  }
+  return node;
+}
+
+/**
+ * Return the child of node matching the format segment, create it if it doesn't exist
+ */
+static struct _u_route_node * ulfius_route_node_get_child(struct _u_route_node * node, const char * segment, size_t len) {
+  struct _u_route_node * child = NULL, ** children;
+  size_t index;
+  int found;
+
+  if (segment[0] == ':' || segment[0] == '@') {
+    if (node->param_child == NULL) {
+      node->param_child = ulfius_route_new_node(NULL, 0);
+    }
+    child = node->param_child;
+  } else {
+    index = ulfius_route_node_find_child(node, segment, len, &found);
+    if (found) {
+      child = node->children[index];
+    } else if ((children = o_realloc(node->children, (node->nb_children + 1) * sizeof(struct _u_route_node *))) != NULL) {
+      node->children = children;
+      if ((child = ulfius_route_new_node(segment, len)) != NULL) {
+        memmove(node->children + index + 1, node->children + index, (node->nb_children - index) * sizeof(struct _u_route_node *));
+        node->children[index] = child;
+        node->nb_children++;
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for node->children");
+    }
+  }
+  return child;
+}
+
+/**
+ * Append a route to a route list
+ * return U_OK on success
+ */
+static int ulfius_route_list_append(struct _u_route *** route_list, size_t * nb_routes, struct _u_route * route) {
+  struct _u_route ** new_list = o_realloc(*route_list, (*nb_routes + 1) * sizeof(struct _u_route *));
+
+  if (new_list != NULL) {
+    new_list[*nb_routes] = route;
+    *route_list = new_list;
+    (*nb_routes)++;
+    return U_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for route_list");
+    return U_ERROR_MEMORY;
+  }
+}
+
+/**
+ * Add a url parameter to the route
+ * return U_OK on success
+ */
+static int ulfius_route_add_param(struct _u_route * route, size_t segment_index, const char * name, size_t len) {
+  struct _u_route_param * params = o_realloc(route->params, (route->nb_params + 1) * sizeof(struct _u_route_param));
+
+  if (params != NULL) {
+    route->params = params;
+    if ((params[route->nb_params].name = o_strndup(name, len)) != NULL) {
+      params[route->nb_params].segment = segment_index;
+      route->nb_params++;
+      return U_OK;
+    }
+  }
+  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for route->params");
+  return U_ERROR_MEMORY;
+}
+
+/**
+ * Compile the url_prefix and url_format of the route endpoint in the route tree
+ * A format segment starting with '*' at the end of the format matches the rest of the url
+ * The url_format segments starting with ':' or '@' are added to the route parameters
+ * return U_OK on success
+ */
+static int ulfius_route_table_insert(struct _u_route_table * route_table, struct _u_route * route) {
+  struct _u_route_node * node = &route_table->root;
+  const char * url_prefix = route->endpoint->url_prefix, * url_format = route->endpoint->url_format, * segment, * next_segment;
+  size_t len, next_len, depth = 0;
+  int is_format, next_is_format;
+
+  segment = ulfius_route_next_format_segment(&url_prefix, &url_format, &len, &is_format);
+  while (segment != NULL) {
+    next_segment = ulfius_route_next_format_segment(&url_prefix, &url_format, &next_len, &next_is_format);
+    if (segment[0] == '*' && next_segment == NULL) {
+      return ulfius_route_list_append(&node->wildcard_routes, &node->nb_wildcard_routes, route);
+    } else if ((node = ulfius_route_node_get_child(node, segment, len)) == NULL) {
+      return U_ERROR_MEMORY;
+    } else if (is_format && (segment[0] == ':' || segment[0] == '@') && ulfius_route_add_param(route, depth, segment + 1, len - 1) != U_OK) {
+      return U_ERROR_MEMORY;
+    }
+    segment = next_segment;
+    len = next_len;
+    is_format = next_is_format;
+    depth++;
+  }
+  return ulfius_route_list_append(&node->routes, &node->nb_routes, route);
+}
+
+/**
+ * Free the content of a route node and its children
+ */
+static void ulfius_route_node_clean(struct _u_route_node * node) {
+  size_t i;
+
+  for (i=0; i<node->nb_children; i++) {
+    ulfius_route_node_clean(node->children[i]);
+    o_free(node->children[i]);
+  }
+  if (node->param_child != NULL) {
+    ulfius_route_node_clean(node->param_child);
+    o_free(node->param_child);
+  }
+  o_free(node->children);
+  o_free(node->segment);
+  o_free(node->routes);
+  o_free(node->wildcard_routes);
+}
+
+/**
+ * ulfius_build_route_table
+ * Compiles the endpoint_list and the default_endpoint into a route tree
+ * The endpoints are copied in the route table, so endpoint_list and default_endpoint
+ * can be modified or free'd while the route table is in use
+ * The route table is immutable and has a reference counter set to 1
+ * return a new route table on success, NULL on memory error
+ * returned value must be released with ulfius_release_route_table after use
+ */
+struct _u_route_table * ulfius_build_route_table(const struct _u_endpoint * endpoint_list, const struct _u_endpoint * default_endpoint) {
+  struct _u_route_table * route_table = o_malloc(sizeof(struct _u_route_table));
+  size_t i, nb_endpoints = 0;
+
+  if (route_table != NULL) {
+    memset(route_table, 0, sizeof(struct _u_route_table));
+    route_table->refcount = 1;
+    if (default_endpoint != NULL && default_endpoint->callback_function != NULL) {
+      route_table->default_endpoint.callback_function = default_endpoint->callback_function;
+      route_table->default_endpoint.user_data = default_endpoint->user_data;
+      route_table->default_endpoint.priority = default_endpoint->priority;
+      route_table->default_endpoint.disable_compression = default_endpoint->disable_compression;
+      route_table->default_endpoint.body_callback = NULL;
+      route_table->default_endpoint.body_file_threshold = 0;
+      route_table->default_route.endpoint = &route_table->default_endpoint;
+    }
+    for (i=0; endpoint_list != NULL && endpoint_list[i].http_method != NULL; i++) {
+      nb_endpoints++;
+    }
+    if (nb_endpoints) {
+      route_table->endpoints = o_malloc(nb_endpoints * sizeof(struct _u_endpoint));
+      route_table->routes = o_malloc(nb_endpoints * sizeof(struct _u_route));
+      if (route_table->endpoints != NULL && route_table->routes != NULL) {
+        for (i=0; i<nb_endpoints; i++) {
+          route_table->routes[i].endpoint = &route_table->endpoints[i];
+          route_table->routes[i].index = i;
+          route_table->routes[i].params = NULL;
+          route_table->routes[i].nb_params = 0;
+          route_table->nb_routes++;
+          if (ulfius_copy_endpoint(&route_table->endpoints[i], &endpoint_list[i]) != U_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_copy_endpoint for route_table->endpoints[%zu]", i);
+            ulfius_release_route_table(route_table);
+            return NULL;
+          }
+          if (ulfius_route_table_insert(route_table, &route_table->routes[i]) != U_OK) {
+            ulfius_release_route_table(route_table);
+            return NULL;
+          }
+          if (route_table->endpoints[i].body_callback != NULL || route_table->endpoints[i].body_file_threshold) {
+            route_table->has_body_handler = 1;
+          }
+        }
+      } else {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for route_table->routes");
+        ulfius_release_route_table(route_table);
+        route_table = NULL;
+      }
+    }
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for route_table");
+  }
+  return route_table;
+}
+
+/**
+ * ulfius_retain_route_table
+ * Increment the reference counter of a route table
+ */
+void ulfius_retain_route_table(struct _u_route_table * route_table) {
+  if (route_table != NULL) {
+    __atomic_add_fetch(&route_table->refcount, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * ulfius_release_route_table
+ * Decrement the reference counter of a route table and free it when it reaches 0
+ */
+void ulfius_release_route_table(struct _u_route_table * route_table) {
+  size_t i, j;
+
+  if (route_table != NULL && !__atomic_sub_fetch(&route_table->refcount, 1, __ATOMIC_ACQ_REL)) {
+    ulfius_route_node_clean(&route_table->root);
+    for (i=0; route_table->endpoints != NULL && i<route_table->nb_routes; i++) {
+      ulfius_clean_endpoint(&route_table->endpoints[i]);
+    }
+    for (i=0; route_table->routes != NULL && i<route_table->nb_routes; i++) {
+      for (j=0; j<route_table->routes[i].nb_params; j++) {
+        o_free(route_table->routes[i].params[j].name);
+      }
+      o_free(route_table->routes[i].params);
+    }
+    o_free(route_table->endpoints);
+    o_free(route_table->routes);
+    o_free(route_table);
+  }
+}
+
+/**
+ * Insert the route in the matching routes list if its http method matches
+ * The list is sorted by priority, then by position in the endpoint list
+ * The list uses match->routes_buffer until it's full
+ * return U_OK on success
+ */
+static int ulfius_route_match_add(struct _u_route_match * match, const char * method, const struct _u_route * route) {
+  const struct _u_route ** routes;
+  size_t i;
+
+  if (0 == o_strcasecmp(route->endpoint->http_method, method) || route->endpoint->http_method[0] == '*') {
+    if (match->nb_routes == match->routes_size) {
+      if (match->routes == match->routes_buffer) {
+        routes = o_malloc(2 * match->routes_size * sizeof(struct _u_route *));
+        if (routes != NULL) {
+          memcpy(routes, match->routes_buffer, match->nb_routes * sizeof(struct _u_route *));
+        }
+      } else {
+        routes = o_realloc(match->routes, 2 * match->routes_size * sizeof(struct _u_route *));
+      }
+      if (routes == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for match->routes");
+        return U_ERROR_MEMORY;
+      }
+      match->routes = routes;
+      match->routes_size *= 2;
+    }
+    for (i=match->nb_routes; i>0 && (match->routes[i-1]->endpoint->priority > route->endpoint->priority || (match->routes[i-1]->endpoint->priority == route->endpoint->priority && match->routes[i-1]->index > route->index)); i--) {
+      match->routes[i] = match->routes[i-1];
+    }
+    match->routes[i] = route;
+    match->nb_routes++;
+  }
+  return U_OK;
+}
+
+/**
+ * Walk the route tree from node to find all the routes matching the url segments starting at depth
+ * return U_OK on success
+ */
+static int ulfius_route_node_match(const struct _u_route_node * node, const char * method, struct _u_route_match * match, size_t depth) {
+  size_t i, index;
+  int found, ret = U_OK;
+
+  for (i=0; i<node->nb_wildcard_routes && ret == U_OK; i++) {
+    ret = ulfius_route_match_add(match, method, node->wildcard_routes[i]);
+  }
+  if (depth == match->nb_segments) {
+    for (i=0; i<node->nb_routes && ret == U_OK; i++) {
+      ret = ulfius_route_match_add(match, method, node->routes[i]);
+    }
+  } else {
+    if (ret == U_OK && node->nb_children) {
+      index = ulfius_route_node_find_child(node, match->segments[depth], match->segments_len[depth], &found);
+      if (found) {
+        ret = ulfius_route_node_match(node->children[index], method, match, depth + 1);
+      }
+    }
+    if (ret == U_OK && node->param_child != NULL) {
+      ret = ulfius_route_node_match(node->param_child, method, match, depth + 1);
+    }
+  }
+  return ret;
+}
+
+/**
+ * ulfius_route_match
+ * Fills match with the routes of route_table matching the url called with the proper http method
+ * match->routes is sorted by priority, if no route matches, match->routes contains the default route if any
+ * match->routes and match->segments point to route_table and url, so both must be kept until match is cleaned
+ * No memory is allocated unless the url has more than U_ROUTE_MATCH_INLINE_SIZE segments
+ * or more than U_ROUTE_MATCH_INLINE_SIZE routes match
+ * return U_OK on success
+ * match must be cleaned with ulfius_clean_route_match after use
+ */
+int ulfius_route_match(const struct _u_route_table * route_table, const char * method, const char * url, struct _u_route_match * match) {
+  const char * cur_url = url;
+  size_t len, i;
+  int ret;
+
+  if (match == NULL) {
+    return U_ERROR_PARAMS;
+  }
+  match->segments = match->segments_buffer;
+  match->segments_len = match->segments_len_buffer;
+  match->nb_segments = 0;
+  match->routes = match->routes_buffer;
+  match->routes_size = U_ROUTE_MATCH_INLINE_SIZE;
+  match->nb_routes = 0;
+  match->decoded = NULL;
+  match->decoded_data = NULL;
+  if (route_table == NULL || method == NULL || url == NULL) {
+    return U_OK;
+  }
+  while (ulfius_route_next_segment(&cur_url, &len) != NULL) {
+    match->nb_segments++;
+  }
+  if (match->nb_segments > U_ROUTE_MATCH_INLINE_SIZE) {
+    match->segments = o_malloc(match->nb_segments * sizeof(char *));
+    match->segments_len = o_malloc(match->nb_segments * sizeof(size_t));
+    if (match->segments == NULL || match->segments_len == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for match->segments");
+      ulfius_clean_route_match(match);
+      return U_ERROR_MEMORY;
+    }
+  }
+  cur_url = url;
+  for (i=0; i<match->nb_segments; i++) {
+    match->segments[i] = ulfius_route_next_segment(&cur_url, &match->segments_len[i]);
+  }
+  ret = ulfius_route_node_match(&route_table->root, method, match, 0);
+  if (ret == U_OK && !match->nb_routes && route_table->default_route.endpoint != NULL) {
+    match->routes[0] = &route_table->default_route;
+    match->nb_routes = 1;
+  }
+  return ret;
+}
+
+/**
+ * ulfius_clean_route_match
+ * Free the content of a match
+ */
+void ulfius_clean_route_match(struct _u_route_match * match) {
+  if (match != NULL) {
+    if (match->segments != match->segments_buffer) {
+      o_free(match->segments);
+    }
+    if (match->segments_len != match->segments_len_buffer) {
+      o_free(match->segments_len);
+    }
+    if (match->routes != match->routes_buffer) {
+      o_free(match->routes);
+    }
+    if (match->decoded != match->decoded_buffer) {
+      o_free(match->decoded);
+    }
+    if (match->decoded_data != match->decoded_data_buffer) {
+      o_free(match->decoded_data);
+    }
+    match->decoded = NULL;
+    match->decoded_data = NULL;
+    match->segments = match->segments_buffer;
+    match->segments_len = match->segments_len_buffer;
+    match->nb_segments = 0;
+    match->routes = match->routes_buffer;
+    match->routes_size = U_ROUTE_MATCH_INLINE_SIZE;
+    match->nb_routes = 0;
+  }
+}
+
+/**
+ * Converts a hex character to its integer value
+ */
+static char ulfius_route_from_hex(char ch) {
+  return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+}
+
+/**
+ * Url-decode the segment of length len in dest, dest must be at least len+1 bytes long
+ */
+static void ulfius_route_decode_segment(const char * segment, size_t len, char * dest) {
+  size_t i;
+
+  for (i=0; i<len; i++) {
+    if (segment[i] == '%') {
+      if (i+2 < len) {
+        *dest++ = ulfius_route_from_hex(segment[i+1]) << 4 | ulfius_route_from_hex(segment[i+2]);
+        i += 2;
+      }
+    } else if (segment[i] == '+') {
+      *dest++ = ' ';
+    } else {
+      *dest++ = segment[i];
+    }
+  }
+  *dest = '\0';
+}
+
+/**
+ * Url-decode all the url segments of the match in a single buffer
+ * If check_utf8 is set, the segments that aren't valid utf8 are set to NULL
+ * return U_OK on success
+ */
+static int ulfius_route_match_decode(struct _u_route_match * match, int check_utf8) {
+  size_t i, data_len = 0;
+  char * cur_data;
+
+  for (i=0; i<match->nb_segments; i++) {
+    data_len += match->segments_len[i] + 1;
+  }
+  match->decoded = match->nb_segments<=U_ROUTE_MATCH_INLINE_SIZE?match->decoded_buffer:o_malloc(match->nb_segments * sizeof(char *));
+  match->decoded_data = data_len<=U_ROUTE_MATCH_DECODED_INLINE_SIZE?match->decoded_data_buffer:o_malloc(data_len);
+  if (match->decoded == NULL || match->decoded_data == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for match->decoded");
+    if (match->decoded != match->decoded_buffer) {
+      o_free(match->decoded);
+    }
+    if (match->decoded_data != match->decoded_data_buffer) {
+      o_free(match->decoded_data);
+    }
+    match->decoded = NULL;
+    match->decoded_data = NULL;
+    return U_ERROR_MEMORY;
+  }
+  cur_data = match->decoded_data;
+  for (i=0; i<match->nb_segments; i++) {
+    ulfius_route_decode_segment(match->segments[i], match->segments_len[i], cur_data);
+    match->decoded[i] = (!check_utf8 || utf8_check(cur_data) == NULL)?cur_data:NULL;
+    cur_data += match->segments_len[i] + 1;
+  }
+  return U_OK;
+}
+
+/**
+ * ulfius_route_match_fill_map_url
+ * fills map with the keys/values of map_initial and the url parameters of route
+ * The url segments are decoded once per match, map is emptied and filled again for each route
+ * because the callback functions may have changed it
+ * return U_OK on success
+ */
+int ulfius_route_match_fill_map_url(struct _u_route_match * match, const struct _u_route * route, const struct _u_map * map_initial, struct _u_map * map, int check_utf8) {
+  const char * value;
+  char * concat_value;
+  size_t i;
+
+  if (match == NULL || route == NULL || map == NULL) {
+    return U_ERROR_PARAMS;
+  }
+  if (route->nb_params && match->decoded == NULL && ulfius_route_match_decode(match, check_utf8) != U_OK) {
+    return U_ERROR_MEMORY;
+  }
+  if (u_map_empty(map) != U_OK || (map_initial != NULL && u_map_copy_into(map, map_initial) != U_OK)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing map_url");
+    return U_ERROR_MEMORY;
+  }
+  for (i=0; i<route->nb_params; i++) {
+    if (route->params[i].segment < match->nb_segments && (value = match->decoded[route->params[i].segment]) != NULL) {
+      if (u_map_has_key(map, route->params[i].name)) {
+        // Repeated parameters values are separated by a comma
+        if ((concat_value = msprintf("%s,%s", u_map_get(map, route->params[i].name), value)) == NULL) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for concat_value");
+          return U_ERROR_MEMORY;
+        } else if (u_map_put(map, route->params[i].name, concat_value) != U_OK) {
+          o_free(concat_value);
+          return U_ERROR_MEMORY;
+        }
+        o_free(concat_value);
+      } else if (u_map_put(map, route->params[i].name, value) != U_OK) {
+        return U_ERROR_MEMORY;
+      }
+    }
+  }
+  return U_OK;
+}
+
+/**
+ * ulfius_init_router
+ * Initialize a router with no route table
+ * return U_OK on success
+ */
+int ulfius_init_router(struct _u_router * router) {
+  if (router == NULL) {
+    return U_ERROR_PARAMS;
+  }
+  router->route_table = NULL;
+  router->epoch = 0;
+  router->readers[0] = 0;
+  router->readers[1] = 0;
+  if (pthread_mutex_init(&router->lock, NULL)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing router->lock");
+    return U_ERROR;
+  }
+  return U_OK;
+}
+
+/**
+ * ulfius_clean_router
+ * Release the current route table of a router and free its resources
+ * No request must be processed with the router anymore
+ */
+void ulfius_clean_router(struct _u_router * router) {
+  if (router != NULL) {
+    ulfius_release_route_table(router->route_table);
+    router->route_table = NULL;
+    pthread_mutex_destroy(&router->lock);
+  }
+}
+
+/**
+ * Wait until all the readers that may have loaded a previous route table pointer
+ * have incremented its reference counter
+ * Each grace period flips the epoch so new readers are counted in the other slot,
+ * then waits for the readers of the previous slot to leave
+ * Two grace periods are needed because a reader may have read the epoch value just before the flip
+ */
+static void ulfius_router_synchronize(struct _u_router * router) {
+  unsigned int epoch, i;
+
+  for (i=0; i<2; i++) {
+    epoch = __atomic_fetch_add(&router->epoch, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&router->readers[epoch & 1], __ATOMIC_SEQ_CST)) {
+      sched_yield();
+    }
+  }
+}
+
+/**
+ * ulfius_router_publish
+ * Replace the current route table of the router with route_table
+ * The router takes the reference of route_table, the previous route table is released
+ * and will be free'd when the last request using it is complete
+ * router->lock must be locked by the caller, readers never lock it
+ */
+void ulfius_router_publish(struct _u_router * router, struct _u_route_table * route_table) {
+  struct _u_route_table * old_route_table;
+
+  old_route_table = __atomic_exchange_n(&router->route_table, route_table, __ATOMIC_SEQ_CST);
+  if (old_route_table != NULL) {
+    ulfius_router_synchronize(router);
+    ulfius_release_route_table(old_route_table);
+  }
+}
+
+/**
+ * ulfius_router_acquire
+ * return the current route table of the router with its reference counter incremented, may be NULL
+ * This function doesn't lock, the reader is counted in the current epoch slot
+ * during the time it loads the route table pointer and increments its reference counter
+ * returned value must be released with ulfius_release_route_table after use
+ */
+struct _u_route_table * ulfius_router_acquire(struct _u_router * router) {
+  struct _u_route_table * route_table;
+  unsigned int slot = __atomic_load_n(&router->epoch, __ATOMIC_SEQ_CST) & 1;
+
+  __atomic_add_fetch(&router->readers[slot], 1, __ATOMIC_SEQ_CST);
+  route_table = __atomic_load_n(&router->route_table, __ATOMIC_SEQ_CST);
+  ulfius_retain_route_table(route_table);
+  __atomic_sub_fetch(&router->readers[slot], 1, __ATOMIC_RELEASE);
+  return route_table;
+}
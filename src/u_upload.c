@@ -0,0 +1,320 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_upload.c: files uploaded in multipart bodies written in the upload file directory
+ *
+ * Copyright 2015-2017 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "u_private.h"
+#include "ulfius.h"
+
+/**
+ * Number of names tried to link an anonymous uploaded file in the upload file directory
+ */
+#define U_UPLOAD_FILE_LINK_RETRIES 16
+
+/**
+ * ulfius_upload_file_open
+ * Open the file storing an uploaded file part in directory
+ * The file is anonymous if the system supports O_TMPFILE, so it disappears if the upload doesn't complete
+ * return U_OK on success
+ */
+static int ulfius_upload_file_open(const char * directory, struct _u_upload_file * file) {
+  char * path;
+
+  file->fd = -1;
+  file->path = NULL;
+#ifdef O_TMPFILE
+  file->fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+#endif
+  if (file->fd == -1) {
+    if ((path = msprintf("%s/ulfius_upload_XXXXXX", directory)) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for upload file path");
+      return U_ERROR_MEMORY;
+    }
+    if ((file->fd = mkstemp(path)) == -1) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating upload file in %s", directory);
+      o_free(path);
+      return U_ERROR;
+    }
+    file->path = path;
+  }
+  return U_OK;
+}
+
+/**
+ * ulfius_upload_file_add_path
+ * Add a path to the list of the files removed when the request is completed
+ * return U_OK on success
+ */
+static int ulfius_upload_file_add_path(struct connection_info_struct * con_info, const char * path) {
+  struct _u_upload_path * upload_path = ulfius_arena_alloc((struct _u_arena *)con_info->arena, sizeof(struct _u_upload_path));
+
+  if (upload_path == NULL || (upload_path->path = ulfius_arena_strdup((struct _u_arena *)con_info->arena, path)) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for upload_path");
+    return U_ERROR_MEMORY;
+  }
+  upload_path->next = (struct _u_upload_path *)con_info->upload_paths;
+  con_info->upload_paths = upload_path;
+  return U_OK;
+}
+
+/**
+ * ulfius_upload_file_pwrite
+ * Write data at the end of the uploaded file
+ * The disk space is preallocated by blocks twice as large each time, if the file system supports it
+ * return U_OK on success
+ */
+static int ulfius_upload_file_pwrite(struct _u_upload_file * file, const char * data, size_t size) {
+  uint64_t step;
+  ssize_t res;
+
+#ifdef __linux__
+  // fallocate fails on file systems that don't support it instead of writing each block like posix_fallocate
+  while (file->preallocate && file->written + size > file->allocated) {
+    step = file->allocated?file->allocated:U_UPLOAD_FILE_PREALLOC_SIZE;
+    if (fallocate(file->fd, 0, (off_t)file->allocated, (off_t)step)) {
+      file->preallocate = 0;
+    } else {
+      file->allocated += step;
+    }
+  }
+#else
+  UNUSED(step);
+#endif
+  while (size) {
+    if ((res = pwrite(file->fd, data, size, (off_t)file->written)) < 0) {
+      if (errno != EINTR) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error writing upload file");
+        return U_ERROR;
+      }
+    } else {
+      data += res;
+      size -= (size_t)res;
+      file->written += (uint64_t)res;
+    }
+  }
+  return U_OK;
+}
+
+/**
+ * ulfius_upload_file_link
+ * Give a name in directory to an anonymous uploaded file
+ * return U_OK on success
+ */
+static int ulfius_upload_file_link(const char * directory, struct _u_upload_file * file) {
+  static unsigned int counter = 0;
+  char fd_path[64];
+  struct timespec now;
+  int i;
+
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", file->fd);
+  for (i=0; i<U_UPLOAD_FILE_LINK_RETRIES; i++) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    if ((file->path = msprintf("%s/ulfius_upload_%d_%lx%lx_%x", directory, (int)getpid(), (unsigned long)now.tv_sec, (unsigned long)now.tv_nsec, __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for upload file path");
+      return U_ERROR_MEMORY;
+    }
+    if (!linkat(AT_FDCWD, fd_path, AT_FDCWD, file->path, AT_SYMLINK_FOLLOW)) {
+      return U_OK;
+    }
+    o_free(file->path);
+    file->path = NULL;
+    if (errno != EEXIST) {
+      break;
+    }
+  }
+  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error linking upload file in %s", directory);
+  return U_ERROR;
+}
+
+/**
+ * ulfius_upload_file_free
+ * Close and free an uploaded file part
+ */
+static void ulfius_upload_file_free(struct _u_upload_file * file) {
+  if (file->fd >= 0) {
+    close(file->fd);
+  }
+  o_free(file->key);
+  o_free(file->filename);
+  o_free(file->content_type);
+  o_free(file->path);
+  o_free(file->buffer);
+  o_free(file);
+}
+
+/**
+ * ulfius_upload_file_put_param
+ * Put the value of the parameter key suffixed by suffix in map
+ * return U_OK on success
+ */
+static int ulfius_upload_file_put_param(struct _u_map * map, const char * key, const char * suffix, const char * value) {
+  char * param = msprintf("%s%s", key, suffix);
+  int ret = U_ERROR_MEMORY;
+
+  if (param != NULL) {
+    ret = u_map_put(map, param, value);
+    o_free(param);
+  }
+  return ret;
+}
+
+/**
+ * ulfius_upload_file_write
+ * Write a block of a file part of a multipart body in the upload file directory
+ * A new file is started when the key changes or when off is 0, the previous one is closed
+ * The blocks are batched in a buffer to write the file with large writes
+ * If max_post_param_size is set, the file is truncated to this size
+ * return U_OK on success
+ */
+int ulfius_upload_file_write(struct connection_info_struct * con_info, const char * key, const char * filename, const char * content_type, const char * data, uint64_t off, size_t size) {
+  struct _u_upload_file * file = (struct _u_upload_file *)con_info->upload_file;
+  int ret;
+
+  if (file != NULL && (!off || o_strcmp(file->key, key))) {
+    if ((ret = ulfius_upload_file_close(con_info)) != U_OK) {
+      return ret;
+    }
+    file = NULL;
+  }
+  if (file == NULL) {
+    if ((file = o_malloc(sizeof(struct _u_upload_file))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for upload file");
+      return U_ERROR_MEMORY;
+    }
+    file->key = o_strdup(key);
+    file->filename = o_strdup(filename);
+    file->content_type = o_strdup(content_type);
+    file->size = 0;
+    file->written = 0;
+    file->allocated = 0;
+    file->preallocate = 1;
+    file->buffer = o_malloc(U_UPLOAD_FILE_BUFFER_SIZE);
+    file->buffer_len = 0;
+    file->fd = -1;
+    file->path = NULL;
+    con_info->upload_file = file;
+    if (file->key == NULL || file->filename == NULL || (content_type != NULL && file->content_type == NULL) || file->buffer == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for upload file");
+      return U_ERROR_MEMORY;
+    }
+    if ((ret = ulfius_upload_file_open(con_info->u_instance->upload_file_directory, file)) != U_OK) {
+      return ret;
+    }
+    // A named file is removed with the request if the upload doesn't complete
+    if (file->path != NULL && (ret = ulfius_upload_file_add_path(con_info, file->path)) != U_OK) {
+      return ret;
+    }
+  }
+
+  if (con_info->max_post_param_size > 0) {
+    if (file->size >= con_info->max_post_param_size) {
+      return U_OK;
+    } else if (file->size + size > con_info->max_post_param_size) {
+      size = (size_t)(con_info->max_post_param_size - file->size);
+    }
+  }
+  file->size += size;
+  if (file->buffer_len + size > U_UPLOAD_FILE_BUFFER_SIZE) {
+    if (file->buffer_len && ulfius_upload_file_pwrite(file, file->buffer, file->buffer_len) != U_OK) {
+      return U_ERROR;
+    }
+    file->buffer_len = 0;
+    if (size >= U_UPLOAD_FILE_BUFFER_SIZE) {
+      return ulfius_upload_file_pwrite(file, data, size);
+    }
+  }
+  memcpy(file->buffer + file->buffer_len, data, size);
+  file->buffer_len += size;
+  return U_OK;
+}
+
+/**
+ * ulfius_upload_file_close
+ * Write the end of the current uploaded file and put its path, size, filename and content type in map_post_body
+ * return U_OK on success
+ */
+int ulfius_upload_file_close(struct connection_info_struct * con_info) {
+  struct _u_upload_file * file = (struct _u_upload_file *)con_info->upload_file;
+  char str_size[32];
+  int ret = U_OK;
+
+  if (file == NULL) {
+    return U_OK;
+  }
+  con_info->upload_file = NULL;
+  if (file->buffer_len && ulfius_upload_file_pwrite(file, file->buffer, file->buffer_len) != U_OK) {
+    ret = U_ERROR;
+  } else if (file->allocated > file->written && ftruncate(file->fd, (off_t)file->written)) {
+    // Release the disk space preallocated but not used
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error truncating upload file");
+    ret = U_ERROR;
+  } else if (file->path == NULL) {
+    if ((ret = ulfius_upload_file_link(con_info->u_instance->upload_file_directory, file)) == U_OK) {
+      ret = ulfius_upload_file_add_path(con_info, file->path);
+    }
+  }
+  if (ret == U_OK) {
+    snprintf(str_size, sizeof(str_size), "%" PRIu64, file->written);
+    if (u_map_put(con_info->request->map_post_body, file->key, file->path) != U_OK ||
+        ulfius_upload_file_put_param(con_info->request->map_post_body, file->key, "_filename", file->filename) != U_OK ||
+        ulfius_upload_file_put_param(con_info->request->map_post_body, file->key, "_size", str_size) != U_OK ||
+        (file->content_type != NULL && ulfius_upload_file_put_param(con_info->request->map_post_body, file->key, "_content_type", file->content_type) != U_OK)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting upload file parameters");
+      ret = U_ERROR;
+    }
+  }
+  ulfius_upload_file_free(file);
+  return ret;
+}
+
+/**
+ * ulfius_upload_file_clean
+ * Close the current uploaded file and remove the files uploaded during the request
+ * The callback functions must move the files they want to keep with rename or link
+ */
+void ulfius_upload_file_clean(struct connection_info_struct * con_info) {
+  struct _u_upload_path * upload_path;
+
+  if (con_info->upload_file != NULL) {
+    ulfius_upload_file_free((struct _u_upload_file *)con_info->upload_file);
+    con_info->upload_file = NULL;
+  }
+  for (upload_path = (struct _u_upload_path *)con_info->upload_paths; upload_path != NULL; upload_path = upload_path->next) {
+    if (unlink(upload_path->path) && errno != ENOENT) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error removing upload file %s", upload_path->path);
+    }
+  }
+  con_info->upload_paths = NULL;
+}
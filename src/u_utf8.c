@@ -0,0 +1,495 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_utf8.c: utf8 validation functions
+ *
+ * Copyright 2015-2017 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <string.h>
+
+#include "u_private.h"
+#include "ulfius.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #define U_UTF8_SIMD
+  #define U_UTF8_X86
+  #include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  #define U_UTF8_SIMD
+  #define U_UTF8_NEON
+  #include <arm_neon.h>
+#endif
+
+/**
+ * The utf8_check() function scans the '\0'-terminated string starting
+ * at s. It returns a pointer to the first byte of the first malformed
+ * or overlong UTF-8 sequence found, or NULL if the string contains
+ * only correct UTF-8. It also spots UTF-8 sequences that could cause
+ * trouble if converted to UTF-16, namely surrogate characters
+ * (U+D800..U+DFFF) and non-Unicode positions (U+FFFE..U+FFFF). This
+ * routine is very likely to find a malformed sequence if the input
+ * uses any other encoding than UTF-8. It therefore can be used as a
+ * very effective heuristic for distinguishing between UTF-8 and other
+ * encodings.
+ *
+ * I wrote this code mainly as a specification of functionality; there
+ * are no doubt performance optimizations possible for certain CPUs.
+ *
+ * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/> -- 2005-03-30
+ * License: http://www.cl.cam.ac.uk/~mgk25/short-license.html
+ */
+const unsigned char * utf8_check_scalar(const char * s_orig) {
+  const unsigned char * s = (unsigned char *)s_orig;
+  while (*s) {
+    if (*s < 0x80) {
+      /* 0xxxxxxx */
+      s++;
+    } else if ((s[0] & 0xe0) == 0xc0) {
+      /* 110XXXXx 10xxxxxx */
+      if ((s[1] & 0xc0) != 0x80 ||
+          (s[0] & 0xfe) == 0xc0) {                  /* overlong? */
+        return s;
+      } else {
+        s += 2;
+      }
+    } else if ((s[0] & 0xf0) == 0xe0) {
+      /* 1110XXXX 10Xxxxxx 10xxxxxx */
+      if ((s[1] & 0xc0) != 0x80 ||
+	  (s[2] & 0xc0) != 0x80 ||
+	  (s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) ||      /* overlong? */
+	  (s[0] == 0xed && (s[1] & 0xe0) == 0xa0) ||      /* surrogate? */
+	  (s[0] == 0xef && s[1] == 0xbf &&
+	   (s[2] & 0xfe) == 0xbe)) {                      /* U+FFFE or U+FFFF? */
+        return s;
+      } else {
+        s += 3;
+      }
+    } else if ((s[0] & 0xf8) == 0xf0) {
+      /* 11110XXX 10XXxxxx 10xxxxxx 10xxxxxx */
+      if ((s[1] & 0xc0) != 0x80 ||
+	  (s[2] & 0xc0) != 0x80 ||
+	  (s[3] & 0xc0) != 0x80 ||
+	  (s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) ||      /* overlong? */
+	  (s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4) { /* > U+10FFFF? */
+        return s;
+      } else {
+        s += 4;
+      }
+    } else {
+      return s;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * utf8_check_chunk_scalar
+ * Incremental version of utf8_check for a string received in several chunks,
+ * the sequences split between two chunks are checked with the same rules
+ * *state must be 0 for the first chunk, it holds the number of continuation bytes expected
+ * and the range of the next one, and U_UTF8_STATE_END after a '\0',
+ * the string is read up to its first '\0' like utf8_check
+ * return a pointer to the first malformed byte of the chunk, NULL if the chunk is valid
+ */
+static const unsigned char * utf8_check_chunk_scalar(const char * s_orig, size_t len, unsigned int * state) {
+  const unsigned char * s = (const unsigned char *)s_orig, * end = s + len;
+  unsigned int remaining = *state & 0x3, low = (*state >> 8) & 0xff, high = (*state >> 16) & 0xff, is_ef = *state & U_UTF8_STATE_EF;
+
+  if (*state & U_UTF8_STATE_END) {
+    return NULL;
+  }
+  while (s < end) {
+    if (remaining) {
+      /* 10xxxxxx in the range allowed by the lead byte */
+      if (*s < low || *s > high) {
+        return s;
+      }
+      remaining--;
+      /* U+FFFE or U+FFFF? */
+      high = (is_ef && remaining == 1 && *s == 0xbf)?0xbd:0xbf;
+      low = 0x80;
+      is_ef = 0;
+      s++;
+    } else if (*s < 0x80) {
+      /* 0xxxxxxx */
+      if (!*s) {
+        *state = U_UTF8_STATE_END;
+        return NULL;
+      }
+      s++;
+    } else {
+      low = 0x80;
+      high = 0xbf;
+      if ((s[0] & 0xe0) == 0xc0) {
+        /* 110XXXXx 10xxxxxx */
+        if ((s[0] & 0xfe) == 0xc0) {                  /* overlong? */
+          return s;
+        }
+        remaining = 1;
+      } else if ((s[0] & 0xf0) == 0xe0) {
+        /* 1110XXXX 10Xxxxxx 10xxxxxx */
+        remaining = 2;
+        if (s[0] == 0xe0) {                           /* overlong? */
+          low = 0xa0;
+        } else if (s[0] == 0xed) {                    /* surrogate? */
+          high = 0x9f;
+        } else if (s[0] == 0xef) {
+          is_ef = 1;
+        }
+      } else if ((s[0] & 0xf8) == 0xf0 && s[0] <= 0xf4) {
+        /* 11110XXX 10XXxxxx 10xxxxxx 10xxxxxx */
+        remaining = 3;
+        if (s[0] == 0xf0) {                           /* overlong? */
+          low = 0x90;
+        } else if (s[0] == 0xf4) {                    /* > U+10FFFF? */
+          high = 0x8f;
+        }
+      } else {
+        return s;
+      }
+      s++;
+    }
+  }
+  *state = remaining | (low << 8) | (high << 16) | (is_ef?U_UTF8_STATE_EF:0);
+  return NULL;
+}
+
+#ifdef U_UTF8_SIMD
+/**
+ * Strings shorter than U_UTF8_SIMD_MIN_LENGTH are checked with the scalar version
+ */
+#define U_UTF8_SIMD_MIN_LENGTH 32
+
+/**
+ * Vectorized validation, after "Validating UTF-8 In Less Than One Instruction Per Byte",
+ * John Keiser and Daniel Lemire, Software: Practice and Experience 51 (5), 2021
+ * Each byte is classified with 3 lookup tables indexed by the high nibble of the previous byte,
+ * its low nibble and the high nibble of the current byte, an error is a bit set in the 3 classes,
+ * then the 3rd and 4th bytes of the sequences are checked with the previous bytes
+ * U+FFFE and U+FFFF are rejected as well, like utf8_check_scalar
+ */
+#define U_UTF8_TOO_SHORT      (1<<0) /* 11______ 0_______ or 11______ 11______ */
+#define U_UTF8_TOO_LONG       (1<<1) /* 0_______ 10______ */
+#define U_UTF8_OVERLONG_3     (1<<2) /* 11100000 100_____ */
+#define U_UTF8_TOO_LARGE      (1<<3) /* 11110100 1001____ or 11110100 101_____ or 11110101-11111111 1001____ or 101_____ */
+#define U_UTF8_SURROGATE      (1<<4) /* 11101101 101_____ */
+#define U_UTF8_OVERLONG_2     (1<<5) /* 1100000_ 10______ */
+#define U_UTF8_TOO_LARGE_1000 (1<<6) /* 11110101-11111111 1000____ */
+#define U_UTF8_OVERLONG_4     (1<<6) /* 11110000 1000____ */
+#define U_UTF8_TWO_CONTS      (1<<7) /* 10______ 10______ */
+#define U_UTF8_CARRY          (U_UTF8_TOO_SHORT | U_UTF8_TOO_LONG | U_UTF8_TWO_CONTS)
+
+static const unsigned char utf8_byte_1_high[16] = {
+  /* 0_______ ________ */
+  U_UTF8_TOO_LONG, U_UTF8_TOO_LONG, U_UTF8_TOO_LONG, U_UTF8_TOO_LONG,
+  U_UTF8_TOO_LONG, U_UTF8_TOO_LONG, U_UTF8_TOO_LONG, U_UTF8_TOO_LONG,
+  /* 10______ ________ */
+  U_UTF8_TWO_CONTS, U_UTF8_TWO_CONTS, U_UTF8_TWO_CONTS, U_UTF8_TWO_CONTS,
+  /* 1100____ ________ */
+  U_UTF8_TOO_SHORT | U_UTF8_OVERLONG_2,
+  /* 1101____ ________ */
+  U_UTF8_TOO_SHORT,
+  /* 1110____ ________ */
+  U_UTF8_TOO_SHORT | U_UTF8_OVERLONG_3 | U_UTF8_SURROGATE,
+  /* 1111____ ________ */
+  U_UTF8_TOO_SHORT | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000 | U_UTF8_OVERLONG_4
+};
+
+static const unsigned char utf8_byte_1_low[16] = {
+  /* ____0000 ________ */
+  U_UTF8_CARRY | U_UTF8_OVERLONG_3 | U_UTF8_OVERLONG_2 | U_UTF8_OVERLONG_4,
+  /* ____0001 ________ */
+  U_UTF8_CARRY | U_UTF8_OVERLONG_2,
+  /* ____001_ ________ */
+  U_UTF8_CARRY,
+  U_UTF8_CARRY,
+  /* ____0100 ________ */
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE,
+  /* ____0101 ________ to ____1100 ________ */
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000,
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000,
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000,
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000,
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000,
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000,
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000,
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000,
+  /* ____1101 ________ */
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000 | U_UTF8_SURROGATE,
+  /* ____111_ ________ */
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000,
+  U_UTF8_CARRY | U_UTF8_TOO_LARGE | U_UTF8_TOO_LARGE_1000
+};
+
+static const unsigned char utf8_byte_2_high[16] = {
+  /* ________ 0_______ */
+  U_UTF8_TOO_SHORT, U_UTF8_TOO_SHORT, U_UTF8_TOO_SHORT, U_UTF8_TOO_SHORT,
+  U_UTF8_TOO_SHORT, U_UTF8_TOO_SHORT, U_UTF8_TOO_SHORT, U_UTF8_TOO_SHORT,
+  /* ________ 1000____ */
+  U_UTF8_TOO_LONG | U_UTF8_OVERLONG_2 | U_UTF8_TWO_CONTS | U_UTF8_OVERLONG_3 | U_UTF8_TOO_LARGE_1000 | U_UTF8_OVERLONG_4,
+  /* ________ 1001____ */
+  U_UTF8_TOO_LONG | U_UTF8_OVERLONG_2 | U_UTF8_TWO_CONTS | U_UTF8_OVERLONG_3 | U_UTF8_TOO_LARGE,
+  /* ________ 101_____ */
+  U_UTF8_TOO_LONG | U_UTF8_OVERLONG_2 | U_UTF8_TWO_CONTS | U_UTF8_SURROGATE | U_UTF8_TOO_LARGE,
+  U_UTF8_TOO_LONG | U_UTF8_OVERLONG_2 | U_UTF8_TWO_CONTS | U_UTF8_SURROGATE | U_UTF8_TOO_LARGE,
+  /* ________ 11______ */
+  U_UTF8_TOO_SHORT, U_UTF8_TOO_SHORT, U_UTF8_TOO_SHORT, U_UTF8_TOO_SHORT
+};
+
+/**
+ * The last 3 bytes of a block are an incomplete sequence if they are greater than these values
+ */
+static const unsigned char utf8_max_value[32] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0-1, 0xe0-1, 0xc0-1
+};
+
+typedef int (* utf8_validate_func)(const unsigned char * s, size_t len);
+
+#ifdef U_UTF8_X86
+/**
+ * utf8_validate_sse2
+ * SSE2 is available on all x86_64 CPUs but has no byte shuffle for the lookup tables,
+ * so the blocks of 16 ASCII characters are skipped and the others are checked with utf8_check_chunk_scalar
+ * return 1 if s is valid
+ */
+static int utf8_validate_sse2(const unsigned char * s, size_t len) {
+  unsigned int state = 0;
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    if ((state & 0x3) || _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)))) {
+      if (utf8_check_chunk_scalar((const char *)s + i, 16, &state) != NULL) {
+        return 0;
+      }
+    }
+  }
+  return utf8_check_chunk_scalar((const char *)s + i, len - i, &state) == NULL && !(state & 0x3);
+}
+
+/**
+ * utf8_check_block_avx2
+ * Check a block of 32 bytes with the 3 previous bytes at the end of prev_input
+ * return the errors found, 0 if the block is valid
+ */
+__attribute__((target("avx2")))
+static __m256i utf8_check_block_avx2(__m256i input, __m256i prev_input) {
+  const __m256i low_nibble = _mm256_set1_epi8(0x0f),
+                byte_1_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_1_high)),
+                byte_1_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_1_low)),
+                byte_2_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)utf8_byte_2_high)),
+                prev_lanes = _mm256_permute2x128_si256(prev_input, input, 0x21),
+                prev1 = _mm256_alignr_epi8(input, prev_lanes, 15),
+                prev2 = _mm256_alignr_epi8(input, prev_lanes, 14),
+                prev3 = _mm256_alignr_epi8(input, prev_lanes, 13);
+  __m256i special_cases, must_be_continuation, noncharacter;
+
+  special_cases = _mm256_and_si256(_mm256_and_si256(
+                    _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble)),
+                    _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, low_nibble))),
+                    _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble)));
+  // The 3rd byte after a 111_____ and the 4th byte after a 1111____ must be continuation bytes
+  must_be_continuation = _mm256_and_si256(_mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xe0-0x80))),
+                                                          _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xf0-0x80)))),
+                                          _mm256_set1_epi8((char)0x80));
+  // U+FFFE or U+FFFF?
+  noncharacter = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(prev2, _mm256_set1_epi8((char)0xef)),
+                                                   _mm256_cmpeq_epi8(prev1, _mm256_set1_epi8((char)0xbf))),
+                                  _mm256_cmpeq_epi8(_mm256_or_si256(input, _mm256_set1_epi8(1)), _mm256_set1_epi8((char)0xbf)));
+  return _mm256_or_si256(_mm256_xor_si256(must_be_continuation, special_cases), noncharacter);
+}
+
+/**
+ * utf8_validate_avx2
+ * Validate s by blocks of 32 bytes, the blocks of ASCII characters are only checked for an incomplete
+ * sequence at the end of the previous block, the last block is padded with '\0'
+ * return 1 if s is valid
+ */
+__attribute__((target("avx2")))
+static int utf8_validate_avx2(const unsigned char * s, size_t len) {
+  const __m256i max_value = _mm256_loadu_si256((const __m256i *)utf8_max_value);
+  __m256i input, prev_input = _mm256_setzero_si256(), prev_incomplete = _mm256_setzero_si256(), error = _mm256_setzero_si256();
+  unsigned char last[32];
+  size_t i;
+
+  for (i = 0; i < len; i += 32) {
+    if (i + 32 <= len) {
+      input = _mm256_loadu_si256((const __m256i *)(s + i));
+    } else {
+      memset(last, 0, sizeof(last));
+      memcpy(last, s + i, len - i);
+      input = _mm256_loadu_si256((const __m256i *)last);
+    }
+    if (!_mm256_movemask_epi8(input)) {
+      error = _mm256_or_si256(error, prev_incomplete);
+      prev_incomplete = _mm256_setzero_si256();
+    } else {
+      error = _mm256_or_si256(error, utf8_check_block_avx2(input, prev_input));
+      prev_incomplete = _mm256_subs_epu8(input, max_value);
+      if (!_mm256_testz_si256(error, error)) {
+        return 0;
+      }
+    }
+    prev_input = input;
+  }
+  error = _mm256_or_si256(error, prev_incomplete);
+  return _mm256_testz_si256(error, error);
+}
+#endif
+
+#ifdef U_UTF8_NEON
+/**
+ * utf8_check_block_neon
+ * Check a block of 16 bytes with the 3 previous bytes at the end of prev_input
+ * return the errors found, 0 if the block is valid
+ */
+static uint8x16_t utf8_check_block_neon(uint8x16_t input, uint8x16_t prev_input) {
+  const uint8x16_t low_nibble = vdupq_n_u8(0x0f),
+                   prev1 = vextq_u8(prev_input, input, 15),
+                   prev2 = vextq_u8(prev_input, input, 14),
+                   prev3 = vextq_u8(prev_input, input, 13);
+  uint8x16_t special_cases, must_be_continuation, noncharacter;
+
+  special_cases = vandq_u8(vandq_u8(vqtbl1q_u8(vld1q_u8(utf8_byte_1_high), vshrq_n_u8(prev1, 4)),
+                                    vqtbl1q_u8(vld1q_u8(utf8_byte_1_low), vandq_u8(prev1, low_nibble))),
+                           vqtbl1q_u8(vld1q_u8(utf8_byte_2_high), vshrq_n_u8(input, 4)));
+  // The 3rd byte after a 111_____ and the 4th byte after a 1111____ must be continuation bytes
+  must_be_continuation = vandq_u8(vorrq_u8(vqsubq_u8(prev2, vdupq_n_u8(0xe0-0x80)), vqsubq_u8(prev3, vdupq_n_u8(0xf0-0x80))), vdupq_n_u8(0x80));
+  // U+FFFE or U+FFFF?
+  noncharacter = vandq_u8(vandq_u8(vceqq_u8(prev2, vdupq_n_u8(0xef)), vceqq_u8(prev1, vdupq_n_u8(0xbf))),
+                          vceqq_u8(vorrq_u8(input, vdupq_n_u8(1)), vdupq_n_u8(0xbf)));
+  return vorrq_u8(veorq_u8(must_be_continuation, special_cases), noncharacter);
+}
+
+/**
+ * utf8_validate_neon
+ * Validate s by blocks of 16 bytes, the blocks of ASCII characters are only checked for an incomplete
+ * sequence at the end of the previous block, the last block is padded with '\0'
+ * return 1 if s is valid
+ */
+static int utf8_validate_neon(const unsigned char * s, size_t len) {
+  const uint8x16_t max_value = vld1q_u8(utf8_max_value + 16);
+  uint8x16_t input, prev_input = vdupq_n_u8(0), prev_incomplete = vdupq_n_u8(0), error = vdupq_n_u8(0);
+  unsigned char last[16];
+  size_t i;
+
+  for (i = 0; i < len; i += 16) {
+    if (i + 16 <= len) {
+      input = vld1q_u8(s + i);
+    } else {
+      memset(last, 0, sizeof(last));
+      memcpy(last, s + i, len - i);
+      input = vld1q_u8(last);
+    }
+    if (vmaxvq_u8(input) < 0x80) {
+      error = vorrq_u8(error, prev_incomplete);
+      prev_incomplete = vdupq_n_u8(0);
+    } else {
+      error = vorrq_u8(error, utf8_check_block_neon(input, prev_input));
+      prev_incomplete = vqsubq_u8(input, max_value);
+      if (vmaxvq_u8(error)) {
+        return 0;
+      }
+    }
+    prev_input = input;
+  }
+  error = vorrq_u8(error, prev_incomplete);
+  return !vmaxvq_u8(error);
+}
+#endif
+
+/**
+ * utf8_get_validate
+ * Select the vectorized validator supported by the CPU on first use
+ * return the validator function
+ */
+static utf8_validate_func utf8_get_validate(void) {
+  static utf8_validate_func validate = NULL;
+  utf8_validate_func selected = __atomic_load_n(&validate, __ATOMIC_RELAXED);
+
+  if (selected == NULL) {
+#ifdef U_UTF8_X86
+    __builtin_cpu_init();
+    selected = __builtin_cpu_supports("avx2")?&utf8_validate_avx2:&utf8_validate_sse2;
+#else
+    selected = &utf8_validate_neon;
+#endif
+    __atomic_store_n(&validate, selected, __ATOMIC_RELAXED);
+  }
+  return selected;
+}
+#endif
+
+/**
+ * utf8_check
+ * Check that the '\0'-terminated string s_orig is valid utf8
+ * with the vectorized validator selected for the CPU,
+ * the first malformed byte of an invalid string is found with utf8_check_scalar
+ * return a pointer to the first malformed byte, NULL if the string is valid
+ */
+const unsigned char * utf8_check(const char * s_orig) {
+#ifdef U_UTF8_SIMD
+  // The length of the short strings isn't computed, they are checked faster with the scalar version
+  if (strnlen(s_orig, U_UTF8_SIMD_MIN_LENGTH) == U_UTF8_SIMD_MIN_LENGTH && utf8_get_validate()((const unsigned char *)s_orig, strlen(s_orig))) {
+    return NULL;
+  }
+#endif
+  return utf8_check_scalar(s_orig);
+}
+
+/**
+ * utf8_check_chunk
+ * Incremental version of utf8_check for a string received in several chunks
+ * If no sequence is pending, the chunk is checked with the vectorized validator up to its '\0'
+ * or its last sequence, possibly incomplete, the end of the chunk is checked with utf8_check_chunk_scalar
+ * return a pointer to the first malformed byte of the chunk, NULL if the chunk is valid
+ */
+const unsigned char * utf8_check_chunk(const char * s_orig, size_t len, unsigned int * state) {
+#ifdef U_UTF8_SIMD
+  const unsigned char * s = (const unsigned char *)s_orig, * nul;
+  size_t cut, nb_cont = 0;
+
+  if (!(*state & (0x3 | U_UTF8_STATE_END)) && len >= U_UTF8_SIMD_MIN_LENGTH) {
+    nul = memchr(s, '\0', len);
+    cut = nul!=NULL?(size_t)(nul - s):len;
+    while (cut && nb_cont < 3 && (s[cut-1] & 0xc0) == 0x80) {
+      cut--;
+      nb_cont++;
+    }
+    if (cut && s[cut-1] >= 0xc0) {
+      cut--;
+    }
+    if (utf8_get_validate()(s, cut)) {
+      return utf8_check_chunk_scalar(s_orig + cut, len - cut, state);
+    }
+  }
+#endif
+  return utf8_check_chunk_scalar(s_orig, len, state);
+}
+
+/**
+ * utf8_check_chunk_end
+ * Check the state of utf8_check_chunk after the last chunk of a string
+ * return 1 if the string ends with an incomplete sequence, 0 otherwise
+ */
+int utf8_check_chunk_end(unsigned int state) {
+  return !(state & U_UTF8_STATE_END) && (state & 0x3);
+}
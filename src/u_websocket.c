@@ -36,10 +36,14 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <gnutls/crypto.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
@@ -48,32 +52,72 @@
 /** Internal websocket functions **/
 /**********************************/
 
-static int is_websocket_data_available(struct _websocket_manager * websocket_manager) {
+/**
+ * Wait for data in the socket for timeout milliseconds
+ * If timeout is -1, wait until data is available or the close signal is sent, without timeout
+ * return 1 if data is available, 0 otherwise
+ */
+static int is_websocket_data_available(struct _websocket_manager * websocket_manager, int timeout) {
+  struct pollfd fds[2];
   int ret = 0, poll_ret = 0;
+  nfds_t nfds = 1;
   
-  poll_ret = poll(&websocket_manager->fds, 1, U_WEBSOCKET_USEC_WAIT);
+  fds[0] = websocket_manager->fds;
+  if (timeout < 0 && websocket_manager->signal_fd[0] >= 0) {
+    // The signal fd stays readable once the close signal is sent
+    fds[1].fd = websocket_manager->signal_fd[0];
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    nfds = 2;
+  }
+  poll_ret = poll(fds, nfds, timeout);
   if (poll_ret == -1) {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error poll websocket read");
-    websocket_manager->connected = 0;
-  } else if (websocket_manager->fds.revents & (POLLRDHUP|POLLERR|POLLHUP|POLLNVAL)) {
+    if (errno != EINTR) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error poll websocket read");
+      websocket_manager->connected = 0;
+    }
+  } else if (fds[0].revents & (POLLRDHUP|POLLERR|POLLHUP|POLLNVAL)) {
     websocket_manager->connected = 0;
-  } else if (poll_ret > 0) {
+  } else if (fds[0].revents & POLLIN) {
     ret = 1;
   }
   return ret;
 }
 
+/**
+ * Open the eventfd, or the pipe if eventfd isn't available, written by ulfius_websocket_send_close_signal
+ * return U_OK on success
+ */
+static int ulfius_open_websocket_signal_fd(struct _websocket_manager * websocket_manager) {
+#ifdef __linux__
+  websocket_manager->signal_fd[0] = websocket_manager->signal_fd[1] = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  return websocket_manager->signal_fd[0]>=0?U_OK:U_ERROR;
+#else
+  int i;
+  
+  if (pipe(websocket_manager->signal_fd)) {
+    websocket_manager->signal_fd[0] = websocket_manager->signal_fd[1] = -1;
+    return U_ERROR;
+  }
+  for (i=0; i<2; i++) {
+    fcntl(websocket_manager->signal_fd[i], F_SETFL, fcntl(websocket_manager->signal_fd[i], F_GETFL) | O_NONBLOCK);
+    fcntl(websocket_manager->signal_fd[i], F_SETFD, FD_CLOEXEC);
+  }
+  return U_OK;
+#endif
+}
+
 static ssize_t read_data_from_socket(struct _websocket_manager * websocket_manager, uint8_t * data, size_t len) {
   ssize_t ret = 0, data_len;
   
   if (len > 0) {
     do {
       if (websocket_manager->tls) {
-        data_len = gnutls_record_recv(websocket_manager->gnutls_session, data, (len - ret));
+        data_len = gnutls_record_recv(websocket_manager->gnutls_session, data + ret, (len - ret));
       } else if (websocket_manager->type == U_WEBSOCKET_SERVER) {
-        data_len = read(websocket_manager->mhd_sock, data, (len - ret));
+        data_len = read(websocket_manager->mhd_sock, data + ret, (len - ret));
       } else {
-        data_len = read(websocket_manager->tcp_sock, data, (len - ret));
+        data_len = read(websocket_manager->tcp_sock, data + ret, (len - ret));
       }
       if (data_len > 0) {
         ret += data_len;
@@ -86,6 +130,31 @@ static ssize_t read_data_from_socket(struct _websocket_manager * websocket_manag
   return ret;
 }
 
+/**
+ * Read at most len bytes available in the socket with one call, without waiting for more
+ * return the number of bytes read, 0 if no data is available, or -1 if the connection is closed
+ */
+static ssize_t read_available_data_from_socket(struct _websocket_manager * websocket_manager, uint8_t * data, size_t len) {
+  ssize_t ret;
+  
+  if (websocket_manager->tls) {
+    ret = gnutls_record_recv(websocket_manager->gnutls_session, data, len);
+    if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+      ret = 0;
+    } else if (ret <= 0) {
+      ret = -1;
+    }
+  } else {
+    ret = recv(websocket_manager->type == U_WEBSOCKET_SERVER?websocket_manager->mhd_sock:websocket_manager->tcp_sock, data, len, MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      ret = 0;
+    } else if (ret <= 0) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
 /**
  * Workaround to make sure a message, as long as it can be is complete sent
  */
@@ -113,93 +182,110 @@ static void ulfius_websocket_send_frame(struct _websocket_manager * websocket_ma
 }
 
 /**
- * Builds a websocket frame from the given struct _websocket_message
- * returns U_OK on success
- * frame must be free'd after use
+ * Send a frame header and its payload in the websocket, without copying the payload
+ * Both are sent with one sendmsg call, or in the same records if the websocket is in a TLS session
+ * return U_OK on success
  */
-static int ulfius_build_frame (const struct _websocket_message * message,
-                               const uint64_t data_offset,
-                               const uint64_t data_len,
-                               uint8_t ** frame,
-                               size_t * frame_len) {
-  int ret, has_fin = 0;
-  unsigned int i;
-  uint64_t off, frame_data_len;
-  if (message != NULL && frame != NULL && frame_len != NULL) {
-    *frame_len = 2;
-    if (message->data_len > 65536) {
-      *frame_len += 8;
-    } else if (message->data_len > 125) {
-      *frame_len += 2;
-    }
-    if (message->has_mask) {
-      *frame_len += 4;
-    }
-    if (data_offset + data_len >= message->data_len) {
-      frame_data_len = message->data_len - data_offset;
-      has_fin = 1;
-    } else {
-      frame_data_len = data_len;
-    }
-    *frame_len += frame_data_len;
-    *frame = o_malloc(*frame_len);
-    if (*frame != NULL) {
-      if (has_fin) {
-        (*frame)[0] = (message->opcode | U_WEBSOCKET_BIT_FIN);
-      } else {
-        (*frame)[0] = 0;
-      }
-      if (message->data_len > 65536) {
-        (*frame)[1] = 127;
-        (*frame)[2] = (uint8_t)(frame_data_len >> 54);
-        (*frame)[3] = (uint8_t)(frame_data_len >> 48);
-        (*frame)[4] = (uint8_t)(frame_data_len >> 40);
-        (*frame)[5] = (uint8_t)(frame_data_len >> 32);
-        (*frame)[6] = (uint8_t)(frame_data_len >> 24);
-        (*frame)[7] = (uint8_t)(frame_data_len >> 16);
-        (*frame)[8] = (uint8_t)(frame_data_len >> 8);
-        (*frame)[9] = (uint8_t)(frame_data_len);
-        off = 10;
-      } else if (data_len > 125) {
-        (*frame)[1] = 126;
-        (*frame)[2] = (uint8_t)(frame_data_len >> 8);
-        (*frame)[3] = (uint8_t)(frame_data_len);
-        off = 4;
-      } else {
-        (*frame)[1] = (uint8_t)frame_data_len;
-        off = 2;
-      }
-      if (message->has_mask) {
-        (*frame)[1] |= U_WEBSOCKET_MASK;
-        // Append mask
-        memcpy(*frame + off, message->mask, 4);
-        off += 4;
-        for (i=0; i < frame_data_len; i++) {
-          (*frame)[off + i] = message->data[data_offset + i] ^ message->mask[i%4];
+static int ulfius_websocket_send_frame_iov(struct _websocket_manager * websocket_manager, const uint8_t * header, size_t header_len, const uint8_t * payload, size_t payload_len) {
+  struct iovec iov[2];
+  struct msghdr msg;
+  struct pollfd fds;
+  ssize_t ret;
+  size_t sent;
+  
+  if (websocket_manager->type == U_WEBSOCKET_CLIENT && websocket_manager->tls) {
+    gnutls_record_cork(websocket_manager->gnutls_session);
+    ulfius_websocket_send_frame(websocket_manager, header, header_len);
+    ulfius_websocket_send_frame(websocket_manager, payload, payload_len);
+    return gnutls_record_uncork(websocket_manager->gnutls_session, GNUTLS_RECORD_WAIT)<0?U_ERROR:U_OK;
+  }
+  iov[0].iov_base = (void *)header;
+  iov[0].iov_len = header_len;
+  iov[1].iov_base = (void *)payload;
+  iov[1].iov_len = payload_len;
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = payload_len?2:1;
+  fds.fd = websocket_manager->type == U_WEBSOCKET_SERVER?websocket_manager->mhd_sock:websocket_manager->tcp_sock;
+  fds.events = POLLOUT;
+  while (msg.msg_iovlen) {
+    ret = sendmsg(fds.fd, &msg, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // The socket may be non blocking, wait until it can be written
+        if (poll(&fds, 1, -1) < 0 && errno != EINTR) {
+          return U_ERROR;
         }
-      } else {
-        memcpy((*frame) + off, message->data + data_offset, frame_data_len);
+      } else if (errno != EINTR) {
+        return U_ERROR;
       }
-      ret = U_OK;
-    } else {
-      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for *frame");
-      ret = U_ERROR_MEMORY;
+      continue;
+    }
+    // A partial write may stop in the header or in the payload
+    sent = (size_t)ret;
+    while (msg.msg_iovlen && sent >= msg.msg_iov[0].iov_len) {
+      sent -= msg.msg_iov[0].iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
     }
+    if (msg.msg_iovlen) {
+      msg.msg_iov[0].iov_base = (uint8_t *)msg.msg_iov[0].iov_base + sent;
+      msg.msg_iov[0].iov_len -= sent;
+    }
+  }
+  return U_OK;
+}
+
+/**
+ * Write the header of a websocket frame in header, U_WEBSOCKET_FRAME_HEADER_MAX_SIZE bytes max
+ * The payload length is written on the smallest size possible
+ * mask is NULL for an unmasked frame
+ * returns the length of the header
+ */
+static size_t ulfius_build_frame_header(const uint8_t first_byte,
+                                        const uint8_t * mask,
+                                        const uint64_t frame_data_len,
+                                        uint8_t * header) {
+  size_t off;
+  int i;
+  
+  header[0] = first_byte;
+  if (frame_data_len > 65535) {
+    header[1] = 127;
+    for (i=0; i<8; i++) {
+      header[2+i] = (uint8_t)(frame_data_len >> (56 - 8*i));
+    }
+    off = 10;
+  } else if (frame_data_len > 125) {
+    header[1] = 126;
+    header[2] = (uint8_t)(frame_data_len >> 8);
+    header[3] = (uint8_t)(frame_data_len);
+    off = 4;
   } else {
-    ret = U_ERROR_PARAMS;
+    header[1] = (uint8_t)frame_data_len;
+    off = 2;
   }
-  return ret;
+  if (mask != NULL) {
+    header[1] |= U_WEBSOCKET_MASK;
+    memcpy(header + off, mask, 4);
+    off += 4;
+  }
+  return off;
 }
 
 /**
  * Builds a struct _websocket_message using the given parameters
+ * With U_WEBSOCKET_BUFFER_COPY, data is copied in the message,
+ * with U_WEBSOCKET_BUFFER_OWN, data is used as the message data,
+ * with U_WEBSOCKET_BUFFER_BORROW, the message has no data
  * returns a newly allocated struct _websocket_message
  * returned value must be free'd after use
  */
 static struct _websocket_message * ulfius_build_message (const uint8_t opcode,
                                                          const short int has_mask,
                                                          const char * data,
-                                                         const uint64_t data_len) {
+                                                         const uint64_t data_len,
+                                                         const int buffer_mode) {
   struct _websocket_message * new_message = NULL;
   if ((
        opcode == U_WEBSOCKET_OPCODE_TEXT ||
@@ -211,14 +297,16 @@ static struct _websocket_message * ulfius_build_message (const uint8_t opcode,
      (data_len == 0 || data != NULL)) {
     new_message = o_malloc(sizeof(struct _websocket_message));
     if (new_message != NULL) {
-      if (data_len) {
+      if (data_len && buffer_mode == U_WEBSOCKET_BUFFER_COPY) {
         new_message->data = o_malloc(data_len*sizeof(char));
+      } else if (data_len && buffer_mode == U_WEBSOCKET_BUFFER_OWN) {
+        new_message->data = (char *)data;
       } else {
         new_message->data = NULL;
       }
-      if (!data_len || new_message->data != NULL) {
+      if (!data_len || buffer_mode == U_WEBSOCKET_BUFFER_BORROW || new_message->data != NULL) {
         new_message->opcode = opcode;
-        new_message->data_len = data_len;
+        new_message->data_len = buffer_mode==U_WEBSOCKET_BUFFER_BORROW?0:data_len;
         if (!has_mask) {
           new_message->has_mask = 0;
           memset(new_message->mask, 0, 4);
@@ -226,7 +314,7 @@ static struct _websocket_message * ulfius_build_message (const uint8_t opcode,
           gnutls_rnd(GNUTLS_RND_NONCE, &new_message->mask, 4*sizeof(uint8_t));
           new_message->has_mask = 1;
         }
-        if (data_len > 0) {
+        if (data_len > 0 && buffer_mode == U_WEBSOCKET_BUFFER_COPY) {
           memcpy(new_message->data, data, data_len);
         }
         time(&new_message->datestamp);
@@ -245,44 +333,74 @@ static struct _websocket_message * ulfius_build_message (const uint8_t opcode,
 /**
  * Builds a struct _websocket_message using the given parameters
  * Sends message to the websocket recipient in fragment if required
- * Then pushes the message in the outcoming message list
+ * Then pushes the message in the outcoming message list if it's sent
+ * The frames are sent from data, masked in a temporary buffer if the websocket is a client
+ * buffer_mode is U_WEBSOCKET_BUFFER_COPY, U_WEBSOCKET_BUFFER_OWN or U_WEBSOCKET_BUFFER_BORROW,
+ * the copy of U_WEBSOCKET_BUFFER_COPY is only used by the outcoming message list
  * returns U_OK on success
  */
 static int ulfius_send_websocket_message_managed(struct _websocket_manager * websocket_manager,
                                                  const uint8_t opcode,
                                                  const uint64_t data_len,
                                                  const char * data,
-                                                 const uint64_t fragment_len) {
-  size_t offset = 0, cur_len;
+                                                 const uint64_t fragment_len,
+                                                 const int buffer_mode) {
+  size_t offset = 0, cur_len, header_len;
   struct _websocket_message * message;
-  uint8_t * frame = NULL;
-  size_t frame_len = 0;
+  uint8_t header[U_WEBSOCKET_FRAME_HEADER_MAX_SIZE], * masked = NULL;
+  const uint8_t * payload = (const uint8_t *)data;
   int ret = U_OK;
   
   if (data != NULL || data_len == 0) {
     if (pthread_mutex_lock(&websocket_manager->write_lock)) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error locking write lock");
+      if (buffer_mode == U_WEBSOCKET_BUFFER_OWN) {
+        o_free((char *)data);
+      }
+      ret = U_ERROR;
     } else {
-      message = ulfius_build_message(opcode, (websocket_manager->type == U_WEBSOCKET_CLIENT), data, data_len);
+      message = ulfius_build_message(opcode, (websocket_manager->type == U_WEBSOCKET_CLIENT), data, data_len, buffer_mode);
       if (message != NULL) {
-        if (ulfius_push_websocket_message(websocket_manager->message_list_outcoming, message) != U_OK) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error pushing new websocket message in list");
+        if (message->has_mask && data_len) {
+          // The payload of a client is masked frame by frame in one buffer, each frame mask starts at the first byte
+          if ((masked = o_malloc(data_len)) != NULL) {
+            payload = masked;
+          } else {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for masked");
+            ret = U_ERROR_MEMORY;
+          }
         }
-        while (offset < data_len) {
-          cur_len = fragment_len<(data_len - offset)?fragment_len:(data_len - offset);
-          if ((ret = ulfius_build_frame(message, offset, cur_len, &frame, &frame_len)) != U_OK) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_build_frame");
+        // A message without payload, like close or pong, is sent in one empty frame
+        while (ret == U_OK) {
+          cur_len = (fragment_len && fragment_len<(data_len - offset))?fragment_len:(data_len - offset);
+          if (masked != NULL) {
+            ulfius_websocket_mask(masked + offset, (const uint8_t *)data + offset, cur_len, message->mask, 0);
+          }
+          header_len = ulfius_build_frame_header((uint8_t)((offset?U_WEBSOCKET_OPCODE_CONTINUE:opcode) | (offset + cur_len >= data_len?U_WEBSOCKET_BIT_FIN:0)),
+                                                 message->has_mask?message->mask:NULL,
+                                                 cur_len,
+                                                 header);
+          if ((ret = ulfius_websocket_send_frame_iov(websocket_manager, header, header_len, payload + offset, cur_len)) != U_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending websocket frame");
+          }
+          offset += cur_len;
+          if (offset >= data_len) {
             break;
-          } else {
-            ulfius_websocket_send_frame(websocket_manager, frame, frame_len);
-            offset += cur_len;
-            o_free(frame);
-            frame = NULL;
-            frame_len = 0;
           }
         }
+        o_free(masked);
+        // Only the messages sent are kept in the outcoming message list
+        if (ret != U_OK) {
+          ulfius_clear_websocket_message(message);
+        } else if (ulfius_push_websocket_message(websocket_manager->message_list_outcoming, message) != U_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error pushing new websocket message in list");
+          ulfius_clear_websocket_message(message);
+        }
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_build_message");
+        if (buffer_mode == U_WEBSOCKET_BUFFER_OWN) {
+          o_free((char *)data);
+        }
         ret = U_ERROR;
       }
       pthread_mutex_unlock(&websocket_manager->write_lock);
@@ -295,122 +413,261 @@ static int ulfius_send_websocket_message_managed(struct _websocket_manager * web
 }
 
 /**
- * Read and parse a new message from the websocket
- * Return the opcode of the new websocket, U_WEBSOCKET_OPCODE_NONE if no message arrived, or U_WEBSOCKET_OPCODE_ERROR on error
- * Sets the new message in the message variable
+ * Parse the messages received in the websocket
+ * The data available in the socket is read with one call if the receive buffer is empty,
+ * then the frames are parsed until a message is complete, the remaining data is kept for the next call
+ * Sets *message to NULL if no message is complete yet, the parser resumes the incomplete frame on the next call
+ * Return U_OK on success, U_ERROR_DISCONNECTED if the connection is closed
  */
 static int ulfius_read_incoming_message(struct _websocket_manager * websocket_manager, struct _websocket_message ** message) {
-  int ret = U_OK, fin = 0, i;
-  uint8_t header[2] = {0}, payload_len[8] = {0}, masking_key[4] = {0};
-  uint8_t * payload_data = NULL;
-  size_t msg_len = 0;
-  ssize_t len = 0;
+  struct _websocket_receive * receive = (struct _websocket_receive *)websocket_manager->receive;
+  size_t consumed;
+  ssize_t len;
+  int ret = U_OK;
   
-  *message = o_malloc(sizeof(struct _websocket_message));
-  if (*message != NULL) {
-    (*message)->data_len = 0;
-    (*message)->has_mask = 0;
-    (*message)->data = NULL;
-    time(&(*message)->datestamp);
-    
-    do {
-      if (ret == U_OK) {
-        // Read header
-        if ((len = read_data_from_socket(websocket_manager, header, 2)) == 2) {
-          (*message)->opcode = header[0] & 0x0F;
-          fin = (header[0] & U_WEBSOCKET_BIT_FIN);
-          if ((header[1] & U_WEBSOCKET_LEN_MASK) <= 125) {
-            msg_len = (header[1] & U_WEBSOCKET_LEN_MASK);
-          } else if ((header[1] & U_WEBSOCKET_LEN_MASK) == 126) {
-            len = read_data_from_socket(websocket_manager, payload_len, 2);
-            if (len == 2) {
-              msg_len = payload_len[1] | ((uint64_t)payload_len[0] << 8);
-            } else if (len >= 0) {
-              ret = U_ERROR;
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reading websocket message length");
-            } else {
-              ret = U_ERROR_DISCONNECTED;
-            }
-          } else if ((header[1] & U_WEBSOCKET_LEN_MASK) == 127) {
-            len = read_data_from_socket(websocket_manager, payload_len, 8);
-            if (len == 8) {
-              msg_len = payload_len[7] |
-                        ((uint64_t)payload_len[6] << 8) |
-                        ((uint64_t)payload_len[5] << 16) |
-                        ((uint64_t)payload_len[4] << 24) |
-                        ((uint64_t)payload_len[3] << 32) |
-                        ((uint64_t)payload_len[2] << 40) |
-                        ((uint64_t)payload_len[1] << 48) |
-                        ((uint64_t)payload_len[0] << 54);
-            } else if (len >= 0) {
-              ret = U_ERROR;
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reading websocket message length");
-            } else {
-              ret = U_ERROR_DISCONNECTED;
-            }
-          }
-        } else if (len == 0) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reading websocket");
+  *message = NULL;
+  if (receive == NULL) {
+    if ((receive = o_malloc(sizeof(struct _websocket_receive))) == NULL || (receive->buffer = o_malloc(U_WEBSOCKET_RECEIVE_BUFFER_SIZE)) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for websocket_manager->receive");
+      o_free(receive);
+      return U_ERROR_MEMORY;
+    }
+    ulfius_init_websocket_parser(&receive->parser);
+    receive->offset = 0;
+    receive->len = 0;
+    websocket_manager->receive = receive;
+  }
+  if (receive->offset == receive->len) {
+    receive->offset = 0;
+    receive->len = 0;
+    if ((len = read_available_data_from_socket(websocket_manager, receive->buffer, U_WEBSOCKET_RECEIVE_BUFFER_SIZE)) < 0) {
+      ret = U_ERROR_DISCONNECTED;
+    } else {
+      receive->len = (size_t)len;
+    }
+  }
+  while (ret == U_OK && *message == NULL && receive->offset < receive->len) {
+    if (ulfius_websocket_parse(&receive->parser, websocket_manager->type, receive->buffer + receive->offset, receive->len - receive->offset, &consumed, message) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_websocket_parse");
+      ret = U_ERROR;
+    } else {
+      receive->offset += consumed;
+    }
+  }
+  return ret;
+}
+
+/**
+ * Check if data received is waiting to be parsed, in the receive buffer or in the TLS session
+ * return 1 if data is buffered, 0 otherwise
+ */
+static int is_websocket_data_buffered(struct _websocket_manager * websocket_manager) {
+  struct _websocket_receive * receive = (struct _websocket_receive *)websocket_manager->receive;
+  
+  if (receive != NULL && receive->offset < receive->len) {
+    return 1;
+  } else if (websocket_manager->tls && gnutls_record_check_pending(websocket_manager->gnutls_session) > 0) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+/**
+ * Initialize a struct _websocket_parser
+ */
+void ulfius_init_websocket_parser(struct _websocket_parser * parser) {
+  if (parser != NULL) {
+    parser->header_len = 0;
+    parser->header_expected = 2;
+    parser->opcode = 0;
+    parser->fin = 0;
+    parser->has_mask = 0;
+    memset(parser->mask, 0, 4);
+    parser->payload_len = 0;
+    parser->payload_read = 0;
+    parser->frame_message = NULL;
+    parser->message = NULL;
+  }
+}
+
+/**
+ * Clear data of a struct _websocket_parser, including the message being received
+ */
+void ulfius_clear_websocket_parser(struct _websocket_parser * parser) {
+  if (parser != NULL) {
+    if (parser->frame_message != parser->message) {
+      ulfius_clear_websocket_message(parser->frame_message);
+    }
+    ulfius_clear_websocket_message(parser->message);
+    ulfius_init_websocket_parser(parser);
+  }
+}
+
+/**
+ * Decode a complete frame header and set the message receiving the payload
+ * Control frames are received in their own message,
+ * so they can be interleaved with the fragments of a data message
+ * return U_OK on success
+ */
+static int ulfius_websocket_parse_header(struct _websocket_parser * parser) {
+  struct _websocket_message * message;
+  char * data;
+  size_t off = 2;
+  int i;
+
+  parser->opcode = parser->header[0] & 0x0F;
+  parser->fin = (parser->header[0] & U_WEBSOCKET_BIT_FIN);
+  parser->has_mask = !!(parser->header[1] & U_WEBSOCKET_MASK);
+  if ((parser->header[1] & U_WEBSOCKET_LEN_MASK) == 126) {
+    parser->payload_len = ((uint64_t)parser->header[2] << 8) | parser->header[3];
+    off = 4;
+  } else if ((parser->header[1] & U_WEBSOCKET_LEN_MASK) == 127) {
+    parser->payload_len = 0;
+    for (i=0; i<8; i++) {
+      parser->payload_len = (parser->payload_len << 8) | parser->header[2+i];
+    }
+    if (parser->payload_len >> 63) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error invalid websocket frame length");
+      return U_ERROR;
+    }
+    off = 10;
+  } else {
+    parser->payload_len = (parser->header[1] & U_WEBSOCKET_LEN_MASK);
+  }
+  if (parser->has_mask) {
+    memcpy(parser->mask, parser->header + off, 4);
+  }
+  parser->payload_read = 0;
+
+  if (parser->opcode & 0x08) {
+    if (!parser->fin || parser->payload_len > 125) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error invalid websocket control frame");
+      return U_ERROR;
+    }
+    message = NULL;
+  } else if (parser->opcode == U_WEBSOCKET_OPCODE_CONTINUE) {
+    if (parser->message == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error websocket continuation frame without a message");
+      return U_ERROR;
+    }
+    message = parser->message;
+  } else if (parser->opcode == U_WEBSOCKET_OPCODE_TEXT || parser->opcode == U_WEBSOCKET_OPCODE_BINARY) {
+    if (parser->message != NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error websocket message started before the end of the previous one");
+      return U_ERROR;
+    }
+    message = NULL;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error unknown websocket opcode");
+    return U_ERROR;
+  }
+
+  if (message == NULL) {
+    if ((message = o_malloc(sizeof(struct _websocket_message))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for message");
+      return U_ERROR_MEMORY;
+    }
+    message->opcode = parser->opcode;
+    message->data_len = 0;
+    message->data = NULL;
+    time(&message->datestamp);
+    if (!(parser->opcode & 0x08)) {
+      parser->message = message;
+    }
+  }
+  message->has_mask = (uint8_t)parser->has_mask;
+  memcpy(message->mask, parser->mask, 4);
+  parser->frame_message = message;
+  if (parser->payload_len) {
+    if (parser->payload_len > SIZE_MAX - message->data_len ||
+        (data = o_realloc(message->data, (size_t)(message->data_len + parser->payload_len))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for message->data");
+      return U_ERROR_MEMORY;
+    }
+    message->data = data;
+  }
+  return U_OK;
+}
+
+/**
+ * Parse the bytes received in a websocket
+ * type is U_WEBSOCKET_SERVER or U_WEBSOCKET_CLIENT, to check the mask of the frames
+ * parsing stops when a message is complete, then *message is set and *consumed is the number of bytes used
+ * the remaining bytes must be given in another call
+ * *message is NULL if all the bytes are consumed before the end of a message
+ * *message must be cleared after use
+ * return U_OK on success, U_ERROR on protocol error
+ */
+int ulfius_websocket_parse(struct _websocket_parser * parser, int type, const uint8_t * data, size_t len, size_t * consumed, struct _websocket_message ** message) {
+  size_t cur_len;
+  uint8_t * dest;
+  int ret = U_OK;
+
+  if (parser == NULL || (data == NULL && len) || consumed == NULL || message == NULL) {
+    return U_ERROR_PARAMS;
+  }
+  *consumed = 0;
+  *message = NULL;
+  while (ret == U_OK && *message == NULL && (*consumed < len || parser->frame_message != NULL)) {
+    if (parser->frame_message == NULL) {
+      cur_len = parser->header_expected - parser->header_len;
+      if (cur_len > len - *consumed) {
+        cur_len = len - *consumed;
+      }
+      memcpy(parser->header + parser->header_len, data + *consumed, cur_len);
+      parser->header_len += cur_len;
+      *consumed += cur_len;
+      if (parser->header_len == 2 && parser->header_expected == 2) {
+        if (type == U_WEBSOCKET_SERVER && !(parser->header[1] & U_WEBSOCKET_MASK)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Incoming message has no MASK flag, exiting");
+          ret = U_ERROR;
+        } else if (type == U_WEBSOCKET_CLIENT && (parser->header[1] & U_WEBSOCKET_MASK)) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Incoming message has MASK flag while it should not, exiting");
           ret = U_ERROR;
         } else {
-          ret = U_ERROR_DISCONNECTED;
-        }
-        
-        if (ret == U_OK) {
-          if (websocket_manager->type == U_WEBSOCKET_SERVER) {
-            // Read mask
-            if (header[1] & U_WEBSOCKET_MASK) {
-              (*message)->has_mask = 1;
-              len = read_data_from_socket(websocket_manager, masking_key, 4);
-              if (len != 4 && len >= 0) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reading websocket for mask");
-                ret = U_ERROR;
-              } else if (len < 0) {
-                ret = U_ERROR_DISCONNECTED;
-              }
-            } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Incoming message has no MASK flag, exiting");
-              ret = U_ERROR;
-            }
-          } else {
-            if ((header[1] & U_WEBSOCKET_MASK)) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Incoming message has MASK flag while it should not, exiting");
-              ret = U_ERROR;
-            }
+          if ((parser->header[1] & U_WEBSOCKET_LEN_MASK) == 126) {
+            parser->header_expected += 2;
+          } else if ((parser->header[1] & U_WEBSOCKET_LEN_MASK) == 127) {
+            parser->header_expected += 8;
           }
-        }
-        if (ret == U_OK) {
-          payload_data = o_malloc(msg_len*sizeof(uint8_t));
-          len = read_data_from_socket(websocket_manager, payload_data, msg_len);
-          if (len < 0) {
-            ret = U_ERROR_DISCONNECTED;
-          } else if ((unsigned int)len != msg_len) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error reading websocket for payload_data");
-            ret = U_ERROR;
-          } else {
-            // If mask, decode message
-            (*message)->data = o_realloc((*message)->data, (msg_len+(*message)->data_len)*sizeof(uint8_t));
-            if ((*message)->has_mask) {
-              for (i = (*message)->data_len; (unsigned int)i < (*message)->data_len + msg_len; i++) {
-                (*message)->data[i] = payload_data[i-(*message)->data_len] ^ masking_key[(i-(*message)->data_len)%4];
-              }
-            } else {
-              memcpy((*message)->data+(*message)->data_len, payload_data, msg_len);
-            }
-            (*message)->data_len += msg_len;
+          if (parser->header[1] & U_WEBSOCKET_MASK) {
+            parser->header_expected += 4;
           }
-          o_free(payload_data);
         }
-        if (!fin) {
-          while (!is_websocket_data_available(websocket_manager));
+      }
+      if (ret == U_OK && parser->header_len == parser->header_expected) {
+        ret = ulfius_websocket_parse_header(parser);
+        parser->header_len = 0;
+        parser->header_expected = 2;
+      }
+    } else {
+      cur_len = len - *consumed;
+      if (cur_len > parser->payload_len - parser->payload_read) {
+        cur_len = (size_t)(parser->payload_len - parser->payload_read);
+      }
+      dest = (uint8_t *)parser->frame_message->data + parser->frame_message->data_len;
+      if (parser->has_mask) {
+        ulfius_websocket_mask(dest, data + *consumed, cur_len, parser->mask, (size_t)(parser->payload_read & 0x3));
+      } else if (cur_len) {
+        memcpy(dest, data + *consumed, cur_len);
+      }
+      parser->frame_message->data_len += cur_len;
+      parser->payload_read += cur_len;
+      *consumed += cur_len;
+      if (parser->payload_read == parser->payload_len) {
+        // End of frame
+        if (parser->frame_message != parser->message) {
+          *message = parser->frame_message;
+        } else if (parser->fin) {
+          *message = parser->message;
+          parser->message = NULL;
         }
+        parser->frame_message = NULL;
+      } else if (*consumed == len) {
+        break;
       }
-    } while (ret == U_OK && !fin);
-  } else {
-    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for *message");
-  }
-  if (ret != U_OK) {
-    ulfius_clear_websocket_message(*message);
+    }
   }
   return ret;
 }
@@ -425,7 +682,7 @@ void * ulfius_thread_websocket_manager_run(void * args) {
     
     // Send close message if the websocket is still open
     if (websocket->websocket_manager->connected) {
-      websocket->websocket_manager->close_flag = 1;
+      ulfius_websocket_send_close_signal(websocket->websocket_manager);
     }
   }
   return NULL;
@@ -459,21 +716,24 @@ void * ulfius_thread_websocket(void * data) {
         }
         websocket->websocket_manager->connected = 0;
       } else {
-        if (is_websocket_data_available(websocket->websocket_manager)) {
+        if (is_websocket_data_buffered(websocket->websocket_manager) || is_websocket_data_available(websocket->websocket_manager, -1)) {
           if (pthread_mutex_lock(&websocket->websocket_manager->read_lock)) {
             y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error locking websocket read lock messages");
             websocket->websocket_manager->connected = 0;
           } else {
-            if (ulfius_read_incoming_message(websocket->websocket_manager, &message) == U_OK) {
+            if (ulfius_read_incoming_message(websocket->websocket_manager, &message) != U_OK) {
+              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_read_incoming_message");
+              websocket->websocket_manager->connected = 0;
+            } else if (message != NULL) {
               if (message->opcode == U_WEBSOCKET_OPCODE_CLOSE) {
                 // Send close command back, then close the socket
-                if (ulfius_send_websocket_message_managed(websocket->websocket_manager, U_WEBSOCKET_OPCODE_CLOSE, 0, NULL, 0) != U_OK) {
+                if (ulfius_send_websocket_message_managed(websocket->websocket_manager, U_WEBSOCKET_OPCODE_CLOSE, 0, NULL, 0, U_WEBSOCKET_BUFFER_COPY) != U_OK) {
                   y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending close command");
                 }
                 websocket->websocket_manager->connected = 0;
               } else if (message->opcode == U_WEBSOCKET_OPCODE_PING) {
-                // Send pong command
-                if (ulfius_websocket_send_message(websocket->websocket_manager, U_WEBSOCKET_OPCODE_PONG, 0, NULL) != U_OK) {
+                // Send pong command with the ping payload
+                if (ulfius_websocket_send_message(websocket->websocket_manager, U_WEBSOCKET_OPCODE_PONG, message->data_len, message->data) != U_OK) {
                   y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending pong command");
                   websocket->websocket_manager->connected = 0;
                 }
@@ -485,9 +745,6 @@ void * ulfius_thread_websocket(void * data) {
                 y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error pushing new websocket message in list");
                 websocket->websocket_manager->connected = 0;
               }
-            } else {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_read_incoming_message");
-              websocket->websocket_manager->connected = 0;
             }
             pthread_mutex_unlock(&websocket->websocket_manager->read_lock);
           }
@@ -828,6 +1085,10 @@ void ulfius_start_websocket_cb (void * cls,
     websocket->websocket_manager->fds.events = POLLIN | POLLRDHUP;
     websocket->websocket_manager->connected = 1;
     websocket->websocket_manager->close_flag = 0;
+    if (websocket->instance != NULL && websocket->instance->websocket_reactor_threads && ulfius_websocket_reactor_add(websocket->instance, websocket) == U_OK) {
+      // The websocket is run by the instance websocket reactor
+      return;
+    }
     thread_ret_websocket = pthread_create(&thread_websocket, NULL, ulfius_thread_websocket, (void *)websocket);
     thread_detach_websocket = pthread_detach(thread_websocket);
     if (thread_ret_websocket || thread_detach_websocket) {
@@ -1029,16 +1290,22 @@ int ulfius_close_websocket(struct _websocket * websocket) {
  * Add a websocket in the list of active websockets of the instance
  */
 int ulfius_instance_add_websocket_active(struct _u_instance * instance, struct _websocket * websocket) {
+  int ret;
+  
   if (instance != NULL && websocket != NULL) {
+    // The websockets are added and removed by different threads, and the websockets of a reactor are closed by several workers
+    pthread_mutex_lock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
     ((struct _websocket_handler *)instance->websocket_handler)->websocket_active = o_realloc(((struct _websocket_handler *)instance->websocket_handler)->websocket_active, (((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active+1)*sizeof(struct _websocket *));
     if (((struct _websocket_handler *)instance->websocket_handler)->websocket_active != NULL) {
       ((struct _websocket_handler *)instance->websocket_handler)->websocket_active[((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active] = websocket;
       ((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active++;
-      return U_OK;
+      ret = U_OK;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for instance->websocket_handler->websocket_active");
-      return U_ERROR_MEMORY;
+      ret = U_ERROR_MEMORY;
     }
+    pthread_mutex_unlock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
+    return ret;
   } else {
     return U_ERROR_PARAMS;
   }
@@ -1049,8 +1316,11 @@ int ulfius_instance_add_websocket_active(struct _u_instance * instance, struct _
  */
 int ulfius_instance_remove_websocket_active(struct _u_instance * instance, struct _websocket * websocket) {
   size_t i, j;
-  if (instance != NULL && ((struct _websocket_handler *)instance->websocket_handler)->websocket_active != NULL && websocket != NULL) {
-    for (i=0; i<((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active; i++) {
+  int ret = U_ERROR_NOT_FOUND;
+  
+  if (instance != NULL && instance->websocket_handler != NULL && websocket != NULL) {
+    pthread_mutex_lock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
+    for (i=0; ((struct _websocket_handler *)instance->websocket_handler)->websocket_active != NULL && i<((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active; i++) {
       if (((struct _websocket_handler *)instance->websocket_handler)->websocket_active[i] == websocket) {
         if (((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active > 1) {
           for (j=i; j<((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active-1; j++) {
@@ -1059,20 +1329,21 @@ int ulfius_instance_remove_websocket_active(struct _u_instance * instance, struc
           ((struct _websocket_handler *)instance->websocket_handler)->websocket_active = o_realloc(((struct _websocket_handler *)instance->websocket_handler)->websocket_active, (((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active-1)*sizeof(struct _websocket *));
           if (((struct _websocket_handler *)instance->websocket_handler)->websocket_active == NULL) {
             y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for instance->websocket_active");
-            return U_ERROR_MEMORY;
+            ret = U_ERROR_MEMORY;
+            break;
           }
         } else {
           o_free(((struct _websocket_handler *)instance->websocket_handler)->websocket_active);
           ((struct _websocket_handler *)instance->websocket_handler)->websocket_active = NULL;
         }
         ((struct _websocket_handler *)instance->websocket_handler)->nb_websocket_active--;
-        pthread_mutex_lock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
         pthread_cond_broadcast(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_cond);
-        pthread_mutex_unlock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
-        return U_OK;
+        ret = U_OK;
+        break;
       }
     }
-    return U_ERROR_NOT_FOUND;
+    pthread_mutex_unlock(&((struct _websocket_handler *)instance->websocket_handler)->websocket_close_lock);
+    return ret;
   } else {
     return U_ERROR_PARAMS;
   }
@@ -1097,30 +1368,36 @@ int ulfius_websocket_send_fragmented_message(struct _websocket_manager * websock
   
   if (websocket_manager != NULL && websocket_manager->connected) {
     if (opcode == U_WEBSOCKET_OPCODE_CLOSE) {
-      if (ulfius_send_websocket_message_managed(websocket_manager, U_WEBSOCKET_OPCODE_CLOSE, 0, NULL, 0) == U_OK) {
+      if (ulfius_send_websocket_message_managed(websocket_manager, U_WEBSOCKET_OPCODE_CLOSE, 0, NULL, 0, U_WEBSOCKET_BUFFER_COPY) == U_OK) {
         // If message sent is U_WEBSOCKET_OPCODE_CLOSE, wait for the close response for WEBSOCKET_MAX_CLOSE_TRY messages max, then close the connection
-        do {
-          if (is_websocket_data_available(websocket_manager)) {
-            message = NULL;
-            ret_message = ulfius_read_incoming_message(websocket_manager, &message);
-            if (ret_message == U_OK && message != NULL) {
-              if (message->opcode == U_WEBSOCKET_OPCODE_CLOSE) {
+        // The socket of a websocket run by the reactor is read by the reactor loop only, the close response isn't waited for
+        if (!websocket_manager->reactor) {
+          do {
+            if (is_websocket_data_buffered(websocket_manager) || is_websocket_data_available(websocket_manager, U_WEBSOCKET_USEC_WAIT)) {
+              // The receive buffer may be shared with the thread reading the websocket
+              pthread_mutex_lock(&websocket_manager->read_lock);
+              message = NULL;
+              ret_message = ulfius_read_incoming_message(websocket_manager, &message);
+              if (ret_message == U_OK && message != NULL) {
+                if (message->opcode == U_WEBSOCKET_OPCODE_CLOSE) {
+                  websocket_manager->connected = 0;
+                }
+                if (ulfius_push_websocket_message(websocket_manager->message_list_incoming, message) != U_OK) {
+                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error pushing new websocket message in list");
+                }
+              } else if (ret_message != U_OK) {
                 websocket_manager->connected = 0;
               }
-              if (ulfius_push_websocket_message(websocket_manager->message_list_incoming, message) != U_OK) {
-                y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error pushing new websocket message in list");
-              }
-            } else {
-              websocket_manager->connected = 0;
+              pthread_mutex_unlock(&websocket_manager->read_lock);
             }
-          }
-        } while (websocket_manager->connected && (count-- > 0));
+          } while (websocket_manager->connected && (count-- > 0));
+        }
       } else {
         y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending U_WEBSOCKET_OPCODE_CLOSE message");
       }
       websocket_manager->connected = 0;
     } else {
-      ret = ulfius_send_websocket_message_managed(websocket_manager, opcode, data_len, data, fragment_len);
+      ret = ulfius_send_websocket_message_managed(websocket_manager, opcode, data_len, data, fragment_len, U_WEBSOCKET_BUFFER_COPY);
     }
   } else {
     ret = U_ERROR_PARAMS;
@@ -1139,6 +1416,45 @@ int ulfius_websocket_send_message(struct _websocket_manager * websocket_manager,
   return ulfius_websocket_send_fragmented_message(websocket_manager, opcode, data_len, data, data_len);
 }
 
+/**
+ * Send a control frame in the websocket even if it's not connected anymore
+ * Return U_OK on success
+ */
+int ulfius_websocket_send_control_message(struct _websocket_manager * websocket_manager,
+                                          const uint8_t opcode,
+                                          const uint64_t data_len,
+                                          const char * data) {
+  if (websocket_manager != NULL && (opcode == U_WEBSOCKET_OPCODE_PONG || opcode == U_WEBSOCKET_OPCODE_CLOSE) && data_len <= 125) {
+    return ulfius_send_websocket_message_managed(websocket_manager, opcode, data_len, data, data_len, U_WEBSOCKET_BUFFER_COPY);
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
+/**
+ * Send a message in the websocket without copying data in a new message
+ * With U_WEBSOCKET_BUFFER_OWN, data is free'd by the websocket manager, even on error
+ * Return U_OK on success
+ */
+int ulfius_websocket_send_buffer_message(struct _websocket_manager * websocket_manager,
+                                         const uint8_t opcode,
+                                         const uint64_t data_len,
+                                         const char * data,
+                                         const int ownership) {
+  int ret;
+  
+  if (websocket_manager != NULL && websocket_manager->connected && opcode != U_WEBSOCKET_OPCODE_CLOSE &&
+      (ownership == U_WEBSOCKET_BUFFER_OWN || ownership == U_WEBSOCKET_BUFFER_BORROW)) {
+    ret = ulfius_send_websocket_message_managed(websocket_manager, opcode, data_len, data, data_len, ownership);
+  } else {
+    if (ownership == U_WEBSOCKET_BUFFER_OWN) {
+      o_free((char *)data);
+    }
+    ret = U_ERROR_PARAMS;
+  }
+  return ret;
+}
+
 /**
  * Return the first message of the message list
  * Return NULL if message_list has no message
@@ -1265,6 +1581,8 @@ int ulfius_init_websocket_manager(struct _websocket_manager * websocket_manager)
     websocket_manager->tcp_sock = 0;
     websocket_manager->protocol = NULL;
     websocket_manager->extensions = NULL;
+    websocket_manager->signal_fd[0] = websocket_manager->signal_fd[1] = -1;
+    websocket_manager->receive = NULL;
     pthread_mutexattr_init ( &mutexattr );
     pthread_mutexattr_settype( &mutexattr, PTHREAD_MUTEX_RECURSIVE );
     if (pthread_mutex_init(&(websocket_manager->read_lock), &mutexattr) != 0 || pthread_mutex_init(&(websocket_manager->write_lock), &mutexattr) != 0) {
@@ -1279,9 +1597,13 @@ int ulfius_init_websocket_manager(struct _websocket_manager * websocket_manager)
                ulfius_init_websocket_message_list(websocket_manager->message_list_outcoming) != U_OK) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing message_list_incoming or message_list_outcoming");
       ret = U_ERROR_MEMORY;
+    } else if (ulfius_open_websocket_signal_fd(websocket_manager) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error opening signal_fd");
+      ret = U_ERROR;
     }
     websocket_manager->fds.events = POLLIN | POLLRDHUP;
     websocket_manager->type = U_WEBSOCKET_NONE;
+    websocket_manager->reactor = 0;
 
     if (ret != U_OK) {
       o_free(websocket_manager->message_list_incoming);
@@ -1309,6 +1631,20 @@ void ulfius_clear_websocket_manager(struct _websocket_manager * websocket_manage
     websocket_manager->message_list_outcoming = NULL;
     o_free(websocket_manager->protocol);
     o_free(websocket_manager->extensions);
+    if (websocket_manager->receive != NULL) {
+      ulfius_clear_websocket_parser(&((struct _websocket_receive *)websocket_manager->receive)->parser);
+      o_free(((struct _websocket_receive *)websocket_manager->receive)->buffer);
+      o_free(websocket_manager->receive);
+      websocket_manager->receive = NULL;
+    }
+    if (websocket_manager->signal_fd[0] >= 0) {
+      close(websocket_manager->signal_fd[0]);
+    }
+    // The signal fd of a websocket run by the reactor is the event_fd of its loop
+    if (!websocket_manager->reactor && websocket_manager->signal_fd[1] >= 0 && websocket_manager->signal_fd[1] != websocket_manager->signal_fd[0]) {
+      close(websocket_manager->signal_fd[1]);
+    }
+    websocket_manager->signal_fd[0] = websocket_manager->signal_fd[1] = -1;
   }
 }
 
@@ -1386,8 +1722,17 @@ int ulfius_set_websocket_response(struct _u_response * response,
  * or U_ERROR on error
  */
 int ulfius_websocket_send_close_signal(struct _websocket_manager * websocket_manager) {
+  uint64_t value = 1;
+  
   if (websocket_manager != NULL) {
     websocket_manager->close_flag = 1;
+    // Wake up the thread reading the websocket, or its reactor loop
+    // signal_fd may be replaced by the reactor, it's -1 when the websocket is closed by the reactor
+    pthread_mutex_lock(&websocket_manager->status_lock);
+    if (websocket_manager->signal_fd[1] >= 0 && write(websocket_manager->signal_fd[1], &value, sizeof(value)) != sizeof(value)) {
+      y_log_message(Y_LOG_LEVEL_DEBUG, "Ulfius - Error writing websocket signal_fd");
+    }
+    pthread_mutex_unlock(&websocket_manager->status_lock);
     return U_OK;
   } else {
     return U_ERROR_PARAMS;
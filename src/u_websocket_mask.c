@@ -0,0 +1,216 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_websocket_mask.c: websocket payload mask functions
+ *
+ * Copyright 2017-2018 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <string.h>
+
+#include "u_private.h"
+#include "ulfius.h"
+
+#ifndef U_DISABLE_WEBSOCKET
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #define U_MASK_SIMD
+  #define U_MASK_X86
+  #include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  #define U_MASK_SIMD
+  #define U_MASK_NEON
+  #include <arm_neon.h>
+#endif
+
+/**
+ * Payloads shorter than this length are masked byte by byte
+ */
+#define U_WEBSOCKET_MASK_MIN_LENGTH 8
+
+/**
+ * Payloads shorter than this length are masked by 64 bits words only
+ */
+#define U_WEBSOCKET_MASK_SIMD_MIN_LENGTH 64
+
+/**
+ * ulfius_websocket_mask_scalar
+ * XOR len bytes of src with the 4 bytes mask, byte by byte, and write them in dest
+ * offset is the position of src in the payload, so the mask is applied with the right phase
+ */
+void ulfius_websocket_mask_scalar(uint8_t * dest, const uint8_t * src, size_t len, const uint8_t * mask, size_t offset) {
+  size_t i;
+
+  for (i=0; i<len; i++) {
+    dest[i] = src[i] ^ mask[(offset + i) & 0x3];
+  }
+}
+
+#ifdef U_MASK_SIMD
+/**
+ * Mask the beginning of src by blocks of 16 or 32 bytes with the rotated mask repeated on 32 bytes
+ * return the number of bytes masked
+ */
+typedef size_t (* u_websocket_mask_func)(uint8_t * dest, const uint8_t * src, size_t len, const uint8_t * rotated);
+
+#ifdef U_MASK_X86
+/**
+ * ulfius_websocket_mask_sse2
+ * Mask src by blocks of 64 then 16 bytes, SSE2 is available on all x86_64 CPUs
+ * return the number of bytes masked
+ */
+static size_t ulfius_websocket_mask_sse2(uint8_t * dest, const uint8_t * src, size_t len, const uint8_t * rotated) {
+  const __m128i mask = _mm_loadu_si128((const __m128i *)rotated);
+  __m128i block_0, block_1, block_2, block_3;
+  size_t i;
+
+  for (i = 0; i + 64 <= len; i += 64) {
+    block_0 = _mm_loadu_si128((const __m128i *)(src + i));
+    block_1 = _mm_loadu_si128((const __m128i *)(src + i + 16));
+    block_2 = _mm_loadu_si128((const __m128i *)(src + i + 32));
+    block_3 = _mm_loadu_si128((const __m128i *)(src + i + 48));
+    _mm_storeu_si128((__m128i *)(dest + i), _mm_xor_si128(block_0, mask));
+    _mm_storeu_si128((__m128i *)(dest + i + 16), _mm_xor_si128(block_1, mask));
+    _mm_storeu_si128((__m128i *)(dest + i + 32), _mm_xor_si128(block_2, mask));
+    _mm_storeu_si128((__m128i *)(dest + i + 48), _mm_xor_si128(block_3, mask));
+  }
+  for (; i + 16 <= len; i += 16) {
+    _mm_storeu_si128((__m128i *)(dest + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), mask));
+  }
+  return i;
+}
+
+/**
+ * ulfius_websocket_mask_avx2
+ * Mask src by blocks of 128 then 32 bytes
+ * return the number of bytes masked
+ */
+__attribute__((target("avx2")))
+static size_t ulfius_websocket_mask_avx2(uint8_t * dest, const uint8_t * src, size_t len, const uint8_t * rotated) {
+  const __m256i mask = _mm256_loadu_si256((const __m256i *)rotated);
+  __m256i block_0, block_1, block_2, block_3;
+  size_t i;
+
+  for (i = 0; i + 128 <= len; i += 128) {
+    block_0 = _mm256_loadu_si256((const __m256i *)(src + i));
+    block_1 = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+    block_2 = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+    block_3 = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+    _mm256_storeu_si256((__m256i *)(dest + i), _mm256_xor_si256(block_0, mask));
+    _mm256_storeu_si256((__m256i *)(dest + i + 32), _mm256_xor_si256(block_1, mask));
+    _mm256_storeu_si256((__m256i *)(dest + i + 64), _mm256_xor_si256(block_2, mask));
+    _mm256_storeu_si256((__m256i *)(dest + i + 96), _mm256_xor_si256(block_3, mask));
+  }
+  for (; i + 32 <= len; i += 32) {
+    _mm256_storeu_si256((__m256i *)(dest + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src + i)), mask));
+  }
+  return i;
+}
+#endif
+
+#ifdef U_MASK_NEON
+/**
+ * ulfius_websocket_mask_neon
+ * Mask src by blocks of 64 then 16 bytes
+ * return the number of bytes masked
+ */
+static size_t ulfius_websocket_mask_neon(uint8_t * dest, const uint8_t * src, size_t len, const uint8_t * rotated) {
+  const uint8x16_t mask = vld1q_u8(rotated);
+  size_t i;
+
+  for (i = 0; i + 64 <= len; i += 64) {
+    uint8x16_t block_0 = vld1q_u8(src + i), block_1 = vld1q_u8(src + i + 16), block_2 = vld1q_u8(src + i + 32), block_3 = vld1q_u8(src + i + 48);
+    vst1q_u8(dest + i, veorq_u8(block_0, mask));
+    vst1q_u8(dest + i + 16, veorq_u8(block_1, mask));
+    vst1q_u8(dest + i + 32, veorq_u8(block_2, mask));
+    vst1q_u8(dest + i + 48, veorq_u8(block_3, mask));
+  }
+  for (; i + 16 <= len; i += 16) {
+    vst1q_u8(dest + i, veorq_u8(vld1q_u8(src + i), mask));
+  }
+  return i;
+}
+#endif
+
+/**
+ * ulfius_websocket_get_mask_func
+ * Select the vectorized mask function supported by the CPU on first use
+ * return the mask function
+ */
+static u_websocket_mask_func ulfius_websocket_get_mask_func(void) {
+  static u_websocket_mask_func mask_func = NULL;
+  u_websocket_mask_func selected = __atomic_load_n(&mask_func, __ATOMIC_RELAXED);
+
+  if (selected == NULL) {
+#ifdef U_MASK_X86
+    __builtin_cpu_init();
+    selected = __builtin_cpu_supports("avx2")?&ulfius_websocket_mask_avx2:&ulfius_websocket_mask_sse2;
+#else
+    selected = &ulfius_websocket_mask_neon;
+#endif
+    __atomic_store_n(&mask_func, selected, __ATOMIC_RELAXED);
+  }
+  return selected;
+}
+#endif
+
+/**
+ * ulfius_websocket_mask
+ * XOR len bytes of src with the 4 bytes mask and write them in dest
+ * The mask is rotated to the offset, then repeated to mask src by vectors of 16 or 32 bytes
+ * with the instructions selected at runtime for the CPU, the remaining bytes are masked
+ * by 64 bits words, then byte by byte
+ */
+void ulfius_websocket_mask(uint8_t * dest, const uint8_t * src, size_t len, const uint8_t * mask, size_t offset) {
+  uint8_t rotated[32];
+  uint32_t mask_half;
+  uint64_t mask_word, word;
+  size_t i;
+
+  if (len < U_WEBSOCKET_MASK_MIN_LENGTH) {
+    ulfius_websocket_mask_scalar(dest, src, len, mask, offset);
+    return;
+  }
+  for (i=0; i<4; i++) {
+    rotated[i] = mask[(offset + i) & 0x3];
+  }
+  // Both halves of the word are the same, so it doesn't depend on the byte order
+  memcpy(&mask_half, rotated, sizeof(mask_half));
+  mask_word = ((uint64_t)mask_half << 32) | mask_half;
+  i = 0;
+#ifdef U_MASK_SIMD
+  if (len >= U_WEBSOCKET_MASK_SIMD_MIN_LENGTH) {
+    memcpy(rotated + 4, rotated, 4);
+    memcpy(rotated + 8, rotated, 8);
+    memcpy(rotated + 16, rotated, 16);
+    i = ulfius_websocket_get_mask_func()(dest, src, len, rotated);
+  }
+#endif
+  // The blocks are multiples of 4 bytes, the mask of the remaining bytes starts with rotated[0]
+  for (; i + sizeof(word) <= len; i += sizeof(word)) {
+    memcpy(&word, src + i, sizeof(word));
+    word ^= mask_word;
+    memcpy(dest + i, &word, sizeof(word));
+  }
+  for (; i<len; i++) {
+    dest[i] = src[i] ^ rotated[i & 0x3];
+  }
+}
+
+#endif
@@ -0,0 +1,679 @@
+/**
+ *
+ * Ulfius Framework
+ *
+ * REST framework library
+ *
+ * u_websocket_reactor.c: websockets shared by a few event loop threads and a pool of worker threads
+ *
+ * Copyright 2017-2018 Nicolas Mora <mail@babelouest.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU GENERAL PUBLIC LICENSE for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "u_private.h"
+#include "ulfius.h"
+
+#ifndef U_DISABLE_WEBSOCKET
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**
+ * Return the number of worker threads of the reactor
+ * i.e. instance->websocket_worker_threads if set, the number of online CPUs otherwise
+ */
+static unsigned int ulfius_websocket_reactor_nb_workers(const struct _u_instance * instance) {
+  long nb_cpu = 1;
+
+  if (instance->websocket_worker_threads) {
+    return instance->websocket_worker_threads;
+  }
+#ifdef _SC_NPROCESSORS_ONLN
+  nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return nb_cpu>0?(unsigned int)nb_cpu:1;
+}
+
+/**
+ * Wake up the loop thread to check its connections
+ */
+static void ulfius_websocket_reactor_wakeup(struct _websocket_reactor_loop * loop) {
+  uint64_t value = 1;
+
+  if (write(loop->event_fd, &value, sizeof(value)) != sizeof(value)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error writing websocket reactor event_fd");
+  }
+}
+
+/**
+ * Append a job to the jobs of the connection,
+ * or mark the connection as closing if job is NULL,
+ * then put the connection in the run queue if it's not already there
+ */
+static void ulfius_websocket_reactor_enqueue(struct _websocket_reactor * reactor, struct _websocket_reactor_connection * connection, struct _websocket_reactor_job * job) {
+  pthread_mutex_lock(&reactor->queue_lock);
+  if (job != NULL) {
+    if (connection->job_last != NULL) {
+      connection->job_last->next = job;
+    } else {
+      connection->job_first = job;
+    }
+    connection->job_last = job;
+  } else {
+    connection->closing = 1;
+  }
+  if (!connection->scheduled) {
+    connection->scheduled = 1;
+    if (reactor->run_last != NULL) {
+      reactor->run_last->next_run = connection;
+    } else {
+      reactor->run_first = connection;
+    }
+    reactor->run_last = connection;
+    pthread_cond_signal(&reactor->queue_cond);
+  }
+  pthread_mutex_unlock(&reactor->queue_lock);
+}
+
+/**
+ * Append a message to dispatch to the jobs of the connection,
+ * or mark the connection as closing if message is NULL
+ * return U_OK on success
+ */
+static int ulfius_websocket_reactor_push(struct _websocket_reactor * reactor, struct _websocket_reactor_connection * connection, struct _websocket_message * message) {
+  struct _websocket_reactor_job * job = NULL;
+
+  if (message != NULL) {
+    if ((job = o_malloc(sizeof(struct _websocket_reactor_job))) == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for job");
+      return U_ERROR_MEMORY;
+    }
+    job->message = message;
+    job->next = NULL;
+  }
+  ulfius_websocket_reactor_enqueue(reactor, connection, job);
+  return U_OK;
+}
+
+/**
+ * Append a control frame to send to the jobs of the connection
+ * The frame is sent by a worker, so a client that doesn't read its socket doesn't block the loop
+ * return U_OK on success
+ */
+static int ulfius_websocket_reactor_push_reply(struct _websocket_reactor * reactor, struct _websocket_reactor_connection * connection, uint8_t opcode, const char * data, size_t data_len) {
+  struct _websocket_reactor_job * job;
+
+  if (data_len > sizeof(job->reply_data)) {
+    return U_ERROR_PARAMS;
+  }
+  if ((job = o_malloc(sizeof(struct _websocket_reactor_job))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for job");
+    return U_ERROR_MEMORY;
+  }
+  job->message = NULL;
+  job->reply_opcode = opcode;
+  job->reply_len = data_len;
+  if (data_len) {
+    memcpy(job->reply_data, data, data_len);
+  }
+  job->next = NULL;
+  ulfius_websocket_reactor_enqueue(reactor, connection, job);
+  return U_OK;
+}
+
+/**
+ * Remove the connection from the loop
+ * The connection is given to the workers after all the events of the current epoll_wait are handled,
+ * they will dispatch its remaining messages, then close it
+ * loop->lock must be locked
+ */
+static void ulfius_websocket_reactor_finish(struct _websocket_reactor_loop * loop, struct _websocket_reactor_connection * connection) {
+  if (connection->finished) {
+    return;
+  }
+  connection->finished = 1;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, connection->websocket->websocket_manager->mhd_sock, NULL)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error removing websocket from epoll instance");
+  }
+  loop->nb_connections--;
+  if (connection->index < loop->nb_connections) {
+    loop->connections[connection->index] = loop->connections[loop->nb_connections];
+    loop->connections[connection->index]->index = connection->index;
+  }
+  connection->websocket->websocket_manager->connected = 0;
+  connection->next_finished = loop->finished_first;
+  loop->finished_first = connection;
+}
+
+/**
+ * Give the connections removed from the loop to the workers
+ * A removed connection may still have an event in the events of the current epoll_wait, it's freed by a worker after that
+ */
+static void ulfius_websocket_reactor_flush_finished(struct _websocket_reactor_loop * loop) {
+  struct _websocket_reactor_connection * connection, * next;
+
+  pthread_mutex_lock(&loop->lock);
+  connection = loop->finished_first;
+  loop->finished_first = NULL;
+  pthread_mutex_unlock(&loop->lock);
+  while (connection != NULL) {
+    next = connection->next_finished;
+    ulfius_websocket_reactor_push(loop->reactor, connection, NULL);
+    connection = next;
+  }
+}
+
+/**
+ * Queue the answers to the control messages, then send the message to the workers
+ */
+static void ulfius_websocket_reactor_handle_message(struct _websocket_reactor_connection * connection, struct _websocket_message * message) {
+  struct _websocket_manager * websocket_manager = connection->websocket->websocket_manager;
+
+  if (message->opcode == U_WEBSOCKET_OPCODE_CLOSE) {
+    // Send close command back, then close the socket
+    if (ulfius_websocket_reactor_push_reply(connection->loop->reactor, connection, U_WEBSOCKET_OPCODE_CLOSE, NULL, 0) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending close command");
+    }
+    websocket_manager->connected = 0;
+  } else if (message->opcode == U_WEBSOCKET_OPCODE_PING) {
+    if (ulfius_websocket_reactor_push_reply(connection->loop->reactor, connection, U_WEBSOCKET_OPCODE_PONG, message->data, message->data_len) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending pong command");
+      websocket_manager->connected = 0;
+    }
+  }
+  if (ulfius_websocket_reactor_push(connection->loop->reactor, connection, message) != U_OK) {
+    ulfius_clear_websocket_message(message);
+    websocket_manager->connected = 0;
+  }
+}
+
+/**
+ * Read the data available in the socket and parse all the frames received
+ */
+static void ulfius_websocket_reactor_read(struct _websocket_reactor_loop * loop, struct _websocket_reactor_connection * connection) {
+  struct _websocket_manager * websocket_manager = connection->websocket->websocket_manager;
+  struct _websocket_message * message;
+  size_t off = 0, consumed;
+  ssize_t len;
+
+  len = recv(websocket_manager->mhd_sock, loop->buffer, U_WEBSOCKET_REACTOR_BUFFER_SIZE, MSG_DONTWAIT);
+  if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    websocket_manager->connected = 0;
+  }
+  while (len > 0 && off < (size_t)len && websocket_manager->connected) {
+    message = NULL;
+    if (ulfius_websocket_parse(&connection->parser, U_WEBSOCKET_SERVER, loop->buffer + off, (size_t)len - off, &consumed, &message) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_websocket_parse");
+      websocket_manager->connected = 0;
+    } else {
+      off += consumed;
+      if (message != NULL) {
+        ulfius_websocket_reactor_handle_message(connection, message);
+      }
+    }
+  }
+}
+
+/**
+ * Check the connections closed by the program, the websocket_manager_callback or a worker
+ * Done when the event_fd of the loop is written
+ */
+static void ulfius_websocket_reactor_check_close(struct _websocket_reactor_loop * loop) {
+  struct _websocket_reactor_connection * connection;
+  size_t i;
+
+  pthread_mutex_lock(&loop->lock);
+  for (i=loop->nb_connections; i>0; i--) {
+    connection = loop->connections[i-1];
+    if (connection->websocket->websocket_manager->close_flag && connection->websocket->websocket_manager->connected) {
+      if (ulfius_websocket_reactor_push_reply(loop->reactor, connection, U_WEBSOCKET_OPCODE_CLOSE, NULL, 0) != U_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending close message on close_flag");
+      }
+    }
+    if (!connection->websocket->websocket_manager->connected || connection->websocket->websocket_manager->close_flag) {
+      ulfius_websocket_reactor_finish(loop, connection);
+    }
+  }
+  pthread_mutex_unlock(&loop->lock);
+}
+
+/**
+ * Event loop thread, reads the sockets ready and parses the frames
+ */
+static void * ulfius_websocket_reactor_loop_run(void * args) {
+  struct _websocket_reactor_loop * loop = (struct _websocket_reactor_loop *)args;
+  struct _websocket_reactor_connection * connection;
+  struct epoll_event events[U_WEBSOCKET_REACTOR_MAX_EVENTS];
+  uint64_t value;
+  int nb_events, i;
+
+  while (!loop->stop) {
+    nb_events = epoll_wait(loop->epoll_fd, events, U_WEBSOCKET_REACTOR_MAX_EVENTS, -1);
+    if (nb_events < 0 && errno != EINTR) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error epoll_wait websocket reactor");
+    }
+    for (i=0; i<nb_events; i++) {
+      if (events[i].data.ptr == NULL) {
+        if (read(loop->event_fd, &value, sizeof(value)) != sizeof(value)) {
+          y_log_message(Y_LOG_LEVEL_DEBUG, "Ulfius - Error reading websocket reactor event_fd");
+        }
+        ulfius_websocket_reactor_check_close(loop);
+      } else {
+        connection = (struct _websocket_reactor_connection *)events[i].data.ptr;
+        // The connection may have been removed by a previous event of the same epoll_wait
+        if (connection->finished) {
+          continue;
+        }
+        ulfius_websocket_reactor_read(loop, connection);
+        if (!connection->websocket->websocket_manager->connected) {
+          pthread_mutex_lock(&loop->lock);
+          ulfius_websocket_reactor_finish(loop, connection);
+          pthread_mutex_unlock(&loop->lock);
+        }
+      }
+    }
+    ulfius_websocket_reactor_flush_finished(loop);
+  }
+  return NULL;
+}
+
+/**
+ * Call websocket_incoming_message_callback with the message, then append it to the incoming messages list
+ */
+static void ulfius_websocket_reactor_dispatch(struct _websocket_reactor_connection * connection, struct _websocket_message * message) {
+  struct _websocket * websocket = connection->websocket;
+
+  if (pthread_mutex_lock(&websocket->websocket_manager->read_lock)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error locking websocket read lock messages");
+    ulfius_clear_websocket_message(message);
+    websocket->websocket_manager->connected = 0;
+    ulfius_websocket_reactor_wakeup(connection->loop);
+  } else {
+    if (websocket->websocket_incoming_message_callback != NULL) {
+      websocket->websocket_incoming_message_callback(websocket->request, websocket->websocket_manager, message, websocket->websocket_incoming_user_data);
+    }
+    if (ulfius_push_websocket_message(websocket->websocket_manager->message_list_incoming, message) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error pushing new websocket message in list");
+      ulfius_clear_websocket_message(message);
+      websocket->websocket_manager->connected = 0;
+      ulfius_websocket_reactor_wakeup(connection->loop);
+    }
+    pthread_mutex_unlock(&websocket->websocket_manager->read_lock);
+  }
+}
+
+/**
+ * Close a connection removed from its loop
+ * Wait for the websocket_manager_callback to complete, then call websocket_onclose_callback and clear the websocket
+ */
+static void ulfius_websocket_reactor_close(struct _websocket_reactor_connection * connection) {
+  struct _websocket * websocket = connection->websocket;
+
+  if (connection->has_thread_manager) {
+    pthread_mutex_lock(&websocket->websocket_manager->status_lock);
+    pthread_cond_broadcast(&websocket->websocket_manager->status_cond);
+    pthread_mutex_unlock(&websocket->websocket_manager->status_lock);
+    pthread_join(connection->thread_manager, NULL);
+  }
+  if (websocket->websocket_onclose_callback != NULL) {
+    websocket->websocket_onclose_callback(websocket->request, websocket->websocket_manager, websocket->websocket_onclose_user_data);
+  }
+  // The event_fd of the loop is closed when the reactor is stopped, the close signal doesn't write it anymore
+  pthread_mutex_lock(&websocket->websocket_manager->status_lock);
+  websocket->websocket_manager->signal_fd[1] = -1;
+  pthread_mutex_unlock(&websocket->websocket_manager->status_lock);
+  if (ulfius_close_websocket(websocket) != U_OK) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error closing websocket");
+  }
+  ulfius_clear_websocket_parser(&connection->parser);
+  o_free(connection);
+  ulfius_clear_websocket(websocket);
+}
+
+/**
+ * Worker thread, dispatches the messages of the connections in the run queue
+ * The messages of a connection are dispatched in order by a single worker at a time
+ */
+static void * ulfius_websocket_reactor_worker_run(void * args) {
+  struct _websocket_reactor * reactor = (struct _websocket_reactor *)args;
+  struct _websocket_reactor_connection * connection;
+  struct _websocket_reactor_job * job;
+
+  pthread_mutex_lock(&reactor->queue_lock);
+  while (1) {
+    while (reactor->run_first == NULL && !reactor->stop) {
+      pthread_cond_wait(&reactor->queue_cond, &reactor->queue_lock);
+    }
+    if (reactor->run_first == NULL) {
+      break;
+    }
+    connection = reactor->run_first;
+    reactor->run_first = connection->next_run;
+    if (reactor->run_first == NULL) {
+      reactor->run_last = NULL;
+    }
+    connection->next_run = NULL;
+    while ((job = connection->job_first) != NULL) {
+      connection->job_first = job->next;
+      if (connection->job_first == NULL) {
+        connection->job_last = NULL;
+      }
+      pthread_mutex_unlock(&reactor->queue_lock);
+      if (job->message != NULL) {
+        ulfius_websocket_reactor_dispatch(connection, job->message);
+      } else if (ulfius_websocket_send_control_message(connection->websocket->websocket_manager, job->reply_opcode, job->reply_len, job->reply_data) != U_OK) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error sending websocket control frame");
+        if (job->reply_opcode == U_WEBSOCKET_OPCODE_PONG) {
+          connection->websocket->websocket_manager->connected = 0;
+          ulfius_websocket_reactor_wakeup(connection->loop);
+        }
+      }
+      o_free(job);
+      pthread_mutex_lock(&reactor->queue_lock);
+    }
+    if (connection->closing) {
+      pthread_mutex_unlock(&reactor->queue_lock);
+      ulfius_websocket_reactor_close(connection);
+      pthread_mutex_lock(&reactor->queue_lock);
+    } else {
+      connection->scheduled = 0;
+    }
+  }
+  pthread_mutex_unlock(&reactor->queue_lock);
+  return NULL;
+}
+
+/**
+ * Stop the loops and the workers started, then free the reactor
+ */
+static void ulfius_websocket_reactor_free(struct _websocket_reactor * reactor) {
+  unsigned int i;
+
+  for (i=0; i<reactor->nb_loops; i++) {
+    reactor->loops[i].stop = 1;
+    ulfius_websocket_reactor_wakeup(&reactor->loops[i]);
+    pthread_join(reactor->loops[i].thread, NULL);
+    close(reactor->loops[i].epoll_fd);
+    close(reactor->loops[i].event_fd);
+    o_free(reactor->loops[i].buffer);
+    o_free(reactor->loops[i].connections);
+    pthread_mutex_destroy(&reactor->loops[i].lock);
+  }
+  pthread_mutex_lock(&reactor->queue_lock);
+  reactor->stop = 1;
+  pthread_cond_broadcast(&reactor->queue_cond);
+  pthread_mutex_unlock(&reactor->queue_lock);
+  for (i=0; i<reactor->nb_workers; i++) {
+    pthread_join(reactor->workers[i], NULL);
+  }
+  pthread_mutex_destroy(&reactor->queue_lock);
+  pthread_cond_destroy(&reactor->queue_cond);
+  o_free(reactor->loops);
+  o_free(reactor->workers);
+  o_free(reactor);
+}
+
+/**
+ * Initialize a reactor loop and start its thread
+ * return U_OK on success
+ */
+static int ulfius_websocket_reactor_start_loop(struct _websocket_reactor * reactor, struct _websocket_reactor_loop * loop) {
+  struct epoll_event event;
+  int ret;
+
+  loop->reactor = reactor;
+  loop->stop = 0;
+  loop->connections = NULL;
+  loop->nb_connections = 0;
+  loop->finished_first = NULL;
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  loop->event_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  loop->buffer = o_malloc(U_WEBSOCKET_REACTOR_BUFFER_SIZE);
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (loop->epoll_fd < 0 || loop->event_fd < 0) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating websocket reactor epoll_fd or event_fd");
+    ret = U_ERROR;
+  } else if (loop->buffer == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for loop->buffer");
+    ret = U_ERROR_MEMORY;
+  } else if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &event)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error adding event_fd to websocket reactor epoll instance");
+    ret = U_ERROR;
+  } else if (pthread_mutex_init(&loop->lock, NULL)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing loop->lock");
+    ret = U_ERROR;
+  } else if (pthread_create(&loop->thread, NULL, ulfius_websocket_reactor_loop_run, (void *)loop)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating websocket reactor loop thread");
+    pthread_mutex_destroy(&loop->lock);
+    ret = U_ERROR;
+  } else {
+    ret = U_OK;
+  }
+  if (ret != U_OK) {
+    if (loop->epoll_fd >= 0) {
+      close(loop->epoll_fd);
+    }
+    if (loop->event_fd >= 0) {
+      close(loop->event_fd);
+    }
+    o_free(loop->buffer);
+  }
+  return ret;
+}
+
+/**
+ * Start the loops and the workers of a new reactor
+ * return the reactor on success, NULL on error
+ */
+static struct _websocket_reactor * ulfius_websocket_reactor_start(struct _u_instance * instance) {
+  struct _websocket_reactor * reactor = o_malloc(sizeof(struct _websocket_reactor));
+  unsigned int nb_loops = instance->websocket_reactor_threads, nb_workers = ulfius_websocket_reactor_nb_workers(instance);
+
+  if (reactor == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for reactor");
+    return NULL;
+  }
+  reactor->nb_loops = 0;
+  reactor->next_loop = 0;
+  reactor->nb_workers = 0;
+  reactor->run_first = NULL;
+  reactor->run_last = NULL;
+  reactor->stop = 0;
+  reactor->loops = o_malloc(nb_loops*sizeof(struct _websocket_reactor_loop));
+  reactor->workers = o_malloc(nb_workers*sizeof(pthread_t));
+  if (reactor->loops == NULL || reactor->workers == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for reactor->loops or reactor->workers");
+    o_free(reactor->loops);
+    o_free(reactor->workers);
+    o_free(reactor);
+    return NULL;
+  }
+  if (pthread_mutex_init(&reactor->queue_lock, NULL) || pthread_cond_init(&reactor->queue_cond, NULL)) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing queue_lock or queue_cond");
+    o_free(reactor->loops);
+    o_free(reactor->workers);
+    o_free(reactor);
+    return NULL;
+  }
+  while (reactor->nb_workers < nb_workers) {
+    if (pthread_create(&reactor->workers[reactor->nb_workers], NULL, ulfius_websocket_reactor_worker_run, (void *)reactor)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating websocket reactor worker thread");
+      ulfius_websocket_reactor_free(reactor);
+      return NULL;
+    }
+    reactor->nb_workers++;
+  }
+  while (reactor->nb_loops < nb_loops) {
+    if (ulfius_websocket_reactor_start_loop(reactor, &reactor->loops[reactor->nb_loops]) != U_OK) {
+      ulfius_websocket_reactor_free(reactor);
+      return NULL;
+    }
+    reactor->nb_loops++;
+  }
+  return reactor;
+}
+
+/**
+ * Run the websocket in the instance websocket reactor
+ * the reactor is started with the first websocket
+ * return U_OK on success, the websocket must be run in its own thread otherwise
+ */
+int ulfius_websocket_reactor_add(struct _u_instance * instance, struct _websocket * websocket) {
+  struct _websocket_handler * websocket_handler;
+  struct _websocket_reactor * reactor;
+  struct _websocket_reactor_connection * connection, ** connections;
+  struct _websocket_reactor_loop * loop;
+  struct epoll_event event;
+  int thread_ret_websocket_manager, ret = U_OK;
+
+  if (instance == NULL || instance->websocket_handler == NULL || websocket == NULL || websocket->websocket_manager == NULL) {
+    return U_ERROR_PARAMS;
+  }
+  websocket_handler = (struct _websocket_handler *)instance->websocket_handler;
+  pthread_mutex_lock(&websocket_handler->websocket_close_lock);
+  if (websocket_handler->reactor == NULL) {
+    websocket_handler->reactor = ulfius_websocket_reactor_start(instance);
+  }
+  reactor = (struct _websocket_reactor *)websocket_handler->reactor;
+  pthread_mutex_unlock(&websocket_handler->websocket_close_lock);
+  if (reactor == NULL) {
+    return U_ERROR;
+  }
+
+  if ((connection = o_malloc(sizeof(struct _websocket_reactor_connection))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for connection");
+    return U_ERROR_MEMORY;
+  }
+  connection->websocket = websocket;
+  connection->has_thread_manager = 0;
+  connection->job_first = NULL;
+  connection->job_last = NULL;
+  connection->scheduled = 0;
+  connection->closing = 0;
+  connection->finished = 0;
+  connection->next_run = NULL;
+  connection->next_finished = NULL;
+  ulfius_init_websocket_parser(&connection->parser);
+
+  pthread_mutex_lock(&reactor->queue_lock);
+  loop = &reactor->loops[reactor->next_loop];
+  reactor->next_loop = (reactor->next_loop + 1) % reactor->nb_loops;
+  pthread_mutex_unlock(&reactor->queue_lock);
+  connection->loop = loop;
+
+  // The close signal of the websocket wakes up its loop instead of a reader thread
+  // status_lock is locked by ulfius_websocket_send_close_signal to write signal_fd
+  pthread_mutex_lock(&websocket->websocket_manager->status_lock);
+  if (websocket->websocket_manager->signal_fd[0] >= 0) {
+    close(websocket->websocket_manager->signal_fd[0]);
+  }
+  if (websocket->websocket_manager->signal_fd[1] >= 0 && websocket->websocket_manager->signal_fd[1] != websocket->websocket_manager->signal_fd[0]) {
+    close(websocket->websocket_manager->signal_fd[1]);
+  }
+  websocket->websocket_manager->signal_fd[0] = -1;
+  websocket->websocket_manager->signal_fd[1] = loop->event_fd;
+  websocket->websocket_manager->reactor = 1;
+  pthread_mutex_unlock(&websocket->websocket_manager->status_lock);
+
+  // The manager thread is started before the socket is given to a loop, the connection may be closed by the loop as soon as it's added
+  if (websocket->websocket_manager_callback != NULL) {
+    thread_ret_websocket_manager = pthread_create(&connection->thread_manager, NULL, ulfius_thread_websocket_manager_run, (void *)websocket);
+    if (thread_ret_websocket_manager) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error creating websocket manager thread, return code: %d", thread_ret_websocket_manager);
+      // The websocket is closed by a worker, as if the client had disconnected
+      websocket->websocket_manager->connected = 0;
+      ulfius_websocket_reactor_push(reactor, connection, NULL);
+      return U_OK;
+    }
+    connection->has_thread_manager = 1;
+  }
+
+  pthread_mutex_lock(&loop->lock);
+  if ((connections = o_realloc(loop->connections, (loop->nb_connections+1)*sizeof(struct _websocket_reactor_connection *))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating resources for loop->connections");
+    ret = U_ERROR_MEMORY;
+  } else {
+    loop->connections = connections;
+    connection->index = loop->nb_connections;
+    loop->connections[loop->nb_connections++] = connection;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = connection;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, websocket->websocket_manager->mhd_sock, &event)) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error adding websocket to epoll instance");
+      loop->nb_connections--;
+      ret = U_ERROR;
+    } else if (websocket->websocket_manager->close_flag) {
+      // The close signal may have been sent before the connection was added to the loop
+      ulfius_websocket_reactor_wakeup(loop);
+    }
+  }
+  pthread_mutex_unlock(&loop->lock);
+  if (ret != U_OK) {
+    // The websocket is closed by a worker, as if the client had disconnected
+    websocket->websocket_manager->connected = 0;
+    ulfius_websocket_reactor_push(reactor, connection, NULL);
+  }
+  return U_OK;
+}
+
+/**
+ * Stop the instance websocket reactor and free its resources
+ * All the websockets must be closed before
+ */
+void ulfius_websocket_reactor_stop(struct _u_instance * instance) {
+  struct _websocket_handler * websocket_handler;
+  struct _websocket_reactor * reactor;
+
+  if (instance != NULL && instance->websocket_handler != NULL) {
+    websocket_handler = (struct _websocket_handler *)instance->websocket_handler;
+    pthread_mutex_lock(&websocket_handler->websocket_close_lock);
+    reactor = (struct _websocket_reactor *)websocket_handler->reactor;
+    websocket_handler->reactor = NULL;
+    pthread_mutex_unlock(&websocket_handler->websocket_close_lock);
+    if (reactor != NULL) {
+      ulfius_websocket_reactor_free(reactor);
+    }
+  }
+}
+
+#else
+
+/**
+ * The websocket reactor uses epoll, the websockets are run in their own threads on other systems
+ */
+int ulfius_websocket_reactor_add(struct _u_instance * instance, struct _websocket * websocket) {
+  UNUSED(instance);
+  UNUSED(websocket);
+  y_log_message(Y_LOG_LEVEL_DEBUG, "Ulfius - Websocket reactor not available, the websocket runs in its own thread");
+  return U_ERROR;
+}
+
+void ulfius_websocket_reactor_stop(struct _u_instance * instance) {
+  UNUSED(instance);
+}
+
+#endif
+
+#endif
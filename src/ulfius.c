@@ -25,8 +25,14 @@
 
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/stat.h>
 #include "u_private.h"
 #include "ulfius.h"
 
@@ -176,6 +182,9 @@ static int ulfius_validate_instance(const struct _u_instance * u_instance) {
   if (u_instance == NULL ||
       u_instance->port <= 0 ||
       u_instance->port >= 65536 ||
+      (u_instance->execution_mode != U_EXECUTION_MODE_THREAD_PER_CONNECTION && u_instance->execution_mode != U_EXECUTION_MODE_THREAD_POOL) ||
+      !u_instance->stream_block_size ||
+      u_instance->post_buffer_size < U_POST_BUFFER_SIZE_MIN ||
       ulfius_validate_endpoint_list(u_instance->endpoint_list, u_instance->nb_endpoints) != U_OK) {
     y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error, instance or has invalid parameters");
     return U_ERROR_PARAMS;
@@ -187,76 +196,193 @@ static int ulfius_validate_instance(const struct _u_instance * u_instance) {
  * Internal method used to duplicate the full url before it's manipulated and modified by MHD
  */
 static void * ulfius_uri_logger (void * cls, const char * uri) {
-  struct connection_info_struct * con_info = o_malloc (sizeof (struct connection_info_struct));
+  struct _u_arena * arena = ulfius_arena_new(U_ARENA_BLOCK_SIZE);
+  struct connection_info_struct * con_info = NULL;
   UNUSED(cls);
   
-  if (con_info != NULL) {
+  // The connection info, the request and the strings owned by the framework are allocated in the arena
+  // and free'd all at once when the request is completed
+  if (arena != NULL && (con_info = ulfius_arena_alloc(arena, sizeof (struct connection_info_struct))) != NULL) {
+    con_info->arena = arena;
     con_info->callback_first_iteration = 1;
     con_info->u_instance = NULL;
-    u_map_init(&con_info->map_url_initial);
-    con_info->request = o_malloc(sizeof(struct _u_request));
+    u_map_init_arena(&con_info->map_url_initial, arena);
+    con_info->request = ulfius_arena_alloc(arena, sizeof(struct _u_request));
     if (con_info->request == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for con_info->request");
-      o_free(con_info);
+      ulfius_arena_free(arena);
       return NULL;
     }
     
-    if (NULL == con_info->request || ulfius_init_request(con_info->request) != U_OK) {
-      ulfius_clean_request_full(con_info->request);
-      o_free(con_info);
+    if (ulfius_init_arena_request(arena, con_info->request) != U_OK) {
+      ulfius_arena_free(arena);
       return NULL;
     }
-    con_info->request->http_url = o_strdup(uri);
+    con_info->request->http_url = ulfius_arena_strdup(arena, uri);
     if (o_strchr(uri, '?') != NULL) {
-      con_info->request->url_path = o_strndup(uri, o_strchr(uri, '?') - uri);
+      con_info->request->url_path = ulfius_arena_strndup(arena, uri, o_strchr(uri, '?') - uri);
     } else {
-      con_info->request->url_path = o_strdup(uri);
+      con_info->request->url_path = ulfius_arena_strdup(arena, uri);
     }
     if (con_info->request->http_url == NULL || con_info->request->url_path == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for con_info->request->http_url or con_info->request->url_path");
-      ulfius_clean_request_full(con_info->request);
-      o_free(con_info);
+      ulfius_clean_arena_request(con_info->request);
+      ulfius_arena_free(arena);
       return NULL;
     }
     con_info->max_post_param_size = 0;
+    con_info->body_length = 0;
+    con_info->body_capacity = 0;
+    con_info->body_callback = NULL;
+    con_info->body_user_data = NULL;
+    con_info->body_file_threshold = 0;
+    con_info->upload_file = NULL;
+    con_info->upload_paths = NULL;
+    con_info->post_value_capacity = 0;
+    con_info->post_utf8_state = 0;
+    con_info->post_value_ignored = 0;
+    con_info->post_value_key = NULL;
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for con_info");
+    ulfius_arena_free(arena);
   }
   return con_info;
 }
 
 /**
- * ulfius_get_body_from_response
- * Extract the body data from the response if any
- * Copy it in newly allocated response_buffer and set the size in response_buffer_len
- * return U_OK on success
+ * ulfius_set_body_handler
+ * Look for the first endpoint matching the request that handles the body as it's received
+ * The route table is matched only if one of its endpoints has a body_callback or a body_file_threshold
  */
-static int ulfius_get_body_from_response(struct _u_response * response, void ** response_buffer, size_t * response_buffer_len) {
-  if (response == NULL || response_buffer == NULL || response_buffer_len == NULL) {
-    return U_ERROR_PARAMS;
-  } else {
-    if (response->binary_body != NULL && response->binary_body_length > 0) {
-      // The user sent a binary response
-      *response_buffer = o_malloc(response->binary_body_length);
-      if (*response_buffer == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for response_buffer");
-        response->status = MHD_HTTP_INTERNAL_SERVER_ERROR;
-        response->binary_body = o_strdup(ULFIUS_HTTP_ERROR_BODY);
-        response->binary_body_length = o_strlen(ULFIUS_HTTP_ERROR_BODY);
-        if (response->binary_body == NULL) {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for response->binary_body");
-          return U_ERROR_MEMORY;
+static void ulfius_set_body_handler(struct connection_info_struct * con_info, const char * method) {
+  struct _u_route_table * route_table = ulfius_router_acquire((struct _u_router *)con_info->u_instance->router);
+  struct _u_route_match route_match;
+  const struct _u_endpoint * endpoint;
+  size_t i;
+  
+  if (route_table != NULL && route_table->has_body_handler) {
+    if (ulfius_route_match(route_table, method, con_info->request->url_path, &route_match) == U_OK) {
+      for (i=0; i<route_match.nb_routes; i++) {
+        endpoint = route_match.routes[i]->endpoint;
+        if (endpoint->body_callback != NULL || endpoint->body_file_threshold) {
+          con_info->body_callback = endpoint->body_callback;
+          con_info->body_user_data = endpoint->user_data;
+          con_info->body_file_threshold = endpoint->body_file_threshold;
+          break;
         }
-      } else {
-        memcpy(*response_buffer, response->binary_body, response->binary_body_length);
-        *response_buffer_len = response->binary_body_length;
       }
     } else {
-      *response_buffer = NULL;
-      *response_buffer_len = 0;
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_route_match");
+    }
+    ulfius_clean_route_match(&route_match);
+  }
+  ulfius_release_route_table(route_table);
+}
+
+/**
+ * ulfius_open_body_file
+ * Open an anonymous temporary file to store a request body
+ * return the file descriptor on success, -1 on error
+ */
+static int ulfius_open_body_file() {
+  char file_path[] = U_BODY_FILE_DIR "/ulfius_bodyXXXXXX";
+  int fd = -1;
+  
+#ifdef O_TMPFILE
+  fd = open(U_BODY_FILE_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+#endif
+  if (fd == -1 && (fd = mkstemp(file_path)) != -1) {
+    // The file is removed when the file descriptor is closed
+    unlink(file_path);
+  }
+  return fd;
+}
+
+/**
+ * ulfius_write_request_body_file
+ * Append data to the body file of the request, the body in memory is moved in the file first
+ * The file offset stays at 0, so the file can be read from the beginning by the callback functions
+ * return U_OK on success
+ */
+static int ulfius_write_request_body_file(struct _u_request * request, const char * data, size_t size) {
+  ssize_t res;
+  
+  if (request->body_fd < 0) {
+    if ((request->body_fd = ulfius_open_body_file()) < 0) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error opening request body file");
+      return U_ERROR;
+    }
+    request->body_fd_length = 0;
+    if (request->binary_body_length && ulfius_write_request_body_file(request, request->binary_body, request->binary_body_length) != U_OK) {
+      return U_ERROR;
     }
+    o_free(request->binary_body);
+    request->binary_body = NULL;
+    request->binary_body_length = 0;
+  }
+  while (size) {
+    if ((res = pwrite(request->body_fd, data, size, (off_t)request->body_fd_length)) < 0) {
+      if (errno != EINTR) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error writing request body file");
+        return U_ERROR;
+      }
+    } else {
+      data += res;
+      size -= (size_t)res;
+      request->body_fd_length += (uint64_t)res;
+    }
+  }
+  return U_OK;
+}
+
+/**
+ * ulfius_reserve_request_body
+ * Make sure the request body buffer can store size more bytes
+ * The buffer is allocated once with the Content-Length if it's known, capped at max_post_body_size
+ * and body_file_threshold, then its capacity is doubled each time it's full
+ * so the body is copied O(log n) times instead of once per block received
+ * return U_OK on success
+ */
+static int ulfius_reserve_request_body(struct connection_info_struct * con_info, size_t size) {
+  size_t needed = con_info->request->binary_body_length + size, capacity = con_info->body_capacity, max_size = con_info->u_instance->max_post_body_size;
+  unsigned long long content_length;
+  const char * str_content_length;
+  char * endptr = NULL;
+  void * body;
+  
+  if (needed <= con_info->body_capacity) {
     return U_OK;
   }
+  if (con_info->body_file_threshold && (!max_size || con_info->body_file_threshold < max_size)) {
+    max_size = con_info->body_file_threshold;
+  }
+  if (!capacity && (str_content_length = u_map_get_case(con_info->request->map_header, "Content-Length")) != NULL) {
+    content_length = strtoull(str_content_length, &endptr, 10);
+    if (endptr != str_content_length && *endptr == '\0' && content_length <= SIZE_MAX) {
+      capacity = (size_t)content_length;
+    }
+  }
+  if (capacity < U_BODY_BUFFER_MIN_SIZE) {
+    capacity = U_BODY_BUFFER_MIN_SIZE;
+  }
+  while (capacity < needed) {
+    capacity = capacity<SIZE_MAX/2?capacity*2:needed;
+  }
+  if (max_size && capacity > max_size) {
+    capacity = needed>max_size?needed:max_size;
+  }
+  if ((body = o_realloc(con_info->request->binary_body, capacity)) == NULL && capacity > needed) {
+    // The Content-Length may be too large to be allocated at once, fall back to the size needed
+    capacity = needed;
+    body = o_realloc(con_info->request->binary_body, capacity);
+  }
+  if (body == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for con_info->request->binary_body");
+    return U_ERROR_MEMORY;
+  }
+  con_info->request->binary_body = body;
+  con_info->body_capacity = capacity;
+  return U_OK;
 }
 
 /**
@@ -276,14 +402,33 @@ static void mhd_request_completed (void *cls, struct MHD_Connection *connection,
   if (con_info->has_post_processor && con_info->post_processor != NULL) {
     MHD_destroy_post_processor (con_info->post_processor);
   }
-  ulfius_clean_request_full(con_info->request);
+  ulfius_upload_file_clean(con_info);
+  o_free(con_info->post_value_key);
+  ulfius_clean_arena_request(con_info->request);
   u_map_clean(&con_info->map_url_initial);
   con_info->request = NULL;
-  o_free(con_info);
+  // con_info is allocated in the arena
+  ulfius_arena_free((struct _u_arena *)con_info->arena);
   con_info = NULL;
   *con_cls = NULL;
 }
 
+/**
+ * ulfius_post_value_complete
+ * Check that the last post value received doesn't end with an incomplete utf8 sequence,
+ * the value is removed from map_post_body otherwise
+ */
+static void ulfius_post_value_complete(struct connection_info_struct * con_info) {
+  if (con_info->post_value_key != NULL) {
+    if (!con_info->post_value_ignored && utf8_check_chunk_end(con_info->post_utf8_state)) {
+      u_map_remove_from_key((struct _u_map *)con_info->request->map_post_body, con_info->post_value_key);
+    }
+    o_free(con_info->post_value_key);
+    con_info->post_value_key = NULL;
+  }
+  con_info->post_utf8_state = 0;
+}
+
 /**
  * mhd_iterate_post_data
  * function used to iterate post parameters
@@ -296,46 +441,70 @@ static int mhd_iterate_post_data (void * coninfo_cls, enum MHD_ValueKind kind, c
   
   struct connection_info_struct * con_info = coninfo_cls;
   size_t cur_size = size;
-  char * data_dup, * filename_param;
+  char * filename_param;
   UNUSED(kind);
   
+  if (!off) {
+    // The previous value is complete
+    ulfius_post_value_complete(con_info);
+  }
   if (filename != NULL && con_info->u_instance != NULL && con_info->u_instance->file_upload_callback != NULL) {
     if (con_info->u_instance->file_upload_callback(con_info->request, key, filename, content_type, transfer_encoding, data, off, size, con_info->u_instance->file_upload_cls) == U_OK) {
       return MHD_YES;
     } else {
       return MHD_NO;
     }
+  } else if (filename != NULL && con_info->u_instance != NULL && con_info->u_instance->upload_file_directory != NULL) {
+    // The content of the file isn't checked, only its key and filename
+    if (con_info->u_instance->check_utf8 && (utf8_check(key) != NULL || utf8_check(filename) != NULL)) {
+      return MHD_YES;
+    } else if (ulfius_upload_file_write(con_info, key, filename, content_type, data, off, size) == U_OK) {
+      return MHD_YES;
+    } else {
+      return MHD_NO;
+    }
+  } else if (con_info->u_instance == NULL) {
+    return MHD_NO;
   } else {
-    if (con_info->u_instance) {
-      if (con_info->u_instance->check_utf8 && (utf8_check(key) != NULL || data == NULL || utf8_check(data) != NULL || (filename != NULL && utf8_check(filename) != NULL))) {
-        return MHD_YES;
-      } else {
-        data_dup = o_strndup(data, size); // Force value to end with a NULL character
-        if (con_info->max_post_param_size > 0) {
-          if (off > con_info->max_post_param_size) {
-            return MHD_YES;
-          } else if (off + size > con_info->max_post_param_size) {
-            cur_size = con_info->max_post_param_size - off;
-          }
+    if (!off) {
+      // First chunk of a new value
+      con_info->post_value_capacity = 0;
+      con_info->post_value_ignored = con_info->u_instance->check_utf8 && (utf8_check(key) != NULL || (filename != NULL && utf8_check(filename) != NULL));
+      if (!con_info->post_value_ignored && filename != NULL) {
+        filename_param = msprintf("%s_filename", key);
+        if (!u_map_has_key((struct _u_map *)con_info->request->map_post_body, filename_param) && u_map_put((struct _u_map *)con_info->request->map_post_body, filename_param, filename) != U_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error u_map_put filename value");
         }
+        o_free(filename_param);
       }
-    } else {
-      return MHD_NO;
     }
-    
-    if (filename != NULL) {
-      filename_param = msprintf("%s_filename", key);
-      if (!u_map_has_key((struct _u_map *)con_info->request->map_post_body, filename_param) && u_map_put((struct _u_map *)con_info->request->map_post_body, filename_param, filename) != U_OK) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error u_map_put filename value");
+    if (con_info->post_value_ignored || (data == NULL && size)) {
+      return MHD_YES;
+    }
+    // The chunks are checked incrementally, a value with a malformed chunk is ignored
+    if (con_info->u_instance->check_utf8 && utf8_check_chunk(data, size, &con_info->post_utf8_state) != NULL) {
+      con_info->post_value_ignored = 1;
+      if (off) {
+        u_map_remove_from_key((struct _u_map *)con_info->request->map_post_body, key);
+      }
+      return MHD_YES;
+    }
+    if (con_info->post_value_key == NULL && utf8_check_chunk_end(con_info->post_utf8_state)) {
+      // The chunk ends inside a utf8 sequence, the key is kept to remove the value if the sequence isn't complete
+      con_info->post_value_key = o_strdup(key);
+    }
+    if (con_info->max_post_param_size > 0) {
+      if (off >= con_info->max_post_param_size) {
+        return MHD_YES;
+      } else if (off + size > con_info->max_post_param_size) {
+        cur_size = con_info->max_post_param_size - off;
       }
-      o_free(filename_param);
     }
     
-    if (cur_size > 0 && data_dup != NULL && u_map_put_binary((struct _u_map *)con_info->request->map_post_body, key, data_dup, off, cur_size + 1) == U_OK) {
-      o_free(data_dup);
+    // The chunk is appended to the value in map_post_body, whose buffer grows geometrically
+    if (u_map_append_binary((struct _u_map *)con_info->request->map_post_body, key, data, off, cur_size, &con_info->post_value_capacity) == U_OK) {
       return MHD_YES;
     } else {
-      o_free(data_dup);
       return MHD_NO;
     }
   }
@@ -347,6 +516,311 @@ static int mhd_iterate_post_data (void * coninfo_cls, enum MHD_ValueKind kind, c
   #define MHD_CREATE_RESPONSE_FROM_BUFFER_PIMPED(len, buf, flag) MHD_create_response_from_buffer((len), (buf), (flag))
 #endif
 
+#if MHD_VERSION < 0x00097302
+/**
+ * State of a buffer body not owned by the response sent through a MHD reader callback
+ */
+struct _u_buffer_body {
+  const char * data;
+  size_t       length;
+  void      (* release_callback)(void * release_cls);
+  void       * release_cls;
+};
+
+/**
+ * mhd_buffer_body_reader
+ * MHD reader callback sending a buffer body
+ */
+static ssize_t mhd_buffer_body_reader(void * cls, uint64_t pos, char * buf, size_t max) {
+  struct _u_buffer_body * buffer_body = (struct _u_buffer_body *)cls;
+  
+  if (pos >= buffer_body->length) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+  if (max > buffer_body->length - pos) {
+    max = buffer_body->length - pos;
+  }
+  memcpy(buf, buffer_body->data + pos, max);
+  return (ssize_t)max;
+}
+
+/**
+ * mhd_buffer_body_free
+ * Release a buffer body when MHD destroys the response
+ */
+static void mhd_buffer_body_free(void * cls) {
+  struct _u_buffer_body * buffer_body = (struct _u_buffer_body *)cls;
+  
+  buffer_body->release_callback(buffer_body->release_cls);
+  o_free(buffer_body);
+}
+#endif
+
+/**
+ * Segmented body of a response handed over to MHD
+ * segment and segment_pos are the position of the reader callback
+ */
+struct _u_segmented_body {
+  struct _u_body_segment * segments;
+  size_t                   nb_segments;
+  size_t                   segment;
+  uint64_t                 segment_pos;
+};
+
+#if MHD_VERSION < 0x00097204
+/**
+ * mhd_segmented_body_reader
+ * MHD reader callback sending the segments one after the other
+ */
+static ssize_t mhd_segmented_body_reader(void * cls, uint64_t pos, char * buf, size_t max) {
+  struct _u_segmented_body * body = (struct _u_segmented_body *)cls;
+  size_t len = 0, chunk, offset;
+  
+  if (pos < body->segment_pos) {
+    body->segment = 0;
+    body->segment_pos = 0;
+  }
+  while (body->segment < body->nb_segments && pos >= body->segment_pos + body->segments[body->segment].length) {
+    body->segment_pos += body->segments[body->segment].length;
+    body->segment++;
+  }
+  while (len < max && body->segment < body->nb_segments) {
+    offset = (size_t)(pos + len - body->segment_pos);
+    chunk = body->segments[body->segment].length - offset;
+    if (chunk > max - len) {
+      chunk = max - len;
+    }
+    memcpy(buf + len, (const char *)body->segments[body->segment].data + offset, chunk);
+    len += chunk;
+    if (offset + chunk == body->segments[body->segment].length) {
+      body->segment_pos += body->segments[body->segment].length;
+      body->segment++;
+    }
+  }
+  return len?(ssize_t)len:MHD_CONTENT_READER_END_OF_STREAM;
+}
+#endif
+
+/**
+ * mhd_segmented_body_free
+ * Release the segments when MHD destroys the response
+ */
+static void mhd_segmented_body_free(void * cls) {
+  struct _u_segmented_body * body = (struct _u_segmented_body *)cls;
+  
+  ulfius_free_body_segments(body->segments, body->nb_segments);
+  o_free(body);
+}
+
+/**
+ * ulfius_create_response_from_segments
+ * Create the MHD response from the segmented body of the response without copying the segments
+ * MHD sends the segments with a single vectored write if available, or through a reader callback otherwise
+ * return the MHD response on success, NULL on error
+ */
+static struct MHD_Response * ulfius_create_response_from_segments(struct _u_response * response) {
+  struct MHD_Response * mhd_response = NULL;
+  struct _u_segmented_body * body;
+#if MHD_VERSION >= 0x00097204
+  struct MHD_IoVec * iov;
+#else
+  uint64_t length = 0;
+#endif
+  size_t i;
+  
+  if ((body = o_malloc(sizeof(struct _u_segmented_body))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for segmented body");
+    return NULL;
+  }
+  body->segments = response->body_segments;
+  body->nb_segments = response->nb_body_segments;
+  body->segment = 0;
+  body->segment_pos = 0;
+#if MHD_VERSION >= 0x00097204
+  // MHD keeps its own copy of the iov array
+  if ((iov = o_malloc(body->nb_segments*sizeof(struct MHD_IoVec))) != NULL) {
+    for (i=0; i<body->nb_segments; i++) {
+      iov[i].iov_base = body->segments[i].data;
+      iov[i].iov_len = body->segments[i].length;
+    }
+    mhd_response = MHD_create_response_from_iovec(iov, (unsigned int)body->nb_segments, &mhd_segmented_body_free, body);
+    o_free(iov);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for iov");
+  }
+#else
+  for (i=0; i<body->nb_segments; i++) {
+    length += body->segments[i].length;
+  }
+  mhd_response = MHD_create_response_from_callback(length, response->stream_block_size, &mhd_segmented_body_reader, body, &mhd_segmented_body_free);
+#endif
+  if (mhd_response != NULL) {
+    // The segments are now released by MHD
+    response->body_segments = NULL;
+    response->nb_body_segments = 0;
+  } else {
+    o_free(body);
+  }
+  return mhd_response;
+}
+
+/**
+ * Stream response whose block size adapts to the speed of the client socket
+ */
+struct _u_adaptive_stream {
+  ssize_t         (* stream_callback) (void * stream_user_data, uint64_t offset, char * out_buf, size_t max);
+  void            (* stream_callback_free) (void * stream_user_data);
+  void             * stream_user_data;
+  size_t             block_size;
+  size_t             block_size_min;
+  size_t             block_size_max;
+  int                last_block_full;
+  struct timespec    last_read;
+};
+
+/**
+ * mhd_adaptive_stream_reader
+ * Read the next block of the stream, the block size is doubled if the previous block was drained quickly
+ * by the socket and was full, and halved if the socket was slow
+ * MHD calls the reader again only when the previous block is sent
+ */
+static ssize_t mhd_adaptive_stream_reader(void * cls, uint64_t pos, char * buf, size_t max) {
+  struct _u_adaptive_stream * stream = (struct _u_adaptive_stream *)cls;
+  struct timespec now;
+  long long elapsed;
+  ssize_t ret;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (stream->last_read.tv_sec || stream->last_read.tv_nsec) {
+    elapsed = (long long)(now.tv_sec - stream->last_read.tv_sec)*1000000 + (now.tv_nsec - stream->last_read.tv_nsec)/1000;
+    if (elapsed < U_STREAM_ADAPTIVE_FAST_DRAIN && stream->last_block_full && stream->block_size < stream->block_size_max) {
+      stream->block_size = stream->block_size*2<stream->block_size_max?stream->block_size*2:stream->block_size_max;
+    } else if (elapsed > U_STREAM_ADAPTIVE_SLOW_DRAIN && stream->block_size > stream->block_size_min) {
+      stream->block_size = stream->block_size/2>stream->block_size_min?stream->block_size/2:stream->block_size_min;
+    }
+  }
+  if (max > stream->block_size) {
+    max = stream->block_size;
+  }
+  ret = stream->stream_callback(stream->stream_user_data, pos, buf, max);
+  stream->last_block_full = (ret == (ssize_t)max);
+  // The time spent in the stream callback isn't counted as drain time
+  clock_gettime(CLOCK_MONOTONIC, &stream->last_read);
+  return ret;
+}
+
+/**
+ * mhd_adaptive_stream_free
+ * Free the adaptive stream and run the stream free callback
+ */
+static void mhd_adaptive_stream_free(void * cls) {
+  struct _u_adaptive_stream * stream = (struct _u_adaptive_stream *)cls;
+  
+  if (stream->stream_callback_free != NULL) {
+    stream->stream_callback_free(stream->stream_user_data);
+  }
+  o_free(stream);
+}
+
+/**
+ * ulfius_create_response_from_stream
+ * Create the MHD response from the stream callback of the response
+ * In adaptive mode, MHD allocates blocks of stream_block_size_max bytes,
+ * and the stream callback is called with a block size that starts at the response stream_block_size
+ * return the MHD response on success, NULL on error
+ */
+static struct MHD_Response * ulfius_create_response_from_stream(const struct _u_instance * u_instance, struct _u_response * response) {
+  struct MHD_Response * mhd_response;
+  struct _u_adaptive_stream * stream;
+  
+  if (u_instance->stream_block_size_max <= response->stream_block_size) {
+    return MHD_create_response_from_callback(response->stream_size, response->stream_block_size, response->stream_callback, response->stream_user_data, response->stream_callback_free);
+  }
+  if ((stream = o_malloc(sizeof(struct _u_adaptive_stream))) == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for adaptive stream");
+    return NULL;
+  }
+  stream->stream_callback = response->stream_callback;
+  stream->stream_callback_free = response->stream_callback_free;
+  stream->stream_user_data = response->stream_user_data;
+  stream->block_size = response->stream_block_size;
+  stream->block_size_min = response->stream_block_size;
+  stream->block_size_max = u_instance->stream_block_size_max;
+  stream->last_block_full = 0;
+  stream->last_read.tv_sec = 0;
+  stream->last_read.tv_nsec = 0;
+  mhd_response = MHD_create_response_from_callback(response->stream_size, stream->block_size_max, &mhd_adaptive_stream_reader, stream, &mhd_adaptive_stream_free);
+  if (mhd_response == NULL) {
+    o_free(stream);
+  }
+  return mhd_response;
+}
+
+/**
+ * ulfius_create_response_from_body
+ * Create the MHD response from the body of the response without copying it
+ * If the body is owned by the response, it's handed over to MHD, or to response_buffer if MHD copies it
+ * If the body was set by ulfius_set_buffer_body_response or ulfius_set_segmented_body_response,
+ * MHD uses it in place and runs the release callbacks when it doesn't need it anymore
+ * If the body was set by ulfius_set_file_response, MHD sends the file with sendfile if possible and closes it
+ * return the MHD response on success, NULL on error
+ */
+static struct MHD_Response * ulfius_create_response_from_body(struct _u_response * response, void ** response_buffer, size_t * response_buffer_len, int mhd_response_flag) {
+  struct MHD_Response * mhd_response = NULL;
+#if MHD_VERSION < 0x00097302
+  struct _u_buffer_body * buffer_body;
+#endif
+  // mhd_response_flag is used by MHD_CREATE_RESPONSE_FROM_BUFFER_PIMPED with old MHD versions only
+  UNUSED(mhd_response_flag);
+  
+  if (response->body_fd >= 0) {
+    // MHD closes the file descriptor when the response is destroyed
+    mhd_response = MHD_create_response_from_fd_at_offset64(response->body_fd_length, response->body_fd, response->body_fd_offset);
+    if (mhd_response != NULL) {
+      response->body_fd = -1;
+    }
+  } else if (response->nb_body_segments > 0) {
+    mhd_response = ulfius_create_response_from_segments(response);
+  } else if (response->binary_body_free != NULL) {
+#if MHD_VERSION >= 0x00097302
+    mhd_response = MHD_create_response_from_buffer_with_free_callback_cls(response->binary_body_length, response->binary_body, response->binary_body_free, response->binary_body_free_cls);
+#else
+    if ((buffer_body = o_malloc(sizeof(struct _u_buffer_body))) != NULL) {
+      buffer_body->data = response->binary_body;
+      buffer_body->length = response->binary_body_length;
+      buffer_body->release_callback = response->binary_body_free;
+      buffer_body->release_cls = response->binary_body_free_cls;
+      mhd_response = MHD_create_response_from_callback(response->binary_body_length, response->stream_block_size, &mhd_buffer_body_reader, buffer_body, &mhd_buffer_body_free);
+      if (mhd_response == NULL) {
+        o_free(buffer_body);
+      }
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for buffer_body");
+    }
+#endif
+    if (mhd_response != NULL) {
+      // The body is now released by MHD
+      response->binary_body = NULL;
+      response->binary_body_length = 0;
+      response->binary_body_free = NULL;
+      response->binary_body_free_cls = NULL;
+    }
+  } else {
+    *response_buffer = response->binary_body;
+    *response_buffer_len = response->binary_body!=NULL?response->binary_body_length:0;
+    response->binary_body = NULL;
+    response->binary_body_length = 0;
+    mhd_response = MHD_CREATE_RESPONSE_FROM_BUFFER_PIMPED (*response_buffer_len, *response_buffer, mhd_response_flag );
+#if MHD_VERSION >= 0x00096100
+    if (mhd_response == NULL) {
+      o_free(*response_buffer);
+      *response_buffer = NULL;
+    }
+#endif
+  }
+  return mhd_response;
+}
+
 /**
  * ulfius_webservice_dispatcher
  * function executed by libmicrohttpd every time an HTTP call is made
@@ -357,9 +831,12 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
                                          const char * version, const char * upload_data,
                                          size_t * upload_data_size, void ** con_cls) {
 
-  struct _u_endpoint * endpoint_list = ((struct _u_instance *)cls)->endpoint_list, ** current_endpoint_list = NULL, * current_endpoint = NULL;
+  const struct _u_endpoint * current_endpoint = NULL;
+  struct _u_route_table * route_table = NULL;
+  struct _u_route_match route_match;
   struct connection_info_struct * con_info = * con_cls;
-  int mhd_ret = MHD_NO, callback_ret = U_OK, i, close_loop = 0, inner_error = U_OK, mhd_response_flag;
+  int mhd_ret = MHD_NO, callback_ret = U_OK, close_loop = 0, inner_error = U_OK, mhd_response_flag;
+  size_t i;
 #ifndef U_DISABLE_WEBSOCKET
   // Websocket variables
   int upgrade_protocol = 0;
@@ -421,9 +898,9 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
     so_client = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS)->client_addr;
     con_info->has_post_processor = 0;
     con_info->max_post_param_size = ((struct _u_instance *)cls)->max_post_param_size;
-    con_info->request->http_protocol = o_strdup(version);
-    con_info->request->http_verb = o_strdup(method);
-    con_info->request->client_address = o_malloc(sizeof(struct sockaddr));
+    con_info->request->http_protocol = ulfius_arena_strdup((struct _u_arena *)con_info->arena, version);
+    con_info->request->http_verb = ulfius_arena_strdup((struct _u_arena *)con_info->arena, method);
+    con_info->request->client_address = ulfius_arena_alloc((struct _u_arena *)con_info->arena, sizeof(struct sockaddr));
     if (con_info->request->client_address == NULL || con_info->request->http_verb == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating client_address or http_verb");
       return MHD_NO;
@@ -444,62 +921,69 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
     if (content_type != NULL && (0 == o_strncmp(MHD_HTTP_POST_ENCODING_FORM_URLENCODED, content_type, o_strlen(MHD_HTTP_POST_ENCODING_FORM_URLENCODED)) || 
         0 == o_strncmp(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA, content_type, o_strlen(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA)))) {
       con_info->has_post_processor = 1;
-      con_info->post_processor = MHD_create_post_processor (connection, ULFIUS_POSTBUFFERSIZE, mhd_iterate_post_data, (void *) con_info);
+      con_info->post_processor = MHD_create_post_processor (connection, con_info->u_instance->post_buffer_size, mhd_iterate_post_data, (void *) con_info);
       if (NULL == con_info->post_processor) {
-        ulfius_clean_request_full(con_info->request);
+        ulfius_clean_arena_request(con_info->request);
         con_info->request = NULL;
         y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating post_processor");
         return MHD_NO;
       }
     }
+    ulfius_set_body_handler(con_info, method);
     return MHD_YES;
   } else if (*upload_data_size != 0) {
-    size_t body_len = con_info->request->binary_body_length + *upload_data_size, upload_data_size_current = *upload_data_size;
+    size_t upload_data_size_current = *upload_data_size;
+    const char * content_type;
     
-    if (((struct _u_instance *)cls)->max_post_body_size > 0 && con_info->request->binary_body_length + *upload_data_size > ((struct _u_instance *)cls)->max_post_body_size) {
-      body_len = ((struct _u_instance *)cls)->max_post_body_size;
-      upload_data_size_current = ((struct _u_instance *)cls)->max_post_body_size - con_info->request->binary_body_length;
+    if (((struct _u_instance *)cls)->max_post_body_size > 0 && con_info->body_length + *upload_data_size > ((struct _u_instance *)cls)->max_post_body_size) {
+      upload_data_size_current = con_info->body_length<((struct _u_instance *)cls)->max_post_body_size?(size_t)(((struct _u_instance *)cls)->max_post_body_size - con_info->body_length):0;
     }
     
-    if (body_len >= con_info->request->binary_body_length) {
-      con_info->request->binary_body = o_realloc(con_info->request->binary_body, body_len);
-      if (con_info->request->binary_body == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for con_info->request->binary_body");
-        return MHD_NO;
+    content_type = u_map_get_case(con_info->request->map_header, ULFIUS_HTTP_HEADER_CONTENT);
+    if (upload_data_size_current) {
+      if (con_info->body_callback != NULL) {
+        // The body is handed over to the endpoint as it's received and isn't stored
+        if (con_info->body_callback(con_info->request, upload_data, con_info->body_length, upload_data_size_current, con_info->body_user_data) != U_OK) {
+          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error body_callback");
+          return MHD_NO;
+        }
+      } else if (con_info->has_post_processor && con_info->u_instance->upload_file_directory != NULL && con_info->u_instance->file_upload_callback == NULL &&
+                 0 == o_strncmp(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA, content_type, o_strlen(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA))) {
+        // The file parts are written in the upload directory by the post processor and the other parts are stored in map_post_body,
+        // so the multipart body isn't stored in binary_body
+      } else if (con_info->request->body_fd >= 0 || (con_info->body_file_threshold && con_info->body_length + upload_data_size_current > con_info->body_file_threshold)) {
+        if (ulfius_write_request_body_file(con_info->request, upload_data, upload_data_size_current) != U_OK) {
+          return MHD_NO;
+        }
       } else {
+        if (ulfius_reserve_request_body(con_info, upload_data_size_current) != U_OK) {
+          return MHD_NO;
+        }
         memcpy((char*)con_info->request->binary_body + con_info->request->binary_body_length, upload_data, upload_data_size_current);
         con_info->request->binary_body_length += upload_data_size_current;
-        // Handles request binary_body
-        const char * content_type = u_map_get_case(con_info->request->map_header, ULFIUS_HTTP_HEADER_CONTENT);
-        if (0 == o_strncmp(MHD_HTTP_POST_ENCODING_FORM_URLENCODED, content_type, o_strlen(MHD_HTTP_POST_ENCODING_FORM_URLENCODED)) || 
-            0 == o_strncmp(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA, content_type, o_strlen(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA))) {
-          MHD_post_process (con_info->post_processor, upload_data, *upload_data_size);
-        }
-        *upload_data_size = 0;
-        return MHD_YES;
       }
-    } else {
-      return MHD_YES;
+      con_info->body_length += upload_data_size_current;
     }
+    // Handles request binary_body, a body handed over to body_callback isn't parsed
+    if (con_info->body_callback == NULL &&
+        (0 == o_strncmp(MHD_HTTP_POST_ENCODING_FORM_URLENCODED, content_type, o_strlen(MHD_HTTP_POST_ENCODING_FORM_URLENCODED)) || 
+         0 == o_strncmp(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA, content_type, o_strlen(MHD_HTTP_POST_ENCODING_MULTIPART_FORMDATA)))) {
+      MHD_post_process (con_info->post_processor, upload_data, *upload_data_size);
+    }
+    *upload_data_size = 0;
+    return MHD_YES;
   } else {
-    // Check if the endpoint has one or more matches
-    current_endpoint_list = ulfius_endpoint_match(method, con_info->request->url_path, endpoint_list);
-    
-    // Set to default_endpoint if no match
-    if ((current_endpoint_list == NULL || current_endpoint_list[0] == NULL) && ((struct _u_instance *)cls)->default_endpoint != NULL && ((struct _u_instance *)cls)->default_endpoint->callback_function != NULL) {
-      current_endpoint_list = o_realloc(current_endpoint_list, 2*sizeof(struct _u_endpoint *));
-      if (current_endpoint_list != NULL) {
-        if ((current_endpoint_list[0] = o_malloc(sizeof(struct _u_endpoint))) != NULL) {
-          if (ulfius_copy_endpoint(current_endpoint_list[0], ((struct _u_instance *)cls)->default_endpoint) != U_OK) {
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_copy_endpoint for current_endpoint_list[0]");
-          }
-        } else {
-          y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for current_endpoint_list[0] of default endpoint");
-        }
-        current_endpoint_list[1] = NULL;
-      } else {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for current_endpoint_list of default endpoint");
-      }
+    // The last post value is complete
+    ulfius_post_value_complete(con_info);
+    // The last file written in the upload file directory is complete
+    if (ulfius_upload_file_close(con_info) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_upload_file_close");
+    }
+    // Check if the endpoint has one or more matches, the default endpoint is returned if no match
+    // The route table is pinned until the end of the request, so endpoints can be added or removed meanwhile
+    route_table = ulfius_router_acquire((struct _u_router *)((struct _u_instance *)cls)->router);
+    if (ulfius_route_match(route_table, method, con_info->request->url_path, &route_match) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_route_match");
     }
     
 #if MHD_VERSION >= 0x00096100
@@ -507,16 +991,16 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
 #else
     mhd_response_flag = MHD_RESPMEM_MUST_FREE;
 #endif
-    if (current_endpoint_list[0] != NULL) {
-      response = o_malloc(sizeof(struct _u_response));
+    if (route_match.nb_routes) {
+      response = ulfius_arena_alloc((struct _u_arena *)con_info->arena, sizeof(struct _u_response));
       if (response == NULL) {
         y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating response");
         mhd_ret = MHD_NO;
       } else if (ulfius_init_response(response) != U_OK) {
-        o_free(response);
         y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_init_response");
         mhd_ret = MHD_NO;
       } else {
+        response->stream_block_size = ((struct _u_instance *)cls)->stream_block_size;
         // Add default headers (if any) to the response header maps
         if (((struct _u_instance *)cls)->default_headers != NULL && u_map_count(((struct _u_instance *)cls)->default_headers) > 0) {
           u_map_clean_full(response->map_header);
@@ -526,13 +1010,11 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
         // Initialize auth variables
         con_info->request->auth_basic_user = MHD_basic_auth_get_username_password(connection, &con_info->request->auth_basic_password);
         
-        for (i=0; current_endpoint_list[i] != NULL && !close_loop; i++) {
-          current_endpoint = current_endpoint_list[i];
-          u_map_empty(con_info->request->map_url);
-          u_map_copy_into(con_info->request->map_url, &con_info->map_url_initial);
-          if (ulfius_parse_url(con_info->request->url_path, current_endpoint, con_info->request->map_url, con_info->u_instance->check_utf8) != U_OK) {
-            o_free(response);
-            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error parsing url: ", con_info->request->url_path);
+        for (i=0; i<route_match.nb_routes && !close_loop; i++) {
+          current_endpoint = route_match.routes[i]->endpoint;
+          // Fill map_url with the url parameters captured by the route match
+          if (ulfius_route_match_fill_map_url(&route_match, route_match.routes[i], &con_info->map_url_initial, con_info->request->map_url, con_info->u_instance->check_utf8) != U_OK) {
+            y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error parsing url: %s", con_info->request->url_path);
             mhd_ret = MHD_NO;
           }
           // Run callback function with the input parameters filled for the current callback
@@ -544,9 +1026,14 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
           if (response->stream_callback != NULL) {
             // Call the stream_callback function to build the response binary_body
             // A stram_callback is always the last one
-            mhd_response = MHD_create_response_from_callback(response->stream_size, response->stream_block_size, response->stream_callback, response->stream_user_data, response->stream_callback_free);
+#ifndef U_DISABLE_ZLIB
+            if (!current_endpoint->disable_compression) {
+              ulfius_compress_response((struct _u_instance *)cls, con_info->request, response);
+            }
+#endif
+            mhd_response = ulfius_create_response_from_stream((struct _u_instance *)cls, response);
             if (mhd_response == NULL) {
-              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error MHD_create_response_from_callback");
+              y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_create_response_from_stream");
               mhd_ret = MHD_NO;
             } else if (ulfius_set_response_header(mhd_response, response->map_header) == -1 || ulfius_set_response_cookie(mhd_response, response) == -1) {
               y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headers or cookies");
@@ -676,7 +1163,7 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
             }
 #endif
           } else {
-            if (callback_ret == U_CALLBACK_CONTINUE && current_endpoint_list[i+1] == NULL) {
+            if (callback_ret == U_CALLBACK_CONTINUE && i+1 == route_match.nb_routes) {
               // If callback_ret is U_CALLBACK_CONTINUE but callback function is the last one on the list
               callback_ret = U_CALLBACK_COMPLETE;
             }
@@ -686,19 +1173,18 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
                 break;
               case U_CALLBACK_COMPLETE:
                 close_loop = 1;
-                if (ulfius_get_body_from_response(response, &response_buffer, &response_buffer_len) == U_OK) {
-                  // Build the response binary_body
-                  mhd_response = MHD_CREATE_RESPONSE_FROM_BUFFER_PIMPED (response_buffer_len, response_buffer, mhd_response_flag );
-                  if (mhd_response == NULL) {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error MHD_create_response_from_buffer");
-                    mhd_ret = MHD_NO;
-                  } else if (ulfius_set_response_header(mhd_response, response->map_header) == -1 || ulfius_set_response_cookie(mhd_response, response) == -1) {
-                    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headers or cookies");
-                    mhd_ret = MHD_NO;
-                  }
-                } else {
+#ifndef U_DISABLE_ZLIB
+                if (!current_endpoint->disable_compression) {
+                  ulfius_compress_response((struct _u_instance *)cls, con_info->request, response);
+                }
+#endif
+                // Build the response binary_body
+                mhd_response = ulfius_create_response_from_body(response, &response_buffer, &response_buffer_len, mhd_response_flag);
+                if (mhd_response == NULL) {
                   // Error building response, sending error 500
+                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error MHD_create_response_from_buffer");
                   response->status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+                  o_free(response_buffer);
                   response_buffer = o_strdup(ULFIUS_HTTP_ERROR_BODY);
                   if (response_buffer == NULL) {
                     y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for response_buffer");
@@ -707,39 +1193,25 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
                     response_buffer_len = o_strlen(ULFIUS_HTTP_ERROR_BODY);
                     mhd_response = MHD_CREATE_RESPONSE_FROM_BUFFER_PIMPED (response_buffer_len, response_buffer, mhd_response_flag );
                   }
+                } else if (ulfius_set_response_header(mhd_response, response->map_header) == -1 || ulfius_set_response_cookie(mhd_response, response) == -1) {
+                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headers or cookies");
+                  mhd_ret = MHD_NO;
                 }
                 break;
               case U_CALLBACK_UNAUTHORIZED:
                 close_loop = 1;
                 // Wrong credentials, send status 401 and realm value if set
-                if (ulfius_get_body_from_response(response, &response_buffer, &response_buffer_len) == U_OK) {
-                  mhd_response = MHD_CREATE_RESPONSE_FROM_BUFFER_PIMPED (response_buffer_len, response_buffer, mhd_response_flag );
-                  if (ulfius_set_response_header(mhd_response, response->map_header) == -1 || ulfius_set_response_cookie(mhd_response, response) == -1) {
-                    inner_error = U_ERROR_PARAMS;
-                    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headers or cookies");
-                    response->status = MHD_HTTP_INTERNAL_SERVER_ERROR;
-                    response->binary_body = o_strdup(ULFIUS_HTTP_ERROR_BODY);
-                    response->binary_body_length = o_strlen(ULFIUS_HTTP_ERROR_BODY);
-                    if (response->binary_body == NULL) {
-                      inner_error = U_ERROR_MEMORY;
-                      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for response->binary_body");
-                      mhd_ret = MHD_NO;
-                    }
-                  } else {
-                    inner_error = U_CALLBACK_UNAUTHORIZED;
-                  }
+                mhd_response = ulfius_create_response_from_body(response, &response_buffer, &response_buffer_len, mhd_response_flag);
+                if (mhd_response == NULL) {
+                  inner_error = U_ERROR_MEMORY;
+                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error MHD_create_response_from_buffer");
+                  mhd_ret = MHD_NO;
+                } else if (ulfius_set_response_header(mhd_response, response->map_header) == -1 || ulfius_set_response_cookie(mhd_response, response) == -1) {
+                  inner_error = U_ERROR_PARAMS;
+                  y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error setting headers or cookies");
+                  response->status = MHD_HTTP_INTERNAL_SERVER_ERROR;
                 } else {
-                  // Error building response, sending error 500
-                  response_buffer = o_strdup(ULFIUS_HTTP_ERROR_BODY);
-                  if (response_buffer == NULL) {
-                    inner_error = U_ERROR_MEMORY;
-                    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for response_buffer");
-                    mhd_ret = MHD_NO;
-                  } else {
-                    response_buffer_len = o_strlen(ULFIUS_HTTP_ERROR_BODY);
-                    mhd_response = MHD_CREATE_RESPONSE_FROM_BUFFER_PIMPED (response_buffer_len, response_buffer, mhd_response_flag );
-                    inner_error = U_CALLBACK_UNAUTHORIZED;
-                  }
+                  inner_error = U_CALLBACK_UNAUTHORIZED;
                 }
                 if (response->auth_realm != NULL) {
                   auth_realm = response->auth_realm;
@@ -778,10 +1250,10 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
             mhd_ret = MHD_queue_response (connection, response->status, mhd_response);
           }
           MHD_destroy_response (mhd_response);
-          // Free Response parameters
-          ulfius_clean_response_full(response);
-          response = NULL;
         }
+        // Free Response parameters, response is allocated in the arena
+        ulfius_clean_response(response);
+        response = NULL;
       }
     } else {
       response_buffer = o_strdup(ULFIUS_HTTP_NOT_FOUND_BODY);
@@ -802,15 +1274,71 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
 #else
     (void)mhd_response_flag;
 #endif
-    for (i=0; current_endpoint_list[i] != NULL; i++) {
-      ulfius_clean_endpoint(current_endpoint_list[i]);
-      o_free(current_endpoint_list[i]);
-    }
-    o_free(current_endpoint_list);
+    ulfius_clean_route_match(&route_match);
+    ulfius_release_route_table(route_table);
     return mhd_ret;
   }
 }
 
+/**
+ * ulfius_publish_route_table
+ * Compiles u_instance->endpoint_list and u_instance->default_endpoint into a new route table
+ * and replaces the current one, requests being processed keep using the previous one
+ * router->lock must be locked by the caller
+ * return U_OK on success
+ */
+static int ulfius_publish_route_table(struct _u_instance * u_instance) {
+  struct _u_route_table * route_table;
+  
+  if (u_instance->router == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error instance router not initialized");
+    return U_ERROR_PARAMS;
+  }
+  route_table = ulfius_build_route_table(u_instance->endpoint_list, u_instance->default_endpoint);
+  if (route_table != NULL) {
+    ulfius_router_publish((struct _u_router *)u_instance->router, route_table);
+    return U_OK;
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error ulfius_build_route_table");
+    return U_ERROR_MEMORY;
+  }
+}
+
+/**
+ * ulfius_update_route_table
+ * Publish a new route table after the endpoints were changed
+ * The route table is built when the framework starts, so nothing is done until then
+ * router->lock must be locked by the caller
+ * return U_OK on success
+ */
+static int ulfius_update_route_table(struct _u_instance * u_instance) {
+  if (u_instance->router == NULL) {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error instance router not initialized");
+    return U_ERROR_PARAMS;
+  }
+  if (__atomic_load_n(&((struct _u_router *)u_instance->router)->route_table, __ATOMIC_SEQ_CST) == NULL) {
+    return U_OK;
+  }
+  return ulfius_publish_route_table(u_instance);
+}
+
+/**
+ * ulfius_get_thread_pool_size
+ * return the number of threads to use when the instance runs in U_EXECUTION_MODE_THREAD_POOL
+ * i.e. u_instance->thread_pool_size if set, the number of online CPUs otherwise
+ */
+static unsigned int ulfius_get_thread_pool_size(const struct _u_instance * u_instance) {
+  long nb_cpu = 1;
+  
+  if (u_instance->thread_pool_size) {
+    return u_instance->thread_pool_size;
+  }
+#ifdef _SC_NPROCESSORS_ONLN
+  nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return nb_cpu>0?(unsigned int)nb_cpu:1;
+}
+
 /**
  * ulfius_run_mhd_daemon
  * Starts a mhd daemon for the specified instance
@@ -818,21 +1346,45 @@ static int ulfius_webservice_dispatcher (void * cls, struct MHD_Connection * con
  * 
  */
 static struct MHD_Daemon * ulfius_run_mhd_daemon(struct _u_instance * u_instance, const char * key_pem, const char * cert_pem, const char * root_ca_perm) {
-  unsigned int mhd_flags = MHD_USE_THREAD_PER_CONNECTION;
-  int index;
+  unsigned int mhd_flags, thread_pool_size = 0;
+  size_t block_size_max;
+  int index, ret;
 
-#ifdef DEBUG
-  mhd_flags |= MHD_USE_DEBUG;
+  if (u_instance->execution_mode == U_EXECUTION_MODE_THREAD_POOL) {
+    // Connections are multiplexed by MHD's internal event loop, epoll if available, and served by a fixed pool of threads
+#if MHD_VERSION >= 0x00095500
+    mhd_flags = MHD_USE_AUTO | MHD_USE_INTERNAL_POLLING_THREAD;
+#else
+    mhd_flags = MHD_USE_SELECT_INTERNALLY;
 #endif
+    thread_pool_size = ulfius_get_thread_pool_size(u_instance);
+  } else {
+    mhd_flags = MHD_USE_THREAD_PER_CONNECTION;
 #if MHD_VERSION >= 0x00095300
-  mhd_flags |= MHD_USE_INTERNAL_POLLING_THREAD;
+    mhd_flags |= MHD_USE_INTERNAL_POLLING_THREAD;
+#endif
+  }
+#ifdef DEBUG
+  mhd_flags |= MHD_USE_DEBUG;
 #endif
 #ifndef U_DISABLE_WEBSOCKET
   mhd_flags |= MHD_ALLOW_UPGRADE;
 #endif
   
   if (u_instance->mhd_daemon == NULL) {
-    struct MHD_OptionItem mhd_ops[8];
+    struct MHD_OptionItem mhd_ops[10];
+    
+    // endpoint_list may have been modified directly since the last ulfius_add_endpoint
+    if (u_instance->router == NULL) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error instance router not initialized");
+      return NULL;
+    }
+    pthread_mutex_lock(&((struct _u_router *)u_instance->router)->lock);
+    ret = ulfius_publish_route_table(u_instance);
+    pthread_mutex_unlock(&((struct _u_router *)u_instance->router)->lock);
+    if (ret != U_OK) {
+      return NULL;
+    }
     
     // Default options
     mhd_ops[0].option = MHD_OPTION_NOTIFY_COMPLETED;
@@ -900,6 +1452,24 @@ static struct MHD_Daemon * ulfius_run_mhd_daemon(struct _u_instance * u_instance
       index++;
     }
 
+    if (thread_pool_size > 1) {
+      mhd_ops[index].option = MHD_OPTION_THREAD_POOL_SIZE;
+      mhd_ops[index].value = thread_pool_size;
+      mhd_ops[index].ptr_value = NULL;
+      
+      index++;
+    }
+
+    // Chunked stream blocks are allocated in the connection memory pool, which must be large enough for the biggest block
+    block_size_max = u_instance->stream_block_size>u_instance->stream_block_size_max?u_instance->stream_block_size:u_instance->stream_block_size_max;
+    if (block_size_max > U_CONNECTION_MEMORY_LIMIT_DEFAULT/2) {
+      mhd_ops[index].option = MHD_OPTION_CONNECTION_MEMORY_LIMIT;
+      mhd_ops[index].value = (intptr_t)(block_size_max + U_CONNECTION_MEMORY_LIMIT_DEFAULT);
+      mhd_ops[index].ptr_value = NULL;
+      
+      index++;
+    }
+
     mhd_ops[index].option = MHD_OPTION_END;
     mhd_ops[index].value = 0;
     mhd_ops[index].ptr_value = NULL;
@@ -1042,19 +1612,24 @@ int ulfius_stop_framework(struct _u_instance * u_instance) {
   if (u_instance != NULL && u_instance->mhd_daemon != NULL) {
 #ifndef U_DISABLE_WEBSOCKET
     int i;
+    pthread_mutex_lock(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock);
     // Loop in all active websockets and send close signal
     for (i=((struct _websocket_handler *)u_instance->websocket_handler)->nb_websocket_active-1; i>=0; i--) {
-      ((struct _websocket_handler *)u_instance->websocket_handler)->websocket_active[i]->websocket_manager->close_flag = 1;
+      ulfius_websocket_send_close_signal(((struct _websocket_handler *)u_instance->websocket_handler)->websocket_active[i]->websocket_manager);
     }
-    pthread_mutex_lock(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock);
     while (((struct _websocket_handler *)u_instance->websocket_handler)->nb_websocket_active > 0) {
       pthread_cond_wait(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_cond, &((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock);
     }
     pthread_mutex_unlock(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock);
+    ulfius_websocket_reactor_stop(u_instance);
 #endif 
     MHD_stop_daemon (u_instance->mhd_daemon);
     u_instance->mhd_daemon = NULL;
     u_instance->status = U_STATUS_STOP;
+    // No request uses the route table anymore, it will be built again if the framework is restarted
+    pthread_mutex_lock(&((struct _u_router *)u_instance->router)->lock);
+    ulfius_router_publish((struct _u_router *)u_instance->router, NULL);
+    pthread_mutex_unlock(&((struct _u_router *)u_instance->router)->lock);
     return U_OK;
   } else if (u_instance != NULL) {
     u_instance->status = U_STATUS_ERROR;
@@ -1076,6 +1651,9 @@ int ulfius_copy_endpoint(struct _u_endpoint * dest, const struct _u_endpoint * s
     dest->callback_function = source->callback_function;
     dest->user_data = source->user_data;
     dest->priority = source->priority;
+    dest->disable_compression = source->disable_compression;
+    dest->body_callback = source->body_callback;
+    dest->body_file_threshold = source->body_file_threshold;
     if (ulfius_is_valid_endpoint(dest, 0)) {
       return U_OK;
     } else {
@@ -1138,13 +1716,26 @@ void ulfius_clean_endpoint_list(struct _u_endpoint * endpoint_list) {
 }
 
 /**
- * Add a struct _u_endpoint * to the specified u_instance
- * Can be done during the execution of the webservice for injection
- * u_instance: pointer to a struct _u_instance that describe its port and bind address
- * u_endpoint: pointer to a struct _u_endpoint that will be copied in the u_instance endpoint_list
+ * internal_ulfius_remove_last_endpoints
+ * Remove the last nb_endpoints endpoints of u_instance->endpoint_list, used to undo an add
+ * router->lock must be locked by the caller
+ */
+static void internal_ulfius_remove_last_endpoints(struct _u_instance * u_instance, int nb_endpoints) {
+  for (; nb_endpoints > 0 && u_instance->nb_endpoints > 0; nb_endpoints--) {
+    u_instance->nb_endpoints--;
+    ulfius_clean_endpoint(&u_instance->endpoint_list[u_instance->nb_endpoints]);
+  }
+  // The empty endpoint terminates the endpoint list
+  ulfius_copy_endpoint(&u_instance->endpoint_list[u_instance->nb_endpoints], ulfius_empty_endpoint());
+}
+
+/**
+ * internal_ulfius_append_endpoint
+ * Append a copy of a struct _u_endpoint * to the endpoint list of the specified u_instance
+ * router->lock must be locked by the caller
  * return U_OK on success
  */
-int ulfius_add_endpoint(struct _u_instance * u_instance, const struct _u_endpoint * u_endpoint) {
+static int internal_ulfius_append_endpoint(struct _u_instance * u_instance, const struct _u_endpoint * u_endpoint) {
   int res;
   
   if (u_instance != NULL && u_endpoint != NULL) {
@@ -1165,14 +1756,13 @@ int ulfius_add_endpoint(struct _u_instance * u_instance, const struct _u_endpoin
           return U_ERROR_MEMORY;
         }
       }
+      // Add empty endpoint at the end of the endpoint list
+      ulfius_copy_endpoint(&u_instance->endpoint_list[u_instance->nb_endpoints], ulfius_empty_endpoint());
       res = ulfius_copy_endpoint(&u_instance->endpoint_list[u_instance->nb_endpoints - 1], u_endpoint);
       if (res != U_OK) {
-        return res;
-      } else {
-        // Add empty endpoint at the end of the endpoint list
-        ulfius_copy_endpoint(&u_instance->endpoint_list[u_instance->nb_endpoints], ulfius_empty_endpoint());
+        internal_ulfius_remove_last_endpoints(u_instance, 1);
       }
-      return U_OK;
+      return res;
     } else {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - ulfius_add_endpoint, invalid struct _u_endpoint");
       return U_ERROR_PARAMS;
@@ -1184,23 +1774,66 @@ int ulfius_add_endpoint(struct _u_instance * u_instance, const struct _u_endpoin
   return U_ERROR;
 }
 
+/**
+ * internal_ulfius_add_endpoint
+ * Add a struct _u_endpoint * to the specified u_instance and publish a new route table if the instance is started
+ * The endpoint is removed if the route table can't be built
+ * router->lock must be locked by the caller
+ * return U_OK on success
+ */
+static int internal_ulfius_add_endpoint(struct _u_instance * u_instance, const struct _u_endpoint * u_endpoint) {
+  int res = internal_ulfius_append_endpoint(u_instance, u_endpoint);
+  
+  if (res == U_OK && (res = ulfius_update_route_table(u_instance)) != U_OK) {
+    internal_ulfius_remove_last_endpoints(u_instance, 1);
+  }
+  return res;
+}
+
+/**
+ * Add a struct _u_endpoint * to the specified u_instance
+ * Can be done during the execution of the webservice for injection
+ * u_instance: pointer to a struct _u_instance that describe its port and bind address
+ * u_endpoint: pointer to a struct _u_endpoint that will be copied in the u_instance endpoint_list
+ * return U_OK on success
+ */
+int ulfius_add_endpoint(struct _u_instance * u_instance, const struct _u_endpoint * u_endpoint) {
+  int ret;
+  
+  if (u_instance != NULL && u_instance->router != NULL) {
+    pthread_mutex_lock(&((struct _u_router *)u_instance->router)->lock);
+    ret = internal_ulfius_add_endpoint(u_instance, u_endpoint);
+    pthread_mutex_unlock(&((struct _u_router *)u_instance->router)->lock);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - ulfius_add_endpoint, invalid parameters");
+    ret = U_ERROR_PARAMS;
+  }
+  return ret;
+}
+
 /**
  * Add a struct _u_endpoint * list to the specified u_instance
  * Can be done during the execution of the webservice for injection
+ * The endpoints are added together, if one of them can't be added, none of them is added
  * u_instance: pointer to a struct _u_instance that describe its port and bind address
  * u_endpoint_list: pointer to a struct _u_endpoint that will be copied in the u_instance endpoint_list
  * return U_OK on success
  */
 int ulfius_add_endpoint_list(struct _u_instance * u_instance, const struct _u_endpoint ** u_endpoint_list) {
-  int i, res;
-  if (u_instance != NULL && u_endpoint_list != NULL) {
-    for (i=0; !ulfius_equals_endpoints(u_endpoint_list[i], ulfius_empty_endpoint()); i++) {
-      res = ulfius_add_endpoint(u_instance, u_endpoint_list[i]);
-      if (res != U_OK) {
-        return res;
+  int i, res = U_OK;
+  if (u_instance != NULL && u_instance->router != NULL && u_endpoint_list != NULL) {
+    // All the endpoints are added before a single route table is published, or none is added on error
+    pthread_mutex_lock(&((struct _u_router *)u_instance->router)->lock);
+    for (i=0; res == U_OK && !ulfius_equals_endpoints(u_endpoint_list[i], ulfius_empty_endpoint()); i++) {
+      if ((res = internal_ulfius_append_endpoint(u_instance, u_endpoint_list[i])) != U_OK) {
+        internal_ulfius_remove_last_endpoints(u_instance, i);
       }
     }
-    return U_OK;
+    if (res == U_OK && (res = ulfius_update_route_table(u_instance)) != U_OK) {
+      internal_ulfius_remove_last_endpoints(u_instance, i);
+    }
+    pthread_mutex_unlock(&((struct _u_router *)u_instance->router)->lock);
+    return res;
   } else {
     y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - ulfius_add_endpoint_list, invalid parameters");
     return U_ERROR_PARAMS;
@@ -1209,15 +1842,12 @@ int ulfius_add_endpoint_list(struct _u_instance * u_instance, const struct _u_en
 }
 
 /**
- * Remove a struct _u_endpoint * from the specified u_instance
- * Can be done during the execution of the webservice for injection
- * u_instance: pointer to a struct _u_instance that describe its port and bind address
- * u_endpoint: pointer to a struct _u_endpoint that will be removed in the u_instance endpoint_list
- * The parameters _u_endpoint.http_method, _u_endpoint.url_prefix and _u_endpoint.url_format are strictly compared for the match
- * If no endpoint is found, return U_ERROR_NOT_FOUND
+ * internal_ulfius_remove_endpoint
+ * Remove a struct _u_endpoint * from the specified u_instance and publish a new route table
+ * router->lock must be locked by the caller
  * return U_OK on success
  */
-int ulfius_remove_endpoint(struct _u_instance * u_instance, const struct _u_endpoint * u_endpoint) {
+static int internal_ulfius_remove_endpoint(struct _u_instance * u_instance, const struct _u_endpoint * u_endpoint) {
   int i, j, found = 0, ret = U_OK;
   char * trim_prefix = NULL, * trim_prefix_save = NULL, * trim_format = NULL, * trim_format_save = NULL,
        * trim_cur_prefix = NULL, * trim_cur_prefix_save = NULL, * trim_cur_format = NULL, * trim_cur_format_save = NULL;
@@ -1259,6 +1889,8 @@ int ulfius_remove_endpoint(struct _u_instance * u_instance, const struct _u_endp
     }
     if (!found) {
       ret = U_ERROR_NOT_FOUND;
+    } else if (ret == U_OK) {
+      ret = ulfius_update_route_table(u_instance);
     }
     o_free(trim_prefix_save);
     o_free(trim_format_save);
@@ -1271,6 +1903,29 @@ int ulfius_remove_endpoint(struct _u_instance * u_instance, const struct _u_endp
   return ret;
 }
 
+/**
+ * Remove a struct _u_endpoint * from the specified u_instance
+ * Can be done during the execution of the webservice for injection
+ * u_instance: pointer to a struct _u_instance that describe its port and bind address
+ * u_endpoint: pointer to a struct _u_endpoint that will be removed in the u_instance endpoint_list
+ * The parameters _u_endpoint.http_method, _u_endpoint.url_prefix and _u_endpoint.url_format are strictly compared for the match
+ * If no endpoint is found, return U_ERROR_NOT_FOUND
+ * return U_OK on success
+ */
+int ulfius_remove_endpoint(struct _u_instance * u_instance, const struct _u_endpoint * u_endpoint) {
+  int ret;
+  
+  if (u_instance != NULL && u_instance->router != NULL) {
+    pthread_mutex_lock(&((struct _u_router *)u_instance->router)->lock);
+    ret = internal_ulfius_remove_endpoint(u_instance, u_endpoint);
+    pthread_mutex_unlock(&((struct _u_router *)u_instance->router)->lock);
+  } else {
+    y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - ulfius_remove_endpoint, invalid parameters");
+    ret = U_ERROR_PARAMS;
+  }
+  return ret;
+}
+
 /**
  * ulfius_empty_endpoint
  * return an empty endpoint that goes at the end of an endpoint list
@@ -1283,6 +1938,9 @@ const struct _u_endpoint * ulfius_empty_endpoint() {
   empty_endpoint.url_format = NULL;
   empty_endpoint.callback_function = NULL;
   empty_endpoint.user_data = NULL;
+  empty_endpoint.disable_compression = 0;
+  empty_endpoint.body_callback = NULL;
+  empty_endpoint.body_file_threshold = 0;
   return &empty_endpoint;
 }
 
@@ -1342,6 +2000,9 @@ int ulfius_add_endpoint_by_val(struct _u_instance * u_instance,
     endpoint.priority = priority;
     endpoint.callback_function = callback_function;
     endpoint.user_data = user_data;
+    endpoint.disable_compression = 0;
+    endpoint.body_callback = NULL;
+    endpoint.body_file_threshold = 0;
     return ulfius_add_endpoint(u_instance, &endpoint);
   } else {
     return U_ERROR_PARAMS;
@@ -1386,21 +2047,30 @@ int ulfius_remove_endpoint_by_val(struct _u_instance * u_instance, const char *
 int ulfius_set_default_endpoint(struct _u_instance * u_instance,
                                          int (* callback_function)(const struct _u_request * request, struct _u_response * response, void * user_data),
                                          void * user_data) {
-  if (u_instance != NULL && callback_function != NULL) {
+  int ret;
+  
+  if (u_instance != NULL && u_instance->router != NULL && callback_function != NULL) {
+    pthread_mutex_lock(&((struct _u_router *)u_instance->router)->lock);
     if (u_instance->default_endpoint == NULL) {
       u_instance->default_endpoint = o_malloc(sizeof(struct _u_endpoint));
-      if (u_instance->default_endpoint == NULL) {
-        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_instance->default_endpoint");
-        return U_ERROR_MEMORY;
-      }
     }
-    u_instance->default_endpoint->http_method = NULL;
-    u_instance->default_endpoint->url_prefix = NULL;
-    u_instance->default_endpoint->url_format = NULL;
-    u_instance->default_endpoint->callback_function = callback_function;
-    u_instance->default_endpoint->user_data = user_data;
-    u_instance->default_endpoint->priority = 0;
-    return U_OK;
+    if (u_instance->default_endpoint != NULL) {
+      u_instance->default_endpoint->http_method = NULL;
+      u_instance->default_endpoint->url_prefix = NULL;
+      u_instance->default_endpoint->url_format = NULL;
+      u_instance->default_endpoint->callback_function = callback_function;
+      u_instance->default_endpoint->user_data = user_data;
+      u_instance->default_endpoint->priority = 0;
+      u_instance->default_endpoint->disable_compression = 0;
+      u_instance->default_endpoint->body_callback = NULL;
+      u_instance->default_endpoint->body_file_threshold = 0;
+      ret = ulfius_update_route_table(u_instance);
+    } else {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_instance->default_endpoint");
+      ret = U_ERROR_MEMORY;
+    }
+    pthread_mutex_unlock(&((struct _u_router *)u_instance->router)->lock);
+    return ret;
   } else {
     return U_ERROR_PARAMS;
   }
@@ -1445,6 +2115,38 @@ int ulfius_set_upload_file_callback_function(struct _u_instance * u_instance,
   }
 }
 
+/**
+ * ulfius_set_upload_file_directory
+ * 
+ * Set the directory where the files uploaded in multipart bodies are written
+ * map_post_body gets the path, the size, the filename and the content type of each file
+ * The files are removed when the request is completed
+ * 
+ * u_instance: pointer to a struct _u_instance that describe its port and bind address
+ * directory:  path to an existing directory, NULL to store the files in memory
+ */
+int ulfius_set_upload_file_directory(struct _u_instance * u_instance, const char * directory) {
+  struct stat st;
+  char * dup_directory = NULL;
+
+  if (u_instance != NULL) {
+    if (directory != NULL) {
+      if (stat(directory, &st) || !S_ISDIR(st.st_mode)) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error, %s is not a directory", directory);
+        return U_ERROR_PARAMS;
+      } else if ((dup_directory = o_strdup(directory)) == NULL) {
+        y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for upload_file_directory");
+        return U_ERROR_MEMORY;
+      }
+    }
+    o_free(u_instance->upload_file_directory);
+    u_instance->upload_file_directory = dup_directory;
+    return U_OK;
+  } else {
+    return U_ERROR_PARAMS;
+  }
+}
+
 /**
  * ulfius_clean_instance
  * 
@@ -1452,10 +2154,14 @@ int ulfius_set_upload_file_callback_function(struct _u_instance * u_instance,
  */
 void ulfius_clean_instance(struct _u_instance * u_instance) {
   if (u_instance != NULL) {
+    ulfius_clean_router((struct _u_router *)u_instance->router);
+    o_free(u_instance->router);
     ulfius_clean_endpoint_list(u_instance->endpoint_list);
     u_map_clean_full(u_instance->default_headers);
     o_free(u_instance->default_auth_realm);
+    o_free(u_instance->upload_file_directory);
     o_free(u_instance->default_endpoint);
+    u_instance->router = NULL;
     u_instance->endpoint_list = NULL;
     u_instance->default_headers = NULL;
     u_instance->default_auth_realm = NULL;
@@ -1464,6 +2170,9 @@ void ulfius_clean_instance(struct _u_instance * u_instance) {
 #ifndef U_DISABLE_WEBSOCKET
     /* ulfius_clean_instance might be called without websocket_handler being initialized */
     if ((struct _websocket_handler *)u_instance->websocket_handler) {
+        if (((struct _websocket_handler *)u_instance->websocket_handler)->pthread_init) {
+          ulfius_websocket_reactor_stop(u_instance);
+        }
         if (((struct _websocket_handler *)u_instance->websocket_handler)->pthread_init && 
             (pthread_mutex_destroy(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock) ||
             pthread_cond_destroy(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_cond))) {
@@ -1505,11 +2214,23 @@ UNUSED(network_type);
 #endif
     u_instance->timeout = 0;
     u_instance->default_auth_realm = o_strdup(default_auth_realm);
+    u_instance->upload_file_directory = NULL;
     u_instance->nb_endpoints = 0;
     u_instance->endpoint_list = NULL;
+    u_instance->router = NULL;
     u_instance->default_headers = o_malloc(sizeof(struct _u_map));
     u_instance->mhd_response_copy_data = 0;
     u_instance->check_utf8 = 1;
+    u_instance->execution_mode = U_EXECUTION_MODE_THREAD_PER_CONNECTION;
+    u_instance->thread_pool_size = 0;
+    u_instance->compression = U_COMPRESSION_NONE;
+    u_instance->compression_min_size = U_COMPRESSION_DEFAULT_MIN_SIZE;
+    u_instance->compression_level = U_COMPRESSION_DEFAULT_LEVEL;
+    u_instance->stream_block_size = ULFIUS_STREAM_BLOCK_SIZE_DEFAULT;
+    u_instance->stream_block_size_max = 0;
+    u_instance->post_buffer_size = ULFIUS_POSTBUFFERSIZE;
+    u_instance->websocket_reactor_threads = 0;
+    u_instance->websocket_worker_threads = 0;
     if (u_instance->default_headers == NULL) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_instance->default_headers");
       ulfius_clean_instance(u_instance);
@@ -1517,6 +2238,14 @@ UNUSED(network_type);
     }
     u_map_init(u_instance->default_headers);
     u_instance->default_endpoint = NULL;
+    u_instance->router = o_malloc(sizeof(struct _u_router));
+    if (u_instance->router == NULL || ulfius_init_router((struct _u_router *)u_instance->router) != U_OK) {
+      y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error allocating memory for u_instance->router");
+      o_free(u_instance->router);
+      u_instance->router = NULL;
+      ulfius_clean_instance(u_instance);
+      return U_ERROR_MEMORY;
+    }
     u_instance->max_post_param_size = 0;
     u_instance->max_post_body_size = 0;
     u_instance->file_upload_callback = NULL;
@@ -1534,6 +2263,7 @@ UNUSED(network_type);
     ((struct _websocket_handler *)u_instance->websocket_handler)->pthread_init = 0;
     ((struct _websocket_handler *)u_instance->websocket_handler)->nb_websocket_active = 0;
     ((struct _websocket_handler *)u_instance->websocket_handler)->websocket_active = NULL;
+    ((struct _websocket_handler *)u_instance->websocket_handler)->reactor = NULL;
     if (pthread_mutex_init(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_lock, NULL) || 
         pthread_cond_init(&((struct _websocket_handler *)u_instance->websocket_handler)->websocket_close_cond, NULL)) {
       y_log_message(Y_LOG_LEVEL_ERROR, "Ulfius - Error initializing websocket_close_lock or websocket_close_cond");
@@ -1592,69 +2322,6 @@ void u_free(void * data) {
   o_free(data);
 }
 
-/**
- * The utf8_check() function scans the '\0'-terminated string starting
- * at s. It returns a pointer to the first byte of the first malformed
- * or overlong UTF-8 sequence found, or NULL if the string contains
- * only correct UTF-8. It also spots UTF-8 sequences that could cause
- * trouble if converted to UTF-16, namely surrogate characters
- * (U+D800..U+DFFF) and non-Unicode positions (U+FFFE..U+FFFF). This
- * routine is very likely to find a malformed sequence if the input
- * uses any other encoding than UTF-8. It therefore can be used as a
- * very effective heuristic for distinguishing between UTF-8 and other
- * encodings.
- *
- * I wrote this code mainly as a specification of functionality; there
- * are no doubt performance optimizations possible for certain CPUs.
- *
- * Markus Kuhn <http://www.cl.cam.ac.uk/~mgk25/> -- 2005-03-30
- * License: http://www.cl.cam.ac.uk/~mgk25/short-license.html
- */
-const unsigned char * utf8_check(const char * s_orig) {
-  const unsigned char * s = (unsigned char *)s_orig;
-  while (*s) {
-    if (*s < 0x80) {
-      /* 0xxxxxxx */
-      s++;
-    } else if ((s[0] & 0xe0) == 0xc0) {
-      /* 110XXXXx 10xxxxxx */
-      if ((s[1] & 0xc0) != 0x80 ||
-          (s[0] & 0xfe) == 0xc0) {                  /* overlong? */
-        return s;
-      } else {
-        s += 2;
-      }
-    } else if ((s[0] & 0xf0) == 0xe0) {
-      /* 1110XXXX 10Xxxxxx 10xxxxxx */
-      if ((s[1] & 0xc0) != 0x80 ||
-	  (s[2] & 0xc0) != 0x80 ||
-	  (s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) ||      /* overlong? */
-	  (s[0] == 0xed && (s[1] & 0xe0) == 0xa0) ||      /* surrogate? */
-	  (s[0] == 0xef && s[1] == 0xbf &&
-	   (s[2] & 0xfe) == 0xbe)) {                      /* U+FFFE or U+FFFF? */
-        return s;
-      } else {
-        s += 3;
-      }
-    } else if ((s[0] & 0xf8) == 0xf0) {
-      /* 11110XXX 10XXxxxx 10xxxxxx 10xxxxxx */
-      if ((s[1] & 0xc0) != 0x80 ||
-	  (s[2] & 0xc0) != 0x80 ||
-	  (s[3] & 0xc0) != 0x80 ||
-	  (s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) ||      /* overlong? */
-	  (s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4) { /* > U+10FFFF? */
-        return s;
-      } else {
-        s += 4;
-      }
-    } else {
-      return s;
-    }
-  }
-
-  return NULL;
-}
-
 /**
  * Converts a hex character to its integer value
  */
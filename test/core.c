@@ -83,6 +83,14 @@ void websocket_onclose_callback_empty (const struct _u_request * request, struct
 void stream_callback_empty_free (void * stream_user_data) {
 }
 
+void buffer_body_release (void * release_cls) {
+  (*(int *)release_cls)++;
+}
+
+void segment_release (void * data) {
+  o_free(data);
+}
+
 #ifndef _WIN32
 START_TEST(test_ulfius_init_instance)
 {
@@ -429,6 +437,8 @@ END_TEST
 START_TEST(test_ulfius_response)
 {
   struct _u_response resp1, resp2, * resp3;
+  struct _u_body_segment segments[3];
+  int nb_release = 0;
 #ifndef U_DISABLE_JANSSON
   json_t * j_body = json_pack("{ss}", "test", "body"), * j_body2 = NULL;
   char * str_body = json_dumps(j_body, JSON_COMPACT);
@@ -470,6 +480,9 @@ START_TEST(test_ulfius_response)
   ck_assert_int_eq(resp1.stream_size, STREAM_SIZE);
   ck_assert_int_eq(resp1.stream_block_size, STREAM_BLOCK_SIZE);
   ck_assert_ptr_eq(resp1.stream_user_data, (void *)STREAM_USER_DATA);
+  // A block size of 0 keeps the current one
+  ck_assert_int_eq(ulfius_set_stream_response(&resp1, STATUS, &stream_callback_empty, &stream_callback_empty_free, STREAM_SIZE, 0, (void *)STREAM_USER_DATA), U_OK);
+  ck_assert_int_eq(resp1.stream_block_size, STREAM_BLOCK_SIZE);
   
 #ifndef U_DISABLE_WEBSOCKET
   ck_assert_int_eq(ulfius_set_websocket_response(&resp1, NULL, NULL, &websocket_manager_callback_empty, (void *)WEBSOCKET_MANAGER_USER_DATA, &websocket_incoming_message_callback_empty, (void *)WEBSOCKET_INCOMING_USER_DATA, &websocket_onclose_callback_empty, (void *)WEBSOCKET_ONCLOSE_USER_DATA), U_OK);
@@ -553,6 +566,21 @@ START_TEST(test_ulfius_response)
   ck_assert_int_eq(ulfius_set_binary_body_response(&resp1, STATUS, BINARY_BODY, BINARY_BODY_LEN), U_OK);
   ck_assert_ptr_ne(resp1.binary_body, NULL);
   ck_assert_int_eq(resp1.binary_body_length, BINARY_BODY_LEN);
+  
+  ck_assert_int_eq(ulfius_set_buffer_body_response(&resp1, STATUS, BINARY_BODY, BINARY_BODY_LEN, &buffer_body_release, &nb_release), U_OK);
+  ck_assert_ptr_eq(resp1.binary_body, BINARY_BODY);
+  ck_assert_int_eq(resp1.binary_body_length, BINARY_BODY_LEN);
+  ck_assert_int_eq(nb_release, 0);
+  ck_assert_int_eq(ulfius_set_buffer_body_response(&resp1, STATUS, STRING_BODY, o_strlen(STRING_BODY), NULL, NULL), U_OK);
+  ck_assert_int_eq(nb_release, 1);
+  ck_assert_ptr_eq(resp1.binary_body, STRING_BODY);
+  ck_assert_int_eq(ulfius_set_buffer_body_response(&resp1, STATUS, BINARY_BODY, BINARY_BODY_LEN, &buffer_body_release, &nb_release), U_OK);
+  ck_assert_int_eq(ulfius_set_string_body_response(&resp1, STATUS, STRING_BODY), U_OK);
+  ck_assert_int_eq(nb_release, 2);
+  ck_assert_ptr_ne(resp1.binary_body, STRING_BODY);
+  ck_assert_ptr_eq(resp1.binary_body_free, NULL);
+  ck_assert_int_eq(ulfius_set_buffer_body_response(&resp1, STATUS, NULL, BINARY_BODY_LEN, NULL, NULL), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_set_buffer_body_response(&resp1, STATUS, BINARY_BODY, BINARY_BODY_LEN, &buffer_body_release, &nb_release), U_OK);
 
 #ifndef U_DISABLE_JANSSON
   ck_assert_int_eq(ulfius_set_json_body_response(&resp1, STATUS, j_body), U_OK);
@@ -565,8 +593,40 @@ START_TEST(test_ulfius_response)
 #endif
 
   ulfius_clean_response(&resp1);
+  ck_assert_int_eq(nb_release, 3);
   ulfius_clean_response(&resp2);
   ulfius_clean_response_full(resp3);
+  
+  // Test ulfius_set_segmented_body_response
+  ulfius_init_response(&resp1);
+  segments[0].data = "segment1 ";
+  segments[0].length = o_strlen("segment1 ");
+  segments[0].release_callback = NULL;
+  segments[1].data = o_strdup("segment2 ");
+  segments[1].length = o_strlen("segment2 ");
+  segments[1].release_callback = &segment_release;
+  segments[2].data = "segment3";
+  segments[2].length = o_strlen("segment3");
+  segments[2].release_callback = NULL;
+  ck_assert_int_eq(ulfius_set_segmented_body_response(&resp1, STATUS, NULL, 3), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_set_segmented_body_response(&resp1, STATUS, segments, 0), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_set_segmented_body_response(&resp1, STATUS, segments, 3), U_OK);
+  ck_assert_int_eq(resp1.status, STATUS);
+  ck_assert_int_eq(resp1.nb_body_segments, 3);
+  ck_assert_ptr_eq(resp1.body_segments[1].data, segments[1].data);
+  ck_assert_ptr_eq(resp1.binary_body, NULL);
+  
+  // The copy of a segmented body is a single binary_body
+  resp3 = ulfius_duplicate_response(&resp1);
+  ck_assert_int_eq(resp3->nb_body_segments, 0);
+  ck_assert_int_eq(resp3->binary_body_length, o_strlen("segment1 segment2 segment3"));
+  ck_assert_int_eq(o_strncmp(resp3->binary_body, "segment1 segment2 segment3", resp3->binary_body_length), 0);
+  ulfius_clean_response_full(resp3);
+  
+  ck_assert_int_eq(ulfius_set_string_body_response(&resp1, STATUS, STRING_BODY), U_OK);
+  ck_assert_int_eq(resp1.nb_body_segments, 0);
+  ck_assert_ptr_eq(resp1.body_segments, NULL);
+  ulfius_clean_response(&resp1);
 }
 END_TEST
 
@@ -574,6 +634,10 @@ START_TEST(test_endpoint)
 {
   struct _u_instance u_instance;
   struct _u_endpoint endpoint;
+  struct _u_endpoint endpoint_valid = {"test4", "test4", NULL, 0, &callback_function_empty, NULL, 0, NULL, 0},
+                     endpoint_invalid = {"test5", "test5", NULL, 0, NULL, NULL, 0, NULL, 0};
+  const struct _u_endpoint * endpoint_list[] = {&endpoint_valid, &endpoint_invalid, ulfius_empty_endpoint()};
+  int nb_endpoints;
   endpoint.http_method = "nope";
   endpoint.url_prefix = NULL;
   endpoint.url_format = NULL;
@@ -624,6 +688,15 @@ START_TEST(test_endpoint)
   ck_assert_int_eq(ulfius_remove_endpoint_by_val(&u_instance, "test3", "test3", NULL), U_OK);
   ck_assert_int_eq(ulfius_set_default_endpoint(&u_instance, NULL, NULL), U_ERROR_PARAMS);
   ck_assert_int_eq(ulfius_set_default_endpoint(&u_instance, &callback_function_empty, NULL), U_OK);
+  // The endpoints of a list are all added or none of them
+  nb_endpoints = u_instance.nb_endpoints;
+  ck_assert_int_eq(ulfius_add_endpoint_list(&u_instance, endpoint_list), U_ERROR_PARAMS);
+  ck_assert_int_eq(u_instance.nb_endpoints, nb_endpoints);
+  ck_assert_int_eq(ulfius_remove_endpoint_by_val(&u_instance, "test4", "test4", NULL), U_ERROR_NOT_FOUND);
+  endpoint_list[1] = ulfius_empty_endpoint();
+  ck_assert_int_eq(ulfius_add_endpoint_list(&u_instance, endpoint_list), U_OK);
+  ck_assert_int_eq(u_instance.nb_endpoints, nb_endpoints + 1);
+  ck_assert_int_eq(ulfius_remove_endpoint_by_val(&u_instance, "test4", "test4", NULL), U_OK);
   
   o_free(endpoint.http_method);
   o_free(endpoint.url_prefix);
@@ -10,6 +10,8 @@
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #ifndef _WIN32
   #include <sys/socket.h>
@@ -23,6 +25,9 @@
 
 #include <check.h>
 #include <ulfius.h>
+#ifndef U_DISABLE_ZLIB
+  #include <zlib.h>
+#endif
 
 #define SMTP_FROM "sender@localhost"
 #define SMTP_TO "recipient@localhost"
@@ -373,6 +378,37 @@ int callback_function_multiple_continue(const struct _u_request * request, struc
   return U_CALLBACK_CONTINUE;
 }
 
+int callback_function_map_url_change(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  u_map_put(request->map_url, "param1", "changed");
+  u_map_put(request->map_url, "added", "value");
+  return U_CALLBACK_CONTINUE;
+}
+
+int callback_function_map_url_check(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  if (0 == o_strcmp(u_map_get(request->map_url, "param1"), "value1") && !u_map_has_key(request->map_url, "added")) {
+    ulfius_set_string_body_response(response, 200, "ok");
+  } else {
+    ulfius_set_string_body_response(response, 400, "error");
+  }
+  return U_CALLBACK_CONTINUE;
+}
+
+int callback_function_route_name(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  if (response->binary_body != NULL) {
+    char * body = msprintf("%.*s\n%s", response->binary_body_length, (char*)response->binary_body, (const char *)user_data);
+    ulfius_set_string_body_response(response, 200, body);
+    o_free(body);
+  } else {
+    ulfius_set_string_body_response(response, 200, (const char *)user_data);
+  }
+  return U_CALLBACK_CONTINUE;
+}
+
+int callback_function_remove_self(const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ulfius_remove_endpoint_by_val((struct _u_instance *)user_data, "GET", "inject", "/once");
+  return U_CALLBACK_CONTINUE;
+}
+
 int callback_function_multiple_complete(const struct _u_request * request, struct _u_response * response, void * user_data) {
   if (response->binary_body != NULL) {
     char * body = msprintf("%.*s\n%s", response->binary_body_length, (char*)response->binary_body, request->http_url);
@@ -403,6 +439,263 @@ int callback_function_stream (const struct _u_request * request, struct _u_respo
   return U_CALLBACK_CONTINUE;
 }
 
+#define STREAM_ADAPTIVE_SIZE (4*1024*1024)
+#define STREAM_ADAPTIVE_BLOCK_SIZE_MAX (256*1024)
+
+struct stream_adaptive_check {
+  size_t length;
+  int    valid;
+};
+
+ssize_t stream_adaptive_data (void * cls, uint64_t pos, char * buf, size_t max) {
+  size_t i, len;
+  
+  if (pos >= STREAM_ADAPTIVE_SIZE) {
+    return U_STREAM_END;
+  }
+  if (max > *(size_t *)cls) {
+    *(size_t *)cls = max;
+  }
+  len = max<(STREAM_ADAPTIVE_SIZE - pos)?max:(size_t)(STREAM_ADAPTIVE_SIZE - pos);
+  for (i=0; i<len; i++) {
+    buf[i] = (char)((pos + i) % 251);
+  }
+  return (ssize_t)len;
+}
+
+int callback_function_stream_adaptive (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ulfius_set_stream_response(response, 200, stream_adaptive_data, NULL, STREAM_ADAPTIVE_SIZE, 0, user_data);
+  return U_CALLBACK_CONTINUE;
+}
+
+size_t stream_adaptive_write_body(void * contents, size_t size, size_t nmemb, void * user_data) {
+  struct stream_adaptive_check * check = (struct stream_adaptive_check *)user_data;
+  size_t i;
+  
+  for (i=0; i<size*nmemb; i++) {
+    if (((char *)contents)[i] != (char)((check->length + i) % 251)) {
+      check->valid = 0;
+    }
+  }
+  check->length += size*nmemb;
+  return size*nmemb;
+}
+
+#define REQUEST_BODY_SIZE (256*1024)
+#define REQUEST_BODY_FILE_THRESHOLD 1024
+
+struct request_body_check {
+  uint64_t length;
+  int      valid;
+};
+
+static void fill_request_body(char * body, size_t size) {
+  size_t i;
+  
+  for (i=0; i<size; i++) {
+    body[i] = (char)(i % 251);
+  }
+}
+
+int callback_function_request_body_chunk (const struct _u_request * request, const char * data, uint64_t off, size_t size, void * user_data) {
+  struct request_body_check * check = (struct request_body_check *)user_data;
+  size_t i;
+  
+  if (off != check->length) {
+    check->valid = 0;
+  }
+  for (i=0; i<size; i++) {
+    if (data[i] != (char)((off + i) % 251)) {
+      check->valid = 0;
+    }
+  }
+  check->length += size;
+  return U_OK;
+}
+
+int callback_function_request_body_stream (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  struct request_body_check * check = (struct request_body_check *)user_data;
+  
+  if (request->binary_body_length == 0 && request->body_fd == -1 && !u_map_count(request->map_post_body) && check->valid && check->length == REQUEST_BODY_SIZE) {
+    ulfius_set_string_body_response(response, 200, "ok");
+  } else {
+    ulfius_set_string_body_response(response, 400, "error");
+  }
+  return U_CALLBACK_CONTINUE;
+}
+
+int callback_function_request_body_file (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  char * expected, * body;
+  
+  if (request->body_fd >= 0) {
+    expected = o_malloc(REQUEST_BODY_SIZE);
+    body = o_malloc(REQUEST_BODY_SIZE);
+    fill_request_body(expected, REQUEST_BODY_SIZE);
+    if (request->binary_body == NULL && request->body_fd_length == REQUEST_BODY_SIZE &&
+        read(request->body_fd, body, REQUEST_BODY_SIZE) == REQUEST_BODY_SIZE && !memcmp(body, expected, REQUEST_BODY_SIZE)) {
+      ulfius_set_string_body_response(response, 200, "file");
+    } else {
+      ulfius_set_string_body_response(response, 400, "error");
+    }
+    o_free(expected);
+    o_free(body);
+  } else {
+    ulfius_set_binary_body_response(response, 200, request->binary_body, request->binary_body_length);
+  }
+  return U_CALLBACK_CONTINUE;
+}
+
+#define UPLOAD_BOUNDARY "ulfiusuploadboundary"
+#define UPLOAD_DIRECTORY "/tmp"
+
+int callback_function_upload_file_directory (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  const char * path = u_map_get(request->map_post_body, "file");
+  char * expected, * body;
+  FILE * f;
+  
+  expected = o_malloc(REQUEST_BODY_SIZE);
+  body = o_malloc(REQUEST_BODY_SIZE+1);
+  fill_request_body(expected, REQUEST_BODY_SIZE);
+  if (path != NULL && o_strncmp(path, UPLOAD_DIRECTORY "/", o_strlen(UPLOAD_DIRECTORY "/")) == 0 &&
+      0 == o_strcmp(u_map_get(request->map_post_body, "file_size"), "262144") &&
+      0 == o_strcmp(u_map_get(request->map_post_body, "file_filename"), "data.bin") &&
+      0 == o_strcmp(u_map_get(request->map_post_body, "file_content_type"), "application/octet-stream") &&
+      0 == o_strcmp(u_map_get(request->map_post_body, "name"), "value") &&
+      request->binary_body_length == 0 &&
+      (f = fopen(path, "rb")) != NULL) {
+    if (fread(body, 1, REQUEST_BODY_SIZE+1, f) == REQUEST_BODY_SIZE && !memcmp(body, expected, REQUEST_BODY_SIZE)) {
+      snprintf((char *)user_data, 256, "%s", path);
+      ulfius_set_string_body_response(response, 200, "ok");
+    } else {
+      ulfius_set_string_body_response(response, 400, "error");
+    }
+    fclose(f);
+  } else {
+    ulfius_set_string_body_response(response, 400, "error");
+  }
+  o_free(expected);
+  o_free(body);
+  return U_CALLBACK_CONTINUE;
+}
+
+#define POST_CHUNKED_NB_FIELDS 100
+#define POST_CHUNKED_UTF8_CHAR "ȸ"
+#define POST_CHUNKED_UTF8_NB 4000
+
+int callback_function_post_chunked (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  char key[32], value[32];
+  const char * large = u_map_get(request->map_post_body, "large_utf8");
+  int i, valid = (u_map_count(request->map_post_body) == POST_CHUNKED_NB_FIELDS + 1 &&
+                  !u_map_has_key(request->map_post_body, "large_invalid") &&
+                  !u_map_has_key(request->map_post_body, "truncated_2") &&
+                  !u_map_has_key(request->map_post_body, "truncated_3") &&
+                  large != NULL && u_map_get_length(request->map_post_body, "large_utf8") == (POST_CHUNKED_UTF8_NB*o_strlen(POST_CHUNKED_UTF8_CHAR))+1);
+  
+  for (i=0; valid && i<POST_CHUNKED_NB_FIELDS; i++) {
+    snprintf(key, sizeof(key), "small%d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    valid = (0 == o_strcmp(u_map_get(request->map_post_body, key), value));
+  }
+  for (i=0; valid && i<POST_CHUNKED_UTF8_NB; i++) {
+    valid = (0 == o_strncmp(large + i*o_strlen(POST_CHUNKED_UTF8_CHAR), POST_CHUNKED_UTF8_CHAR, o_strlen(POST_CHUNKED_UTF8_CHAR)));
+  }
+  ulfius_set_string_body_response(response, valid?200:400, valid?"ok":"error");
+  return U_CALLBACK_CONTINUE;
+}
+
+#define BUFFER_BODY "precomputed buffer body"
+
+void release_buffer_body(void * release_cls) {
+  __atomic_add_fetch((int *)release_cls, 1, __ATOMIC_SEQ_CST);
+}
+
+int callback_function_buffer_body (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  ulfius_set_buffer_body_response(response, 200, BUFFER_BODY, o_strlen(BUFFER_BODY), &release_buffer_body, user_data);
+  return U_CALLBACK_CONTINUE;
+}
+
+#define SEGMENTED_BODY_HEADER "{\"header\":true,"
+#define SEGMENTED_BODY_CONTENT "\"content\":\"segmented\","
+#define SEGMENTED_BODY_FOOTER "\"footer\":true}"
+
+void release_segment(void * data) {
+  o_free(data);
+}
+
+int callback_function_segmented_body (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  struct _u_body_segment segments[3];
+  
+  segments[0].data = SEGMENTED_BODY_HEADER;
+  segments[0].length = o_strlen(SEGMENTED_BODY_HEADER);
+  segments[0].release_callback = NULL;
+  segments[1].data = o_strdup(SEGMENTED_BODY_CONTENT);
+  segments[1].length = o_strlen(SEGMENTED_BODY_CONTENT);
+  segments[1].release_callback = &release_segment;
+  segments[2].data = SEGMENTED_BODY_FOOTER;
+  segments[2].length = o_strlen(SEGMENTED_BODY_FOOTER);
+  segments[2].release_callback = NULL;
+  ulfius_set_segmented_body_response(response, 200, segments, 3);
+  return U_CALLBACK_CONTINUE;
+}
+
+#define FILE_BODY "0123456789file response body0123456789"
+#define FILE_BODY_OFFSET 10
+#define FILE_BODY_LENGTH 18
+
+int callback_function_file_body (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  int fd = open((const char *)user_data, O_RDONLY);
+  
+  if (fd == -1 || ulfius_set_file_response(response, 200, fd, FILE_BODY_OFFSET, FILE_BODY_LENGTH) != U_OK) {
+    return U_CALLBACK_ERROR;
+  }
+  return U_CALLBACK_CONTINUE;
+}
+
+#ifndef U_DISABLE_ZLIB
+#define COMPRESSION_BODY_LINE "compressed response body line\n"
+#define COMPRESSION_BODY_NB_LINES 256
+
+int callback_function_compression (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  char * body = o_malloc(o_strlen(COMPRESSION_BODY_LINE)*COMPRESSION_BODY_NB_LINES + 1);
+  int i;
+  
+  body[0] = '\0';
+  for (i=0; i<COMPRESSION_BODY_NB_LINES; i++) {
+    strcat(body, COMPRESSION_BODY_LINE);
+  }
+  ulfius_set_string_body_response(response, 200, body);
+  o_free(body);
+  return U_CALLBACK_CONTINUE;
+}
+
+int callback_function_compression_headers (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  callback_function_compression(request, response, user_data);
+  u_map_put(response->map_header, "vary", "Origin");
+  u_map_put(response->map_header, "etag", "\"compression\"");
+  return U_CALLBACK_CONTINUE;
+}
+
+static void check_compression_body(const struct _u_response * response) {
+  z_stream stream;
+  size_t expected_len = o_strlen(COMPRESSION_BODY_LINE)*COMPRESSION_BODY_NB_LINES, i;
+  char * body = o_malloc(expected_len + 1);
+  
+  memset(&stream, 0, sizeof(stream));
+  ck_assert_int_eq(inflateInit2(&stream, 15 + 32), Z_OK);
+  stream.next_in = response->binary_body;
+  stream.avail_in = (uInt)response->binary_body_length;
+  stream.next_out = (Bytef *)body;
+  stream.avail_out = (uInt)(expected_len + 1);
+  ck_assert_int_eq(inflate(&stream, Z_FINISH), Z_STREAM_END);
+  ck_assert_int_eq(stream.total_out, expected_len);
+  for (i=0; i<COMPRESSION_BODY_NB_LINES; i++) {
+    ck_assert_int_eq(o_strncmp(body + i*o_strlen(COMPRESSION_BODY_LINE), COMPRESSION_BODY_LINE, o_strlen(COMPRESSION_BODY_LINE)), 0);
+  }
+  inflateEnd(&stream);
+  o_free(body);
+}
+#endif
+
 size_t my_write_body(void * contents, size_t size, size_t nmemb, void * user_data) {
   ck_assert_int_eq(o_strncmp((char *)contents, "stream test ", o_strlen("stream test ")), 0);
   ck_assert_int_ne(strtol((char *)contents + o_strlen("stream test "), NULL, 10), 0);
@@ -807,6 +1100,15 @@ START_TEST(test_ulfius_endpoint_parameters)
   ulfius_clean_request(&request);
   ulfius_clean_response(&response);
   
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/param/value%201/value+2/value3.1/value3.2?param3=value3.0");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(o_strncmp(response.binary_body, "param1 is value 1, param2 is value 2, param3 is value3.0,value3.1,value3.2", o_strlen("param1 is value 1, param2 is value 2, param3 is value3.0,value3.1,value3.2")), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
   ulfius_init_request(&request);
   request.http_verb = o_strdup("POST");
   request.http_url = o_strdup("http://localhost:8080/param/");
@@ -897,6 +1199,19 @@ START_TEST(test_ulfius_endpoint_injection)
   ulfius_clean_request(&request);
   ulfius_clean_response(&response);
   
+  // The endpoints added while the framework is stopped are routed when it's started again
+  ck_assert_int_eq(ulfius_stop_framework(&u_instance), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "inject3", NULL, 0, &callback_function_empty, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/inject3");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
   ulfius_stop_framework(&u_instance);
   ulfius_clean_instance(&u_instance);
 }
@@ -917,6 +1232,8 @@ START_TEST(test_ulfius_endpoint_multiple)
   ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "multiple_complete", "/:param1/*", 1, &callback_function_multiple_complete, NULL), U_OK);
   ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "multiple_complete", "/:param1/:param2/*", 2, &callback_function_multiple_continue, NULL), U_OK);
   ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "multiple_complete", "/:param1/:param2/:param3", 3, &callback_function_multiple_continue, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "multiple_map_url", "/:param1", 0, &callback_function_map_url_change, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "multiple_map_url", "/:param1", 1, &callback_function_map_url_check, NULL), U_OK);
   ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
   
   ulfius_init_request(&request);
@@ -972,6 +1289,131 @@ START_TEST(test_ulfius_endpoint_multiple)
   ulfius_clean_request(&request);
   ulfius_clean_response(&response);
   
+  // map_url is filled again for each callback function, even if the url parameters are the same
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/multiple_map_url/value1");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_routing)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "*", "route", "/items/*", 3, &callback_function_route_name, "any"), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "route", "/items/:id/*", 2, &callback_function_route_name, "id_wildcard"), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "route", "/items/:id", 1, &callback_function_route_name, "id"), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "route", "/items/latest", 0, &callback_function_route_name, "latest"), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "POST", "route", "/items/:id", 0, &callback_function_route_name, "post"), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/route/items/latest");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, o_strlen("latest\nid\nid_wildcard\nany"));
+  ck_assert_int_eq(o_strncmp(response.binary_body, "latest\nid\nid_wildcard\nany", response.binary_body_length), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/route//items/42/sub/");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, o_strlen("id_wildcard\nany"));
+  ck_assert_int_eq(o_strncmp(response.binary_body, "id_wildcard\nany", response.binary_body_length), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("POST");
+  request.http_url = o_strdup("http://localhost:8080/route/items/42");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, o_strlen("post\nany"));
+  ck_assert_int_eq(o_strncmp(response.binary_body, "post\nany", response.binary_body_length), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/route/other");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 404);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_remove_endpoint_by_val(&u_instance, "GET", "route", "/items/latest"), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/route/items/latest");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, o_strlen("id\nid_wildcard\nany"));
+  ck_assert_int_eq(o_strncmp(response.binary_body, "id\nid_wildcard\nany", response.binary_body_length), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_injection_running)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "inject", "/once", 0, &callback_function_remove_self, &u_instance), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "inject", "/once", 1, &callback_function_route_name, "after"), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/inject/once");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, o_strlen("after"));
+  ck_assert_int_eq(o_strncmp(response.binary_body, "after", response.binary_body_length), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/inject/once");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 404);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_set_default_endpoint(&u_instance, &callback_function_route_name, "default"), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/inject/once");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, o_strlen("default"));
+  ck_assert_int_eq(o_strncmp(response.binary_body, "default", response.binary_body_length), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
   ulfius_stop_framework(&u_instance);
   ulfius_clean_instance(&u_instance);
 }
@@ -999,6 +1441,415 @@ START_TEST(test_ulfius_endpoint_stream)
 }
 END_TEST
 
+START_TEST(test_ulfius_endpoint_stream_block_size)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct stream_adaptive_check check;
+  size_t block_size = 0;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  u_instance.stream_block_size = 16*1024;
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "stream", NULL, 0, &callback_function_stream_adaptive, &block_size), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  check.length = 0;
+  check.valid = 1;
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/stream");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_streaming_request(&request, &response, stream_adaptive_write_body, &check), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(check.length, STREAM_ADAPTIVE_SIZE);
+  ck_assert_int_eq(check.valid, 1);
+  ck_assert_int_le(block_size, 16*1024);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_stream_adaptive)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct stream_adaptive_check check;
+  size_t block_size = 0;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  u_instance.stream_block_size_max = STREAM_ADAPTIVE_BLOCK_SIZE_MAX;
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "stream", NULL, 0, &callback_function_stream_adaptive, &block_size), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  check.length = 0;
+  check.valid = 1;
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/stream");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_streaming_request(&request, &response, stream_adaptive_write_body, &check), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(check.length, STREAM_ADAPTIVE_SIZE);
+  ck_assert_int_eq(check.valid, 1);
+  // The block size depends on how fast the client drains the blocks, only its bound is checked
+  ck_assert_int_le(block_size, STREAM_ADAPTIVE_BLOCK_SIZE_MAX);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_request_body)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct request_body_check check = {0, 1};
+  struct _u_endpoint endpoint_stream = {"PUT", "body", "/stream", 0, &callback_function_request_body_stream, &check, 0, &callback_function_request_body_chunk, 0};
+  struct _u_endpoint endpoint_file = {"PUT", "body", "/file", 0, &callback_function_request_body_file, NULL, 0, NULL, REQUEST_BODY_FILE_THRESHOLD};
+  char * body = o_malloc(REQUEST_BODY_SIZE);
+  
+  fill_request_body(body, REQUEST_BODY_SIZE);
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint(&u_instance, &endpoint_stream), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint(&u_instance, &endpoint_file), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "PUT", "body", "/memory", 0, &callback_function_request_body_file, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  // The body is sent to body_callback and isn't stored
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("PUT");
+  request.http_url = o_strdup("http://localhost:8080/body/stream");
+  ck_assert_int_eq(ulfius_set_binary_body_request(&request, body, REQUEST_BODY_SIZE), U_OK);
+  u_map_put(request.map_header, "Content-Type", "application/octet-stream");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(check.length, REQUEST_BODY_SIZE);
+  ck_assert_int_eq(check.valid, 1);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  // A url-encoded body sent to body_callback isn't parsed in map_post_body
+  check.length = 0;
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("PUT");
+  request.http_url = o_strdup("http://localhost:8080/body/stream");
+  ck_assert_int_eq(ulfius_set_binary_body_request(&request, body, REQUEST_BODY_SIZE), U_OK);
+  u_map_put(request.map_header, "Content-Type", "application/x-www-form-urlencoded");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(check.length, REQUEST_BODY_SIZE);
+  ck_assert_int_eq(check.valid, 1);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  // The body is larger than body_file_threshold and is stored in a file
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("PUT");
+  request.http_url = o_strdup("http://localhost:8080/body/file");
+  ck_assert_int_eq(ulfius_set_binary_body_request(&request, body, REQUEST_BODY_SIZE), U_OK);
+  u_map_put(request.map_header, "Content-Type", "application/octet-stream");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, 4);
+  ck_assert_int_eq(o_strncmp(response.binary_body, "file", 4), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  // The body is smaller than body_file_threshold and is stored in memory
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("PUT");
+  request.http_url = o_strdup("http://localhost:8080/body/file");
+  ck_assert_int_eq(ulfius_set_binary_body_request(&request, body, REQUEST_BODY_FILE_THRESHOLD), U_OK);
+  u_map_put(request.map_header, "Content-Type", "application/octet-stream");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, REQUEST_BODY_FILE_THRESHOLD);
+  ck_assert_int_eq(memcmp(response.binary_body, body, REQUEST_BODY_FILE_THRESHOLD), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  // The body is received in several blocks and stored in memory
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("PUT");
+  request.http_url = o_strdup("http://localhost:8080/body/memory");
+  ck_assert_int_eq(ulfius_set_binary_body_request(&request, body, REQUEST_BODY_SIZE), U_OK);
+  u_map_put(request.map_header, "Content-Type", "application/octet-stream");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, REQUEST_BODY_SIZE);
+  ck_assert_int_eq(memcmp(response.binary_body, body, REQUEST_BODY_SIZE), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+  o_free(body);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_upload_file_directory)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  const char * head = "--" UPLOAD_BOUNDARY "\r\nContent-Disposition: form-data; name=\"name\"\r\n\r\nvalue\r\n"
+                      "--" UPLOAD_BOUNDARY "\r\nContent-Disposition: form-data; name=\"file\"; filename=\"data.bin\"\r\nContent-Type: application/octet-stream\r\n\r\n",
+             * tail = "\r\n--" UPLOAD_BOUNDARY "--\r\n";
+  char path[256] = {0}, * body;
+  size_t body_len = o_strlen(head) + REQUEST_BODY_SIZE + o_strlen(tail);
+  
+  body = o_malloc(body_len);
+  memcpy(body, head, o_strlen(head));
+  fill_request_body(body + o_strlen(head), REQUEST_BODY_SIZE);
+  memcpy(body + o_strlen(head) + REQUEST_BODY_SIZE, tail, o_strlen(tail));
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_set_upload_file_directory(&u_instance, "/nonexistent_ulfius_directory"), U_ERROR_PARAMS);
+  ck_assert_int_eq(ulfius_set_upload_file_directory(&u_instance, UPLOAD_DIRECTORY), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "POST", "upload", NULL, 0, &callback_function_upload_file_directory, path), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  // The file part is written in the upload directory, map_post_body gets its path, size and content type, binary_body stays empty
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("POST");
+  request.http_url = o_strdup("http://localhost:8080/upload");
+  ck_assert_int_eq(ulfius_set_binary_body_request(&request, body, body_len), U_OK);
+  u_map_put(request.map_header, "Content-Type", "multipart/form-data; boundary=" UPLOAD_BOUNDARY);
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+  o_free(body);
+  
+  // The file is removed when the request is completed
+  ck_assert_int_ne(path[0], 0);
+  ck_assert_int_ne(access(path, F_OK), 0);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_post_chunked)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  char key[32], value[32], * large_utf8, * large_invalid;
+  size_t char_len = o_strlen(POST_CHUNKED_UTF8_CHAR);
+  int i;
+  
+  large_utf8 = o_malloc(POST_CHUNKED_UTF8_NB*char_len+1);
+  for (i=0; i<POST_CHUNKED_UTF8_NB; i++) {
+    memcpy(large_utf8 + i*char_len, POST_CHUNKED_UTF8_CHAR, char_len);
+  }
+  large_utf8[POST_CHUNKED_UTF8_NB*char_len] = '\0';
+  large_invalid = o_malloc(3003);
+  memset(large_invalid, 'a', 3002);
+  large_invalid[3000] = (char)0xC3;
+  large_invalid[3001] = (char)0x28;
+  large_invalid[3002] = '\0';
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  // The smallest post buffer splits the large values in many chunks
+  u_instance.post_buffer_size = 256;
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "POST", "chunked", NULL, 0, &callback_function_post_chunked, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  // The utf8 sequences split between two chunks are valid, a value with an invalid chunk
+  // or ending with an incomplete sequence is ignored
+  ulfius_init_request(&request);
+  request.http_verb = o_strdup("POST");
+  request.http_url = o_strdup("http://localhost:8080/chunked");
+  for (i=0; i<POST_CHUNKED_NB_FIELDS; i++) {
+    snprintf(key, sizeof(key), "small%d", i);
+    snprintf(value, sizeof(value), "value%d", i);
+    u_map_put(request.map_post_body, key, value);
+  }
+  u_map_put(request.map_post_body, "large_utf8", large_utf8);
+  u_map_put(request.map_post_body, "large_invalid", large_invalid);
+  // Incomplete 2-byte sequence followed by another value, incomplete 3-byte sequence at the end of the body
+  u_map_put(request.map_post_body, "truncated_2", "value\xc8");
+  u_map_put(request.map_post_body, "truncated_3", "value\xe2\x82");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+  o_free(large_utf8);
+  o_free(large_invalid);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_buffer_body)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  int nb_release = 0, i;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "buffer", NULL, 0, &callback_function_buffer_body, &nb_release), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  for (i=0; i<3; i++) {
+    ulfius_init_request(&request);
+    request.http_url = o_strdup("http://localhost:8080/buffer");
+    ulfius_init_response(&response);
+    ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+    ck_assert_int_eq(response.status, 200);
+    ck_assert_int_eq(response.binary_body_length, o_strlen(BUFFER_BODY));
+    ck_assert_int_eq(o_strncmp(response.binary_body, BUFFER_BODY, o_strlen(BUFFER_BODY)), 0);
+    ulfius_clean_request(&request);
+    ulfius_clean_response(&response);
+  }
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+  ck_assert_int_eq(nb_release, 3);
+}
+END_TEST
+
+#ifndef U_DISABLE_ZLIB
+START_TEST(test_ulfius_endpoint_compression)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct _u_endpoint endpoint = {"GET", "uncompressed", NULL, 0, &callback_function_compression, NULL, 1};
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  u_instance.compression = U_COMPRESSION_GZIP;
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "compressed", NULL, 0, &callback_function_compression, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "compressed_headers", NULL, 0, &callback_function_compression_headers, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint(&u_instance, &endpoint), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/compressed");
+  u_map_put(request.map_header, "Accept-Encoding", "deflate;q=0.5, gzip");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_str_eq(u_map_get_case(response.map_header, "Content-Encoding"), "gzip");
+  ck_assert_ptr_ne(o_strcasestr(u_map_get_case(response.map_header, "Vary"), "Accept-Encoding"), NULL);
+  ck_assert_int_lt(response.binary_body_length, o_strlen(COMPRESSION_BODY_LINE)*COMPRESSION_BODY_NB_LINES);
+  check_compression_body(&response);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/compressed");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_ptr_eq(u_map_get_case(response.map_header, "Content-Encoding"), NULL);
+  ck_assert_int_eq(response.binary_body_length, o_strlen(COMPRESSION_BODY_LINE)*COMPRESSION_BODY_NB_LINES);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/uncompressed");
+  u_map_put(request.map_header, "Accept-Encoding", "gzip");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_ptr_eq(u_map_get_case(response.map_header, "Content-Encoding"), NULL);
+  ck_assert_int_eq(response.binary_body_length, o_strlen(COMPRESSION_BODY_LINE)*COMPRESSION_BODY_NB_LINES);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  // The headers set by the callback in lower case are replaced, not sent twice
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/compressed_headers");
+  u_map_put(request.map_header, "Accept-Encoding", "gzip");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_str_eq(u_map_get_case(response.map_header, "Content-Encoding"), "gzip");
+  ck_assert_str_eq(u_map_get_case(response.map_header, "Vary"), "Origin, Accept-Encoding");
+  ck_assert_str_eq(u_map_get_case(response.map_header, "ETag"), "W/\"compression\"");
+  check_compression_body(&response);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+#endif
+
+START_TEST(test_ulfius_endpoint_segmented_body)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  const char * expected = SEGMENTED_BODY_HEADER SEGMENTED_BODY_CONTENT SEGMENTED_BODY_FOOTER;
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "segmented", NULL, 0, &callback_function_segmented_body, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/segmented");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, o_strlen(expected));
+  ck_assert_int_eq(o_strncmp(response.binary_body, expected, o_strlen(expected)), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+}
+END_TEST
+
+START_TEST(test_ulfius_endpoint_file_body)
+{
+  struct _u_instance u_instance;
+  struct _u_request request;
+  struct _u_response response;
+  char file_path[] = "/tmp/ulfius_file_bodyXXXXXX";
+  int fd = mkstemp(file_path);
+  
+  ck_assert_int_ne(fd, -1);
+  ck_assert_int_eq(write(fd, FILE_BODY, o_strlen(FILE_BODY)), o_strlen(FILE_BODY));
+  close(fd);
+  
+  ck_assert_int_eq(ulfius_init_instance(&u_instance, 8080, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&u_instance, "GET", "file", NULL, 0, &callback_function_file_body, file_path), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&u_instance), U_OK);
+  
+  ulfius_init_request(&request);
+  request.http_url = o_strdup("http://localhost:8080/file");
+  ulfius_init_response(&response);
+  ck_assert_int_eq(ulfius_send_http_request(&request, &response), U_OK);
+  ck_assert_int_eq(response.status, 200);
+  ck_assert_int_eq(response.binary_body_length, FILE_BODY_LENGTH);
+  ck_assert_int_eq(o_strncmp(response.binary_body, FILE_BODY + FILE_BODY_OFFSET, FILE_BODY_LENGTH), 0);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ulfius_stop_framework(&u_instance);
+  ulfius_clean_instance(&u_instance);
+  unlink(file_path);
+}
+END_TEST
+
 START_TEST(test_ulfius_utf8_not_ignored)
 {
   char * invalid_utf8_seq2 = msprintf("value %c%c", 0xC3, 0x28);
@@ -1318,7 +2169,20 @@ static Suite *ulfius_suite(void)
   tcase_add_test(tc_core, test_ulfius_endpoint_parameters);
   tcase_add_test(tc_core, test_ulfius_endpoint_injection);
   tcase_add_test(tc_core, test_ulfius_endpoint_multiple);
+  tcase_add_test(tc_core, test_ulfius_endpoint_routing);
+  tcase_add_test(tc_core, test_ulfius_endpoint_injection_running);
   tcase_add_test(tc_core, test_ulfius_endpoint_stream);
+  tcase_add_test(tc_core, test_ulfius_endpoint_stream_block_size);
+  tcase_add_test(tc_core, test_ulfius_endpoint_stream_adaptive);
+  tcase_add_test(tc_core, test_ulfius_endpoint_request_body);
+  tcase_add_test(tc_core, test_ulfius_endpoint_upload_file_directory);
+  tcase_add_test(tc_core, test_ulfius_endpoint_post_chunked);
+  tcase_add_test(tc_core, test_ulfius_endpoint_buffer_body);
+#ifndef U_DISABLE_ZLIB
+  tcase_add_test(tc_core, test_ulfius_endpoint_compression);
+#endif
+  tcase_add_test(tc_core, test_ulfius_endpoint_segmented_body);
+  tcase_add_test(tc_core, test_ulfius_endpoint_file_body);
   tcase_add_test(tc_core, test_ulfius_utf8_not_ignored);
   tcase_add_test(tc_core, test_ulfius_utf8_ignored);
   tcase_add_test(tc_core, test_ulfius_endpoint_callback_position);
@@ -176,6 +176,65 @@ START_TEST(test_u_map_copy_empty)
 }
 END_TEST
 
+START_TEST(test_u_map_large)
+{
+  struct _u_map map;
+  char key[16], value[16];
+  const char ** keys;
+  int i;
+  
+  u_map_init(&map);
+  for (i=0; i<100; i++) {
+    snprintf(key, 16, "Key-%d", i);
+    snprintf(value, 16, "value%d", i);
+    ck_assert_int_eq(u_map_put(&map, key, value), U_OK);
+  }
+  ck_assert_int_eq(u_map_put(&map, "key-42", "lowercase"), U_OK);
+  ck_assert_int_eq(u_map_count(&map), 101);
+  for (i=0; i<100; i++) {
+    snprintf(key, 16, "Key-%d", i);
+    snprintf(value, 16, "value%d", i);
+    ck_assert_str_eq(u_map_get(&map, key), value);
+    ck_assert_int_eq(u_map_has_key(&map, key), 1);
+    snprintf(key, 16, "KEY-%d", i);
+    ck_assert_str_eq(u_map_get_case(&map, key), value);
+    ck_assert_int_eq(u_map_has_key_case(&map, key), 1);
+    ck_assert_ptr_eq((void *)u_map_get(&map, key), NULL);
+  }
+  ck_assert_str_eq(u_map_get(&map, "key-42"), "lowercase");
+  keys = u_map_enum_keys(&map);
+  ck_assert_str_eq(keys[0], "Key-0");
+  ck_assert_str_eq(keys[99], "Key-99");
+  ck_assert_str_eq(keys[100], "key-42");
+  ck_assert_ptr_eq(keys[101], NULL);
+  ck_assert_int_eq(u_map_remove_from_key(&map, "Key-42"), U_OK);
+  ck_assert_str_eq(u_map_get_case(&map, "KEY-42"), "lowercase");
+  ck_assert_int_eq(u_map_remove_at(&map, 0), U_OK);
+  ck_assert_ptr_eq((void *)u_map_get(&map, "Key-0"), NULL);
+  ck_assert_str_eq(u_map_get(&map, "Key-1"), "value1");
+  ck_assert_str_eq(u_map_get(&map, "Key-99"), "value99");
+  ck_assert_int_eq(u_map_count(&map), 99);
+  // The keys removed one by one are removed from the hash index in place
+  for (i=1; i<100; i+=2) {
+    snprintf(key, 16, "Key-%d", i);
+    ck_assert_int_eq(u_map_remove_from_key(&map, key), U_OK);
+    ck_assert_int_eq(u_map_remove_from_key(&map, key), U_ERROR_NOT_FOUND);
+  }
+  for (i=2; i<100; i++) {
+    snprintf(key, 16, "Key-%d", i);
+    snprintf(value, 16, "value%d", i);
+    if (i%2 || i == 42) {
+      ck_assert_ptr_eq((void *)u_map_get(&map, key), NULL);
+    } else {
+      ck_assert_str_eq(u_map_get(&map, key), value);
+    }
+  }
+  ck_assert_str_eq(u_map_get_case(&map, "KEY-42"), "lowercase");
+  ck_assert_int_eq(u_map_count(&map), 49);
+  u_map_clean(&map);
+}
+END_TEST
+
 static Suite *ulfius_suite(void)
 {
 	Suite *s;
@@ -191,6 +250,7 @@ static Suite *ulfius_suite(void)
 	tcase_add_test(tc_core, test_u_map_has);
 	tcase_add_test(tc_core, test_u_map_remove);
 	tcase_add_test(tc_core, test_u_map_copy_empty);
+	tcase_add_test(tc_core, test_u_map_large);
 	tcase_set_timeout(tc_core, 30);
 	suite_add_tcase(s, tc_core);
 
@@ -15,6 +15,9 @@
 #define DEFAULT_MESSAGE "message content with a few characters"
 #define PORT 9275
 #define PREFIX_WEBSOCKET "/websocket"
+#define NB_BURST_MESSAGES 64
+#define LARGE_MESSAGE_LEN 70000
+#define NB_CLOSE_SIGNAL_CLIENTS 4
 
 #ifndef U_DISABLE_WEBSOCKET
 void websocket_manager_callback_empty (const struct _u_request * request, struct _websocket_manager * websocket_manager, void * websocket_manager_user_data) {
@@ -61,6 +64,93 @@ void websocket_incoming_message_callback_client (const struct _u_request * reque
   ck_assert_int_eq(0, o_strncmp(message->data, DEFAULT_MESSAGE, message->data_len));
 }
 
+void websocket_manager_callback_burst (const struct _u_request * request, struct _websocket_manager * websocket_manager, void * websocket_manager_user_data) {
+  unsigned int * nb_echo = (unsigned int *)websocket_manager_user_data;
+  int i;
+  
+  // Send the messages back to back, the server receives several frames in one read
+  for (i=0; i<NB_BURST_MESSAGES; i++) {
+    ck_assert_int_eq(ulfius_websocket_send_message(websocket_manager, U_WEBSOCKET_OPCODE_TEXT, o_strlen(DEFAULT_MESSAGE), DEFAULT_MESSAGE), U_OK);
+  }
+  for (i=0; i<100 && __atomic_load_n(nb_echo, __ATOMIC_SEQ_CST) < NB_BURST_MESSAGES; i++) {
+    ulfius_websocket_wait_close(websocket_manager, 50);
+  }
+  ck_assert_int_eq(__atomic_load_n(nb_echo, __ATOMIC_SEQ_CST), NB_BURST_MESSAGES);
+}
+
+void websocket_incoming_message_callback_burst (const struct _u_request * request, struct _websocket_manager * websocket_manager, const struct _websocket_message * message, void * websocket_incoming_user_data) {
+  ck_assert_int_eq(message->data_len, o_strlen(DEFAULT_MESSAGE));
+  ck_assert_int_eq(0, o_strncmp(message->data, DEFAULT_MESSAGE, message->data_len));
+  __atomic_add_fetch((unsigned int *)websocket_incoming_user_data, 1, __ATOMIC_SEQ_CST);
+}
+
+void websocket_echo_buffer_message_callback (const struct _u_request * request,
+                                              struct _websocket_manager * websocket_manager,
+                                              const struct _websocket_message * last_message,
+                                              void * websocket_incoming_message_user_data) {
+  char * data;
+  
+  if (last_message->opcode == U_WEBSOCKET_OPCODE_TEXT) {
+    ck_assert_int_eq(ulfius_websocket_send_buffer_message(websocket_manager, U_WEBSOCKET_OPCODE_TEXT, last_message->data_len, last_message->data, U_WEBSOCKET_BUFFER_BORROW), U_OK);
+  } else if (last_message->opcode == U_WEBSOCKET_OPCODE_BINARY) {
+    data = o_malloc(last_message->data_len);
+    ck_assert_ptr_ne(data, NULL);
+    memcpy(data, last_message->data, last_message->data_len);
+    ck_assert_int_eq(ulfius_websocket_send_buffer_message(websocket_manager, U_WEBSOCKET_OPCODE_BINARY, last_message->data_len, data, U_WEBSOCKET_BUFFER_OWN), U_OK);
+  }
+}
+
+void websocket_manager_callback_buffer (const struct _u_request * request, struct _websocket_manager * websocket_manager, void * websocket_manager_user_data) {
+  unsigned int * nb_echo = (unsigned int *)websocket_manager_user_data;
+  char * data;
+  size_t i;
+  
+  ck_assert_int_eq(ulfius_websocket_send_buffer_message(websocket_manager, U_WEBSOCKET_OPCODE_TEXT, o_strlen(DEFAULT_MESSAGE), DEFAULT_MESSAGE, U_WEBSOCKET_BUFFER_BORROW), U_OK);
+  ck_assert_ptr_eq(websocket_manager->message_list_outcoming->list[websocket_manager->message_list_outcoming->len-1]->data, NULL);
+  data = o_malloc(LARGE_MESSAGE_LEN);
+  ck_assert_ptr_ne(data, NULL);
+  for (i=0; i<LARGE_MESSAGE_LEN; i++) {
+    data[i] = (char)(i%251);
+  }
+  ck_assert_int_eq(ulfius_websocket_send_buffer_message(websocket_manager, U_WEBSOCKET_OPCODE_BINARY, LARGE_MESSAGE_LEN, data, U_WEBSOCKET_BUFFER_OWN), U_OK);
+  ck_assert_ptr_eq(websocket_manager->message_list_outcoming->list[websocket_manager->message_list_outcoming->len-1]->data, data);
+  ck_assert_int_eq(ulfius_websocket_send_buffer_message(websocket_manager, U_WEBSOCKET_OPCODE_CLOSE, 0, NULL, U_WEBSOCKET_BUFFER_BORROW), U_ERROR_PARAMS);
+  for (i=0; i<100 && __atomic_load_n(nb_echo, __ATOMIC_SEQ_CST) < 2; i++) {
+    ulfius_websocket_wait_close(websocket_manager, 50);
+  }
+  ck_assert_int_eq(__atomic_load_n(nb_echo, __ATOMIC_SEQ_CST), 2);
+}
+
+void websocket_incoming_message_callback_buffer (const struct _u_request * request, struct _websocket_manager * websocket_manager, const struct _websocket_message * message, void * websocket_incoming_user_data) {
+  size_t i;
+  
+  if (message->opcode == U_WEBSOCKET_OPCODE_TEXT) {
+    ck_assert_int_eq(message->data_len, o_strlen(DEFAULT_MESSAGE));
+    ck_assert_int_eq(0, o_strncmp(message->data, DEFAULT_MESSAGE, message->data_len));
+  } else {
+    ck_assert_int_eq(message->opcode, U_WEBSOCKET_OPCODE_BINARY);
+    ck_assert_int_eq(message->data_len, LARGE_MESSAGE_LEN);
+    for (i=0; i<LARGE_MESSAGE_LEN; i++) {
+      ck_assert_int_eq((unsigned char)message->data[i], i%251);
+    }
+  }
+  __atomic_add_fetch((unsigned int *)websocket_incoming_user_data, 1, __ATOMIC_SEQ_CST);
+}
+
+void websocket_manager_callback_close_signal (const struct _u_request * request, struct _websocket_manager * websocket_manager, void * websocket_manager_user_data) {
+  // Close the websocket from the server while the client is still sending messages
+  ulfius_websocket_wait_close(websocket_manager, 20);
+  ck_assert_int_eq(ulfius_websocket_send_close_signal(websocket_manager), U_OK);
+}
+
+void websocket_manager_callback_client_stream (const struct _u_request * request, struct _websocket_manager * websocket_manager, void * websocket_manager_user_data) {
+  int i;
+  
+  for (i=0; i<10000 && ulfius_websocket_status(websocket_manager) == U_WEBSOCKET_STATUS_OPEN; i++) {
+    ulfius_websocket_send_message(websocket_manager, U_WEBSOCKET_OPCODE_TEXT, o_strlen(DEFAULT_MESSAGE), DEFAULT_MESSAGE);
+  }
+}
+
 int callback_websocket (const struct _u_request * request, struct _u_response * response, void * user_data) {
   int ret;
   char * websocket_allocated_data = o_strdup("grut");
@@ -78,6 +168,22 @@ int callback_websocket_onclose (const struct _u_request * request, struct _u_res
   return (ret == U_OK)?U_CALLBACK_CONTINUE:U_CALLBACK_ERROR;
 }
 
+int callback_websocket_buffer (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  int ret;
+  
+  ret = ulfius_set_websocket_response(response, NULL, NULL, NULL, NULL, &websocket_echo_buffer_message_callback, NULL, NULL, NULL);
+  ck_assert_int_eq(ret, U_OK);
+  return (ret == U_OK)?U_CALLBACK_CONTINUE:U_CALLBACK_ERROR;
+}
+
+int callback_websocket_close_signal (const struct _u_request * request, struct _u_response * response, void * user_data) {
+  int ret;
+  
+  ret = ulfius_set_websocket_response(response, NULL, NULL, &websocket_manager_callback_close_signal, NULL, &websocket_echo_message_callback, NULL, NULL, NULL);
+  ck_assert_int_eq(ret, U_OK);
+  return (ret == U_OK)?U_CALLBACK_CONTINUE:U_CALLBACK_ERROR;
+}
+
 START_TEST(test_websocket_ulfius_set_websocket_response)
 {
   struct _u_response response;
@@ -219,6 +325,137 @@ START_TEST(test_websocket_ulfius_websocket_client_no_onclose)
 }
 END_TEST
 
+START_TEST(test_websocket_ulfius_websocket_client_burst)
+{
+  struct _u_instance instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct _websocket_client_handler websocket_client_handler;
+  char url[64], * allocated_data = o_strdup("plop");
+  unsigned int nb_echo = 0;
+
+  ck_assert_int_eq(ulfius_init_instance(&instance, PORT, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", PREFIX_WEBSOCKET, NULL, 0, &callback_websocket, allocated_data), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  sprintf(url, "ws://localhost:%d/%s", PORT, PREFIX_WEBSOCKET);
+  
+  // Test that all the messages sent back to back are received and echoed
+  ck_assert_int_eq(ulfius_set_websocket_request(&request, url, DEFAULT_PROTOCOL, DEFAULT_EXTENSION), U_OK);
+  ck_assert_int_eq(ulfius_open_websocket_client_connection(&request, &websocket_manager_callback_burst, &nb_echo, &websocket_incoming_message_callback_burst, &nb_echo, NULL, NULL, &websocket_client_handler, &response), U_OK);
+  ck_assert_int_eq(ulfius_websocket_client_connection_wait_close(&websocket_client_handler, 0), U_WEBSOCKET_STATUS_CLOSE);
+  ck_assert_int_eq(nb_echo, NB_BURST_MESSAGES);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_stop_framework(&instance), U_OK);
+  ulfius_clean_instance(&instance);
+  o_free(allocated_data);
+}
+END_TEST
+
+START_TEST(test_websocket_ulfius_websocket_client_buffer)
+{
+  struct _u_instance instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct _websocket_client_handler websocket_client_handler;
+  char url[64];
+  unsigned int nb_echo = 0;
+
+  ck_assert_int_eq(ulfius_init_instance(&instance, PORT, NULL, NULL), U_OK);
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", PREFIX_WEBSOCKET, NULL, 0, &callback_websocket_buffer, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  ulfius_init_request(&request);
+  ulfius_init_response(&response);
+  sprintf(url, "ws://localhost:%d/%s", PORT, PREFIX_WEBSOCKET);
+  
+  // Test the messages sent without copying their payload, a borrowed text message and an owned binary message with a 64 bits length
+  ck_assert_int_eq(ulfius_set_websocket_request(&request, url, DEFAULT_PROTOCOL, DEFAULT_EXTENSION), U_OK);
+  ck_assert_int_eq(ulfius_open_websocket_client_connection(&request, &websocket_manager_callback_buffer, &nb_echo, &websocket_incoming_message_callback_buffer, &nb_echo, NULL, NULL, &websocket_client_handler, &response), U_OK);
+  ck_assert_int_eq(ulfius_websocket_client_connection_wait_close(&websocket_client_handler, 0), U_WEBSOCKET_STATUS_CLOSE);
+  ck_assert_int_eq(nb_echo, 2);
+  ulfius_clean_request(&request);
+  ulfius_clean_response(&response);
+  
+  ck_assert_int_eq(ulfius_stop_framework(&instance), U_OK);
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+
+START_TEST(test_websocket_ulfius_websocket_client_reactor)
+{
+  struct _u_instance instance;
+  struct _u_request request;
+  struct _u_response response;
+  struct _websocket_client_handler websocket_client_handler;
+  char url[64], * allocated_data = o_strdup("plop");
+  int i;
+
+  ck_assert_int_eq(ulfius_init_instance(&instance, PORT, NULL, NULL), U_OK);
+  instance.websocket_reactor_threads = 2;
+  instance.websocket_worker_threads = 2;
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", PREFIX_WEBSOCKET, NULL, 0, &callback_websocket, allocated_data), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  sprintf(url, "ws://localhost:%d/%s", PORT, PREFIX_WEBSOCKET);
+  
+  // Test several websocket connections shared by the reactor loops
+  for (i=0; i<4; i++) {
+    ulfius_init_request(&request);
+    ulfius_init_response(&response);
+    ck_assert_int_eq(ulfius_set_websocket_request(&request, url, DEFAULT_PROTOCOL, DEFAULT_EXTENSION), U_OK);
+    ck_assert_int_eq(ulfius_open_websocket_client_connection(&request, &websocket_manager_callback_client, NULL, &websocket_incoming_message_callback_client, NULL, websocket_onclose_callback_client, allocated_data, &websocket_client_handler, &response), U_OK);
+    ck_assert_int_eq(ulfius_websocket_client_connection_wait_close(&websocket_client_handler, 0), U_WEBSOCKET_STATUS_CLOSE);
+    ulfius_clean_request(&request);
+    ulfius_clean_response(&response);
+  }
+  
+  ck_assert_int_eq(ulfius_stop_framework(&instance), U_OK);
+  ulfius_clean_instance(&instance);
+  o_free(allocated_data);
+}
+END_TEST
+
+START_TEST(test_websocket_ulfius_websocket_client_reactor_close_signal)
+{
+  struct _u_instance instance;
+  struct _u_request request[NB_CLOSE_SIGNAL_CLIENTS];
+  struct _u_response response[NB_CLOSE_SIGNAL_CLIENTS];
+  struct _websocket_client_handler websocket_client_handler[NB_CLOSE_SIGNAL_CLIENTS];
+  char url[64];
+  int i;
+
+  ck_assert_int_eq(ulfius_init_instance(&instance, PORT, NULL, NULL), U_OK);
+  instance.websocket_reactor_threads = 1;
+  instance.websocket_worker_threads = 2;
+  ck_assert_int_eq(ulfius_add_endpoint_by_val(&instance, "GET", PREFIX_WEBSOCKET, NULL, 0, &callback_websocket_close_signal, NULL), U_OK);
+  ck_assert_int_eq(ulfius_start_framework(&instance), U_OK);
+
+  sprintf(url, "ws://localhost:%d/%s", PORT, PREFIX_WEBSOCKET);
+  
+  // Test the websockets closed by the server in the same loop while their clients are sending
+  for (i=0; i<NB_CLOSE_SIGNAL_CLIENTS; i++) {
+    ulfius_init_request(&request[i]);
+    ulfius_init_response(&response[i]);
+    ck_assert_int_eq(ulfius_set_websocket_request(&request[i], url, DEFAULT_PROTOCOL, DEFAULT_EXTENSION), U_OK);
+    ck_assert_int_eq(ulfius_open_websocket_client_connection(&request[i], &websocket_manager_callback_client_stream, NULL, &websocket_incoming_message_callback_empty, NULL, NULL, NULL, &websocket_client_handler[i], &response[i]), U_OK);
+  }
+  for (i=0; i<NB_CLOSE_SIGNAL_CLIENTS; i++) {
+    ck_assert_int_eq(ulfius_websocket_client_connection_wait_close(&websocket_client_handler[i], 0), U_WEBSOCKET_STATUS_CLOSE);
+    ulfius_clean_request(&request[i]);
+    ulfius_clean_response(&response[i]);
+  }
+  
+  // All the websockets must be closed by the reactor for the framework to stop
+  ck_assert_int_eq(ulfius_stop_framework(&instance), U_OK);
+  ulfius_clean_instance(&instance);
+}
+END_TEST
+
 #endif
 
 static Suite *ulfius_suite(void)
@@ -234,6 +471,10 @@ static Suite *ulfius_suite(void)
 	tcase_add_test(tc_websocket, test_websocket_ulfius_open_websocket_client_connection_error);
 	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_client);
 	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_client_no_onclose);
+	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_client_burst);
+	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_client_buffer);
+	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_client_reactor);
+	tcase_add_test(tc_websocket, test_websocket_ulfius_websocket_client_reactor_close_signal);
 #endif
 	tcase_set_timeout(tc_websocket, 30);
 	suite_add_tcase(s, tc_websocket);